@@ -25,6 +25,8 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include "debug.h"
 
@@ -120,12 +122,15 @@ static FILE *npw_log_file(void)
 	  mode = "a";
 #endif
 	  g_log_file = fopen(log_file, mode);
+	  /* both processes write to the same file: let the kernel move
+		 each write to the current end, instead of seeking there
+		 before every message.  */
+	  if (g_log_file)
+		fcntl(fileno(g_log_file), F_SETFL, fcntl(fileno(g_log_file), F_GETFL) | O_APPEND);
 	}
-	if (log_file == NULL)
+	if (g_log_file == NULL)
 	  g_log_file = stderr;
   }
-  if (g_log_file != stderr)
-	fseek(g_log_file, 0, SEEK_END);
   return g_log_file;
 }
 
@@ -165,3 +170,45 @@ void npw_printf(const char *format, ...)
   npw_vprintf(format, args);
   va_end(args);
 }
+
+
+// Monotonic time, so that intervals don't jump with the wall clock
+uint64_t npw_get_time_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void npw_histogram_add(NPW_Histogram *histogram, uint64_t value)
+{
+  int bucket = 0;
+  while (bucket < NPW_HISTOGRAM_BUCKETS - 1 && (value >> bucket) != 0)
+	bucket++;
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  histogram->total += value;
+  if (histogram->max < value)
+	histogram->max = value;
+}
+
+// Print histogram through the debug channel, i.e. only if NPW_DEBUG is set
+void npw_histogram_dump(const NPW_Histogram *histogram)
+{
+  if (get_debug_level() <= 0 || histogram->count == 0)
+	return;
+
+  const char *unit = histogram->unit ? histogram->unit : "";
+  npw_printf("%s: %" G_GUINT64_FORMAT " samples, avg %" G_GUINT64_FORMAT " %s, max %" G_GUINT64_FORMAT " %s\n",
+			 histogram->name, histogram->count,
+			 histogram->total / histogram->count, unit,
+			 histogram->max, unit);
+  for (int i = 0; i < NPW_HISTOGRAM_BUCKETS; i++) {
+	if (histogram->buckets[i] == 0)
+	  continue;
+	uint64_t lo = i > 0 ? UINT64_C(1) << (i - 1) : 0;
+	uint64_t hi = UINT64_C(1) << i;
+	npw_printf("  [%8" G_GUINT64_FORMAT ", %8" G_GUINT64_FORMAT ") %s: %u\n",
+			   lo, hi, unit, histogram->buckets[i]);
+  }
+}
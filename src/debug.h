@@ -36,6 +36,23 @@ extern G_GNUC_PRINTF(2, 3) void npw_idprintf(int inc, const char *format, ...) a
 extern G_GNUC_PRINTF(1, 2) void npw_printf(const char *format, ...) attribute_hidden;
 extern void npw_vprintf(const char *format, va_list args) attribute_hidden;
 
+/* Timing statistics, with log2 buckets: bucket N counts values in
+   [2^(N-1), 2^N), the last bucket also counts larger values */
+#define NPW_HISTOGRAM_BUCKETS 24
+
+typedef struct {
+  const char *name;
+  const char *unit;
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+  uint32_t buckets[NPW_HISTOGRAM_BUCKETS];
+} NPW_Histogram;
+
+extern uint64_t npw_get_time_us(void) attribute_hidden;
+extern void npw_histogram_add(NPW_Histogram *histogram, uint64_t value) attribute_hidden;
+extern void npw_histogram_dump(const NPW_Histogram *histogram) attribute_hidden;
+
 #if DEBUG
 /* Very verbose mode that uses the ##__VA_ARGS__ GCC extension */
 # if 0 && (defined(__GNUC__) && (__GNUC__ >= 3 || (__GNUC__ == 2 && __GNUC_MINOR__ == 96)))
@@ -55,16 +55,17 @@ CURLMcode glibcurl_add(CURL* easy_handle);
 CURLMcode glibcurl_remove(CURL* easy_handle);
 
 /** Call this whenever you have added a request using
-    curl_multi_add_handle(). This is necessary to start new requests. It does
-    so by triggering a call to curl_multi_perform() even in the case where no
-    open fds cause that function to be called anyway. The call happens
-    "later", i.e. during the next iteration of the glib main loop.
-    glibcurl_start() only sets a flag to make it happen. */
+    curl_multi_add_handle(). This is necessary to start new requests with
+    older libcurl versions. It does so by scheduling a call to
+    curl_multi_socket_action() even in the case where no open fds cause that
+    function to be called anyway. The call happens "later", i.e. during the
+    next iteration of the glib main loop. */
 void glibcurl_start();
 
 /** Callback function for glibcurl_set_callback */
 typedef void (*GlibcurlCallback)(void*);
-/** Set function to call after each invocation of curl_multi_perform(). Pass
+/** Set function to call after each invocation of curl_multi_socket_action(),
+    i.e. whenever some transfers may have made progress or completed. Pass
     function==0 to unregister a previously set callback. The callback
     function will be called with the supplied data pointer as its first
     argument. */
@@ -52,7 +52,10 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 /* Xlib/Xt stuff */
 #include <X11/Xlib.h>
@@ -121,36 +124,306 @@ static gboolean         xt_is_initialized = FALSE;
 static gint             num_widgets = 0;
 
 static GPollFD          xt_event_poll_fd;
-static gint             xt_polling_timer_id = 0;
 static guint            tag = 0;
 
+/* Without insight into the Xt timer queue, we have to poll for
+   expired timers. The interval backs off while nothing happens */
+#define XT_DEFAULT_TIMEOUT       25
+#define XT_MAX_FALLBACK_TIMEOUT  100
+static gint             xt_fallback_timeout = XT_DEFAULT_TIMEOUT;
+
+/* Private libXt structures. Only the leading members are declared,
+   the layout is validated at runtime by xt_app_context_probe() */
+typedef struct _XtbinTimerEventRec {
+  struct timeval              te_timer_value;
+  struct _XtbinTimerEventRec *te_next;
+  XtTimerCallbackProc         te_proc;
+  XtAppContext                app;
+  XtPointer                   te_closure;
+} XtbinTimerEventRec;
+
+typedef struct _XtbinInputEvent {
+  XtInputCallbackProc         ie_proc;
+  XtPointer                   ie_closure;
+  struct _XtbinInputEvent    *ie_next;
+  struct _XtbinInputEvent    *ie_oq;
+  XtAppContext                app;
+  int                         ie_source;
+  XtInputMask                 ie_condition;
+} XtbinInputEvent;
+
+typedef struct _XtbinAppStruct {
+  XtAppContext         next;
+  void                *process;
+  void                *destroy_callbacks;
+  Display            **list;
+  XtbinTimerEventRec  *timerQueue;
+  void                *workQueue;
+  XtbinInputEvent    **input_list;
+  XtbinInputEvent     *outstandingQueue;
+  void                *signalQueue;
+  XrmDatabase          errorDB;
+  XtErrorMsgHandler    errorMsgHandler, warningMsgHandler;
+  XtErrorHandler       errorHandler, warningHandler;
+  void                *action_table;
+  void                *converterTable;
+  unsigned long        selectionTimeout;
+  char                 fds[3*sizeof(fd_set)+4];
+  short                count;
+  short                max;
+  short                last;
+  short                input_count;
+  short                input_max;
+} XtbinAppStruct;
+
+#define XT_APP(ac) ((XtbinAppStruct *)(ac))
+
+/* What we could learn about the application context layout */
+static gboolean         xt_has_timer_queue = FALSE;
+static gint             xt_input_count_offset = 0;
+static gint             xt_input_max_offset = 0;
+
+/* GPollFDs mirroring the Xt input sources */
+#define XT_MAX_INPUT_POLL_FDS 64
+static GPollFD          xt_input_poll_fds[XT_MAX_INPUT_POLL_FDS];
+static gint             xt_input_n_poll_fds = 0;
+
+static void
+xt_dummy_timeout_cb (XtPointer closure, XtIntervalId *id)
+{
+  /* never called */
+}
+
+static void
+xt_dummy_input_cb (XtPointer closure, int *source, XtInputId *id)
+{
+  /* never called */
+}
+
+static inline int
+xt_app_context_short_at (XtAppContext ac, int offset)
+{
+  return *((short *)((char *)ac + offset));
+}
+
+/* Locate the input_count and input_max fields by registering dummy
+   input sources and watching which counters follow. input_max is the
+   largest input fd + 1, so this must run before the plugin adds its
+   own input sources */
+static void
+xt_app_context_probe_inputs (XtAppContext ac)
+{
+  const int low_offset  = offsetof(XtbinAppStruct, fds);
+  const int high_offset = offsetof(XtbinAppStruct, input_max);
+  int offsets[(offsetof(XtbinAppStruct, input_max) -
+               offsetof(XtbinAppStruct, fds)) / 2];
+  int n_offsets = 0;
+  struct { int fd; XtInputId id; } inputs[4];
+  int n_inputs = 0, max_fd = -1;
+  int i, ofs;
+
+  while (n_inputs < G_N_ELEMENTS(inputs)) {
+    int fd = open("/dev/null", O_WRONLY);
+    if (fd < 0)
+      break;
+    inputs[n_inputs].fd = fd;
+    inputs[n_inputs].id = XtAppAddInput(ac, fd,
+                                        (XtPointer)XtInputWriteMask,
+                                        xt_dummy_input_cb, NULL);
+    n_inputs++;
+    max_fd = MAX(max_fd, fd);
+
+    if (n_inputs == 1) {
+      for (ofs = low_offset; ofs < high_offset; ofs += 2) {
+        if (xt_app_context_short_at(ac, ofs) == 1)
+          offsets[n_offsets++] = ofs;
+      }
+    }
+    else {
+      int n = 0;
+      for (i = 0; i < n_offsets; i++) {
+        if (xt_app_context_short_at(ac, offsets[i]) == n_inputs)
+          offsets[n++] = offsets[i];
+      }
+      n_offsets = n;
+    }
+  }
+
+  if (n_inputs == G_N_ELEMENTS(inputs) && n_offsets == 1) {
+    xt_input_count_offset = offsets[0];
+    /* input_max immediately follows input_count in libXt */
+    if (xt_app_context_short_at(ac, offsets[0] + 2) == max_fd + 1)
+      xt_input_max_offset = offsets[0] + 2;
+  }
+
+  for (i = 0; i < n_inputs; i++) {
+    XtRemoveInput(inputs[i].id);
+    close(inputs[i].fd);
+  }
+}
+
+/* Check that the head of the timer queue is where we expect it */
+static void
+xt_app_context_probe_timers (XtAppContext ac)
+{
+  XtbinTimerEventRec *tq;
+  XtIntervalId id;
+
+  id = XtAppAddTimeOut(ac, 0, xt_dummy_timeout_cb,
+                       GUINT_TO_POINTER(0xdeadbeef));
+  tq = XT_APP(ac)->timerQueue;
+  xt_has_timer_queue = tq != NULL
+    && tq->app == ac
+    && tq->te_proc == xt_dummy_timeout_cb
+    && tq->te_closure == GUINT_TO_POINTER(0xdeadbeef);
+  XtRemoveTimeOut(id);
+}
+
+static void
+xt_app_context_probe (XtAppContext ac)
+{
+  xt_app_context_probe_timers(ac);
+  xt_app_context_probe_inputs(ac);
+#ifdef DEBUG_XTBIN
+  printf("Xt timer queue %s, input sources %s\n",
+         xt_has_timer_queue ? "found" : "not found",
+         xt_input_max_offset > 0 ? "found" : "not found");
+#endif
+}
+
+static inline gushort
+xt_input_events (XtInputMask condition)
+{
+  gushort events = 0;
+  if (condition & XtInputReadMask)
+    events |= G_IO_IN | G_IO_HUP | G_IO_ERR;
+  if (condition & XtInputWriteMask)
+    events |= G_IO_OUT | G_IO_ERR;
+  if (condition & XtInputExceptMask)
+    events |= G_IO_PRI;
+  return events;
+}
+
+/* Synchronize the source GPollFDs with the Xt input sources. Return
+   FALSE if some of them could not be mirrored */
+static gboolean
+xt_update_input_polls (GSource *source, XtAppContext ac)
+{
+  int input_max = xt_app_context_short_at(ac, xt_input_max_offset);
+  XtbinInputEvent **input_list = XT_APP(ac)->input_list;
+  GPollFD poll_fds[XT_MAX_INPUT_POLL_FDS];
+  gboolean is_complete = TRUE;
+  int fd, i, n_poll_fds = 0;
+
+  for (fd = 0; input_list && fd < input_max; fd++) {
+    XtbinInputEvent *ie;
+    gushort events = 0;
+    for (ie = input_list[fd]; ie; ie = ie->ie_next)
+      events |= xt_input_events(ie->ie_condition);
+    if (events == 0)
+      continue;
+    if (n_poll_fds == XT_MAX_INPUT_POLL_FDS) {
+      is_complete = FALSE;
+      break;
+    }
+    poll_fds[n_poll_fds].fd = fd;
+    poll_fds[n_poll_fds].events = events;
+    poll_fds[n_poll_fds].revents = 0;
+    n_poll_fds++;
+  }
+
+  if (n_poll_fds == xt_input_n_poll_fds) {
+    for (i = 0; i < n_poll_fds; i++) {
+      if (poll_fds[i].fd != xt_input_poll_fds[i].fd ||
+          poll_fds[i].events != xt_input_poll_fds[i].events)
+        break;
+    }
+    if (i == n_poll_fds)
+      return is_complete;
+  }
+
+  for (i = 0; i < xt_input_n_poll_fds; i++)
+    g_source_remove_poll(source, &xt_input_poll_fds[i]);
+  for (i = 0; i < n_poll_fds; i++) {
+    xt_input_poll_fds[i] = poll_fds[i];
+    g_source_add_poll(source, &xt_input_poll_fds[i]);
+  }
+  xt_input_n_poll_fds = n_poll_fds;
+  return is_complete;
+}
+
+/* Compute how long the main loop may sleep before Xt needs us again,
+   -1 meaning until some fd becomes ready */
+static gint
+xt_get_next_timeout (GSource *source, XtAppContext ac)
+{
+  gint input_timeout, timer_timeout;
+
+  if (!xt_has_timer_queue) {
+    timer_timeout = xt_fallback_timeout;
+    xt_fallback_timeout = MIN(xt_fallback_timeout * 2, XT_MAX_FALLBACK_TIMEOUT);
+  }
+  else if (XT_APP(ac)->timerQueue == NULL)
+    timer_timeout = -1;
+  else {
+    struct timeval *next = &XT_APP(ac)->timerQueue->te_timer_value;
+    GTimeVal now;
+    gint64 diff;
+    g_source_get_current_time(source, &now);
+    diff = ((gint64)next->tv_sec - now.tv_sec) * G_USEC_PER_SEC
+      + ((gint64)next->tv_usec - now.tv_usec);
+    /* round up so that we don't wake up just before the deadline */
+    timer_timeout = diff <= 0 ? 0 : (gint)MIN((diff + 999) / 1000, G_MAXINT);
+  }
+
+  if (xt_input_max_offset > 0 && xt_update_input_polls(source, ac))
+    input_timeout = -1;
+  else if (xt_input_count_offset == 0 ||
+           xt_app_context_short_at(ac, xt_input_count_offset) > 0)
+    input_timeout = XT_DEFAULT_TIMEOUT;
+  else
+    input_timeout = -1;
+
+  if (input_timeout < 0)
+    return timer_timeout;
+  if (timer_timeout < 0)
+    return input_timeout;
+  return MIN(input_timeout, timer_timeout);
+}
+
 static gboolean
 xt_event_prepare (GSource*  source_data,
                    gint     *timeout)
 {   
+  XtAppContext ac;
   int mask;
 
+  ac = XtDisplayToApplicationContext(xtdisplay);
+
   GDK_THREADS_ENTER();
-  mask = XPending(xtdisplay);
+  mask = XtAppPending(ac);
+  if (!mask)
+    *timeout = xt_get_next_timeout(source_data, ac);
   GDK_THREADS_LEAVE();
 
-  return (gboolean)mask;
+  return mask != 0 || *timeout == 0;
 }
 
 static gboolean
 xt_event_check (GSource*  source_data)
 {
-  GDK_THREADS_ENTER ();
+  XtAppContext ac;
+  int mask;
 
-  if (xt_event_poll_fd.revents & G_IO_IN) {
-    int mask;
-    mask = XPending(xtdisplay);
-    GDK_THREADS_LEAVE ();
-    return (gboolean)mask;
-  }
+  ac = XtDisplayToApplicationContext(xtdisplay);
 
+  /* poll() returned because of the X connection, an input source or
+   * the next timer deadline. Xt knows which of them need processing */
+  GDK_THREADS_ENTER ();
+  mask = XtAppPending(ac);
   GDK_THREADS_LEAVE ();
-  return FALSE;
+
+  return mask != 0;
 }   
 
 static gboolean
@@ -158,7 +431,6 @@ xt_event_dispatch (GSource*  source_data,
                     GSourceFunc call_back,
                     gpointer  user_data)
 {
-  XEvent event;
   XtAppContext ac;
   int i = 0;
 
@@ -166,14 +438,15 @@ xt_event_dispatch (GSource*  source_data,
 
   GDK_THREADS_ENTER ();
 
-  /* Process only real X traffic here.  We only look for data on the
-   * pipe, limit it to XTBIN_MAX_EVENTS and only call
-   * XtAppProcessEvent so that it will look for X events.  There's no
-   * timer processing here since we already have a timer callback that
-   * does it.  */
-  for (i=0; i < XTBIN_MAX_EVENTS && XPending(xtdisplay); i++) {
-    XtAppProcessEvent(ac, XtIMXEvent);
+  /* Process X events, expired timers and ready input sources, but no
+   * more than XTBIN_MAX_EVENTS at once so that a flood of Xt events
+   * cannot starve GTK. Anything left is still pending and makes the
+   * next prepare() return TRUE. */
+  for (i=0; i < XTBIN_MAX_EVENTS && XtAppPending(ac); i++) {
+    XtAppProcessEvent(ac, XtIMAll);
   }
+  if (i > 0)
+    xt_fallback_timeout = XT_DEFAULT_TIMEOUT;
 
   GDK_THREADS_LEAVE ();
 
@@ -189,27 +462,6 @@ static GSourceFuncs xt_event_funcs = {
   (GSourceDummyMarshal)NULL
 };
 
-static gboolean
-xt_event_polling_timer_callback(gpointer user_data)
-{
-  Display * display;
-  XtAppContext ac;
-  int eventsToProcess = 20;
-
-  display = (Display *)user_data;
-  ac = XtDisplayToApplicationContext(display);
-
-  /* We need to process many Xt events here. If we just process
-     one event we might starve one or more Xt consumers. On the other hand
-     this could hang the whole app if Xt events come pouring in. So process
-     up to 20 Xt events right now and save the rest for later. This is a hack,
-     but it oughta work. We *really* should have out of process plugins.
-  */
-  while (eventsToProcess-- && XtAppPending(ac))
-    XtAppProcessEvent(ac, XtIMAll);
-  return TRUE;
-}
-
 GType
 gtk_xtbin_get_type (void)
 {
@@ -367,14 +619,9 @@ gtk_xtbin_new (GdkWindow *parent_window, String * f)
     xt_event_poll_fd.events = G_IO_IN; 
     xt_event_poll_fd.revents = 0;    /* hmm... is this correct? */
 
-    g_main_context_add_poll ((GMainContext*)NULL, 
-                             &xt_event_poll_fd, 
-                             G_PRIORITY_LOW);
-    /* add a timer so that we can poll and process Xt timers */
-    xt_polling_timer_id =
-      g_timeout_add(25,
-                    (GtkFunction)xt_event_polling_timer_callback,
-                    xtdisplay);
+    /* Xt timers and alternate input sources are handled by the source
+       itself, see xt_get_next_timeout() */
+    g_source_add_poll(gs, &xt_event_poll_fd);
   }
 
   /* Bump up our usage count */
@@ -497,11 +744,8 @@ gtk_xtbin_destroy (GtkObject *object)
 #ifdef DEBUG_XTBIN
       printf("removing the Xt connection from the main loop\n");
 #endif
-      g_main_context_remove_poll((GMainContext*)NULL, &xt_event_poll_fd);
       g_source_remove(tag);
-
-      g_source_remove(xt_polling_timer_id);
-      xt_polling_timer_id = 0;
+      xt_input_n_poll_fds = 0;
     }
   }
 
@@ -544,8 +788,10 @@ xt_client_init( XtClient * xtclient,
 
     xtdisplay = XtOpenDisplay(app_context, gdk_get_display(), NULL, 
                             "Wrapper", NULL, 0, &mArgc, mArgv);
-    if (xtdisplay)
+    if (xtdisplay) {
       xt_is_initialized = TRUE;
+      xt_app_context_probe(app_context);
+    }
   }
   xtclient->xtdisplay  = xtdisplay;
   xtclient->xtvisual   = xtvisual;
@@ -183,6 +183,20 @@ npw_get_stream_instance (NPStream *np_stream)
   return NULL;
 }
 
+/* Check whether a window given to NPP_SetWindow() shows anything:
+   browsers pass an empty clip rect for plugins scrolled out of view
+   or in background tabs */
+static inline bool
+npw_window_is_visible (const NPWindow *window)
+{
+  if (window == NULL)
+    return false;
+  if (window->window == NULL && window->type == NPWindowTypeWindow)
+    return false;
+  return (window->clipRect.right > window->clipRect.left
+	  && window->clipRect.bottom > window->clipRect.top);
+}
+
 /* Unimplemented functions */
 #define NPW_UNIMPLEMENTED()						\
   npw_printf ("WARNING: Unimplemented function %s() at %s:%d\n",	\
@@ -72,16 +72,18 @@ static void FUNC(elf_swap_sym)(ElfW(Sym) *sym)
   sym->st_shndx			= bswap_16(sym->st_shndx);
 }
 
-static bool FUNC(is_elf_plugin_fd)(int fd, NPW_PluginInfo *out_plugin_info)
+static bool FUNC(is_elf_plugin)(const ElfFile *elf, bool *out_is_wrapper, NPW_PluginInfo *out_wrapper_info, NPW_PluginInfo *out_plugin_info)
 {
   int i;
   bool ret = false;
 
-  ElfW(Ehdr) ehdr;
-  if (read(fd, &ehdr, sizeof(ehdr)) != sizeof(ehdr))
+  const ElfW(Ehdr) *ehdr_p = elf_file_data(elf, 0, sizeof(ElfW(Ehdr)));
+  if (ehdr_p == NULL)
 	return false;
 
-  bool do_swap = (ehdr.e_ident[EI_DATA] == ELFDATA2LSB) && !is_little_endian();
+  // Headers are copied out of the read-only mapping before swapping
+  ElfW(Ehdr) ehdr = *ehdr_p;
+  bool do_swap = (ehdr.e_ident[EI_DATA] == ELFDATA2LSB) != is_little_endian();
   if (do_swap)
 	FUNC(elf_swap_ehdr)(&ehdr);
 
@@ -91,57 +93,85 @@ static bool FUNC(is_elf_plugin_fd)(int fd, NPW_PluginInfo *out_plugin_info)
 	return false;
   if (ehdr.e_version != EV_CURRENT)
 	return false;
+  if (ehdr.e_shentsize != sizeof(ElfW(Shdr)))
+	return false;
 
-  ElfW(Shdr) *shdr = (ElfW(Shdr) *)load_data(fd, ehdr.e_shoff, ehdr.e_shnum * sizeof(*shdr));
-  if (do_swap) {
-	for (i = 0; i < ehdr.e_shnum; i++)
-	  FUNC(elf_swap_shdr)(&shdr[i]);
-  }
-
-  char **sdata = (char **)calloc(ehdr.e_shnum, sizeof(*sdata));
-  for (i = 0; i < ehdr.e_shnum; i++) {
-	ElfW(Shdr) *sec = &shdr[i];
-	if (sec->sh_type != SHT_NOBITS)
-	  sdata[i] =  (char *)load_data(fd, sec->sh_offset, sec->sh_size);
-  }
+  const ElfW(Shdr) *shdr = elf_file_data(elf, ehdr.e_shoff, ehdr.e_shnum * sizeof(*shdr));
+  if (shdr == NULL)
+	return false;
 
-  ElfW(Shdr) *symtab_sec = NULL;
+  // Only .dynsym and its string table are looked at
+  ElfW(Shdr) symtab_sec, strtab_sec;
+  const ElfW(Sym) *symtab = NULL;
+  const char *strtab = NULL;
   for (i = 0; i < ehdr.e_shnum; i++) {
-	ElfW(Shdr) *sec = &shdr[i];
-	if (sec->sh_type == SHT_DYNSYM
-		&& strcmp(sdata[ehdr.e_shstrndx] + sec->sh_name, ".dynsym") == 0) {
-	  symtab_sec = sec;
-	  break;
-	}
+	symtab_sec = shdr[i];
+	if (do_swap)
+	  FUNC(elf_swap_shdr)(&symtab_sec);
+	if (symtab_sec.sh_type != SHT_DYNSYM || symtab_sec.sh_link >= ehdr.e_shnum)
+	  continue;
+	strtab_sec = shdr[symtab_sec.sh_link];
+	if (do_swap)
+	  FUNC(elf_swap_shdr)(&strtab_sec);
+	symtab = elf_file_data(elf, symtab_sec.sh_offset, symtab_sec.sh_size);
+	strtab = elf_file_data(elf, strtab_sec.sh_offset, strtab_sec.sh_size);
+	break;
   }
-  if (symtab_sec == NULL)
+  if (symtab == NULL || strtab == NULL || strtab_sec.sh_size == 0)
 	goto done;
-  ElfW(Sym) *symtab = (ElfW(Sym) *)sdata[symtab_sec - shdr];
-  char *strtab = sdata[symtab_sec->sh_link];
-
-  int nb_syms = symtab_sec->sh_size / sizeof(*symtab);
-  if (do_swap) {
-	for (i = 0; i < nb_syms; i++)
-	  FUNC(elf_swap_sym)(&symtab[i]);
-  }
 
+  int nb_syms = symtab_sec.sh_size / sizeof(*symtab);
   int nb_np_syms;
   int is_wrapper_plugin = 0;
+  ElfW(Sym) wrapper_sym = { 0 };
   for (i = 0, nb_np_syms = 0; i < nb_syms; i++) {
-	ElfW(Sym) *sym = &symtab[i];
-	const char *name = strtab + sym->st_name;
-	if (ELFW(ST_BIND)(sym->st_info) != STB_GLOBAL)
+	ElfW(Sym) sym = symtab[i];
+	if (do_swap)
+	  FUNC(elf_swap_sym)(&sym);
+	if (ELFW(ST_BIND)(sym.st_info) != STB_GLOBAL)
+	  continue;
+	if (sym.st_name >= strtab_sec.sh_size)
+	  continue;
+	const char *name = strtab + sym.st_name;
+	if (memchr(name, '\0', strtab_sec.sh_size - sym.st_name) == NULL)
 	  continue;
-	if (ELFW(ST_TYPE)(sym->st_info) == STT_OBJECT && strcmp(name, "NPW_Plugin") == 0)
+	if (ELFW(ST_TYPE)(sym.st_info) == STT_OBJECT && strcmp(name, "NPW_Plugin") == 0) {
+	  wrapper_sym = sym;
 	  is_wrapper_plugin = 1;
-	if (ELFW(ST_TYPE)(sym->st_info) != STT_FUNC)
+	}
+	if (ELFW(ST_TYPE)(sym.st_info) != STT_FUNC)
 	  continue;
 	if (!strcmp(name, "NP_GetMIMEDescription") ||
 		!strcmp(name, "NP_Initialize") ||
 		!strcmp(name, "NP_Shutdown"))
 	  nb_np_syms++;
   }
-  ret = (nb_np_syms == 3) && !is_wrapper_plugin;
+  ret = (nb_np_syms == 3);
+
+  // NPW_Plugin is a constant without relocations, its file image is
+  // exactly what the wrapper sees at run-time
+  if (is_wrapper_plugin && out_wrapper_info) {
+	const void *data = NULL;
+	uint64_t size = wrapper_sym.st_size;
+	if (size > sizeof(*out_wrapper_info))
+	  size = sizeof(*out_wrapper_info);
+	memset(out_wrapper_info, 0, sizeof(*out_wrapper_info));
+	if (wrapper_sym.st_shndx < ehdr.e_shnum) {
+	  ElfW(Shdr) sec = shdr[wrapper_sym.st_shndx];
+	  if (do_swap)
+		FUNC(elf_swap_shdr)(&sec);
+	  if (sec.sh_type != SHT_NOBITS
+		  && wrapper_sym.st_value >= sec.sh_addr
+		  && wrapper_sym.st_value - sec.sh_addr + size <= sec.sh_size)
+		data = elf_file_data(elf, sec.sh_offset + (wrapper_sym.st_value - sec.sh_addr), size);
+	}
+	if (data)
+	  memcpy(out_wrapper_info, data, size);
+	else
+	  is_wrapper_plugin = 0;
+  }
+  if (out_is_wrapper)
+	*out_is_wrapper = is_wrapper_plugin;
 
  done:
   if (out_plugin_info) {
@@ -164,10 +194,21 @@ static bool FUNC(is_elf_plugin_fd)(int fd, NPW_PluginInfo *out_plugin_info)
 	case ELFOSABI_FREEBSD:	target_os = "freebsd";	break;
 	}
 	if (target_os == NULL) {
-	  for (i = 0; i < ehdr.e_shnum; i++) {
-	    ElfW(Shdr) *sec = &shdr[i];
-	    if ((sec->sh_type == 0x6ffffffd /* SHT_SUNW_verdef */ || sec->sh_type == 0x6ffffffe /*SHT_SUNW_verneed*/)
-			&& strcmp(sdata[ehdr.e_shstrndx] + sec->sh_name, ".SUNW_version") == 0) {
+	  ElfW(Shdr) shstrtab_sec;
+	  const char *shstrtab = NULL;
+	  if (ehdr.e_shstrndx < ehdr.e_shnum) {
+		shstrtab_sec = shdr[ehdr.e_shstrndx];
+		if (do_swap)
+		  FUNC(elf_swap_shdr)(&shstrtab_sec);
+		shstrtab = elf_file_data(elf, shstrtab_sec.sh_offset, shstrtab_sec.sh_size);
+	  }
+	  for (i = 0; shstrtab && i < ehdr.e_shnum; i++) {
+		ElfW(Shdr) sec = shdr[i];
+		if (do_swap)
+		  FUNC(elf_swap_shdr)(&sec);
+	    if ((sec.sh_type == 0x6ffffffd /* SHT_SUNW_verdef */ || sec.sh_type == 0x6ffffffe /*SHT_SUNW_verneed*/)
+			&& sec.sh_name + sizeof(".SUNW_version") <= shstrtab_sec.sh_size
+			&& strcmp(shstrtab + sec.sh_name, ".SUNW_version") == 0) {
 	      target_os = "solaris";
 	      break;
 	    }
@@ -178,10 +219,6 @@ static bool FUNC(is_elf_plugin_fd)(int fd, NPW_PluginInfo *out_plugin_info)
 	strcpy(out_plugin_info->target_os, target_os);
   }
 
-  for (i = 0; i < ehdr.e_shnum; i++)
-	free(sdata[i]);
-  free(sdata);
-  free(shdr);
   return ret;
 }
 
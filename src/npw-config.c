@@ -28,16 +28,15 @@
 #include <limits.h>
 #include <errno.h>
 
-#include <dlfcn.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <elf.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <pwd.h>
 #include <dirent.h>
+#include <pthread.h>
 
 #include <glib.h>
 
@@ -270,81 +269,7 @@ static const char **get_mozilla_plugin_dirs(void)
   return dirs;
 }
 
-/* ELF decoder derived from QEMU code */
-
-#undef bswap_16
-#define bswap_16(x) \
-	((((x) >> 8) & 0xff) | (((x) & 0xff) << 8))
-
-#undef bswap_32
-#define bswap_32(x) \
-     ((((x) & 0xff000000) >> 24) | (((x) & 0x00ff0000) >>  8) | \
-      (((x) & 0x0000ff00) <<  8) | (((x) & 0x000000ff) << 24))
-
-#undef bswap_64
-#define bswap_64(x) \
-     (              \
-      (((x) & 0xff00000000000000) >> 56)  | (((x) & 0x00ff000000000000) >> 40) | \
-      (((x) & 0x00000000000000ff) << 56)  | (((x) & 0x000000000000ff00) << 40) | \
-      (((x) & 0x0000ff0000000000) >> 24)  | (((x) & 0x000000ff00000000) >>  8) | \
-      (((x) & 0x0000000000ff0000) << 24)  | (((x) & 0x00000000ff000000) <<  8) \
-     )
-
-/* Base structure - used to distinguish between 32/64 bit version */
-typedef struct
-{
-  unsigned char	e_ident[EI_NIDENT];	/* Magic number and other info */
-} Elf_hdr_base;
-
-void *load_data(int fd, long offset, unsigned int size)
-{
-  char *data = (char *)malloc(size);
-  if (!data)
-	return NULL;
-
-  lseek(fd, offset, SEEK_SET);
-  if (read(fd, data, size) != size) {
-	free(data);
-	return NULL;
-  }
-
-  return data;
-}
-
-static bool is_little_endian(void)
-{
-  union { uint32_t i; uint8_t b[4]; } x;
-  x.i = 0x01020304;
-  return x.b[0] == 0x04;
-}
-
-#define ELF_CLASS ELFCLASS32
-#include "npw-config-template.h"
-
-#define ELF_CLASS ELFCLASS64
-#include "npw-config-template.h"
-
-static bool is_plugin_fd(int fd, NPW_PluginInfo *out_plugin_info)
-{
-  Elf_hdr_base ehdr;
-	
-  if (read(fd, &ehdr, sizeof(ehdr)) != sizeof(ehdr))
-	return false;
-
-  if (ehdr.e_ident[EI_MAG0] != ELFMAG0
-	  || ehdr.e_ident[EI_MAG1] != ELFMAG1
-	  || ehdr.e_ident[EI_MAG2] != ELFMAG2
-	  || ehdr.e_ident[EI_MAG3] != ELFMAG3)
-	return false;
-
-  lseek(fd, 0, SEEK_SET);
-
-  switch (ehdr.e_ident[EI_CLASS]) {
-  case ELFCLASS32: return is_elf_plugin_fd_32(fd, out_plugin_info);
-  case ELFCLASS64: return is_elf_plugin_fd_64(fd, out_plugin_info);
-  }
-  return false;
-}
+#include "npw-elf.h"
 
 enum {
   EXIT_VIEWER_NOT_FOUND	= -2,
@@ -361,13 +286,16 @@ static bool is_plugin_viewer_ok(const char *viewer_path, const char *filename)
   if (pid == 0) {
 	if (!g_verbose) {
 	  // don't spit out errors in non-verbose mode, we only need
-	  // to know whether there is a valid viewer or not
-	  if (freopen("/dev/null", "w", stderr) == NULL) {
-		fprintf(stderr, "failed to silence stderr\n");
+	  // to know whether there is a valid viewer or not. Other probe
+	  // threads may hold stdio locks, so stick to plain syscalls
+	  int null_fd = open("/dev/null", O_WRONLY);
+	  if (null_fd >= 0) {
+		dup2(null_fd, 2);
+		close(null_fd);
 	  }
 	}
 	execl(viewer_path, NPW_VIEWER, "--test", "--plugin", filename, NULL);
-	exit(1);
+	_exit(1);
   }
   else {
 	int status;
@@ -381,7 +309,7 @@ static bool is_plugin_viewer_ok(const char *viewer_path, const char *filename)
 
 static int detect_plugin_viewer(const char *filename, NPW_PluginInfo *out_plugin_info)
 {
-  static const char *target_arch_table[] = {
+  const char *target_arch_table[] = {
 	NULL,
 	"i386",
 	NULL
@@ -393,7 +321,7 @@ static int detect_plugin_viewer(const char *filename, NPW_PluginInfo *out_plugin
   else
 	target_arch_table[0] = NULL;
 
-  static const char *target_os_table[] = {
+  const char *target_os_table[] = {
 	NULL,
 	"linux",
 	NULL
@@ -480,7 +408,8 @@ static bool is_plugin(const char *filename, NPW_PluginInfo *out_plugin_info)
   if (fd < 0)
 	return false;
 
-  bool ret = is_plugin_fd(fd, out_plugin_info);
+  bool is_wrapper = false;
+  bool ret = is_plugin_fd(fd, &is_wrapper, NULL, out_plugin_info) && !is_wrapper;
   close(fd);
   return ret;
 }
@@ -490,52 +419,60 @@ static bool is_compatible_plugin(const char *filename, NPW_PluginInfo *out_plugi
   return is_plugin(filename, out_plugin_info) && is_plugin_viewer_available(filename, out_plugin_info);
 }
 
-static bool is_wrapper_plugin_handle(void *handle, NPW_PluginInfo *out_plugin_info)
+static void get_wrapper_plugin_info(NPW_PluginInfo *pi, NPW_PluginInfo *out_plugin_info)
 {
-  if (dlsym(handle, "NP_Initialize") == NULL)
-	return false;
-  if (dlsym(handle, "NP_Shutdown") == NULL)
-	return false;
-  if (dlsym(handle, "NP_GetMIMEDescription") == NULL)
-	return false;
-  NPW_PluginInfo *pi;
-  if ((pi = (NPW_PluginInfo *)dlsym(handle, "NPW_Plugin")) == NULL)
-	return false;
-  if (out_plugin_info) {
-	int plugin_info_version = 0;
-	if (strncmp(pi->ident, "NPW:0.9.90", 10) != 0)
-	  plugin_info_version = 1;
-	if (strncmp(pi->ident, "NPW:X:", 6) == 0)
-	  plugin_info_version = pi->struct_version;
-	out_plugin_info->struct_version = plugin_info_version;
-	strcpy(out_plugin_info->ident, pi->ident);
-	strcpy(out_plugin_info->path, pi->path);
-	out_plugin_info->mtime = pi->mtime;
-	if (plugin_info_version >= 1) {		// additional members in 0.9.91+
-	  strcpy(out_plugin_info->target_arch, pi->target_arch);
-	  strcpy(out_plugin_info->target_os, pi->target_os);
-	}
-	else {
-	  out_plugin_info->target_arch[0] = '\0';
-	  out_plugin_info->target_os[0] = '\0';
-	}
-	if (plugin_info_version >= 2)		// additional members in 1.3.0+
-	  strcpy(out_plugin_info->viewer_path, pi->viewer_path);
-	else
-	  out_plugin_info->viewer_path[0] = '\0';
+  // The record comes straight from the file, don't trust its strings
+  pi->ident[sizeof(pi->ident) - 1] = '\0';
+  pi->path[sizeof(pi->path) - 1] = '\0';
+  pi->target_arch[sizeof(pi->target_arch) - 1] = '\0';
+  pi->target_os[sizeof(pi->target_os) - 1] = '\0';
+  pi->viewer_path[sizeof(pi->viewer_path) - 1] = '\0';
+
+  int plugin_info_version = 0;
+  if (strncmp(pi->ident, "NPW:0.9.90", 10) != 0)
+	plugin_info_version = 1;
+  if (strncmp(pi->ident, "NPW:X:", 6) == 0)
+	plugin_info_version = pi->struct_version;
+  out_plugin_info->struct_version = plugin_info_version;
+  strcpy(out_plugin_info->ident, pi->ident);
+  strcpy(out_plugin_info->path, pi->path);
+  out_plugin_info->mtime = pi->mtime;
+  if (plugin_info_version >= 1) {		// additional members in 0.9.91+
+	strcpy(out_plugin_info->target_arch, pi->target_arch);
+	strcpy(out_plugin_info->target_os, pi->target_os);
+  }
+  else {
+	out_plugin_info->target_arch[0] = '\0';
+	out_plugin_info->target_os[0] = '\0';
+  }
+  if (plugin_info_version >= 2)		// additional members in 1.3.0+
+	strcpy(out_plugin_info->viewer_path, pi->viewer_path);
+  else
+	out_plugin_info->viewer_path[0] = '\0';
+  if (plugin_info_version >= 3) {		// original plugin size and inode
+	out_plugin_info->size = pi->size;
+	out_plugin_info->inode = pi->inode;
+  }
+  else {
+	out_plugin_info->size = 0;
+	out_plugin_info->inode = 0;
   }
-  return true;
 }
 
+// NPW_Plugin is read from the ELF image, wrappers are never loaded
 static bool is_wrapper_plugin(const char *plugin_path, NPW_PluginInfo *out_plugin_info)
 {
-  void *handle = dlopen(plugin_path, RTLD_LAZY);
-  if (handle == NULL)
+  int fd = open(plugin_path, O_RDONLY);
+  if (fd < 0)
 	return false;
 
-  bool ret = is_wrapper_plugin_handle(handle, out_plugin_info);
-  /* Intentionally leak the handle; many libraries crash when unloaded. */
-  /* dlclose(handle); */
+  NPW_PluginInfo plugin_info;
+  bool is_wrapper = false;
+  bool ret = is_plugin_fd(fd, &is_wrapper, &plugin_info, NULL) && is_wrapper;
+  close(fd);
+
+  if (ret && out_plugin_info)
+	get_wrapper_plugin_info(&plugin_info, out_plugin_info);
   return ret;
 }
 
@@ -618,6 +555,56 @@ static bool is_root_only_accessible_plugin(const char *plugin_path)
 typedef bool (*is_plugin_cb)(const char *plugin_path, NPW_PluginInfo *plugin_info);
 typedef int (*process_plugin_cb)(const char *plugin_path, NPW_PluginInfo *plugin_info);
 
+/* Directory entries are probed by a small pool of threads, since the
+   test callbacks may fork a viewer and wait for it. The process
+   callback is then called from the main thread, in sorted order, so
+   that the output does not depend on scheduling */
+#define MAX_PROBE_THREADS 8
+
+typedef struct {
+  char *plugin_path;
+  bool is_plugin;
+  NPW_PluginInfo plugin_info;
+} ProbeEntry;
+
+typedef struct {
+  ProbeEntry *entries;
+  int n_entries;
+  int next_entry;
+  pthread_mutex_t lock;
+  is_plugin_cb test;
+} ProbeQueue;
+
+static void *probe_thread(void *arg)
+{
+  ProbeQueue *queue = (ProbeQueue *)arg;
+  for (;;) {
+	pthread_mutex_lock(&queue->lock);
+	int i = queue->next_entry++;
+	pthread_mutex_unlock(&queue->lock);
+	if (i >= queue->n_entries)
+	  break;
+	ProbeEntry *entry = &queue->entries[i];
+	memset(&entry->plugin_info, 0, sizeof(entry->plugin_info));
+	entry->is_plugin = queue->test(entry->plugin_path, &entry->plugin_info);
+  }
+  return NULL;
+}
+
+static int get_probe_thread_count(int n_entries)
+{
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_cpus < 1)
+	n_cpus = 1;
+  int n_threads = n_cpus < MAX_PROBE_THREADS ? n_cpus : MAX_PROBE_THREADS;
+  return n_threads < n_entries ? n_threads : n_entries;
+}
+
+static int compare_probe_entries(const void *a, const void *b)
+{
+  return strcmp(((const ProbeEntry *)a)->plugin_path, ((const ProbeEntry *)b)->plugin_path);
+}
+
 static int process_plugin_dir(const char *plugin_dir, is_plugin_cb test, process_plugin_cb process)
 {
   if (g_verbose)
@@ -627,19 +614,86 @@ static int process_plugin_dir(const char *plugin_dir, is_plugin_cb test, process
   if (dir == NULL)
 	return -1;
 
+  ProbeQueue queue;
+  int max_entries = 0;
+  queue.entries = NULL;
+  queue.n_entries = 0;
+  queue.next_entry = 0;
+  queue.test = test;
+  pthread_mutex_init(&queue.lock, NULL);
+
   struct dirent *ent;
   while ((ent = readdir(dir)) != NULL) {
-	char *plugin_path = g_build_filename(plugin_dir, ent->d_name, NULL);
-	NPW_PluginInfo plugin_info;
-	if (test(plugin_path, &plugin_info))
-	  process(plugin_path, &plugin_info);
-	g_free(plugin_path);
+	if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+	  continue;
+	if (queue.n_entries == max_entries) {
+	  max_entries = max_entries ? 2 * max_entries : 64;
+	  queue.entries = g_renew(ProbeEntry, queue.entries, max_entries);
+	}
+	queue.entries[queue.n_entries++].plugin_path = g_build_filename(plugin_dir, ent->d_name, NULL);
   }
-
   closedir(dir);
+
+  qsort(queue.entries, queue.n_entries, sizeof(queue.entries[0]), compare_probe_entries);
+
+  pthread_t threads[MAX_PROBE_THREADS];
+  int i, n_threads = get_probe_thread_count(queue.n_entries);
+  for (i = 0; i < n_threads; i++) {
+	if (pthread_create(&threads[i], NULL, probe_thread, &queue) != 0)
+	  break;
+  }
+  n_threads = i;
+  if (n_threads == 0)
+	probe_thread(&queue);
+  for (i = 0; i < n_threads; i++)
+	pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&queue.lock);
+
+  for (i = 0; i < queue.n_entries; i++) {
+	ProbeEntry *entry = &queue.entries[i];
+	if (entry->is_plugin)
+	  process(entry->plugin_path, &entry->plugin_info);
+	g_free(entry->plugin_path);
+  }
+  g_free(queue.entries);
   return 0;
 }
 
+/* The browser may have the previous wrapper mapped, so never rewrite it
+   in place: fill in a temporary file next to it, then rename it over */
+static int write_file_atomically(const char *path, const char *data, size_t size, int mode)
+{
+  char *tmp_path = g_strdup_printf("%s.XXXXXX", path);
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+	g_free(tmp_path);
+	return -1;
+  }
+
+  int ret = 0;
+  while (size > 0) {
+	ssize_t n = write(fd, data, size);
+	if (n < 0) {
+	  if (errno == EINTR)
+		continue;
+	  ret = -1;
+	  break;
+	}
+	data += n;
+	size -= n;
+  }
+  if (ret == 0 && (fchmod(fd, mode) < 0 || fsync(fd) < 0))
+	ret = -1;
+  if (close(fd) < 0)
+	ret = -1;
+  if (ret == 0 && rename(tmp_path, path) < 0)
+	ret = -1;
+  if (ret < 0)
+	unlink(tmp_path);
+  g_free(tmp_path);
+  return ret;
+}
+
 static int do_install_plugin(const char *plugin_path, const char *plugin_dir, NPW_PluginInfo *plugin_info)
 {
   if (plugin_dir == NULL)
@@ -716,6 +770,8 @@ static int do_install_plugin(const char *plugin_path, const char *plugin_dir, NP
   strcpy(pi->target_os, plugin_info->target_os);
   pi->struct_version = w_plugin_info.struct_version;
   strcpy(pi->viewer_path, plugin_info->viewer_path);
+  pi->size = st.st_size;
+  pi->inode = st.st_ino;
 
   int mode = 0700;
   if (!is_user_home_path(d_plugin_path) &&
@@ -724,7 +780,7 @@ static int do_install_plugin(const char *plugin_path, const char *plugin_dir, NP
 
   // TODO: Don't swallow the error message. Also get rid of these ridiculous
   // return codes. They're never acted on anyway. Use GError or something.
-  if (!g_file_set_contents(d_plugin_path, plugin_data, w_size, NULL))
+  if (write_file_atomically(d_plugin_path, plugin_data, w_size, mode) < 0)
     return 4;
 
   if (g_verbose)
@@ -851,7 +907,10 @@ static int update_plugin(const char *plugin_path)
 	  printf ("  ... but re-installing it to root private mozilla plugins dir\n");
 	ret = install_plugin(plugin_info.path, &plugin_info);
   }
-  else if (stat(plugin_info.path, &st) == 0 && st.st_mtime > plugin_info.mtime) {
+  else if (stat(plugin_info.path, &st) == 0
+		   && (st.st_mtime != plugin_info.mtime
+			   || st.st_size != plugin_info.size
+			   || st.st_ino != plugin_info.inode)) {
 	if (g_verbose)
 	  printf("  NPAPI plugin %s was modified, reinstalling plugin\n", plugin_info.path);
 	ret = install_plugin(plugin_info.path, &plugin_info);
@@ -0,0 +1,119 @@
+/*
+ *  npw-elf.h - ELF plugin probe, shared by npconfig and npplayer
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef NPW_ELF_H
+#define NPW_ELF_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* ELF decoder derived from QEMU code */
+
+#undef bswap_16
+#define bswap_16(x) \
+	((((x) >> 8) & 0xff) | (((x) & 0xff) << 8))
+
+#undef bswap_32
+#define bswap_32(x) \
+     ((((x) & 0xff000000) >> 24) | (((x) & 0x00ff0000) >>  8) | \
+      (((x) & 0x0000ff00) <<  8) | (((x) & 0x000000ff) << 24))
+
+#undef bswap_64
+#define bswap_64(x) \
+     (              \
+      (((x) & 0xff00000000000000) >> 56)  | (((x) & 0x00ff000000000000) >> 40) | \
+      (((x) & 0x00000000000000ff) << 56)  | (((x) & 0x000000000000ff00) << 40) | \
+      (((x) & 0x0000ff0000000000) >> 24)  | (((x) & 0x000000ff00000000) >>  8) | \
+      (((x) & 0x0000000000ff0000) << 24)  | (((x) & 0x00000000ff000000) <<  8) \
+     )
+
+/* Base structure - used to distinguish between 32/64 bit version */
+typedef struct
+{
+  unsigned char	e_ident[EI_NIDENT];	/* Magic number and other info */
+} Elf_hdr_base;
+
+/* Read-only mapping of the whole file, sections are only paged in
+   when they are looked at */
+typedef struct
+{
+  const unsigned char *data;
+  size_t size;
+} ElfFile;
+
+static const void *elf_file_data(const ElfFile *elf, uint64_t offset, uint64_t size)
+{
+  if (offset > elf->size || size > elf->size - offset)
+	return NULL;
+  return elf->data + offset;
+}
+
+static bool is_little_endian(void)
+{
+  union { uint32_t i; uint8_t b[4]; } x;
+  x.i = 0x01020304;
+  return x.b[0] == 0x04;
+}
+
+#define ELF_CLASS ELFCLASS32
+#include "npw-config-template.h"
+
+#define ELF_CLASS ELFCLASS64
+#include "npw-config-template.h"
+
+/* Check whether FD is an ELF shared object exporting the NPAPI entry
+   points, without loading it. OUT_IS_WRAPPER is set if this is an
+   nspluginwrapper plugin (it exports NPW_Plugin), in which case
+   OUT_WRAPPER_INFO receives the raw contents of NPW_Plugin */
+static bool is_plugin_fd(int fd, bool *out_is_wrapper, NPW_PluginInfo *out_wrapper_info, NPW_PluginInfo *out_plugin_info)
+{
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < sizeof(Elf_hdr_base))
+	return false;
+
+  ElfFile elf;
+  elf.size = st.st_size;
+  elf.data = mmap(NULL, elf.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (elf.data == MAP_FAILED)
+	return false;
+
+  bool ret = false;
+  const Elf_hdr_base *ehdr = (const Elf_hdr_base *)elf.data;
+  if (ehdr->e_ident[EI_MAG0] == ELFMAG0
+	  && ehdr->e_ident[EI_MAG1] == ELFMAG1
+	  && ehdr->e_ident[EI_MAG2] == ELFMAG2
+	  && ehdr->e_ident[EI_MAG3] == ELFMAG3) {
+	switch (ehdr->e_ident[EI_CLASS]) {
+	case ELFCLASS32: ret = is_elf_plugin_32(&elf, out_is_wrapper, out_wrapper_info, out_plugin_info); break;
+	case ELFCLASS64: ret = is_elf_plugin_64(&elf, out_is_wrapper, out_wrapper_info, out_plugin_info); break;
+	}
+  }
+
+  munmap((void *)elf.data, elf.size);
+  return ret;
+}
+
+#endif /* NPW_ELF_H */
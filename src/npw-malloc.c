@@ -37,6 +37,7 @@ struct _NPW_MallocHooks
   NPW_MemAllocProcPtr memalloc;
   NPW_MemAllocProcPtr memalloc0;
   NPW_MemFreeProcPtr  memfree;
+  bool                needs_header;	/* memfree() needs the block size */
 };
 
 #define NPW_MALLOC_MAGIC 0x4e50574d /* 'NPWM' */
@@ -49,11 +50,12 @@ struct _NPW_MemBlock
   uint32_t    alloc_size;
   uint32_t    alloc_lineno;
   const char *alloc_file;
+  struct _NPW_MemSite *alloc_site;
 };
 
-static void *npw_mem_alloc      (uint32_t size, const char *file, int lineno);
-static void *npw_mem_alloc0     (uint32_t size, const char *file, int lineno);
-static void *npw_mem_alloc_copy (uint32_t size, const void *ptr, const char *file, int lineno);
+static void *npw_mem_alloc      (uint32_t size, const char *file, int lineno, const void *caller);
+static void *npw_mem_alloc0     (uint32_t size, const char *file, int lineno, const void *caller);
+static void *npw_mem_alloc_copy (uint32_t size, const void *ptr, const char *file, int lineno, const void *caller);
 static void npw_mem_free        (void *ptr, const char *file, int lineno);
 
 /* ====================================================================== */
@@ -88,7 +90,8 @@ NPW_Libc_MemFree (void *ptr, uint32_t size)
 static const NPW_MallocHooks g_libc_hooks = {
   NPW_Libc_MemAlloc,
   NPW_Libc_MemAlloc0,
-  NPW_Libc_MemFree
+  NPW_Libc_MemFree,
+  true
 };
 #endif
 
@@ -124,7 +127,276 @@ NPW_Glib_MemFree (void *ptr, uint32_t size)
 static const NPW_MallocHooks g_glib_hooks = {
   NPW_Glib_MemAlloc,
   NPW_Glib_MemAlloc0,
-  NPW_Glib_MemFree
+  NPW_Glib_MemFree,
+  true
+};
+#endif
+
+/* ====================================================================== */
+/* === Size-class pools                                               === */
+/* ====================================================================== */
+
+#ifndef USE_MALLOC_POOL
+#define USE_MALLOC_POOL 0
+#endif
+
+#if USE_MALLOC_POOL
+#include <stdlib.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/* Small blocks are carved out of slabs taken from a single reserved
+   address range, so that the size class of a block is known from its
+   address alone and no header is needed. Each thread keeps its own
+   free lists, refilled from a shared depot or from new slabs. Larger
+   blocks, or any block once the arena is exhausted, go to libc. */
+
+#define POOL_SLAB_SIZE	(16 * 1024)
+#define POOL_ARENA_SIZE	(64 * 1024 * 1024)
+#define POOL_N_SLABS	(POOL_ARENA_SIZE / POOL_SLAB_SIZE)
+#define POOL_MAX_SIZE	1024
+#define POOL_CACHE_MAX	1024 /* per-thread blocks per class before spilling to the depot */
+
+static const uint16_t g_pool_class_sizes[] = {
+  8, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, POOL_MAX_SIZE
+};
+#define POOL_N_CLASSES (sizeof (g_pool_class_sizes) / sizeof (g_pool_class_sizes[0]))
+
+typedef struct _NPW_PoolBlock NPW_PoolBlock;
+struct _NPW_PoolBlock
+{
+  NPW_PoolBlock *next;
+};
+
+typedef struct _NPW_PoolList NPW_PoolList;
+struct _NPW_PoolList
+{
+  NPW_PoolBlock *head;
+  uint32_t       count;
+};
+
+typedef struct _NPW_PoolCache NPW_PoolCache;
+struct _NPW_PoolCache
+{
+  NPW_PoolList lists[POOL_N_CLASSES];
+  bool         registered;
+};
+
+static pthread_once_t  g_pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t   g_pool_key;
+static uint8_t        *g_pool_arena;
+static uint32_t        g_pool_n_slabs;
+static uint8_t         g_pool_slab_class[POOL_N_SLABS];
+static NPW_PoolList    g_pool_depot[POOL_N_CLASSES];
+static uint8_t         g_pool_class_index[POOL_MAX_SIZE / 8 + 1];
+static __thread NPW_PoolCache g_pool_cache;
+
+static inline bool
+pool_contains (const void *ptr)
+{
+  const uint8_t *p = ptr;
+  /* the arena is NULL if it could not be mapped */
+  return (g_pool_arena != NULL
+	  && p >= g_pool_arena && p < g_pool_arena + POOL_ARENA_SIZE);
+}
+
+static inline unsigned int
+pool_class_index (uint32_t size)
+{
+  return g_pool_class_index[(size + 7) / 8];
+}
+
+/* Move LIST to the depot, the caller holds g_pool_lock */
+static void
+pool_depot_push (unsigned int cls, NPW_PoolList *list)
+{
+  NPW_PoolBlock *tail = list->head;
+
+  if (tail == NULL)
+    return;
+  while (tail->next)
+    tail = tail->next;
+  tail->next = g_pool_depot[cls].head;
+  g_pool_depot[cls].head = list->head;
+  g_pool_depot[cls].count += list->count;
+  list->head = NULL;
+  list->count = 0;
+}
+
+/* Hand the free lists of an exiting thread over to the other threads */
+static void
+pool_cache_destroy (void *data)
+{
+  NPW_PoolCache *cache = data;
+  unsigned int cls;
+
+  pthread_mutex_lock (&g_pool_lock);
+  for (cls = 0; cls < POOL_N_CLASSES; cls++)
+    pool_depot_push (cls, &cache->lists[cls]);
+  pthread_mutex_unlock (&g_pool_lock);
+}
+
+/* Reserve address space only, slabs are made accessible as needed */
+static void *
+pool_reserve_arena (void)
+{
+#if defined(MAP_ANONYMOUS)
+  return mmap (NULL, POOL_ARENA_SIZE, PROT_NONE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#else
+  void *arena;
+  int fd;
+
+  if ((fd = open ("/dev/zero", O_RDWR)) < 0)
+    return MAP_FAILED;
+  arena = mmap (NULL, POOL_ARENA_SIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+  close (fd);
+  return arena;
+#endif
+}
+
+static void
+pool_init (void)
+{
+  unsigned int i, cls = 0;
+
+  for (i = 0; i < sizeof (g_pool_class_index); i++)
+    {
+      while (g_pool_class_sizes[cls] < i * 8)
+	cls++;
+      g_pool_class_index[i] = cls;
+    }
+
+  void *arena = pool_reserve_arena ();
+  if (arena != MAP_FAILED)
+    g_pool_arena = arena;
+
+  if (pthread_key_create (&g_pool_key, pool_cache_destroy) != 0)
+    npw_printf ("WARNING: memory pools of exiting threads will leak\n");
+}
+
+static inline NPW_PoolCache *
+pool_get_cache (void)
+{
+  NPW_PoolCache *cache = &g_pool_cache;
+
+  if (G_UNLIKELY (!cache->registered))
+    {
+      pthread_once (&g_pool_once, pool_init);
+      pthread_setspecific (g_pool_key, cache);
+      cache->registered = true;
+    }
+  return cache;
+}
+
+/* Refill the (empty) thread free list for class CLS */
+static bool
+pool_refill (NPW_PoolCache *cache, unsigned int cls)
+{
+  NPW_PoolList *list = &cache->lists[cls];
+  uint8_t *slab = NULL;
+
+  pthread_mutex_lock (&g_pool_lock);
+  if (g_pool_depot[cls].head)
+    {
+      *list = g_pool_depot[cls];
+      g_pool_depot[cls].head = NULL;
+      g_pool_depot[cls].count = 0;
+    }
+  else if (g_pool_arena && g_pool_n_slabs < POOL_N_SLABS)
+    {
+      slab = g_pool_arena + g_pool_n_slabs * POOL_SLAB_SIZE;
+      if (mprotect (slab, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE) == 0)
+	g_pool_slab_class[g_pool_n_slabs++] = cls;
+      else
+	slab = NULL;
+    }
+  pthread_mutex_unlock (&g_pool_lock);
+
+  if (slab)
+    {
+      const uint32_t block_size = g_pool_class_sizes[cls];
+      const uint32_t n_blocks = POOL_SLAB_SIZE / block_size;
+      uint32_t i;
+
+      for (i = n_blocks; i-- > 0; )
+	{
+	  NPW_PoolBlock *block = (NPW_PoolBlock *)(slab + i * block_size);
+	  block->next = list->head;
+	  list->head = block;
+	}
+      list->count = n_blocks;
+    }
+
+  return list->head != NULL;
+}
+
+static void *
+NPW_Pool_MemAlloc (uint32_t size)
+{
+  if (size > POOL_MAX_SIZE)
+    return malloc (size);
+
+  NPW_PoolCache *cache = pool_get_cache ();
+  unsigned int cls = pool_class_index (size);
+  NPW_PoolList *list = &cache->lists[cls];
+
+  if (list->head == NULL && !pool_refill (cache, cls))
+    return malloc (size);
+
+  NPW_PoolBlock *block = list->head;
+  list->head = block->next;
+  list->count--;
+  return block;
+}
+
+static void *
+NPW_Pool_MemAlloc0 (uint32_t size)
+{
+  void *ptr = NPW_Pool_MemAlloc (size);
+  if (ptr)
+    memset (ptr, 0, size);
+  return ptr;
+}
+
+static void
+NPW_Pool_MemFree (void *ptr, uint32_t size)
+{
+  if (!pool_contains (ptr))
+    {
+      free (ptr);
+      return;
+    }
+
+  NPW_PoolCache *cache = pool_get_cache ();
+  unsigned int cls = g_pool_slab_class[((uint8_t *)ptr - g_pool_arena) / POOL_SLAB_SIZE];
+  NPW_PoolList *list = &cache->lists[cls];
+  NPW_PoolBlock *block = ptr;
+
+  block->next = list->head;
+  list->head = block;
+  if (++list->count > POOL_CACHE_MAX)
+    {
+      /* Don't let a thread that only frees hoard the blocks */
+      pthread_mutex_lock (&g_pool_lock);
+      pool_depot_push (cls, list);
+      pthread_mutex_unlock (&g_pool_lock);
+    }
+}
+
+static const NPW_MallocHooks g_pool_hooks = {
+  NPW_Pool_MemAlloc,
+  NPW_Pool_MemAlloc0,
+  NPW_Pool_MemFree,
+  false
 };
 #endif
 
@@ -132,7 +404,7 @@ static const NPW_MallocHooks g_glib_hooks = {
 /* === Public interface                                               === */
 /* ====================================================================== */
 
-#define N_MALLOC_LIBS (USE_MALLOC_LIBC + USE_MALLOC_GLIB)
+#define N_MALLOC_LIBS (USE_MALLOC_LIBC + USE_MALLOC_GLIB + USE_MALLOC_POOL)
 
 #ifndef CONCAT
 #define CONCAT_(a,b) a##b
@@ -156,6 +428,10 @@ do_get_malloc_hooks (void)
 #if USE_MALLOC_GLIB
       if (strcmp (malloc_lib, "glib") == 0)
 	return &g_glib_hooks;
+#endif
+#if USE_MALLOC_POOL
+      if (strcmp (malloc_lib, "pool") == 0)
+	return &g_pool_hooks;
 #endif
     }
   return get_default_malloc_hooks ();
@@ -176,19 +452,19 @@ get_malloc_hooks (void)
 void *
 NPW_MemAlloc (uint32_t size)
 {
-  return npw_mem_alloc (size, NULL, 0);
+  return npw_mem_alloc (size, NULL, 0, __builtin_return_address (0));
 }
 
 void *
 NPW_MemAlloc0 (uint32_t size)
 {
-  return npw_mem_alloc0 (size, NULL, 0);
+  return npw_mem_alloc0 (size, NULL, 0, __builtin_return_address (0));
 }
 
 void *
 NPW_MemAllocCopy (uint32_t size, const void *ptr)
 {
-  return npw_mem_alloc_copy (size, ptr, NULL, 0);
+  return npw_mem_alloc_copy (size, ptr, NULL, 0, __builtin_return_address (0));
 }
 
 void
@@ -200,19 +476,19 @@ NPW_MemFree (void *ptr)
 void *
 NPW_Debug_MemAlloc (uint32_t size, const char *file, int lineno)
 {
-  return npw_mem_alloc (size, file, lineno);
+  return npw_mem_alloc (size, file, lineno, __builtin_return_address (0));
 }
 
 void *
 NPW_Debug_MemAlloc0 (uint32_t size, const char *file, int lineno)
 {
-  return npw_mem_alloc0 (size, file, lineno);
+  return npw_mem_alloc0 (size, file, lineno, __builtin_return_address (0));
 }
 
 void *
 NPW_Debug_MemAllocCopy (uint32_t size, const void *ptr, const char *file, int lineno)
 {
-  return npw_mem_alloc_copy (size, ptr, file, lineno);
+  return npw_mem_alloc_copy (size, ptr, file, lineno, __builtin_return_address (0));
 }
 
 void
@@ -296,12 +572,266 @@ malloc_check_guards_ok (uint8_t *ptr, uint32_t size, int *punderflow, int *pover
   return !underflow && !overflow;
 }
 
+/* ====================================================================== */
+/* === Allocation profiling                                           === */
+/* ====================================================================== */
+
+#include <signal.h>
+#include <pthread.h>
+
+/* Per call-site statistics. Call sites are identified by the file and
+   line recorded with malloc checks, or by the return address of the
+   NPW_MemAlloc() caller otherwise */
+typedef struct _NPW_MemSite NPW_MemSite;
+struct _NPW_MemSite
+{
+  const char *file;
+  int         lineno;
+  const void *caller;
+  uint64_t    n_allocs;
+  uint64_t    n_bytes;
+  uint32_t    live_blocks;
+  uint64_t    live_bytes;
+  uint64_t    peak_bytes;
+};
+
+static pthread_mutex_t         g_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable             *g_profile_sites;
+static volatile sig_atomic_t   g_profile_dump_requested;
+
+static void npw_mem_profile_dump_unlocked (const char *reason, bool live_only);
+
+static void
+malloc_profile_sigusr1 (int sig)
+{
+  /* Only record the request, the report is printed on the next
+     allocation or release from a safe context */
+  g_profile_dump_requested = 1;
+}
+
+static bool
+is_malloc_profile_enabled_1 (void)
+{
+  const char *malloc_profile_str;
+  if ((malloc_profile_str = getenv ("NPW_MALLOC_PROFILE")) == NULL)
+    return false;
+  if (strcmp (malloc_profile_str, "yes") != 0 && strcmp (malloc_profile_str, "1") != 0)
+    return false;
+
+  /* Don't override a SIGUSR1 handler the application installed */
+  struct sigaction sa;
+  if (sigaction (SIGUSR1, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL)
+    {
+      memset (&sa, 0, sizeof (sa));
+      sa.sa_handler = malloc_profile_sigusr1;
+      sigemptyset (&sa.sa_mask);
+      sa.sa_flags = SA_RESTART;
+      sigaction (SIGUSR1, &sa, NULL);
+    }
+  return true;
+}
+
+static inline bool
+is_malloc_profile_enabled (void)
+{
+  static int malloc_profile = -1;
+  if (malloc_profile < 0)
+    malloc_profile = is_malloc_profile_enabled_1 ();
+  return malloc_profile;
+}
+
+static guint
+npw_mem_site_hash (gconstpointer key)
+{
+  const NPW_MemSite *site = key;
+  return GPOINTER_TO_UINT (site->file) ^ (site->lineno << 16) ^ GPOINTER_TO_UINT (site->caller);
+}
+
+static gboolean
+npw_mem_site_equal (gconstpointer a, gconstpointer b)
+{
+  const NPW_MemSite *sa = a, *sb = b;
+  return sa->file == sb->file && sa->lineno == sb->lineno && sa->caller == sb->caller;
+}
+
+static void
+npw_mem_profile_check_dump (void)
+{
+  if (g_profile_dump_requested)
+    {
+      g_profile_dump_requested = 0;
+      npw_mem_profile_dump_unlocked ("SIGUSR1", false);
+    }
+}
+
+static NPW_MemSite *
+npw_mem_profile_alloc (uint32_t size, const char *file, int lineno, const void *caller)
+{
+  NPW_MemSite key, *site;
+
+  /* file:line is more useful than an address, if we have it */
+  memset (&key, 0, sizeof (key));
+  key.file   = file;
+  key.lineno = lineno;
+  key.caller = file ? NULL : caller;
+
+  pthread_mutex_lock (&g_profile_lock);
+  if (g_profile_sites == NULL)
+    g_profile_sites = g_hash_table_new (npw_mem_site_hash, npw_mem_site_equal);
+  if ((site = g_hash_table_lookup (g_profile_sites, &key)) == NULL)
+    {
+      if ((site = calloc (1, sizeof (*site))) != NULL)
+	{
+	  *site = key;
+	  g_hash_table_insert (g_profile_sites, site, site);
+	}
+    }
+  if (site)
+    {
+      site->n_allocs++;
+      site->n_bytes += size;
+      site->live_blocks++;
+      if ((site->live_bytes += size) > site->peak_bytes)
+	site->peak_bytes = site->live_bytes;
+    }
+  npw_mem_profile_check_dump ();
+  pthread_mutex_unlock (&g_profile_lock);
+  return site;
+}
+
+static void
+npw_mem_profile_free (NPW_MemSite *site, uint32_t size)
+{
+  pthread_mutex_lock (&g_profile_lock);
+  if (site)
+    {
+      site->live_blocks--;
+      site->live_bytes -= size;
+    }
+  npw_mem_profile_check_dump ();
+  pthread_mutex_unlock (&g_profile_lock);
+}
+
+static void
+npw_mem_site_collect (gpointer key, gpointer value, gpointer user_data)
+{
+  g_ptr_array_add ((GPtrArray *)user_data, value);
+}
+
+static int
+npw_mem_site_compare (const void *a, const void *b)
+{
+  const NPW_MemSite *sa = *(const NPW_MemSite **)a;
+  const NPW_MemSite *sb = *(const NPW_MemSite **)b;
+  if (sa->live_bytes != sb->live_bytes)
+    return sa->live_bytes < sb->live_bytes ? 1 : -1;
+  if (sa->peak_bytes != sb->peak_bytes)
+    return sa->peak_bytes < sb->peak_bytes ? 1 : -1;
+  return sa->n_allocs < sb->n_allocs ? 1 : (sa->n_allocs > sb->n_allocs ? -1 : 0);
+}
+
+static const char *
+npw_mem_site_name (const NPW_MemSite *site, char *buf, size_t size)
+{
+  if (site->file)
+    snprintf (buf, size, "%s:%d", site->file, site->lineno);
+  else
+    snprintf (buf, size, "caller %p", site->caller);
+  return buf;
+}
+
+static void
+npw_mem_profile_dump_unlocked (const char *reason, bool live_only)
+{
+  if (g_profile_sites == NULL)
+    return;
+
+  GPtrArray *sites = g_ptr_array_new ();
+  g_hash_table_foreach (g_profile_sites, npw_mem_site_collect, sites);
+  qsort (sites->pdata, sites->len, sizeof (gpointer), npw_mem_site_compare);
+
+  uint64_t live_bytes = 0, live_blocks = 0;
+  char name[PATH_MAX + 16];
+  guint i;
+
+  if (live_only)
+    {
+      for (i = 0; i < sites->len; i++)
+	{
+	  const NPW_MemSite *site = g_ptr_array_index (sites, i);
+	  if (site->live_blocks == 0)
+	    continue;
+	  npw_printf ("WARNING: %u block(s), %llu bytes, allocated at %s still live at %s\n",
+		      site->live_blocks, (unsigned long long)site->live_bytes,
+		      npw_mem_site_name (site, name, sizeof (name)), reason);
+	}
+    }
+  else
+    {
+      npw_printf ("Memory allocation profile (%s)\n", reason);
+      npw_printf ("  %12s %8s %12s %10s %12s  %s\n",
+		  "live bytes", "blocks", "peak bytes", "allocs", "total bytes", "call site");
+      for (i = 0; i < sites->len; i++)
+	{
+	  const NPW_MemSite *site = g_ptr_array_index (sites, i);
+	  npw_printf ("  %12llu %8u %12llu %10llu %12llu  %s\n",
+		      (unsigned long long)site->live_bytes, site->live_blocks,
+		      (unsigned long long)site->peak_bytes,
+		      (unsigned long long)site->n_allocs,
+		      (unsigned long long)site->n_bytes,
+		      npw_mem_site_name (site, name, sizeof (name)));
+	  live_bytes += site->live_bytes;
+	  live_blocks += site->live_blocks;
+	}
+      npw_printf ("  %12llu %8llu %12s %10s %12s  total\n",
+		  (unsigned long long)live_bytes, (unsigned long long)live_blocks,
+		  "", "", "");
+    }
+
+  g_ptr_array_free (sites, TRUE);
+}
+
+void
+NPW_MemDumpProfile (const char *reason, bool live_only)
+{
+  if (!is_malloc_profile_enabled ())
+    return;
+
+  pthread_mutex_lock (&g_profile_lock);
+  npw_mem_profile_dump_unlocked (reason, live_only);
+  pthread_mutex_unlock (&g_profile_lock);
+}
+
+static void __attribute__((destructor))
+npw_mem_profile_sentinel (void)
+{
+  NPW_MemDumpProfile ("exit", false);
+}
+
+/* ====================================================================== */
+/* === Implementation                                                 === */
+/* ====================================================================== */
+
+/* Blocks are prefixed with an NPW_MemBlock header only if the
+   allocator needs their size, or if malloc checks or profiling are
+   enabled */
+static inline bool
+npw_mem_has_header (void)
+{
+  return (get_malloc_hooks ()->needs_header
+	  || is_malloc_check_enabled ()
+	  || is_malloc_profile_enabled ());
+}
+
 static inline void *
-npw_do_mem_alloc (NPW_MemAllocProcPtr mem_alloc_func, uint32_t size, const char *file, int lineno)
+npw_do_mem_alloc (NPW_MemAllocProcPtr mem_alloc_func, uint32_t size, const char *file, int lineno, const void *caller)
 {
   uint32_t      real_size;
   NPW_MemBlock *mem;
 
+  if (!npw_mem_has_header ())
+    return mem_alloc_func (size);
+
   real_size = sizeof (*mem) + size + 2 * MALLOC_CHECK_GUARD_SIZE;
   if ((mem = mem_alloc_func (real_size)) == NULL)
     return NULL;
@@ -311,6 +841,9 @@ npw_do_mem_alloc (NPW_MemAllocProcPtr mem_alloc_func, uint32_t size, const char
   mem->alloc_size   = size;
   mem->alloc_file   = file;
   mem->alloc_lineno = lineno;
+  mem->alloc_site   = NULL;
+  if (is_malloc_profile_enabled ())
+    mem->alloc_site = npw_mem_profile_alloc (size, file, lineno, caller);
 
   uint8_t *ptr = (uint8_t *)mem + sizeof (*mem) + MALLOC_CHECK_GUARD_SIZE;
   malloc_check_guards_init (ptr, size);
@@ -318,21 +851,21 @@ npw_do_mem_alloc (NPW_MemAllocProcPtr mem_alloc_func, uint32_t size, const char
 }
 
 static void *
-npw_mem_alloc (uint32_t size, const char *file, int lineno)
+npw_mem_alloc (uint32_t size, const char *file, int lineno, const void *caller)
 {
-  return npw_do_mem_alloc (get_malloc_hooks ()->memalloc, size, file, lineno);
+  return npw_do_mem_alloc (get_malloc_hooks ()->memalloc, size, file, lineno, caller);
 }
 
 static void *
-npw_mem_alloc0 (uint32_t size, const char *file, int lineno)
+npw_mem_alloc0 (uint32_t size, const char *file, int lineno, const void *caller)
 {
-  return npw_do_mem_alloc (get_malloc_hooks ()->memalloc0, size, file, lineno);
+  return npw_do_mem_alloc (get_malloc_hooks ()->memalloc0, size, file, lineno, caller);
 }
 
 static void *
-npw_mem_alloc_copy (uint32_t size, const void *src, const char *file, int lineno)
+npw_mem_alloc_copy (uint32_t size, const void *src, const char *file, int lineno, const void *caller)
 {
-  void *ptr = npw_mem_alloc (size, file, lineno);
+  void *ptr = npw_mem_alloc (size, file, lineno, caller);
   if (ptr)
     memcpy (ptr, src, size);
   return ptr;
@@ -344,6 +877,12 @@ npw_mem_free (void *ptr, const char *file, int lineno)
   if (ptr == NULL)
     return;
 
+  if (!npw_mem_has_header ())
+    {
+      get_malloc_hooks ()->memfree (ptr, 0);
+      return;
+    }
+
   NPW_MemBlock *mem = (NPW_MemBlock *)((char *)ptr - (sizeof (*mem) + MALLOC_CHECK_GUARD_SIZE));
   if (mem->magic == NPW_MALLOC_MAGIC)
     {
@@ -365,6 +904,8 @@ npw_mem_free (void *ptr, const char *file, int lineno)
 			mem->alloc_file, mem->alloc_lineno,
 			file, lineno);
 	}
+      if (is_malloc_profile_enabled ())
+	npw_mem_profile_free (mem->alloc_site, mem->alloc_size);
       get_malloc_hooks ()->memfree (mem, mem->real_size);
     }
   else
@@ -45,6 +45,9 @@ NPW_Debug_MemAllocCopy (uint32_t size, const void *ptr, const char *file, int li
 void
 NPW_Debug_MemFree (void *ptr, const char *file, int lineno) attribute_hidden;
 
+void
+NPW_MemDumpProfile (const char *reason, bool live_only) attribute_hidden;
+
 #define NPW_MemNew(type, n) \
   ((type *) NPW_MemAlloc ((n) * sizeof (type)))
 
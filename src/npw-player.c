@@ -23,6 +23,10 @@
 #include <errno.h>
 #include <dlfcn.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gtk/gtk.h>
@@ -34,6 +38,7 @@
 #include "glibcurl.h"
 #include "gtk2xtbin.h"
 #include "npw-rpc.h"
+#include "npw-elf.h"
 
 #define XP_UNIX 1
 #define MOZ_X11 1
@@ -56,6 +61,7 @@ enum
   };
 
 static gboolean g_verbose     = FALSE;
+static gboolean g_wakeups     = FALSE;
 static guint g_backend        = BACKEND_GTK;
 static guint g_xid            = 0;
 static guint g_n_plugins      = 0;
@@ -63,6 +69,7 @@ static guint g_n_plugins      = 0;
 typedef struct _Plugin		Plugin;
 typedef struct _PluginDataType	PluginDataType;
 typedef struct _StreamInstance  StreamInstance;
+typedef struct _StreamChunk     StreamChunk;
 typedef struct _StreamBuffer    StreamBuffer;
 typedef struct _PlayerApp	PlayerApp;
 typedef struct _GtkDisplay	GtkDisplay;
@@ -97,6 +104,7 @@ struct _Plugin
   gchar                   *path;
   gchar                   *src;
   gchar                   *mime_type;
+  gchar                   *mime_desc;
   void                    *module;
   GList                   *data_types;
   GtkWidget               *window;
@@ -142,6 +150,33 @@ enum
     URI_TYPE_FTP
   };
 
+/* Incoming stream data is queued into fixed-size chunks. Consumed
+   chunks are recycled through a small pool so that a steady stream
+   does not hit the allocator for every libcurl callback */
+#define STREAM_CHUNK_SIZE	16384
+#define STREAM_CHUNK_POOL_MAX	64
+
+/* Local files are read ahead up to STREAM_BUFFER_HIGH pending bytes,
+   and libcurl transfers are paused past that point. Both are resumed
+   once the plugin drained the buffer below STREAM_BUFFER_LOW */
+#define STREAM_BUFFER_HIGH	(1024 * 1024)
+#define STREAM_BUFFER_LOW	(256 * 1024)
+
+struct _StreamChunk
+{
+  StreamChunk *next;
+  guint        start;
+  guint        end;
+  guchar       bytes[STREAM_CHUNK_SIZE];
+};
+
+struct _StreamBuffer
+{
+  StreamChunk *head;
+  StreamChunk *tail;
+  gsize        length;
+};
+
 struct _StreamInstance
 {
   NPStream  *np_stream;
@@ -158,15 +193,10 @@ struct _StreamInstance
   FILE      *temp_file;
   gchar     *temp_filename;
   gint       commit_source;
-  GList     *buffers;
-  guint      offset;
-};
-
-struct _StreamBuffer
-{
-  guchar    *bytes;
-  guint      size;
+  gint       file_fd;
+  StreamBuffer buffer;
   guint      offset;
+  gboolean   paused;
 };
 
 static GList *
@@ -189,11 +219,8 @@ stream_new (Plugin *plugin,
 static void
 stream_destroy (StreamInstance *pstream);
 
-static StreamBuffer *
-stream_buffer_new (guchar *bytes, gsize nbytes);
-
 static void
-stream_buffer_destroy (StreamBuffer *buffer);
+stream_buffer_clear (StreamBuffer *buffer);
 
 
 /* ====================================================================== */
@@ -1151,12 +1178,12 @@ g_NPP_WriteReady (StreamInstance *pstream)
 }
 
 static int32_t
-g_NPP_Write (StreamInstance *pstream, StreamBuffer *buffer, guint32 len)
+g_NPP_Write (StreamInstance *pstream, guchar *bytes, guint32 len)
 {
   if (pstream == NULL)
     return -1;
 
-  if (buffer == NULL)
+  if (bytes == NULL)
     return -1;
 
   Plugin *plugin = pstream->plugin;
@@ -1168,7 +1195,7 @@ g_NPP_Write (StreamInstance *pstream, StreamBuffer *buffer, guint32 len)
 			    pstream->np_stream,
 			    pstream->offset,
 			    len,
-			    buffer->bytes + buffer->offset);
+			    bytes);
 }
 
 static void
@@ -1304,6 +1331,7 @@ stream_new (Plugin *plugin,
   pstream->mime_type    = g_strdup (type);
   pstream->stype        = NP_NORMAL;
   pstream->status       = STREAM_STATUS_IDLE;
+  pstream->file_fd      = -1;
   pstream->notify_data  = notify_data;
   pstream->uri_type     = uri_type_from_url (src);
   pstream->seekable     = 0 && (pstream->uri_type == URI_TYPE_FILE);
@@ -1343,13 +1371,14 @@ stream_destroy (StreamInstance *pstream)
       pstream->curl_handle = NULL;
     }
 
-  if (pstream->buffers)
+  if (pstream->file_fd >= 0)
     {
-      g_list_foreach (pstream->buffers, (GFunc)stream_buffer_destroy, NULL);
-      g_list_free (pstream->buffers);
-      pstream->buffers = NULL;
+      close (pstream->file_fd);
+      pstream->file_fd = -1;
     }
 
+  stream_buffer_clear (&pstream->buffer);
+
   if (pstream->temp_file)
     {
       /* Close the file prior to calling NPP_StreamAsFile() [Acrobat5] */
@@ -1440,7 +1469,7 @@ stream_write_ready (StreamInstance *pstream)
 }
 
 static int32_t
-stream_write (StreamInstance *pstream, StreamBuffer *buffer, guint32 len)
+stream_write (StreamInstance *pstream, guchar *bytes, guint32 len)
 {
   switch (pstream->stype)
     {
@@ -1448,61 +1477,237 @@ stream_write (StreamInstance *pstream, StreamBuffer *buffer, guint32 len)
     case NP_ASFILEONLY:
       if (pstream->temp_file)
 	{
-	  if (fwrite (buffer->bytes + buffer->offset, len, 1, pstream->temp_file) != 1)
+	  if (fwrite (bytes, len, 1, pstream->temp_file) != 1)
 	    return -1;
 	}
       break;
     }
   if (!stream_use_npp_write (pstream))
     return len;
-  return g_NPP_Write (pstream, buffer, len);
+  return g_NPP_Write (pstream, bytes, len);
 }
 
-static StreamBuffer *
-stream_buffer_new (guchar *bytes, gsize nbytes)
+static StreamChunk *g_stream_chunk_pool   = NULL;
+static guint        g_stream_chunk_n_pool = 0;
+
+static StreamChunk *
+stream_chunk_new (void)
 {
-  StreamBuffer *buffer = g_new0 (StreamBuffer, 1);
+  StreamChunk *chunk = g_stream_chunk_pool;
 
-  if (buffer)
+  if (chunk)
     {
-      buffer->bytes  = g_memdup (bytes, nbytes);
-      buffer->size   = nbytes;
-      buffer->offset = 0;
+      g_stream_chunk_pool = chunk->next;
+      g_stream_chunk_n_pool--;
     }
+  else if ((chunk = g_new (StreamChunk, 1)) == NULL)
+    return NULL;
 
-  return buffer;
+  chunk->next  = NULL;
+  chunk->start = 0;
+  chunk->end   = 0;
+  return chunk;
 }
 
 static void
-stream_buffer_destroy (StreamBuffer *buffer)
+stream_chunk_destroy (StreamChunk *chunk)
+{
+  if (g_stream_chunk_n_pool < STREAM_CHUNK_POOL_MAX)
+    {
+      chunk->next = g_stream_chunk_pool;
+      g_stream_chunk_pool = chunk;
+      g_stream_chunk_n_pool++;
+    }
+  else
+    g_free (chunk);
+}
+
+static gboolean
+stream_buffer_append (StreamBuffer *buffer, const guchar *bytes, gsize nbytes)
 {
-  if (buffer == NULL)
+  while (nbytes > 0)
+    {
+      StreamChunk *chunk = buffer->tail;
+
+      if (chunk == NULL || chunk->end == STREAM_CHUNK_SIZE)
+	{
+	  if ((chunk = stream_chunk_new ()) == NULL)
+	    return FALSE;
+	  if (buffer->tail)
+	    buffer->tail->next = chunk;
+	  else
+	    buffer->head = chunk;
+	  buffer->tail = chunk;
+	}
+
+      gsize len = MIN (nbytes, STREAM_CHUNK_SIZE - chunk->end);
+      memcpy (chunk->bytes + chunk->end, bytes, len);
+      chunk->end += len;
+      buffer->length += len;
+      bytes += len;
+      nbytes -= len;
+    }
+
+  return TRUE;
+}
+
+/* Read up to NBYTES bytes from FD straight into the chunks */
+static gssize
+stream_buffer_read (StreamBuffer *buffer, gint fd, gsize nbytes)
+{
+  gsize count = 0;
+
+  while (count < nbytes)
+    {
+      StreamChunk *chunk = buffer->tail;
+
+      if (chunk == NULL || chunk->end == STREAM_CHUNK_SIZE)
+	{
+	  if ((chunk = stream_chunk_new ()) == NULL)
+	    return -1;
+	  if (buffer->tail)
+	    buffer->tail->next = chunk;
+	  else
+	    buffer->head = chunk;
+	  buffer->tail = chunk;
+	}
+
+      gsize len = MIN (nbytes - count, STREAM_CHUNK_SIZE - chunk->end);
+      ssize_t n = read (fd, chunk->bytes + chunk->end, len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      if (n == 0)
+	break;
+      chunk->end += n;
+      buffer->length += n;
+      count += n;
+    }
+
+  return count;
+}
+
+/* Drop the first NBYTES bytes, which must all be in the head chunk */
+static void
+stream_buffer_consume (StreamBuffer *buffer, gsize nbytes)
+{
+  StreamChunk *chunk = buffer->head;
+
+  g_assert (chunk != NULL && nbytes <= chunk->end - chunk->start);
+  chunk->start += nbytes;
+  buffer->length -= nbytes;
+
+  if (chunk->start == chunk->end)
+    {
+      if ((buffer->head = chunk->next) == NULL)
+	buffer->tail = NULL;
+      stream_chunk_destroy (chunk);
+    }
+}
+
+static void
+stream_buffer_clear (StreamBuffer *buffer)
+{
+  while (buffer->head)
+    {
+      StreamChunk *chunk = buffer->head;
+      buffer->head = chunk->next;
+      stream_chunk_destroy (chunk);
+    }
+  buffer->tail = NULL;
+  buffer->length = 0;
+}
+
+/* Refill the buffer from the local file, if any */
+static void
+stream_read_file (StreamInstance *pstream)
+{
+  StreamBuffer *buffer = &pstream->buffer;
+
+  if (pstream->file_fd < 0 || buffer->length >= STREAM_BUFFER_LOW)
+    return;
+
+  gssize n = stream_buffer_read (buffer, pstream->file_fd,
+				 STREAM_BUFFER_HIGH - buffer->length);
+  if (n > 0 && buffer->length >= STREAM_BUFFER_LOW)
     return;
 
-  if (buffer->bytes)
+  /* End of file, or read error */
+  close (pstream->file_fd);
+  pstream->file_fd = -1;
+  if (n < 0 || (pstream->offset == 0 && buffer->length == 0))
+    pstream->status |= STREAM_STATUS_ERROR;
+  stream_schedule_destroy (pstream, FALSE);
+}
+
+/* Hand as much pending data as the plugin is ready to take, possibly
+   spanning several chunks */
+static void
+stream_deliver (StreamInstance *pstream)
+{
+  StreamBuffer *buffer = &pstream->buffer;
+  int32_t write_ready = stream_write_ready (pstream);
+
+  if (write_ready < 0)
+    {
+      /* The plug-in doesn't want the stream, kill all pending buffers */
+      pstream->status |= STREAM_STATUS_DESTROY;
+      return;
+    }
+
+  while (write_ready > 0 && buffer->head)
     {
-      g_free (buffer->bytes);
-      buffer->bytes = NULL;
+      StreamChunk *chunk = buffer->head;
+      int32_t len = MIN (chunk->end - chunk->start, write_ready);
+
+      len = stream_write (pstream, chunk->bytes + chunk->start, len);
+
+      if (len < 0)
+	{
+	  pstream->status |= STREAM_STATUS_ERROR | STREAM_STATUS_DESTROY;
+	  return;
+	}
+      if (len == 0)
+	break;
+
+      /* Plugins may claim they consumed more than what they were given */
+      len = MIN (len, chunk->end - chunk->start);
+      stream_buffer_consume (buffer, len);
+      pstream->offset += len;
+      write_ready -= len;
     }
 
-  g_free (buffer);
+  stream_read_file (pstream);
+
+#ifdef CURL_WRITEFUNC_PAUSE
+  if (pstream->paused && buffer->length < STREAM_BUFFER_LOW)
+    {
+      /* NOTE: libcurl may call on_stream_read_cb() right away */
+      pstream->paused = FALSE;
+      curl_easy_pause (pstream->curl_handle, CURLPAUSE_CONT);
+    }
+#endif
 }
 
 static gboolean
 on_stream_commit_cb (gpointer user_data)
 {
   StreamInstance *pstream = (StreamInstance *)user_data;
+  StreamBuffer *buffer = &pstream->buffer;
 
-  if (pstream->buffers)
+  if (buffer->head)
     {
-      StreamBuffer *buffer = pstream->buffers->data;
-
       if (!(pstream->status & STREAM_STATUS_ACTIVE))
 	{
+	  StreamChunk *chunk = buffer->head;
+
 	  /* XXX: determine MIME type (should be done in NPN_GetURL*()...) */
 	  if (pstream->mime_type == NULL)
-	    pstream->mime_type = get_mime_type_from_content (buffer->bytes,
-							     buffer->size);
+	    pstream->mime_type = get_mime_type_from_content (chunk->bytes + chunk->start,
+							     chunk->end - chunk->start);
 	  if (pstream->mime_type == NULL)
 	    pstream->mime_type = g_strdup (pstream->plugin->mime_type);
 
@@ -1511,38 +1716,13 @@ on_stream_commit_cb (gpointer user_data)
 	  pstream->status |= STREAM_STATUS_ACTIVE;
 	}
 
-      int32_t write_ready = stream_write_ready (pstream);
-
-      if (write_ready < 0)
-	{
-	  /* The plug-in doesn't want the stream, kill all pending buffers */
-	  pstream->status |= STREAM_STATUS_DESTROY;
-	}
-      else if (write_ready > 0)
-	{
-	  int32_t len = MIN (buffer->size - buffer->offset, write_ready);
-
-	  len = stream_write (pstream, buffer, len);
-
-	  if (len < 0)
-	    pstream->status |= STREAM_STATUS_ERROR | STREAM_STATUS_DESTROY;
-	  else if (len > 0)
-	    {
-	      if ((buffer->offset += len) >= buffer->size)
-		{
-		  stream_buffer_destroy (buffer);
-		  pstream->offset += len;
-		  pstream->buffers = g_list_delete_link (pstream->buffers,
-							 pstream->buffers);
-		}
-	    }
-	}
+      stream_deliver (pstream);
     }
 
-  if (pstream->buffers == NULL && (pstream->status & STREAM_STATUS_FINISH))
+  if (buffer->head == NULL && (pstream->status & STREAM_STATUS_FINISH))
     pstream->status |= STREAM_STATUS_DESTROY;
 
-  if (pstream->buffers == NULL || (pstream->status & STREAM_STATUS_DESTROY))
+  if (buffer->head == NULL || (pstream->status & STREAM_STATUS_DESTROY))
     {
     force_destroy:
       g_source_remove (pstream->commit_source);
@@ -1561,10 +1741,18 @@ on_stream_read_cb (void *ptr, size_t size, size_t nmemb, void *user_data)
   StreamInstance *pstream = (StreamInstance *)user_data;
   size_t real_size = size * nmemb;
 
-  StreamBuffer *buffer = stream_buffer_new (ptr, real_size);
-  if (buffer == NULL)
+#ifdef CURL_WRITEFUNC_PAUSE
+  /* Let libcurl keep the data until the plugin catches up */
+  if (pstream->curl_handle && pstream->buffer.length >= STREAM_BUFFER_HIGH)
+    {
+      pstream->paused = TRUE;
+      stream_commit (pstream);
+      return CURL_WRITEFUNC_PAUSE;
+    }
+#endif
+
+  if (!stream_buffer_append (&pstream->buffer, ptr, real_size))
     return 0;
-  pstream->buffers = g_list_append (pstream->buffers, buffer);
   stream_commit (pstream);
   return real_size;
 }
@@ -1621,6 +1809,28 @@ on_stream_open_cb (gpointer user_data)
       return FALSE;
     }
 
+  /* Local files are read on demand, as the plugin consumes them.
+     libcurl would read them whole at once since file:// transfers
+     cannot be paused */
+  if (pstream->uri_type == URI_TYPE_FILE)
+    {
+      const gchar *url = pstream->np_stream->url;
+      gchar *filename = g_filename_from_uri (url, NULL, NULL);
+      if (filename == NULL)
+	filename = g_strdup (url + 7);
+      pstream->file_fd = open (filename, O_RDONLY);
+      g_free (filename);
+      if (pstream->file_fd < 0)
+	{
+	  pstream->status |= STREAM_STATUS_ERROR;
+	  stream_schedule_destroy (pstream, FALSE);
+	  return FALSE;
+	}
+      stream_read_file (pstream);
+      stream_commit (pstream);
+      return FALSE;
+    }
+
   if ((pstream->curl_handle = curl_easy_init ()) == NULL)
     npw_printf ("WARNING: could not create CURL stream\n");
 
@@ -1711,7 +1921,7 @@ on_stream_close_cb (gpointer user_data)
 		}
 
 	      /* XXX: consider the stream in error if it was never started */
-	      if (pstream->buffers == NULL)
+	      if (pstream->buffer.length == 0)
 		pstream->status |= STREAM_STATUS_ERROR;
 	    }
 
@@ -1764,7 +1974,9 @@ plugin_get_data_types (Plugin *plugin)
   if (plugin->data_types)
     return plugin->data_types;
 
-  const gchar *mime_desc = plugin->NP_GetMIMEDescription ();
+  const gchar *mime_desc = plugin->mime_desc;
+  if (mime_desc == NULL && plugin->NP_GetMIMEDescription)
+    mime_desc = plugin->NP_GetMIMEDescription ();
   if (mime_desc == NULL)
     return NULL;
 
@@ -1798,15 +2010,29 @@ plugin_get_data_types (Plugin *plugin)
 static void plugin_destroy (Plugin *plugin);
 
 static Plugin *
-plugin_new (const gchar *path)
+plugin_new (const gchar *path, const gchar *mime_desc)
 {
   Plugin *plugin = g_new0 (Plugin, 1);
   if (plugin == NULL)
     return NULL;
   plugin->path = g_strdup (path);
+  plugin->mime_desc = g_strdup (mime_desc);
+  return plugin;
+}
 
-  if ((plugin->module = dlopen (path, RTLD_LAZY|RTLD_LOCAL)) == NULL)
-    goto error;
+/* Load the plugin module, this is deferred until the plugin is
+   actually used */
+static gboolean
+plugin_load (Plugin *plugin)
+{
+  if (plugin->module)
+    return TRUE;
+
+  if ((plugin->module = dlopen (plugin->path, RTLD_LAZY|RTLD_LOCAL)) == NULL)
+    {
+      npw_printf ("ERROR: %s\n", dlerror ());
+      return FALSE;
+    }
 
   if (!(plugin->NP_Initialize = dlsym (plugin->module, "NP_Initialize")))
     goto error;
@@ -1818,15 +2044,12 @@ plugin_new (const gchar *path)
   if (!(plugin->NP_GetValue = dlsym (plugin->module, "NP_GetValue")))
     goto error;
 
-  return plugin;
+  return TRUE;
 
  error:
-  if (plugin)
-    {
-      plugin_destroy (plugin);
-      plugin = NULL;
-    }
-  return NULL;
+  /* See plugin_destroy() as to why the module is not unloaded */
+  plugin->module = NULL;
+  return FALSE;
 }
 
 static void
@@ -1870,6 +2093,12 @@ plugin_destroy (Plugin *plugin)
       plugin->mime_type = NULL;
     }
 
+  if (plugin->mime_desc)
+    {
+      g_free (plugin->mime_desc);
+      plugin->mime_desc = NULL;
+    }
+
   if (plugin->data_types)
     {
       g_list_foreach (plugin->data_types, (GFunc)plugin_data_type_destroy, NULL);
@@ -2025,75 +2254,291 @@ get_plugin_dirs (void)
   return dirs;
 }
 
+/* ====================================================================== */
+/* === Plugin index                                                   === */
+/* ====================================================================== */
+
+/* The MIME description of every file found in the plugin directories
+   is kept in an index, keyed by path and validated against the file
+   modification time, size and inode. Plugins are only dlopen()ed
+   when they are actually used, or in a short-lived child process to
+   fill in a missing index entry */
+
+#define PLUGIN_INDEX_FILE "npplayer-plugins-1.index"
+
+static GKeyFile *g_plugin_index       = NULL;
+static gboolean  g_plugin_index_dirty = FALSE;
+
+static gchar *
+plugin_index_get_dir (void)
+{
+  return g_build_filename (g_get_user_cache_dir (), "nspluginwrapper", NULL);
+}
+
+static GKeyFile *
+plugin_index_get (void)
+{
+  if (g_plugin_index == NULL)
+    {
+      gchar *dir = plugin_index_get_dir ();
+      gchar *filename = g_build_filename (dir, PLUGIN_INDEX_FILE, NULL);
+      g_plugin_index = g_key_file_new ();
+      g_key_file_load_from_file (g_plugin_index, filename, G_KEY_FILE_NONE, NULL);
+      g_free (filename);
+      g_free (dir);
+    }
+  return g_plugin_index;
+}
+
+static gchar *
+plugin_index_stamp (const struct stat *st)
+{
+  return g_strdup_printf ("%llu:%llu:%llu",
+			  (unsigned long long)st->st_mtime,
+			  (unsigned long long)st->st_size,
+			  (unsigned long long)st->st_ino);
+}
+
+/* Group names cannot hold brackets or control characters */
+static gboolean
+plugin_index_is_valid_key (const gchar *path)
+{
+  for (const gchar *p = path; *p; p++)
+    {
+      if (*p == '[' || *p == ']' || (guchar)*p < 0x20)
+	return FALSE;
+    }
+  return g_utf8_validate (path, -1, NULL);
+}
+
+/* Return TRUE if PATH has an up-to-date index entry. *PMIME_DESC is
+   then set to its MIME description, or to NULL if PATH is not a
+   plugin */
+static gboolean
+plugin_index_lookup (const gchar *path, const struct stat *st, gchar **pmime_desc)
+{
+  GKeyFile *index = plugin_index_get ();
+
+  if (!plugin_index_is_valid_key (path) || !g_key_file_has_group (index, path))
+    return FALSE;
+
+  gchar *stamp = plugin_index_stamp (st);
+  gchar *index_stamp = g_key_file_get_string (index, path, "stamp", NULL);
+  gboolean is_valid = index_stamp && strcmp (stamp, index_stamp) == 0;
+  g_free (index_stamp);
+  g_free (stamp);
+  if (!is_valid)
+    return FALSE;
+
+  *pmime_desc = NULL;
+  if (g_key_file_has_key (index, path, "mime", NULL))
+    {
+      if ((*pmime_desc = g_key_file_get_string (index, path, "mime", NULL)) == NULL)
+	return FALSE;
+    }
+  return TRUE;
+}
+
+static void
+plugin_index_update (const gchar *path, const struct stat *st, const gchar *mime_desc)
+{
+  GKeyFile *index = plugin_index_get ();
+
+  if (!plugin_index_is_valid_key (path))
+    return;
+
+  g_key_file_remove_group (index, path, NULL);
+  gchar *stamp = plugin_index_stamp (st);
+  g_key_file_set_string (index, path, "stamp", stamp);
+  g_free (stamp);
+  if (mime_desc && g_utf8_validate (mime_desc, -1, NULL))
+    g_key_file_set_string (index, path, "mime", mime_desc);
+  g_plugin_index_dirty = TRUE;
+}
+
+/* Write the index through a temporary file so that concurrent players
+   never see a partial index */
+static void
+plugin_index_save (void)
+{
+  if (g_plugin_index == NULL || !g_plugin_index_dirty)
+    return;
+  g_plugin_index_dirty = FALSE;
+
+  gchar *dir = plugin_index_get_dir ();
+  g_mkdir (g_get_user_cache_dir (), 0700);
+  g_mkdir (dir, 0700);
+
+  gchar *filename = g_build_filename (dir, PLUGIN_INDEX_FILE, NULL);
+  gchar *tmp_filename = g_strdup_printf ("%s.XXXXXX", filename);
+  gsize length;
+  gchar *data = g_key_file_to_data (g_plugin_index, &length, NULL);
+  gint fd = g_mkstemp (tmp_filename);
+  if (fd >= 0)
+    {
+      gboolean ok = data && write (fd, data, length) == length;
+      if (close (fd) < 0)
+	ok = FALSE;
+      if (!ok || g_rename (tmp_filename, filename) < 0)
+	g_unlink (tmp_filename);
+    }
+  g_free (data);
+  g_free (tmp_filename);
+  g_free (filename);
+  g_free (dir);
+}
+
 static gboolean
 is_npapi_plugin (const gchar *path)
 {
-  void *module = dlopen (path, RTLD_LAZY|RTLD_LOCAL);
-  if (module == NULL)
+  NPW_PluginInfo plugin_info;
+  gint fd;
+
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return FALSE;
+
+  memset (&plugin_info, 0, sizeof (plugin_info));
+  gboolean is_valid = is_plugin_fd (fd, NULL, NULL, &plugin_info);
+  close (fd);
+
+  /* dlopen() would fail on plugins built for another architecture */
+  if (is_valid
+      && plugin_info.target_arch[0] != '\0'
+      && strcmp (plugin_info.target_arch, HOST_ARCH) != 0)
     {
       if (g_verbose)
-	npw_printf ("WARNING: %s\n", dlerror ());
-      return FALSE;
+	npw_printf ("WARNING: skip %s plugin %s\n", plugin_info.target_arch, path);
+      is_valid = FALSE;
     }
+  return is_valid;
+}
 
-  gboolean is_valid = TRUE;
-  if (dlsym (module, "NP_Initialize") == NULL)
-    is_valid = FALSE;
-  if (dlsym (module, "NP_Shutdown") == NULL)
-    is_valid = FALSE;
-  if (dlsym (module, "NP_GetMIMEDescription") == NULL)
-    is_valid = FALSE;
-
-  /* Intentionally avoid unloading the module. This causes crashes as
-   * some libraries break when you unload them. In particular, Qt has
-   * a bug where it will blow away pthread_key_t 0 on unload. (In this
-   * process, this corresponds to glib's internal thread
-   * data. Everything in glib breaks when this happens) Sadly, Kopete
-   * installs this utterly pointless "skypebuttons.so" plugin that
-   * pulls in Qt while doing almost nothing else.
-   *
-   * http://bugreports.qt.nokia.com/browse/QTBUG-10861 */
+/* Get the plugin MIME description from a child process, so that the
+   plugin and its dependencies are never loaded into the player */
+static gchar *
+plugin_query_mime_description (const gchar *path)
+{
+  gint fds[2];
+  pid_t pid;
 
-  /* dlclose (module); */
-  return is_valid;
+  if (pipe (fds) < 0)
+    return NULL;
+
+  if ((pid = fork ()) < 0)
+    {
+      close (fds[0]);
+      close (fds[1]);
+      return NULL;
+    }
+
+  if (pid == 0)
+    {
+      NP_GetMIMEDescriptionFunc NP_GetMIMEDescription;
+      const gchar *mime_desc;
+      void *module;
+
+      close (fds[0]);
+
+      /* Like browsers, load the plugin from its own directory */
+      if (g_path_is_absolute (path))
+	{
+	  gchar *dirname = g_path_get_dirname (path);
+	  if (g_chdir (dirname) < 0)
+	    _exit (1);
+	}
+      if ((module = dlopen (path, RTLD_LAZY|RTLD_LOCAL)) == NULL)
+	_exit (1);
+      if ((NP_GetMIMEDescription = dlsym (module, "NP_GetMIMEDescription")) == NULL)
+	_exit (1);
+      if ((mime_desc = NP_GetMIMEDescription ()) == NULL)
+	_exit (1);
+
+      gsize length = strlen (mime_desc);
+      while (length > 0)
+	{
+	  ssize_t n = write (fds[1], mime_desc, length);
+	  if (n < 0)
+	    {
+	      if (errno == EINTR)
+		continue;
+	      _exit (1);
+	    }
+	  mime_desc += n;
+	  length -= n;
+	}
+      _exit (0);
+    }
+
+  close (fds[1]);
+  GString *mime_desc = g_string_new (NULL);
+  for (;;)
+    {
+      gchar buf[4096];
+      ssize_t n = read (fds[0], buf, sizeof (buf));
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	break;
+      g_string_append_len (mime_desc, buf, n);
+    }
+  close (fds[0]);
+
+  gint status;
+  while (waitpid (pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0 || mime_desc->len == 0)
+    {
+      if (g_verbose)
+	npw_printf ("WARNING: could not get MIME description of %s\n", path);
+      g_string_free (mime_desc, TRUE);
+      return NULL;
+    }
+  return g_string_free (mime_desc, FALSE);
 }
 
 static void
-player_app_load_plugin (PlayerApp *app, const gchar *path)
+player_app_add_plugin (PlayerApp *app, const gchar *path)
 {
-  Plugin *plugin;
+  struct stat st;
+  gchar *mime_desc = NULL;
+
+  if (stat (path, &st) < 0 || !S_ISREG (st.st_mode))
+    return;
+
+  if (!plugin_index_lookup (path, &st, &mime_desc))
+    {
+      if (is_npapi_plugin (path))
+	mime_desc = plugin_query_mime_description (path);
+      plugin_index_update (path, &st, mime_desc);
+    }
 
-  if ((plugin = plugin_new (path)) == NULL)
-    g_error ("could not initialize plugin '%s'", path);
+  if (mime_desc == NULL)
+    return;
 
-  app->plugins = g_list_prepend (app->plugins, plugin);
+  Plugin *plugin = plugin_new (path, mime_desc);
+  if (plugin)
+    app->plugins = g_list_prepend (app->plugins, plugin);
+  g_free (mime_desc);
 }
 
 static void
 player_app_load_plugins (PlayerApp *app, const gchar *dirname)
 {
   GDir        *dir;
-  gchar       *old_dir = g_get_current_dir ();
   const gchar *name;
   gchar       *path;
 
   if ((dir = g_dir_open (dirname, 0, NULL)) == NULL)
     return;
 
-  g_chdir (dirname);
-
   while ((name = g_dir_read_name (dir)) != NULL)
     {
       path = g_build_filename (dirname, name, NULL);
-      if (is_npapi_plugin (path))
-	player_app_load_plugin (app, path);
+      player_app_add_plugin (app, path);
       g_free (path);
     }
 
   g_dir_close (dir);
-
-  g_chdir (old_dir);
-  g_free (old_dir);
 }
 
 typedef struct _FindPluginCustomArg FindPluginCustomArg;
@@ -2180,6 +2625,7 @@ player_app_destroy (PlayerApp *app)
 static gboolean
 player_app_run (PlayerApp *app)
 {
+  GTimer *timer = g_timer_new ();
   GList *plugin_dirs = get_plugin_dirs ();
   for (GList *l = plugin_dirs; l != NULL; l = l->next)
     {
@@ -2189,6 +2635,7 @@ player_app_run (PlayerApp *app)
     }
   g_list_free (plugin_dirs);
   plugin_dirs = NULL;
+  plugin_index_save ();
 
   /* Lookup plugin by MIME type first, then try by object type (from URI) */
   gchar *value;
@@ -2208,6 +2655,19 @@ player_app_run (PlayerApp *app)
 
   if (app->plugin == NULL)
     g_error ("could not find any plugin to use");
+  if (!plugin_load (app->plugin))
+    g_error ("could not initialize plugin '%s'", app->plugin->path);
+
+  g_timer_stop (timer);
+  if (g_verbose)
+    {
+      struct rusage ru;
+      getrusage (RUSAGE_SELF, &ru);
+      npw_printf ("Found %u plugin(s) in %.1f ms, max RSS %ld KB\n",
+		  g_list_length (app->plugins),
+		  g_timer_elapsed (timer, NULL) * 1000.0, ru.ru_maxrss);
+    }
+  g_timer_destroy (timer);
 
   /* Free all other plugins */
   if (app->plugins)
@@ -2235,6 +2695,50 @@ player_app_quit (PlayerApp *app)
 /* === GUI glue                                                       === */
 /* ====================================================================== */
 
+/* ====================================================================== */
+/* === Main loop statistics                                           === */
+/* ====================================================================== */
+
+#define WAKEUPS_REPORT_INTERVAL 10 /* seconds */
+
+static GPollFunc g_default_poll_func;
+static guint     g_n_polls;
+static guint     g_n_wakeups;
+
+/* Every main loop iteration goes through poll(), and a poll() that
+   may block is a potential wakeup once it returns */
+static gint
+count_wakeups_poll (GPollFD *ufds, guint nfds, gint timeout)
+{
+  g_n_polls++;
+  if (timeout != 0)
+    g_n_wakeups++;
+  return g_default_poll_func (ufds, nfds, timeout);
+}
+
+static gboolean
+report_wakeups_cb (gpointer user_data)
+{
+  GTimer *timer = user_data;
+  gdouble elapsed = g_timer_elapsed (timer, NULL);
+
+  /* Our own report timeout accounts for one wakeup per interval */
+  g_print ("wakeups: %.2f/s, main loop iterations: %.2f/s\n",
+	   g_n_wakeups / elapsed, g_n_polls / elapsed);
+  g_n_polls = 0;
+  g_n_wakeups = 0;
+  g_timer_start (timer);
+  return TRUE;
+}
+
+static void
+count_wakeups (void)
+{
+  g_default_poll_func = g_main_context_get_poll_func (NULL);
+  g_main_context_set_poll_func (NULL, count_wakeups_poll);
+  g_timeout_add (WAKEUPS_REPORT_INTERVAL * 1000, report_wakeups_cb, g_timer_new ());
+}
+
 static void
 print_help (const gchar *program_name)
 {
@@ -2245,6 +2749,7 @@ print_help (const gchar *program_name)
   g_print ("  -v|--verbose            enable verbose mode\n");
   g_print ("  -f|--fullscreen         start in fullscreen mode\n");
   g_print ("  --xid N                 embed in window with xid N\n");
+  g_print ("  --wakeups               report main loop wakeups per second\n");
   g_print ("\n");
 
   g_print ("Common attributes include:\n");
@@ -2500,6 +3005,8 @@ main (int argc, char *argv[])
 	}
       else if (strcmp (arg, "--verbose") == 0)
 	g_verbose = TRUE;
+      else if (strcmp (arg, "--wakeups") == 0)
+	g_wakeups = TRUE;
       else if (strcmp (arg, "--title") == 0)
 	{
 	  if (++i < argc)
@@ -2667,6 +3174,9 @@ main (int argc, char *argv[])
 	}
     }
 
+  if (g_wakeups)
+    count_wakeups ();
+
   if (g_backend == BACKEND_GTK)
     gtk_main ();
 
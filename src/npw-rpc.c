@@ -28,6 +28,105 @@
 #include "debug.h"
 
 
+/*
+ *  Names of RPC methods
+ */
+
+const char *string_of_RPC_METHOD(int method)
+{
+  const char *str;
+
+  switch (method) {
+#define _(VAL) case VAL: str = #VAL; break;
+	_(RPC_METHOD_NP_GET_VALUE);
+	_(RPC_METHOD_NP_GET_MIME_DESCRIPTION);
+	_(RPC_METHOD_NP_INITIALIZE);
+	_(RPC_METHOD_NP_SHUTDOWN);
+	_(RPC_METHOD_NPN_USER_AGENT);
+	_(RPC_METHOD_NPN_GET_VALUE);
+	_(RPC_METHOD_NPN_SET_VALUE);
+	_(RPC_METHOD_NPN_GET_URL);
+	_(RPC_METHOD_NPN_GET_URL_NOTIFY);
+	_(RPC_METHOD_NPN_POST_URL);
+	_(RPC_METHOD_NPN_POST_URL_NOTIFY);
+	_(RPC_METHOD_NPN_STATUS);
+	_(RPC_METHOD_NPN_PRINT_DATA);
+	_(RPC_METHOD_NPN_REQUEST_READ);
+	_(RPC_METHOD_NPN_NEW_STREAM);
+	_(RPC_METHOD_NPN_DESTROY_STREAM);
+	_(RPC_METHOD_NPN_WRITE);
+	_(RPC_METHOD_NPN_PUSH_POPUPS_ENABLED_STATE);
+	_(RPC_METHOD_NPN_POP_POPUPS_ENABLED_STATE);
+	_(RPC_METHOD_NPN_FORCE_REDRAW);
+	_(RPC_METHOD_NPN_INVALIDATE_RECT);
+	_(RPC_METHOD_NPN_INVALIDATE_REGION);
+	_(RPC_METHOD_NPN_GET_VALUE_FOR_URL);
+	_(RPC_METHOD_NPN_SET_VALUE_FOR_URL);
+	_(RPC_METHOD_NPN_GET_AUTHENTICATION_INFO);
+	_(RPC_METHOD_NPN_POP_UP_CONTEXT_MENU);
+	_(RPC_METHOD_NPN_HANDLE_EVENT);
+	_(RPC_METHOD_NPN_UNFOCUS_INSTANCE);
+	_(RPC_METHOD_NPN_URL_REDIRECT_RESPONSE);
+	_(RPC_METHOD_NPP_NEW);
+	_(RPC_METHOD_NPP_DESTROY);
+	_(RPC_METHOD_NPP_SET_WINDOW);
+	_(RPC_METHOD_NPP_HANDLE_EVENT);
+	_(RPC_METHOD_NPP_GET_VALUE);
+	_(RPC_METHOD_NPP_SET_VALUE);
+	_(RPC_METHOD_NPP_URL_NOTIFY);
+	_(RPC_METHOD_NPP_NEW_STREAM);
+	_(RPC_METHOD_NPP_DESTROY_STREAM);
+	_(RPC_METHOD_NPP_WRITE_READY);
+	_(RPC_METHOD_NPP_WRITE);
+	_(RPC_METHOD_NPP_STREAM_AS_FILE);
+	_(RPC_METHOD_NPP_PRINT);
+	_(RPC_METHOD_NPP_GOT_FOCUS);
+	_(RPC_METHOD_NPP_LOST_FOCUS);
+	_(RPC_METHOD_NPP_URL_REDIRECT_NOTIFY);
+	_(RPC_METHOD_NPP_CLEAR_SITE_DATA);
+	_(RPC_METHOD_NPP_GET_SITES_WITH_DATA);
+	_(RPC_METHOD_NPN_CREATE_OBJECT);
+	_(RPC_METHOD_NPN_RETAIN_OBJECT);
+	_(RPC_METHOD_NPN_RELEASE_OBJECT);
+	_(RPC_METHOD_NPN_INVOKE);
+	_(RPC_METHOD_NPN_INVOKE_DEFAULT);
+	_(RPC_METHOD_NPN_EVALUATE);
+	_(RPC_METHOD_NPN_GET_PROPERTY);
+	_(RPC_METHOD_NPN_SET_PROPERTY);
+	_(RPC_METHOD_NPN_REMOVE_PROPERTY);
+	_(RPC_METHOD_NPN_HAS_PROPERTY);
+	_(RPC_METHOD_NPN_HAS_METHOD);
+	_(RPC_METHOD_NPN_SET_EXCEPTION);
+	_(RPC_METHOD_NPN_ENUMERATE);
+	_(RPC_METHOD_NPN_CONSTRUCT);
+	_(RPC_METHOD_NPN_GET_STRING_IDENTIFIER);
+	_(RPC_METHOD_NPN_GET_STRING_IDENTIFIERS);
+	_(RPC_METHOD_NPN_GET_INT_IDENTIFIER);
+	_(RPC_METHOD_NPN_IDENTIFIER_IS_STRING);
+	_(RPC_METHOD_NPN_UTF8_FROM_IDENTIFIER);
+	_(RPC_METHOD_NPN_INT_FROM_IDENTIFIER);
+	_(RPC_METHOD_NPCLASS_INVALIDATE);
+	_(RPC_METHOD_NPCLASS_HAS_METHOD);
+	_(RPC_METHOD_NPCLASS_INVOKE);
+	_(RPC_METHOD_NPCLASS_INVOKE_DEFAULT);
+	_(RPC_METHOD_NPCLASS_HAS_PROPERTY);
+	_(RPC_METHOD_NPCLASS_GET_PROPERTY);
+	_(RPC_METHOD_NPCLASS_SET_PROPERTY);
+	_(RPC_METHOD_NPCLASS_REMOVE_PROPERTY);
+	_(RPC_METHOD_NPCLASS_ENUMERATE);
+	_(RPC_METHOD_NPCLASS_CONSTRUCT);
+	_(RPC_METHOD_NPCLASS_DEALLOCATE);
+	_(RPC_METHOD_NPW_HIBERNATE);
+#undef _
+  default:
+	str = NULL;
+	break;
+  }
+
+  return str;
+}
+
+
 /*
  *  RPC types of NPP/NPN variables
  */
@@ -1456,6 +1555,61 @@ static int do_recv_NPString(rpc_message_t *message, void *p_value)
 }
 
 
+/*
+ *  Process NPW_Surface objects
+ */
+
+static int do_send_NPW_Surface(rpc_message_t *message, void *p_value)
+{
+  NPW_Surface *surface = (NPW_Surface *)p_value;
+  int error;
+
+  if ((error = rpc_message_send_int32(message, surface->shm_id[0])) < 0)
+	return error;
+  if ((error = rpc_message_send_int32(message, surface->shm_id[1])) < 0)
+	return error;
+  if ((error = rpc_message_send_uint32(message, surface->width)) < 0)
+	return error;
+  if ((error = rpc_message_send_uint32(message, surface->height)) < 0)
+	return error;
+  if ((error = rpc_message_send_uint32(message, surface->depth)) < 0)
+	return error;
+  if ((error = rpc_message_send_uint32(message, surface->bytes_per_line)) < 0)
+	return error;
+
+  return RPC_ERROR_NO_ERROR;
+}
+
+static int do_recv_NPW_Surface(rpc_message_t *message, void *p_value)
+{
+  NPW_Surface *surface = (NPW_Surface *)p_value;
+  int32_t shm_id0, shm_id1;
+  uint32_t width, height, depth, bytes_per_line;
+  int error;
+
+  if ((error = rpc_message_recv_int32(message, &shm_id0)) < 0)
+	return error;
+  if ((error = rpc_message_recv_int32(message, &shm_id1)) < 0)
+	return error;
+  if ((error = rpc_message_recv_uint32(message, &width)) < 0)
+	return error;
+  if ((error = rpc_message_recv_uint32(message, &height)) < 0)
+	return error;
+  if ((error = rpc_message_recv_uint32(message, &depth)) < 0)
+	return error;
+  if ((error = rpc_message_recv_uint32(message, &bytes_per_line)) < 0)
+	return error;
+
+  surface->shm_id[0] = shm_id0;
+  surface->shm_id[1] = shm_id1;
+  surface->width = width;
+  surface->height = height;
+  surface->depth = depth;
+  surface->bytes_per_line = bytes_per_line;
+  return RPC_ERROR_NO_ERROR;
+}
+
+
 /*
  *  Process NPVariant objects
  */
@@ -1708,10 +1862,19 @@ static const rpc_message_descriptor_t message_descs[] = {
 	sizeof(NPVariant),
 	do_send_NPVariant_pass_ref,
 	do_recv_NPVariant_pass_ref
+  },
+  {
+	RPC_TYPE_NPW_SURFACE,
+	sizeof(NPW_Surface),
+	do_send_NPW_Surface,
+	do_recv_NPW_Surface
   }
 };
 
 int rpc_add_np_marshalers(rpc_connection_t *connection)
 {
+  // Let RPC statistics report NPAPI method names
+  rpc_set_method_name_func(string_of_RPC_METHOD);
+
   return rpc_connection_add_message_descriptors(connection, message_descs, sizeof(message_descs) / sizeof(message_descs[0]));
 }
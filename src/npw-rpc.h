@@ -109,7 +109,9 @@ enum {
   RPC_METHOD_NPCLASS_REMOVE_PROPERTY,
   RPC_METHOD_NPCLASS_ENUMERATE,
   RPC_METHOD_NPCLASS_CONSTRUCT,
-  RPC_METHOD_NPCLASS_DEALLOCATE
+  RPC_METHOD_NPCLASS_DEALLOCATE,
+
+  RPC_METHOD_NPW_HIBERNATE						/* 80 */
 };
 
 // NPAPI data types
@@ -133,7 +135,8 @@ enum {
   RPC_TYPE_NP_UTF8,
   RPC_TYPE_NP_OBJECT_PASS_REF,
   RPC_TYPE_NP_VARIANT_PASS_REF,
-  RPC_TYPE_NPW_PLUGIN_INSTANCE
+  RPC_TYPE_NPW_PLUGIN_INSTANCE,				/* 20 */
+  RPC_TYPE_NPW_SURFACE
 };
 
 // NPPrintData is used to get the plugin printed tmpfile
@@ -142,9 +145,32 @@ typedef struct _NPPrintData {
   uint8_t data[4096];
 } NPPrintData;
 
+// NPW_Surface describes the double-buffered MIT-SHM image a windowless
+// plugin draws into. shm_id[] are SysV segment ids, or -1 if unused
+typedef struct _NPW_Surface {
+  int32_t shm_id[2];
+  uint32_t width;
+  uint32_t height;
+  uint32_t depth;
+  uint32_t bytes_per_line;
+} NPW_Surface;
+
+// Browser values snapshotted by the wrapper and sent with NPP_New, so
+// that the viewer answers NPN_GetValue() locally. A bit is set only if
+// the browser returned NPERR_NO_ERROR for that variable
+enum {
+  NPW_NPP_NEW_SUPPORTS_WINDOWLESS	= 1 << 0,
+  NPW_NPP_NEW_SUPPORTS_XEMBED		= 1 << 1,
+  NPW_NPP_NEW_PRIVATE_MODE			= 1 << 2,
+  NPW_NPP_NEW_DOCUMENT_ORIGIN		= 1 << 3,
+};
+
 // Initialize marshalers for NS4 plugin types
 extern int rpc_add_np_marshalers(rpc_connection_t *connection) attribute_hidden;
 
+// Name of RPC_METHOD_* value, or NULL if unknown
+extern const char *string_of_RPC_METHOD(int method) attribute_hidden;
+
 // RPC types
 extern int rpc_type_of_NPNVariable(int variable) attribute_hidden;
 extern int rpc_type_of_NPPVariable(int variable) attribute_hidden;
@@ -31,6 +31,13 @@
 #include <errno.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include <X11/X.h>
 #include <X11/Xlib.h>
@@ -68,11 +75,19 @@ static pthread_t g_main_thread = 0;
 // True as long as the event loop is running.
 static bool g_is_running = false;
 
+// Serve all wrappers of this plugin (--shared), see shared_viewer_run()
+static bool g_shared_viewer = false;
+static bool g_shared_session = false;
+
+// Seconds a shared viewer lingers without sessions
+#define SHARED_VIEWER_IDLE_TIMEOUT 60
+
 // Instance state information about the plugin
 typedef struct _PluginInstance {
   NPW_DECL_PLUGIN_INSTANCE;
   bool use_xembed;
   bool is_windowless;
+  bool is_transparent;
   NPWindow window;
   uint32_t width, height;
   void *toolkit_data;
@@ -80,6 +95,23 @@ typedef struct _PluginInstance {
   uint32_t next_timer_id;
   GHashTable *timers;
   GHashTable *npobjects;
+  struct _ShmSurface *surface;
+  uint32_t cached_values;			// NPW_NPP_NEW_* bits
+  bool supports_windowless;
+  bool supports_xembed;
+  bool private_mode;
+  char *document_origin;
+  NPObject *window_npobj;
+  NPObject *element_npobj;
+  uint32_t cached_values_hits;
+  bool hibernated;						// hidden for a while, see RPC_METHOD_NPW_HIBERNATE
+  bool is_visible;						// last NPP_SetWindow() showed something
+  uint32_t timer_wakeups;
+  char *status_sent;					// last NPN_Status() message sent
+  char *status_pending;					// held back by the rate limit
+  uint64_t status_time;					// when status_sent went out, in us
+  uint32_t status_timer;				// npw_timeout_add() id sending status_pending
+  GSList *stream_files;					// fds behind NPP_StreamAsFile() paths
 } PluginInstance;
 
 #define PLUGIN_INSTANCE(instance) \
@@ -91,8 +123,16 @@ typedef struct _PluginInstance {
 // Browser side data for an NPStream instance
 typedef struct _StreamInstance {
   NPW_DECL_STREAM_INSTANCE;
+  NPP instance;
+  uint8_t *cache_data;					// seekable stream data shared with the wrapper
+  uint32_t cache_size;
+  NPByteRange *cache_reads;				// cached ranges NPN_RequestRead() wants
+  guint cache_source;
 } StreamInstance;
 
+// Delay before offering data again to a plugin that wasn't ready
+#define STREAM_CACHE_RETRY_DELAY 10
+
 // Xt wrapper data
 typedef struct _XtData {
   Window browser_window;
@@ -106,18 +146,33 @@ typedef struct _GtkData {
   GtkWidget *socket;
 } GtkData;
 
+// Shared memory surface for windowless plugins
+typedef struct _ShmSurface {
+  NPW_Surface desc;
+  XShmSegmentInfo shminfo[2];
+  XImage *image[2];
+  Pixmap pixmap[2];
+  bool use_shm_pixmaps;
+  int back_buffer;
+  int x_offset, y_offset;
+} ShmSurface;
+
 // Timer information
 typedef struct _Timer {
   bool repeat;
+  uint32_t interval;
   void (*func)(NPP npp, uint32_t timerID);
-  guint source_id;
+  uint32_t source_id;					// from npw_timeout_add()
 } Timer;
 
 // Prototypes
 static void destroy_window(PluginInstance *plugin);
+static void destroy_surface(PluginInstance *plugin);
 static int xt_source_create(void);
 static void xt_source_destroy(void);
 static void timer_free(Timer *timer);
+static void stream_cache_read(StreamInstance *stream_ndata, NPByteRange *ranges);
+static void stream_cache_detach(StreamInstance *stream_ndata);
 
 
 /* ====================================================================== */
@@ -157,18 +212,33 @@ static void plugin_instance_finalize(PluginInstance *plugin)
 	free(plugin->instance);
 	plugin->instance = NULL;
   }
+  if (plugin->document_origin) {
+	free(plugin->document_origin);
+	plugin->document_origin = NULL;
+  }
+  g_free(plugin->status_sent);
+  g_free(plugin->status_pending);
   if (plugin->timers) {
 	g_hash_table_destroy(plugin->timers);
   }
   if (plugin->npobjects) {
 	g_hash_table_destroy(plugin->npobjects);
   }
+  for (GSList *l = plugin->stream_files; l != NULL; l = l->next)
+	close(GPOINTER_TO_INT(l->data));
+  g_slist_free(plugin->stream_files);
 }
 
 static void plugin_instance_invalidate(PluginInstance *plugin)
 {
   destroy_window(plugin);
 
+  // the browser window is going away, drop the pending status
+  if (plugin->status_timer) {
+	npw_timeout_remove(plugin->status_timer);
+	plugin->status_timer = 0;
+  }
+
   /* NPP instance is no longer valid beyond this point. Drop the link
 	 to the PluginInstance now so that future RPC with this
 	 PluginInstance will actually emit a NULL instance, which the
@@ -914,6 +984,185 @@ static void destroy_window(PluginInstance *plugin)
 	destroy_window_attributes(plugin->window.ws_info);
 	plugin->window.ws_info = NULL;
   }
+
+  destroy_surface(plugin);
+}
+
+
+/* ====================================================================== */
+/* === Shared memory surfaces                                         === */
+/* ====================================================================== */
+
+/*
+ *  Windowless plugins normally draw straight into the browser's
+ *  drawable, which requires both processes to XSync() around each
+ *  GraphicsExpose. When the wrapper asks for it, the plugin instead
+ *  draws into one of two MIT-SHM images owned by the viewer. The
+ *  damaged area is returned with the NPP_HandleEvent() reply and the
+ *  wrapper composites it into the browser drawable with XShmPutImage().
+ *
+ *  Buffers are flipped after each paint so that the viewer never
+ *  writes to the image the X server may still be reading from.
+ */
+
+// Check whether MIT-SHM is usable, and whether it supports shared pixmaps
+static int get_shm_support(void)
+{
+  static int shm_support = -1;
+  if (shm_support < 0) {
+	int major, minor;
+	Bool shared_pixmaps;
+	shm_support = 0;
+	if (XShmQueryExtension(x_display) &&
+		XShmQueryVersion(x_display, &major, &minor, &shared_pixmaps)) {
+	  shm_support = 1;
+	  if (shared_pixmaps && XShmPixmapFormat(x_display) == ZPixmap)
+		shm_support = 2;
+	}
+  }
+  return shm_support;
+}
+
+static void destroy_surface_buffer(ShmSurface *surface, int i)
+{
+  if (surface->pixmap[i] != None) {
+	XFreePixmap(x_display, surface->pixmap[i]);
+	surface->pixmap[i] = None;
+  }
+  if (surface->desc.shm_id[i] >= 0)
+	XShmDetach(x_display, &surface->shminfo[i]);
+  if (surface->image[i]) {
+	surface->image[i]->data = NULL;
+	XDestroyImage(surface->image[i]);
+	surface->image[i] = NULL;
+  }
+  if (surface->shminfo[i].shmaddr && surface->shminfo[i].shmaddr != (char *)-1) {
+	shmdt(surface->shminfo[i].shmaddr);
+	surface->shminfo[i].shmaddr = NULL;
+  }
+  if (surface->shminfo[i].shmid >= 0) {
+	shmctl(surface->shminfo[i].shmid, IPC_RMID, NULL);
+	surface->shminfo[i].shmid = -1;
+  }
+  surface->desc.shm_id[i] = -1;
+}
+
+static int create_surface_buffer(ShmSurface *surface, NPSetWindowCallbackStruct *ws_info, int i)
+{
+  XShmSegmentInfo *shminfo = &surface->shminfo[i];
+  uint32_t width = surface->desc.width;
+  uint32_t height = surface->desc.height;
+  uint32_t depth = surface->desc.depth;
+
+  XImage *image = XShmCreateImage(x_display, ws_info->visual, depth, ZPixmap,
+								  NULL, shminfo, width, height);
+  if (image == NULL)
+	return -1;
+  surface->image[i] = image;
+
+  // the wrapper marks the segment for removal as soon as it is attached
+  // so that it goes away with the last user, even if we crash
+  shminfo->shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+  if (shminfo->shmid < 0)
+	return -1;
+  shminfo->shmaddr = image->data = shmat(shminfo->shmid, NULL, 0);
+  if (shminfo->shmaddr == (char *)-1)
+	return -1;
+  shminfo->readOnly = False;
+  if (!XShmAttach(x_display, shminfo))
+	return -1;
+  surface->desc.shm_id[i] = shminfo->shmid;
+  surface->desc.bytes_per_line = image->bytes_per_line;
+
+  if (surface->use_shm_pixmaps)
+	surface->pixmap[i] = XShmCreatePixmap(x_display, DefaultRootWindow(x_display),
+										  shminfo->shmaddr, shminfo,
+										  width, height, depth);
+  else
+	surface->pixmap[i] = XCreatePixmap(x_display, DefaultRootWindow(x_display),
+									   width, height, depth);
+  if (surface->pixmap[i] == None)
+	return -1;
+  return 0;
+}
+
+// Destroy the shared memory surface attached to the plugin instance, if any
+static void destroy_surface(PluginInstance *plugin)
+{
+  ShmSurface *surface = plugin->surface;
+  if (surface == NULL)
+	return;
+  for (int i = 0; i < 2; i++)
+	destroy_surface_buffer(surface, i);
+  XSync(x_display, False);
+  NPW_MemFree(surface);
+  plugin->surface = NULL;
+}
+
+// (Re)create the shared memory surface to match the windowless plugin area
+static int update_surface(PluginInstance *plugin)
+{
+  NPWindow *window = &plugin->window;
+  NPSetWindowCallbackStruct *ws_info = window->ws_info;
+
+  // plugins drawing over the page background need the real drawable
+  if (plugin->is_transparent || ws_info == NULL ||
+	  window->width == 0 || window->height == 0 || get_shm_support() == 0) {
+	destroy_surface(plugin);
+	return -1;
+  }
+
+  ShmSurface *surface = plugin->surface;
+  if (surface == NULL ||
+	  surface->desc.width != window->width ||
+	  surface->desc.height != window->height ||
+	  surface->desc.depth != ws_info->depth) {
+	destroy_surface(plugin);
+	if ((surface = NPW_MemNew0(ShmSurface, 1)) == NULL)
+	  return -1;
+	plugin->surface = surface;
+	surface->desc.width = window->width;
+	surface->desc.height = window->height;
+	surface->desc.depth = ws_info->depth;
+	surface->use_shm_pixmaps = get_shm_support() == 2;
+	for (int i = 0; i < 2; i++) {
+	  surface->shminfo[i].shmid = -1;
+	  surface->desc.shm_id[i] = -1;
+	}
+	for (int i = 0; i < 2; i++) {
+	  if (create_surface_buffer(surface, ws_info, i) < 0) {
+		npw_printf("WARNING: could not allocate shared memory surface, using the browser drawable\n");
+		destroy_surface(plugin);
+		return -1;
+	  }
+	}
+	// make sure the X server attached the segments before anyone else does
+	XSync(x_display, False);
+	D(bug("created %dx%d shared memory surface (%s)\n", window->width, window->height,
+		  surface->use_shm_pixmaps ? "shm pixmaps" : "shm images"));
+  }
+
+  // the plugin now draws at the origin of the surface
+  surface->x_offset = window->x;
+  surface->y_offset = window->y;
+  window->x = 0;
+  window->y = 0;
+  window->clipRect.left -= surface->x_offset;
+  window->clipRect.right -= surface->x_offset;
+  window->clipRect.top -= surface->y_offset;
+  window->clipRect.bottom -= surface->y_offset;
+  return 0;
+}
+
+// Get the surface description to send back to the wrapper
+static void get_surface_desc(PluginInstance *plugin, NPW_Surface *desc)
+{
+  if (plugin->surface)
+	*desc = plugin->surface->desc;
+  else {
+	memset(desc, 0, sizeof(*desc));
+	desc->shm_id[0] = desc->shm_id[1] = -1;
+  }
 }
 
 
@@ -1142,6 +1391,56 @@ g_NPN_GetValue_real(NPP instance, NPNVariable variable, void *value)
   return ret;
 }
 
+// Answers NPN_GetValue() from the values the browser sent along with
+// NPP_New. The window and plugin element objects don't change either
+// but are only fetched on first use, as most plugins never ask
+static bool
+get_cached_value(PluginInstance *plugin, NPNVariable variable, void *value, NPError *ret)
+{
+  NPObject **npobj_p;
+  switch (variable) {
+  case NPNVSupportsWindowless:
+	if ((plugin->cached_values & NPW_NPP_NEW_SUPPORTS_WINDOWLESS) == 0)
+	  return false;
+	*((NPBool *)value) = plugin->supports_windowless;
+	break;
+  case NPNVSupportsXEmbedBool:
+	if ((plugin->cached_values & NPW_NPP_NEW_SUPPORTS_XEMBED) == 0)
+	  return false;
+	*((NPBool *)value) = plugin->supports_xembed;
+	break;
+  case NPNVprivateModeBool:
+	if ((plugin->cached_values & NPW_NPP_NEW_PRIVATE_MODE) == 0)
+	  return false;
+	*((NPBool *)value) = plugin->private_mode;
+	break;
+  case NPNVdocumentOrigin:
+	if ((plugin->cached_values & NPW_NPP_NEW_DOCUMENT_ORIGIN) == 0)
+	  return false;
+	// Reallocate with NPN_MemAlloc. Caller frees.
+	*ret = NPW_ReallocData(plugin->document_origin, strlen(plugin->document_origin) + 1, (void **)value);
+	plugin->cached_values_hits++;
+	return true;
+  case NPNVWindowNPObject:
+  case NPNVPluginElementNPObject:
+	npobj_p = variable == NPNVWindowNPObject ? &plugin->window_npobj : &plugin->element_npobj;
+	if (*npobj_p == NULL) {
+	  *ret = g_NPN_GetValue_real(PLUGIN_INSTANCE_NPP(plugin), variable, value);
+	  // Keep a reference of our own. Caller releases the other one.
+	  if (*ret == NPERR_NO_ERROR && *((NPObject **)value) != NULL)
+		*npobj_p = NPN_RetainObject(*((NPObject **)value));
+	  return true;
+	}
+	*((NPObject **)value) = NPN_RetainObject(*npobj_p);
+	break;
+  default:
+	return false;
+  }
+  plugin->cached_values_hits++;
+  *ret = NPERR_NO_ERROR;
+  return true;
+}
+
 static NPError
 g_NPN_GetValue(NPP instance, NPNVariable variable, void *value)
 {
@@ -1195,7 +1494,12 @@ g_NPN_GetValue(NPP instance, NPNVariable variable, void *value)
   case NPNVPluginElementNPObject:
   case NPNVprivateModeBool:
   case NPNVdocumentOrigin:
-	return g_NPN_GetValue_real(instance, variable, value);
+	{
+	  NPError ret;
+	  if (plugin && get_cached_value(plugin, variable, value, &ret))
+		return ret;
+	  return g_NPN_GetValue_real(instance, variable, value);
+	}
   default:
 	switch (variable & 0xff) {
 	case 13: /* NPNVToolkit */
@@ -1461,13 +1765,19 @@ invoke_NPN_RequestRead(NPStream *stream, NPByteRange *rangeList)
   }
 
   int32_t ret;
-  error = rpc_method_wait_for_reply(g_rpc_connection, RPC_TYPE_INT32, &ret, RPC_TYPE_INVALID);
+  NPByteRange *cached;
+  error = rpc_method_wait_for_reply(g_rpc_connection,
+									RPC_TYPE_INT32, &ret,
+									RPC_TYPE_NP_BYTE_RANGE, &cached,
+									RPC_TYPE_INVALID);
 
   if (error != RPC_ERROR_NO_ERROR) {
 	npw_perror("NPN_RequestRead() wait for reply", error);
 	return NPERR_GENERIC_ERROR;
   }
 
+  // The wrapper has these in the stream cache already
+  stream_cache_read(stream->ndata, cached);
   return ret;
 }
 
@@ -1539,6 +1849,12 @@ g_NPN_SetValue(NPP instance, NPPVariable variable, void *value)
   if (plugin == NULL)
 	return NPERR_INVALID_INSTANCE_ERROR;
 
+  // transparent plugins must draw over the page, not a private surface
+  if (variable == NPPVpluginTransparentBool) {
+	if ((plugin->is_transparent = value != NULL))
+	  destroy_surface(plugin);
+  }
+
   D(bugiI("NPN_SetValue instance=%p, variable=%d [%s]\n", instance, variable, string_of_NPPVariable(variable)));
   npw_plugin_instance_ref(plugin);
   NPError ret = invoke_NPN_SetValue(plugin, variable, value);
@@ -1553,7 +1869,8 @@ invoke_NPN_Status(PluginInstance *plugin, const char *message)
 {
   npw_return_if_fail(rpc_method_invoke_possible(g_rpc_connection));
 
-  int error = rpc_method_invoke(g_rpc_connection,
+  // purely cosmetic, don't wait for the browser
+  int error = rpc_method_notify(g_rpc_connection,
 								RPC_METHOD_NPN_STATUS,
 								RPC_TYPE_NPW_PLUGIN_INSTANCE, plugin,
 								RPC_TYPE_STRING, message,
@@ -1563,13 +1880,54 @@ invoke_NPN_Status(PluginInstance *plugin, const char *message)
 	npw_perror("NPN_Status() invoke", error);
 	return;
   }
+}
 
-  error = rpc_method_wait_for_reply(g_rpc_connection, RPC_TYPE_INVALID);
+// Plugins tend to update the status line from their animation loop,
+// so an instance sends at most one message every NPW_STATUS_INTERVAL
+// ms, the latest one. Repeated messages are not sent at all
+#define STATUS_INTERVAL_DEFAULT 100
 
-  if (error != RPC_ERROR_NO_ERROR) {
-	npw_perror("NPN_Status() wait for reply", error);
-	return;
+static uint32_t timer_slack(PluginInstance *plugin);
+
+static uint32_t status_interval(void)
+{
+  static int interval = -1;
+  if (interval < 0) {
+	const char *interval_str = getenv("NPW_STATUS_INTERVAL");
+	interval = interval_str ? atoi(interval_str) : STATUS_INTERVAL_DEFAULT;
+	if (interval < 0)
+	  interval = 0;
   }
+  return interval;
+}
+
+static void
+status_send(PluginInstance *plugin, char *message)
+{
+  invoke_NPN_Status(plugin, message);
+  g_free(plugin->status_sent);
+  plugin->status_sent = message;
+  plugin->status_time = npw_get_time_us();
+}
+
+static gboolean
+status_timer_run(PluginInstance *plugin)
+{
+  plugin->status_timer = 0;
+  char *message = plugin->status_pending;
+  plugin->status_pending = NULL;
+  if (message == NULL)
+	return FALSE;
+  // back to the message already displayed, e.g. after a "Loading..." blip
+  if (plugin->status_sent && strcmp(message, plugin->status_sent) == 0) {
+	g_free(message);
+	return FALSE;
+  }
+  if (npw_plugin_instance_is_valid(plugin))
+	status_send(plugin, message);
+  else
+	g_free(message);
+  return FALSE;
 }
 
 static void
@@ -1583,12 +1941,40 @@ g_NPN_Status(NPP instance, const char *message)
   PluginInstance *plugin = NULL;
   if (instance)
 	plugin = PLUGIN_INSTANCE(instance);
+  if (message == NULL)
+	message = "";
 
   D(bugiI("NPN_Status instance=%p, message='%s'\n", instance, message));
-  npw_plugin_instance_ref(plugin);
-  invoke_NPN_Status(plugin, message);
-  npw_plugin_instance_unref(plugin);
-  D(bugiD("NPN_Status done\n"));
+  if (plugin == NULL) {
+	invoke_NPN_Status(plugin, message);
+	D(bugiD("NPN_Status done\n"));
+	return;
+  }
+
+  const char *last = plugin->status_pending ? plugin->status_pending : plugin->status_sent;
+  if (last && strcmp(message, last) == 0) {
+	D(bugiD("NPN_Status done (unchanged)\n"));
+	return;
+  }
+
+  uint64_t interval = (uint64_t)status_interval() * 1000;
+  uint64_t elapsed = npw_get_time_us() - plugin->status_time;
+  if (plugin->status_timer == 0 && (plugin->status_sent == NULL || elapsed >= interval)) {
+	status_send(plugin, g_strdup(message));
+	D(bugiD("NPN_Status done\n"));
+	return;
+  }
+
+  g_free(plugin->status_pending);
+  plugin->status_pending = g_strdup(message);
+  if (plugin->status_timer == 0) {
+	plugin->status_timer = npw_timeout_add((interval - elapsed + 999) / 1000,
+										   timer_slack(plugin),
+										   (GSourceFunc) status_timer_run,
+										   npw_plugin_instance_ref(plugin),
+										   (GDestroyNotify) npw_plugin_instance_unref);
+  }
+  D(bugiD("NPN_Status done (delayed)\n"));
 }
 
 // Returns the browser's user agent field
@@ -3097,25 +3483,26 @@ g_NPN_IntFromIdentifier(NPIdentifier identifier)
 }
 
 typedef struct _AsyncCall {
+  NPW_AsyncCall base;
   PluginInstance *plugin;
   void (*func)(void *);
   void *userData;
 } AsyncCall;
 
 static void
-async_call_free(AsyncCall *asyncCall)
+async_call_free(NPW_AsyncCall *call)
 {
+  AsyncCall *asyncCall = (AsyncCall *)call;
   npw_plugin_instance_unref(asyncCall->plugin);
   free(asyncCall);
 }
 
-static gboolean
-async_call_run(gpointer data)
+static void
+async_call_run(NPW_AsyncCall *call)
 {
-  AsyncCall *asyncCall = data;
+  AsyncCall *asyncCall = (AsyncCall *)call;
   if (npw_plugin_instance_is_valid(asyncCall->plugin))
 	asyncCall->func(asyncCall->userData);
-  return FALSE;
 }
 
 static void
@@ -3132,12 +3519,17 @@ g_NPN_PluginThreadAsyncCall(NPP instance,
 	return;
 
   // No debug statements as the debug system is not thread-safe.
+  // Calls from decoder threads come in bursts, they are queued and
+  // the main loop runs all of them in a single iteration.
   AsyncCall *asyncCall = malloc(sizeof(AsyncCall));
+  if (asyncCall == NULL)
+	return;
+  asyncCall->base.run = async_call_run;
+  asyncCall->base.destroy = async_call_free;
   asyncCall->plugin = npw_plugin_instance_ref(plugin);
   asyncCall->func = func;
   asyncCall->userData = userData;
-  g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
-				  async_call_run, asyncCall, (GDestroyNotify) async_call_free);
+  npw_async_call(&asyncCall->base);
 }
 
 // Queries information about a URL
@@ -3368,6 +3760,28 @@ typedef struct _TimerData {
   PluginInstance *plugin;
 } TimerData;
 
+// Shortest interval of the timers of a hibernated instance, in ms
+#define HIBERNATED_TIMER_INTERVAL 1000
+
+// Timers due within the slack (NPW_TIMER_SLACK ms) of each other run
+// in the same main loop iteration, so that a dozen plugin timers cost
+// one wakeup and one rpc_sync() with the browser. Hidden instances
+// get TIMER_SLACK_HIDDEN_FACTOR times as much
+#define TIMER_SLACK_DEFAULT 8
+#define TIMER_SLACK_HIDDEN_FACTOR 8
+
+static uint32_t timer_slack(PluginInstance *plugin)
+{
+  static int slack = -1;
+  if (slack < 0) {
+	const char *slack_str = getenv("NPW_TIMER_SLACK");
+	slack = slack_str ? atoi(slack_str) : TIMER_SLACK_DEFAULT;
+	if (slack < 0)
+	  slack = 0;
+  }
+  return plugin->is_visible ? slack : slack * TIMER_SLACK_HIDDEN_FACTOR;
+}
+
 static gboolean
 timer_data_run(TimerData *data)
 {
@@ -3379,8 +3793,19 @@ timer_data_run(TimerData *data)
   if (timer == NULL)
 	return FALSE;
 
+  data->plugin->timer_wakeups++;
+  uint32_t source_id = timer->source_id;
   timer->func(PLUGIN_INSTANCE_NPP(data->plugin), data->timer_id);
 
+  // The callback may have unscheduled the timer, freeing it, or
+  // rescheduled it, in which case a new timeout took over
+  if (!npw_plugin_instance_is_valid(data->plugin))
+	return FALSE;
+  timer = g_hash_table_lookup(data->plugin->timers,
+							  GINT_TO_POINTER(data->timer_id));
+  if (timer == NULL || timer->source_id != source_id)
+	return FALSE;
+
   if (!timer->repeat) {
 	// Don't bother trying to detach it later.
 	timer->source_id = 0;
@@ -3400,12 +3825,42 @@ static void
 timer_free(Timer *timer)
 {
   if (timer->source_id) {
-	g_source_remove(timer->source_id);
+	npw_timeout_remove(timer->source_id);
 	timer->source_id = 0;
   }
   g_free(timer);
 }
 
+static void
+timer_schedule(PluginInstance *plugin, uint32_t timer_id, Timer *timer)
+{
+  uint32_t interval = timer->interval;
+  if (plugin->hibernated && interval < HIBERNATED_TIMER_INTERVAL)
+	interval = HIBERNATED_TIMER_INTERVAL;
+
+  TimerData *timer_data = g_new0(TimerData, 1);
+  timer_data->timer_id = timer_id;
+  timer_data->plugin = npw_plugin_instance_ref(plugin);
+
+  timer->source_id = npw_timeout_add(interval,
+									 timer_slack(plugin),
+									 (GSourceFunc) timer_data_run,
+									 timer_data,
+									 (GDestroyNotify) timer_data_free);
+}
+
+// Restart pending timers with the intervals and slack of the
+// visibility and hibernation state
+static void
+timer_reschedule(gpointer key, gpointer value, gpointer user_data)
+{
+  Timer *timer = (Timer *)value;
+  if (timer->source_id == 0)
+	return;
+  npw_timeout_remove(timer->source_id);
+  timer_schedule((PluginInstance *)user_data, GPOINTER_TO_UINT(key), timer);
+}
+
 static uint32_t
 g_NPN_ScheduleTimer(NPP instance, uint32_t interval, NPBool repeat,
 					void (*timerFunc)(NPP npp, uint32_t timerID))
@@ -3429,18 +3884,10 @@ g_NPN_ScheduleTimer(NPP instance, uint32_t interval, NPBool repeat,
 
   Timer *timer = g_new0(Timer, 1);
   timer->repeat = repeat;
+  timer->interval = interval;
   timer->func = timerFunc;
   g_hash_table_insert(plugin->timers, GINT_TO_POINTER(timer_id), timer);
-
-  TimerData *timer_data = g_new0(TimerData, 1);
-  timer_data->timer_id = timer_id;
-  timer_data->plugin = npw_plugin_instance_ref(plugin);
-
-  timer->source_id = g_timeout_add_full(G_PRIORITY_DEFAULT,
-										interval,
-										(GSourceFunc) timer_data_run,
-										timer_data,
-										(GDestroyNotify) timer_data_free);
+  timer_schedule(plugin, timer_id, timer);
 
   D(bugiD("NPN_ScheduleTimer return: %d\n", timer_id));
 
@@ -3626,13 +4073,16 @@ g_NP_Initialize(uint32_t version, uint32_t *plugin_version,
   *plugin_version = plugin_funcs.version;
 
   if (plugin_capabilities) {
+	// The browser tells of private mode changes through NPP_SetValue(),
+	// which g_NPP_SetValue() needs even if the plugin has none
 	int num = 0;
 #define PLUGIN_FUNC(func, member)								\
 	if (num >= plugin_capabilities_len)	{						\
 	  D(bug("ERROR: provided array was too small.\n"));			\
 	  goto plugin_func_done;									\
 	}															\
-	plugin_capabilities[num] = (plugin_funcs.member != NULL);	\
+	plugin_capabilities[num] = (plugin_funcs.member != NULL		\
+		|| offsetof(NPPluginFuncs, member) == offsetof(NPPluginFuncs, setvalue)); \
 	num++;
 #include "plugin-funcs.h"
 #undef PLUGIN_FUNC
@@ -3650,10 +4100,12 @@ static int handle_NP_Initialize(rpc_connection_t *connection)
   uint32_t version;
   uint32_t *browser_capabilities;
   uint32_t browser_capabilities_len;
+  char *user_agent;
   int error = rpc_method_get_args(connection,
 								  RPC_TYPE_UINT32, &version,
 								  RPC_TYPE_ARRAY, RPC_TYPE_UINT32,
 								  &browser_capabilities_len, &browser_capabilities,
+								  RPC_TYPE_STRING, &user_agent,
 								  RPC_TYPE_INVALID);
 
   if (error != RPC_ERROR_NO_ERROR) {
@@ -3661,6 +4113,13 @@ static int handle_NP_Initialize(rpc_connection_t *connection)
 	return error;
   }
 
+  // NPN_UserAgent() is answered locally from now on
+  if (user_agent) {
+	if (g_user_agent)
+	  free(g_user_agent);
+	g_user_agent = user_agent;
+  }
+
   uint32_t plugin_version = 0;
   uint32_t plugin_capabilities[0
 #define PLUGIN_FUNC(func, member)				\
@@ -3698,6 +4157,10 @@ g_NP_Shutdown(void)
 
   npobject_bridge_destroy();
 
+  // Anything still allocated at this point is most likely leaked
+  NPW_MemDumpProfile("NP_Shutdown", true);
+  rpc_dump_stats("NP_Shutdown");
+
   g_is_running = false;
 
   return ret;
@@ -3720,14 +4183,24 @@ static int handle_NP_Shutdown(rpc_connection_t *connection)
 // NPP_New
 static NPError g_NPP_New(NPMIMEType plugin_type, uint32_t instance_id,
 						 uint16_t mode, int16_t argc, char *argn[], char *argv[],
-						 NPSavedData *saved)
+						 NPSavedData *saved, uint32_t cached_values,
+						 bool supports_windowless, bool supports_xembed,
+						 bool private_mode, char *document_origin)
 {
   PluginInstance *plugin = npw_plugin_instance_new(&PluginInstanceClass);
-  if (plugin == NULL)
+  if (plugin == NULL) {
+	free(document_origin);
 	return NPERR_OUT_OF_MEMORY_ERROR;
+  }
   plugin->instance_id = instance_id;
   id_link(instance_id, plugin);
 
+  plugin->cached_values = cached_values;
+  plugin->supports_windowless = supports_windowless;
+  plugin->supports_xembed = supports_xembed;
+  plugin->private_mode = private_mode;
+  plugin->document_origin = document_origin;
+
   NPP instance = malloc(sizeof(*instance));
   if (instance == NULL)
 	return NPERR_OUT_OF_MEMORY_ERROR;
@@ -3759,7 +4232,7 @@ static NPError g_NPP_New(NPMIMEType plugin_type, uint32_t instance_id,
 	// Even though NPAPI kindly provides an NPBool typedef,
 	// NPNVSupportsXEmbedBool is documented to be a 4-byte PRBool. And
 	// Flash treats it as such.
-	NPError error = mozilla_funcs.getvalue(NULL, NPNVSupportsXEmbedBool, (void *)&supports_XEmbed);
+	NPError error = mozilla_funcs.getvalue(instance, NPNVSupportsXEmbedBool, (void *)&supports_XEmbed);
 	if (error == NPERR_NO_ERROR && plugin_funcs.getvalue) {
 	  long needs_XEmbed = FALSE;
 	  error = plugin_funcs.getvalue(instance, NPPVpluginNeedsXEmbed, (void *)&needs_XEmbed);
@@ -3774,6 +4247,7 @@ static NPError g_NPP_New(NPMIMEType plugin_type, uint32_t instance_id,
 	  return NPERR_GENERIC_ERROR;
   }
 
+  plugin->is_visible = true;
   plugin->next_timer_id = 1;
   plugin->timers = g_hash_table_new_full(NULL, NULL, NULL,
 										 (GDestroyNotify) timer_free);
@@ -3794,6 +4268,9 @@ static int handle_NPP_New(rpc_connection_t *connection)
   int argn_count, argv_count;
   char **argn, **argv;
   NPSavedData *saved;
+  uint32_t cached_values;
+  uint32_t supports_windowless, supports_xembed, private_mode;
+  char *document_origin;
   int error = rpc_method_get_args(connection,
 								  RPC_TYPE_UINT32, &instance_id,
 								  RPC_TYPE_STRING, &plugin_type,
@@ -3801,6 +4278,11 @@ static int handle_NPP_New(rpc_connection_t *connection)
 								  RPC_TYPE_ARRAY, RPC_TYPE_STRING, &argn_count, &argn,
 								  RPC_TYPE_ARRAY, RPC_TYPE_STRING, &argv_count, &argv,
 								  RPC_TYPE_NP_SAVED_DATA, &saved,
+								  RPC_TYPE_UINT32, &cached_values,
+								  RPC_TYPE_BOOLEAN, &supports_windowless,
+								  RPC_TYPE_BOOLEAN, &supports_xembed,
+								  RPC_TYPE_BOOLEAN, &private_mode,
+								  RPC_TYPE_STRING, &document_origin,
 								  RPC_TYPE_INVALID);
 
   if (error != RPC_ERROR_NO_ERROR) {
@@ -3808,8 +4290,14 @@ static int handle_NPP_New(rpc_connection_t *connection)
 	return error;
   }
 
+  if (document_origin == NULL)
+	cached_values &= ~NPW_NPP_NEW_DOCUMENT_ORIGIN;
+
+  // The instance owns document_origin from now on
   assert(argn_count == argv_count);
-  NPError ret = g_NPP_New(plugin_type, instance_id, mode, argn_count, argn, argv, saved);
+  NPError ret = g_NPP_New(plugin_type, instance_id, mode, argn_count, argn, argv, saved,
+						  cached_values, supports_windowless, supports_xembed,
+						  private_mode, document_origin);
 
   if (plugin_type)
 	free(plugin_type);
@@ -3859,6 +4347,16 @@ static NPError g_NPP_Destroy(NPP instance, NPSavedData **sdata)
   NPError ret = plugin_funcs.destroy(instance, sdata);
   D(bugiD("NPP_Destroy return: %d [%s]\n", ret, string_of_NPError(ret)));
 
+  D(bug("NPN_GetValue answered locally %u times\n", plugin->cached_values_hits));
+  if (plugin->window_npobj) {
+	NPN_ReleaseObject(plugin->window_npobj);
+	plugin->window_npobj = NULL;
+  }
+  if (plugin->element_npobj) {
+	NPN_ReleaseObject(plugin->element_npobj);
+	plugin->element_npobj = NULL;
+  }
+
   // Invalidate all NPObjects remaining. We won't forcibly delete them
   // like Firefox does because there may be proxies and stubs still
   // holding on. The references should eventually go away and allow us
@@ -3906,9 +4404,70 @@ static int handle_NPP_Destroy(rpc_connection_t *connection)
   return error;
 }
 
+// Resident memory of the viewer, in KB
+static unsigned long get_rss_kb(void)
+{
+  FILE *fp = fopen("/proc/self/statm", "r");
+  if (fp == NULL)
+	return 0;
+  unsigned long size, resident = 0;
+  if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+	resident = 0;
+  fclose(fp);
+  return resident * (getpagesize() / 1024);
+}
+
+/*
+ *  Hibernation of hidden instances
+ *
+ *  The wrapper tells us when an instance has been hidden for a while
+ *  (NPW_HIBERNATE_DELAY). Its timers then fire at most once every
+ *  HIBERNATED_TIMER_INTERVAL ms, the wrapper stops forwarding stream
+ *  data, and we give free heap pages back to the system. The instance
+ *  wakes up on the next NPP_SetWindow() that makes it visible.
+ */
+static void
+plugin_set_hibernated(PluginInstance *plugin, bool hibernated)
+{
+  if (plugin->hibernated == hibernated)
+	return;
+  plugin->hibernated = hibernated;
+  g_hash_table_foreach(plugin->timers, timer_reschedule, plugin);
+#ifdef __GLIBC__
+  if (hibernated)
+	malloc_trim(0);
+#endif
+  npw_dprintf("instance %p %s: rss %lu KB, %u timer wakeups\n",
+			  PLUGIN_INSTANCE_NPP(plugin), hibernated ? "hibernated" : "resumed",
+			  get_rss_kb(), plugin->timer_wakeups);
+}
+
+static int handle_NPW_Hibernate(rpc_connection_t *connection)
+{
+  D(bug("handle_NPW_Hibernate\n"));
+
+  PluginInstance *plugin;
+  int error = rpc_method_get_args(connection,
+								  RPC_TYPE_NPW_PLUGIN_INSTANCE, &plugin,
+								  RPC_TYPE_INVALID);
+
+  if (error != RPC_ERROR_NO_ERROR) {
+	npw_perror("NPW_Hibernate() get args", error);
+	return error;
+  }
+
+  if (plugin)
+	plugin_set_hibernated(plugin, true);
+
+  return rpc_method_send_reply(connection,
+							   RPC_TYPE_UINT32, (uint32_t)get_rss_kb(),
+							   RPC_TYPE_UINT32, plugin ? plugin->timer_wakeups : 0,
+							   RPC_TYPE_INVALID);
+}
+
 // NPP_SetWindow
 static NPError
-g_NPP_SetWindow(NPP instance, NPWindow *np_window)
+g_NPP_SetWindow(NPP instance, NPWindow *np_window, bool use_surface)
 {
   if (instance == NULL)
 	return NPERR_INVALID_INSTANCE_ERROR;
@@ -3922,6 +4481,14 @@ g_NPP_SetWindow(NPP instance, NPWindow *np_window)
 
   plugin->is_windowless = np_window && np_window->type == NPWindowTypeDrawable;
 
+  bool is_visible = npw_window_is_visible(np_window);
+  if (plugin->hibernated && is_visible)
+	plugin_set_hibernated(plugin, false);
+  if (plugin->is_visible != is_visible) {
+	plugin->is_visible = is_visible;
+	g_hash_table_foreach(plugin->timers, timer_reschedule, plugin);
+  }
+
   NPWindow *window = np_window;
   if (window && (window->window || plugin->is_windowless)) {
 	if (plugin->toolkit_data) {
@@ -3933,6 +4500,12 @@ g_NPP_SetWindow(NPP instance, NPWindow *np_window)
 		return NPERR_GENERIC_ERROR;
 	}
 	window = &plugin->window;
+	if (plugin->is_windowless) {
+	  if (use_surface)
+		update_surface(plugin);
+	  else
+		destroy_surface(plugin);
+	}
   }
 
   D(bugiI("NPP_SetWindow instance=%p, window=%p [%s]\n",
@@ -3954,10 +4527,12 @@ static int handle_NPP_SetWindow(rpc_connection_t *connection)
   int error;
   PluginInstance *plugin;
   NPWindow *window;
+  uint32_t use_surface;
 
   error = rpc_method_get_args(connection,
 							  RPC_TYPE_NPW_PLUGIN_INSTANCE, &plugin,
 							  RPC_TYPE_NP_WINDOW, &window,
+							  RPC_TYPE_BOOLEAN, &use_surface,
 							  RPC_TYPE_INVALID);
 
   if (error != RPC_ERROR_NO_ERROR) {
@@ -3965,7 +4540,7 @@ static int handle_NPP_SetWindow(rpc_connection_t *connection)
 	return error;
   }
 
-  NPError ret = g_NPP_SetWindow(PLUGIN_INSTANCE_NPP(plugin), window);
+  NPError ret = g_NPP_SetWindow(PLUGIN_INSTANCE_NPP(plugin), window, use_surface);
 
   if (window) {
 	if (window->ws_info) {
@@ -3975,7 +4550,12 @@ static int handle_NPP_SetWindow(rpc_connection_t *connection)
 	free(window);
   }
 
-  return rpc_method_send_reply(connection, RPC_TYPE_INT32, ret, RPC_TYPE_INVALID);
+  NPW_Surface surface;
+  get_surface_desc(plugin, &surface);
+  return rpc_method_send_reply(connection,
+							   RPC_TYPE_INT32, ret,
+							   RPC_TYPE_NPW_SURFACE, &surface,
+							   RPC_TYPE_INVALID);
 }
 
 // NPP_GetValue
@@ -4052,6 +4632,57 @@ static int handle_NPP_GetValue(rpc_connection_t *connection)
   abort();
 }
 
+// NPP_SetValue
+static NPError
+g_NPP_SetValue(NPP instance, NPNVariable variable, void *value)
+{
+  if (instance == NULL)
+	return NPERR_INVALID_INSTANCE_ERROR;
+
+  PluginInstance *plugin = PLUGIN_INSTANCE(instance);
+  if (plugin == NULL)
+	return NPERR_INVALID_INSTANCE_ERROR;
+
+  // Keep the value NPN_GetValue() answers with in sync
+  if (variable == NPNVprivateModeBool) {
+	plugin->private_mode = *(NPBool *)value;
+	plugin->cached_values |= NPW_NPP_NEW_PRIVATE_MODE;
+  }
+
+  if (plugin_funcs.setvalue == NULL)
+	return NPERR_INVALID_FUNCTABLE_ERROR;
+
+  D(bugiI("NPP_SetValue instance=%p, variable=%d [%s]\n", instance, variable, string_of_NPNVariable(variable)));
+  NPError ret = plugin_funcs.setvalue(instance, variable, value);
+  D(bugiD("NPP_SetValue return: %d [%s]\n", ret, string_of_NPError(ret)));
+  return ret;
+}
+
+static int handle_NPP_SetValue(rpc_connection_t *connection)
+{
+  D(bug("handle_NPP_SetValue\n"));
+
+  int error;
+  PluginInstance *plugin;
+  uint32_t variable;
+  uint32_t b;
+
+  error = rpc_method_get_args(connection,
+							  RPC_TYPE_NPW_PLUGIN_INSTANCE, &plugin,
+							  RPC_TYPE_UINT32, &variable,
+							  RPC_TYPE_BOOLEAN, &b,
+							  RPC_TYPE_INVALID);
+
+  if (error != RPC_ERROR_NO_ERROR) {
+	npw_perror("NPP_SetValue() get args", error);
+	return error;
+  }
+
+  NPBool value = b ? TRUE : FALSE;
+  NPError ret = g_NPP_SetValue(PLUGIN_INSTANCE_NPP(plugin), variable, &value);
+  return rpc_method_send_reply(connection, RPC_TYPE_INT32, ret, RPC_TYPE_INVALID);
+}
+
 // NPP_URLNotify
 static void
 g_NPP_URLNotify(NPP instance, const char *url, NPReason reason, void *notifyData)
@@ -4123,6 +4754,7 @@ static int handle_NPP_NewStream(rpc_connection_t *connection)
   PluginInstance *plugin;
   uint32_t stream_id;
   uint32_t seekable;
+  int32_t cache_shm_id;
   NPMIMEType type;
 
   NPStream *stream;
@@ -4140,6 +4772,7 @@ static int handle_NPP_NewStream(rpc_connection_t *connection)
 							  RPC_TYPE_NP_NOTIFY_DATA, &stream->notifyData,
 							  RPC_TYPE_STRING, &stream->headers,
 							  RPC_TYPE_BOOLEAN, &seekable,
+							  RPC_TYPE_INT32, &cache_shm_id,
 							  RPC_TYPE_INVALID);
 
   if (error != RPC_ERROR_NO_ERROR) {
@@ -4156,6 +4789,18 @@ static int handle_NPP_NewStream(rpc_connection_t *connection)
   id_link(stream_id, stream_ndata);
   stream_ndata->stream = stream;
   stream_ndata->is_plugin_stream = 0;
+  stream_ndata->instance = PLUGIN_INSTANCE_NPP(plugin);
+  if (cache_shm_id >= 0) {
+	void *data = shmat(cache_shm_id, NULL, 0);
+	if (data != (void *)-1) {
+	  stream_ndata->cache_data = data;
+	  stream_ndata->cache_size = stream->end;
+	  // Both sides are attached now, so the segment can go away with
+	  // the last of them, even if that one is killed. The wrapper only
+	  // removes it itself when we could not attach
+	  shmctl(cache_shm_id, IPC_RMID, NULL);
+	}
+  }
 
   uint16_t stype = NP_NORMAL;
   NPError ret = g_NPP_NewStream(PLUGIN_INSTANCE_NPP(plugin), type, stream, seekable, &stype);
@@ -4163,10 +4808,15 @@ static int handle_NPP_NewStream(rpc_connection_t *connection)
   if (type)
 	free(type);
 
+  // The wrapper drops the cache as well in these cases
+  if (ret != NPERR_NO_ERROR || stype == NP_ASFILEONLY)
+	stream_cache_detach(stream_ndata);
+
   return rpc_method_send_reply(connection,
 							   RPC_TYPE_INT32, ret,
 							   RPC_TYPE_UINT32, (uint32_t)stype,
 							   RPC_TYPE_NP_NOTIFY_DATA, stream->notifyData,
+							   RPC_TYPE_BOOLEAN, stream_ndata->cache_data != NULL,
 							   RPC_TYPE_INVALID);
 }
 
@@ -4190,6 +4840,7 @@ g_NPP_DestroyStream(NPP instance, NPStream *stream, NPReason reason)
 
   StreamInstance *stream_ndata = stream->ndata;
   if (stream_ndata) {
+	stream_cache_detach(stream_ndata);
 	id_remove(stream_ndata->stream_id);
 	free(stream_ndata);
   }
@@ -4301,7 +4952,14 @@ static int handle_NPP_Write(rpc_connection_t *connection)
 	return error;
   }
 
-  int32_t ret = g_NPP_Write(PLUGIN_INSTANCE_NPP(plugin), stream, offset, len, buf);
+  // Data the wrapper put in the stream cache doesn't go through the RPC
+  void *data = buf;
+  StreamInstance *stream_ndata = stream ? stream->ndata : NULL;
+  if (buf == NULL && len > 0 && offset >= 0 && stream_ndata && stream_ndata->cache_data
+	  && (uint32_t)offset + (uint32_t)len <= stream_ndata->cache_size)
+	data = stream_ndata->cache_data + offset;
+
+  int32_t ret = g_NPP_Write(PLUGIN_INSTANCE_NPP(plugin), stream, offset, len, data);
 
   if (buf)
 	free(buf);
@@ -4309,6 +4967,107 @@ static int handle_NPP_Write(rpc_connection_t *connection)
   return rpc_method_send_reply(connection, RPC_TYPE_INT32, ret, RPC_TYPE_INVALID);
 }
 
+// Stream cache
+static void stream_cache_detach(StreamInstance *stream_ndata)
+{
+  if (stream_ndata->cache_source) {
+	g_source_remove(stream_ndata->cache_source);
+	stream_ndata->cache_source = 0;
+  }
+  while (stream_ndata->cache_reads) {
+	NPByteRange *range = stream_ndata->cache_reads;
+	stream_ndata->cache_reads = range->next;
+	free(range);
+  }
+  if (stream_ndata->cache_data) {
+	shmdt(stream_ndata->cache_data);
+	stream_ndata->cache_data = NULL;
+  }
+}
+
+static gboolean stream_cache_deliver(gpointer user_data);
+
+static void stream_cache_schedule(StreamInstance *stream_ndata, bool retry)
+{
+  if (retry)
+	stream_ndata->cache_source = g_timeout_add(STREAM_CACHE_RETRY_DELAY, stream_cache_deliver, stream_ndata);
+  else
+	stream_ndata->cache_source = g_idle_add(stream_cache_deliver, stream_ndata);
+}
+
+// Feeds the plugin one chunk of cached data per main loop iteration,
+// the way the browser would with data from the network
+static gboolean stream_cache_deliver(gpointer user_data)
+{
+  StreamInstance *stream_ndata = user_data;
+  NPStream *stream = stream_ndata->stream;
+  NPP instance = stream_ndata->instance;
+  uint32_t stream_id = stream_ndata->stream_id;
+
+  stream_ndata->cache_source = 0;
+  NPByteRange *range = stream_ndata->cache_reads;
+  if (range == NULL)
+	return FALSE;
+
+  int32_t ready = g_NPP_WriteReady(instance, stream);
+  // The plugin may have destroyed the stream in the meantime
+  if (id_lookup(stream_id) != stream_ndata)
+	return FALSE;
+  if (ready <= 0) {
+	stream_cache_schedule(stream_ndata, true);
+	return FALSE;
+  }
+
+  int32_t len = MIN((uint32_t)ready, range->length);
+  int32_t ret = g_NPP_Write(instance, stream, range->offset, len,
+							stream_ndata->cache_data + range->offset);
+  if (id_lookup(stream_id) != stream_ndata)
+	return FALSE;
+  if (ret < 0) {
+	D(bug("plugin refused cached data for stream %p\n", stream));
+	while (stream_ndata->cache_reads) {
+	  range = stream_ndata->cache_reads;
+	  stream_ndata->cache_reads = range->next;
+	  free(range);
+	}
+	return FALSE;
+  }
+
+  ret = MIN(ret, len);
+  range->offset += ret;
+  range->length -= ret;
+  if (range->length == 0) {
+	stream_ndata->cache_reads = range->next;
+	free(range);
+  }
+  if (stream_ndata->cache_reads)
+	stream_cache_schedule(stream_ndata, ret == 0);
+  return FALSE;
+}
+
+// Queues RANGES, which are in the stream cache, for delivery to the plugin
+static void stream_cache_read(StreamInstance *stream_ndata, NPByteRange *ranges)
+{
+  if (ranges == NULL)
+	return;
+
+  if (stream_ndata == NULL || stream_ndata->cache_data == NULL) {
+	while (ranges) {
+	  NPByteRange *range = ranges;
+	  ranges = range->next;
+	  free(range);
+	}
+	return;
+  }
+
+  NPByteRange **tail = &stream_ndata->cache_reads;
+  while (*tail)
+	tail = &(*tail)->next;
+  *tail = ranges;
+  if (stream_ndata->cache_source == 0)
+	stream_cache_schedule(stream_ndata, false);
+}
+
 // NPP_StreamAsFile
 static void
 g_NPP_StreamAsFile(NPP instance, NPStream *stream, const char *fname)
@@ -4333,10 +5092,12 @@ static int handle_NPP_StreamAsFile(rpc_connection_t *connection)
 
   PluginInstance *plugin;
   NPStream *stream;
+  int fd;
   char *fname;
   int error = rpc_method_get_args(connection,
 								  RPC_TYPE_NPW_PLUGIN_INSTANCE, &plugin,
 								  RPC_TYPE_NP_STREAM, &stream,
+								  RPC_TYPE_FD, &fd,
 								  RPC_TYPE_STRING, &fname,
 								  RPC_TYPE_INVALID);
 
@@ -4345,7 +5106,28 @@ static int handle_NPP_StreamAsFile(rpc_connection_t *connection)
 	return error;
   }
 
-  g_NPP_StreamAsFile(PLUGIN_INSTANCE_NPP(plugin), stream, fname);
+  // Pass the browser's path through when it names the very file the
+  // browser opened for us, plugins may look at its extension. Else,
+  // e.g. in another filesystem namespace, hand out a name for the fd.
+  // Plugins open such files again long after the stream is destroyed,
+  // so the fd stays open for the lifetime of the instance
+  char fd_path[32];
+  const char *path = fname;
+  if (fd >= 0) {
+	struct stat fd_st, path_st;
+	if (fname && fstat(fd, &fd_st) == 0 && stat(fname, &path_st) == 0
+		&& fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino)
+	  close(fd);
+	else if (plugin) {
+	  plugin->stream_files = g_slist_prepend(plugin->stream_files, GINT_TO_POINTER(fd));
+	  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+	  path = fd_path;
+	}
+	else
+	  close(fd);
+  }
+
+  g_NPP_StreamAsFile(PLUGIN_INSTANCE_NPP(plugin), stream, path);
 
   if (fname)
 	free(fname);
@@ -4498,6 +5280,57 @@ g_NPP_HandleEvent(NPP instance, NPEvent *event)
   return ret;
 }
 
+// Paint the exposed area into the back buffer of the shared memory surface
+static int16_t
+g_NPP_HandleEvent_surface(NPP instance, NPEvent *event, int32_t *p_buffer, NPRect *damage)
+{
+  PluginInstance *plugin = PLUGIN_INSTANCE(instance);
+  ShmSurface *surface = plugin->surface;
+  XGraphicsExposeEvent *xexpose = &event->xgraphicsexpose;
+
+  *p_buffer = -1;
+
+  // clip the exposed area to the surface
+  int x1 = MAX(xexpose->x - surface->x_offset, 0);
+  int y1 = MAX(xexpose->y - surface->y_offset, 0);
+  int x2 = MIN(xexpose->x - surface->x_offset + xexpose->width, (int)surface->desc.width);
+  int y2 = MIN(xexpose->y - surface->y_offset + xexpose->height, (int)surface->desc.height);
+  if (x1 >= x2 || y1 >= y2)
+	return false;
+
+  int buffer = surface->back_buffer;
+  xexpose->drawable = surface->pixmap[buffer];
+  xexpose->x = x1;
+  xexpose->y = y1;
+  xexpose->width = x2 - x1;
+  xexpose->height = y2 - y1;
+
+  D(bugiI("NPP_HandleEvent instance=%p, event=%p [GraphicsExpose, buffer %d]\n", instance, event, buffer));
+  int16_t ret = plugin_funcs.event(instance, event);
+  D(bugiD("NPP_HandleEvent return: %d\n", ret));
+
+  // without shared pixmaps, read back the damaged rows into the image
+  if (!surface->use_shm_pixmaps) {
+	XImage *image = surface->image[buffer];
+	char *data = image->data;
+	int height = image->height;
+	image->data += y1 * image->bytes_per_line;
+	image->height = y2 - y1;
+	XShmGetImage(x_display, surface->pixmap[buffer], image, 0, y1, AllPlanes);
+	image->data = data;
+	image->height = height;
+  }
+  XSync(x_display, False);
+
+  surface->back_buffer ^= 1;
+  *p_buffer = buffer;
+  damage->left = x1;
+  damage->top = y1;
+  damage->right = x2;
+  damage->bottom = y2;
+  return ret;
+}
+
 static int handle_NPP_HandleEvent(rpc_connection_t *connection)
 {
   D(bug("handle_NPP_HandleEvent\n"));
@@ -4515,9 +5348,19 @@ static int handle_NPP_HandleEvent(rpc_connection_t *connection)
   }
 
   event.xany.display = x_display;
-  int16_t ret = g_NPP_HandleEvent(PLUGIN_INSTANCE_NPP(plugin), &event);
+  int16_t ret;
+  int32_t buffer = -1;
+  NPRect damage = { 0, 0, 0, 0 };
+  if (event.type == GraphicsExpose && plugin && plugin->surface && plugin_funcs.event)
+	ret = g_NPP_HandleEvent_surface(PLUGIN_INSTANCE_NPP(plugin), &event, &buffer, &damage);
+  else
+	ret = g_NPP_HandleEvent(PLUGIN_INSTANCE_NPP(plugin), &event);
 
-  return rpc_method_send_reply(connection, RPC_TYPE_INT32, ret, RPC_TYPE_INVALID);
+  return rpc_method_send_reply(connection,
+							   RPC_TYPE_INT32, ret,
+							   RPC_TYPE_INT32, buffer,
+							   RPC_TYPE_NP_RECT, &damage,
+							   RPC_TYPE_INVALID);
 }
 
 // Clears site-data stored by the plug-in
@@ -4616,7 +5459,10 @@ static GSource *xt_source = NULL;
 static int xt_source_count = 0;
 static GPollFD xt_event_poll_fd;
 static const int XT_DEFAULT_TIMEOUT = 25;
-static const int XT_MAX_DISPATCH_EVENTS = 10;
+static const int XT_MAX_FALLBACK_TIMEOUT = 100;
+static const int XT_DISPATCH_BUDGET = 4000; /* usec */
+static NPW_Histogram xt_dispatch_histogram = { "Xt dispatch time", "us" };
+static int xt_fallback_timeout = 25;
 
 static void xt_dummy_timeout_cb(XtPointer closure, XtIntervalId *id)
 {
@@ -4664,12 +5510,12 @@ static void xt_dummy_input_cb(XtPointer closure, int *source, XtInputId *id)
   npw_printf("ERROR: xt_dummy_input_cb() should never be called\n");
 }
 
-static inline int get_appcontext_input_count_at(int offset)
+static inline int get_appcontext_short_at(int offset)
 {
   return *((short *)((char *)x_app_context + offset));
 }
 
-static inline int add_appcontext_input(int fd, int n)
+static inline XtInputId add_appcontext_input(int fd, int n)
 {
   return XtAppAddInput(x_app_context,
 					   fd,
@@ -4678,7 +5524,15 @@ static inline int add_appcontext_input(int fd, int n)
 					   GUINT_TO_POINTER(0xdead0000));
 }
 
-static int get_appcontext_input_count_offset(void)
+// Offsets of the input_count and input_max fields in the appcontext
+static int xt_input_count_offset = -1;
+static int xt_input_max_offset = -1;
+
+/* Try to determine where the number of input sources is, and where
+   the size of input_list[] is. The latter is the largest input
+   source fd + 1, which is only reliable if no input source with a
+   higher fd was registered yet, i.e. this is best called early. */
+static void xt_probe_appcontext_inputs(void)
 {
 #define low_offset		offsetof(struct _XtAppStruct, __maxed__nfds)
 #define high_offset		offsetof(struct _XtAppStruct, __maybe__input_max)
@@ -4687,38 +5541,44 @@ static int get_appcontext_input_count_offset(void)
   int offsets[n_offsets_max] = { 0, };
 
 #define n_inputs_max	4 /* number of refinements/input sources */
-  int fd, id, n_inputs = 0;
-  struct { int fd, id; } inputs[n_inputs_max] = { { 0 } };
+  int fd, n_inputs = 0, max_fd = -1;
+  XtInputId id;
+  struct { int fd; XtInputId id; } inputs[n_inputs_max] = { { 0 } };
+
+  xt_input_count_offset = 0;
+  xt_input_max_offset = 0;
 
   if ((fd = open("/dev/null", O_WRONLY)) < 0)
-	return 0;
-  if ((id = add_appcontext_input(fd, 0)) < 0) {
+	return;
+  if ((id = add_appcontext_input(fd, 0)) == 0) {
 	close(fd);
-	return 0;
+	return;
   }
   inputs[n_inputs].fd = fd;
   inputs[n_inputs].id = id;
   n_inputs++;
+  max_fd = MAX(max_fd, fd);
 
   for (ofs = low_offset; ofs < high_offset; ofs += 2) {
-	if (get_appcontext_input_count_at(ofs) == 1)
+	if (get_appcontext_short_at(ofs) == 1)
 	  offsets[n_offsets++] = ofs;
   }
 
   while (n_inputs < n_inputs_max) {
 	if ((fd = open("/dev/null", O_WRONLY)) < 0)
 	  break;
-	if ((id = add_appcontext_input(fd, n_inputs)) < 0) {
+	if ((id = add_appcontext_input(fd, n_inputs)) == 0) {
 	  close(fd);
 	  break;
 	}
 	inputs[n_inputs].fd = fd;
 	inputs[n_inputs].id = id;
 	n_inputs++;
+	max_fd = MAX(max_fd, fd);
 
 	int n = 0;
 	for (i = 0; i < n_offsets; i++) {
-	  if (get_appcontext_input_count_at(offsets[i]) == n_inputs)
+	  if (get_appcontext_short_at(offsets[i]) == n_inputs)
 		offsets[n++] = offsets[i];
 	}
 	for (i = n; i < n_offsets; i++)
@@ -4726,48 +5586,137 @@ static int get_appcontext_input_count_offset(void)
 	n_offsets = n;
   }
 
+  if (n_offsets == 1) {
+	xt_input_count_offset = offsets[0];
+	// input_max immediately follows input_count in libXt
+	if (get_appcontext_short_at(offsets[0] + 2) == max_fd + 1)
+	  xt_input_max_offset = offsets[0] + 2;
+  }
+
   for (i = 0; i < n_inputs; i++) {
 	XtRemoveInput(inputs[i].id);
 	close(inputs[i].fd);
   }
 
-  if (n_offsets == 1)
-	return offsets[0];
-
-#undef n_fds_max
+#undef n_inputs_max
 #undef n_offsets_max
 #undef high_offset
 #undef low_offset
-  return 0;
 }
 
 static int get_appcontext_input_count(void)
 {
-  static int input_count_offset = -1;
-  if (input_count_offset < 0)
-	input_count_offset = get_appcontext_input_count_offset();
-  if (input_count_offset == 0)
+  if (xt_input_count_offset < 0)
+	xt_probe_appcontext_inputs();
+  if (xt_input_count_offset == 0)
 	return 1; /* fake we have input to trigger timeout */
-  return get_appcontext_input_count_at(input_count_offset);
+  return get_appcontext_short_at(xt_input_count_offset);
 }
 
-static int xt_has_compatible_appcontext(void)
+// Check whether Xt input sources can be exported as GPollFDs
+static inline bool xt_can_poll_inputs(void)
 {
-  return xt_has_compatible_appcontext_timerQueue();
+  if (xt_input_max_offset < 0)
+	xt_probe_appcontext_inputs();
+  return xt_input_max_offset > 0;
 }
 
-static int xt_get_next_timeout(GSource *source)
+static int xt_has_compatible_appcontext(void)
 {
   static int has_compatible_appcontext = -1;
   if (has_compatible_appcontext < 0) {
-	if ((has_compatible_appcontext = xt_has_compatible_appcontext()) == 0)
+	if ((has_compatible_appcontext = xt_has_compatible_appcontext_timerQueue()) == 0)
 	  npw_printf("WARNING: xt_get_next_timeout() is not optimizable\n");
   }
+  return has_compatible_appcontext;
+}
+
+// Probe the appcontext layout before the plugin adds timers and inputs
+static void xt_appcontext_init(void)
+{
+  xt_has_compatible_appcontext();
+  xt_probe_appcontext_inputs();
+}
+
+// GPollFDs mirroring the Xt input sources
+static GPollFD *xt_input_poll_fds = NULL;
+static int xt_input_n_poll_fds = 0;
+static int xt_input_max_poll_fds = 0;
+
+static inline gushort xt_input_events(XtInputMask condition)
+{
+  gushort events = 0;
+  if (condition & XtInputReadMask)
+	events |= G_IO_IN | G_IO_HUP | G_IO_ERR;
+  if (condition & XtInputWriteMask)
+	events |= G_IO_OUT | G_IO_ERR;
+  if (condition & XtInputExceptMask)
+	events |= G_IO_PRI;
+  return events;
+}
+
+// Synchronize the source GPollFDs with the Xt input sources. Return
+// false if some of them could not be exported
+static bool xt_update_input_polls(GSource *source)
+{
+  int input_max = get_appcontext_short_at(xt_input_max_offset);
+  InputEvent **input_list = x_app_context->input_list;
+  GPollFD poll_fds[64];
+  int i, n_poll_fds = 0;
+  bool is_complete = true;
+
+  for (int fd = 0; input_list && fd < input_max; fd++) {
+	gushort events = 0;
+	for (InputEvent *ie = input_list[fd]; ie; ie = ie->ie_next)
+	  events |= xt_input_events(ie->ie_condition);
+	if (events == 0)
+	  continue;
+	if (n_poll_fds == G_N_ELEMENTS(poll_fds)) {
+	  is_complete = false;
+	  break;
+	}
+	poll_fds[n_poll_fds].fd = fd;
+	poll_fds[n_poll_fds].events = events;
+	poll_fds[n_poll_fds].revents = 0;
+	n_poll_fds++;
+  }
+
+  if (n_poll_fds == xt_input_n_poll_fds) {
+	for (i = 0; i < n_poll_fds; i++) {
+	  if (poll_fds[i].fd != xt_input_poll_fds[i].fd ||
+		  poll_fds[i].events != xt_input_poll_fds[i].events)
+		break;
+	}
+	if (i == n_poll_fds)
+	  return is_complete;
+  }
+
+  // GLib keeps pointers to our GPollFDs, remove them before reallocating
+  for (i = 0; i < xt_input_n_poll_fds; i++)
+	g_source_remove_poll(source, &xt_input_poll_fds[i]);
+  if (n_poll_fds > xt_input_max_poll_fds) {
+	xt_input_poll_fds = g_renew(GPollFD, xt_input_poll_fds, n_poll_fds);
+	xt_input_max_poll_fds = n_poll_fds;
+  }
+  xt_input_n_poll_fds = n_poll_fds;
+  for (i = 0; i < n_poll_fds; i++) {
+	xt_input_poll_fds[i] = poll_fds[i];
+	g_source_add_poll(source, &xt_input_poll_fds[i]);
+  }
+  D(bug("polling %d Xt input source(s)\n", n_poll_fds));
+  return is_complete;
+}
+
+static int xt_get_next_timeout(GSource *source)
+{
   int timeout = XT_DEFAULT_TIMEOUT;
-  if (has_compatible_appcontext) {
+  if (xt_has_compatible_appcontext()) {
 	int input_timeout, timer_timeout;
-	/* Check there is any input source to process */
-	if (get_appcontext_input_count() > 0)
+	/* Check there is any input source to process. They are normally
+	   polled along with the X connection so we don't need to wake up */
+	if (xt_can_poll_inputs() && xt_update_input_polls(source))
+	  input_timeout = -1;
+	else if (get_appcontext_input_count() > 0)
 	  input_timeout = XT_DEFAULT_TIMEOUT;
 	else
 	  input_timeout = -1;
@@ -4782,10 +5731,10 @@ static int xt_get_next_timeout(GSource *source)
 	  g_source_get_current_time(source, &now);
 	  if ((diff = (int64_t)next->tv_sec - (int64_t)now.tv_sec) < 0)
 		timer_timeout = 0;
-	  else if ((diff = diff*1000 + ((int64_t)next->tv_usec - (int64_t)now.tv_usec)/1000) <= 0)
+	  else if ((diff = diff*1000000 + ((int64_t)next->tv_usec - (int64_t)now.tv_usec)) <= 0)
 		timer_timeout = 0;
-	  else
-		timer_timeout = diff;
+	  else /* round up so that we don't wake up just before the deadline */
+		timer_timeout = (diff + 999) / 1000;
 	}
 	if (input_timeout < 0)
 	  timeout = timer_timeout;
@@ -4794,6 +5743,12 @@ static int xt_get_next_timeout(GSource *source)
 	else
 	  timeout = MIN(input_timeout, timer_timeout);
   }
+  else {
+	/* We can't tell when the next timer expires, so we have to poll.
+	   Back off while nothing happens, xt_event_dispatch() resets it */
+	timeout = xt_fallback_timeout;
+	xt_fallback_timeout = MIN(xt_fallback_timeout * 2, XT_MAX_FALLBACK_TIMEOUT);
+  }
   return timeout;
 }
 
@@ -4802,13 +5757,17 @@ static gboolean xt_event_prepare(GSource *source, gint *timeout)
   int mask = XtAppPending(x_app_context);
   if (mask)
 	return TRUE;
-  /* XXX: create new GPollFD for input sources? */
   return (*timeout = xt_get_next_timeout(source)) == 0;
 }
 
 static gboolean xt_event_check(GSource *source)
 {
-  if (xt_event_poll_fd.revents & G_IO_IN) {
+  bool has_events = xt_event_poll_fd.revents & G_IO_IN;
+  for (int i = 0; !has_events && i < xt_input_n_poll_fds; i++) {
+	if (xt_input_poll_fds[i].revents & xt_input_poll_fds[i].events)
+	  has_events = true;
+  }
+  if (has_events) {
 	int mask = XtAppPending(x_app_context);
 	if (mask)
 	  return TRUE;
@@ -4816,14 +5775,24 @@ static gboolean xt_event_check(GSource *source)
   return FALSE;
 }
 
+/* The browser is held in rpc_sync() while we dispatch, so stop once
+   the time budget is exhausted. Remaining events are still pending
+   and get processed in the next main loop iteration. */
 static gboolean xt_event_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
 {
   int i;
-  for (i = 0; i < XT_MAX_DISPATCH_EVENTS; i++) {
+  uint64_t start_time = npw_get_time_us();
+  uint64_t elapsed_time = 0;
+  for (i = 0; elapsed_time < XT_DISPATCH_BUDGET; i++) {
 	int mask = XtAppPending(x_app_context);
 	if (mask == 0)
 	  break;
 	XtAppProcessEvent(x_app_context, XtIMAll);
+	elapsed_time = npw_get_time_us() - start_time;
+  }
+  if (i > 0) {
+	xt_fallback_timeout = XT_DEFAULT_TIMEOUT;
+	npw_histogram_add(&xt_dispatch_histogram, elapsed_time);
   }
   return TRUE;
 }
@@ -4861,6 +5830,7 @@ static void xt_source_destroy(void)
   if (--xt_source_count < 1 && xt_source) {
 	g_source_destroy(xt_source);
 	xt_source = NULL;
+	xt_input_n_poll_fds = 0;
   }
 }
 
@@ -4879,6 +5849,90 @@ static void rpc_error_callback_cb(rpc_connection_t *connection, void *user_data)
 
 static int do_test(void);
 
+// Logs how much memory this process uses and how much of it is shared
+static void shared_viewer_report(const char *what)
+{
+  FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+  if (fp == NULL)
+	return;
+
+  char line[256];
+  unsigned long rss = 0, pss = 0, private_kb = 0, value;
+  while (fgets(line, sizeof(line), fp)) {
+	if (sscanf(line, "Rss: %lu kB", &value) == 1)
+	  rss = value;
+	else if (sscanf(line, "Pss: %lu kB", &value) == 1)
+	  pss = value;
+	else if (sscanf(line, "Private_Clean: %lu kB", &value) == 1
+			 || sscanf(line, "Private_Dirty: %lu kB", &value) == 1)
+	  private_kb += value;
+  }
+  fclose(fp);
+
+  npw_dprintf("shared viewer %s %d: rss %lu KB, pss %lu KB, private %lu KB\n",
+			  what, getpid(), rss, pss, private_kb);
+}
+
+/*
+ *  A shared viewer loads the plugin once and forks a session process
+ *  for each wrapper that connects. Only what dlopen() did is shared
+ *  copy-on-write: the plugin and the libraries, relocated and with
+ *  their constructors run. NP_Initialize() needs the browser functions
+ *  of the wrapper and, for most plugins, an X connection, so each
+ *  session calls it and pays for the plugin globals set up there. Each
+ *  session also gets its own X connection, instance ids and NPObjects,
+ *  and one that crashes only takes its own browser process down.
+ *
+ *  Returns true in session processes, false in the daemon once it has
+ *  had no session for SHARED_VIEWER_IDLE_TIMEOUT seconds.
+ */
+static bool shared_viewer_run(rpc_connection_t *connection)
+{
+  int n_sessions = 0;
+  int idle_time = 0;
+
+  shared_viewer_report("daemon");
+  for (;;) {
+	pid_t pid;
+	while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+	  --n_sessions;
+	  D(bug("shared viewer session %d ended, %d left\n", pid, n_sessions));
+	}
+
+	int ret = rpc_wait_accept(connection, 1000000);
+	if (ret <= 0) {
+	  if (n_sessions > 0)
+		idle_time = 0;
+	  else if (++idle_time >= SHARED_VIEWER_IDLE_TIMEOUT)
+		break;
+	  continue;
+	}
+
+	if (rpc_listen_socket(connection) < 0)
+	  continue;
+	if (!rpc_peer_is_same_user(connection)) {
+	  npw_printf("WARNING: rejected shared viewer client from another user\n");
+	  rpc_close_socket(connection);
+	  continue;
+	}
+
+	if ((pid = fork()) == 0) {
+	  rpc_close_listen_socket(connection);
+	  g_shared_session = true;
+	  return true;
+	}
+	rpc_close_socket(connection);
+	if (pid < 0) {
+	  npw_printf("ERROR: failed to fork shared viewer session\n");
+	  continue;
+	}
+	++n_sessions;
+	idle_time = 0;
+	D(bug("shared viewer session %d started, %d active\n", pid, n_sessions));
+  }
+  return false;
+}
+
 static int do_main(int argc, char **argv, const char *connection_path)
 {
   if (do_test() != 0)
@@ -4901,15 +5955,30 @@ static int do_main(int argc, char **argv, const char *connection_path)
 	unsetenv("LD_PRELOAD");
 #endif
 
+  // Sessions fork off before anything that can't be shared, like the
+  // X connection, is set up
+  if (g_shared_viewer) {
+	if ((g_rpc_connection = rpc_init_server(connection_path)) == NULL) {
+	  D(bug("  could not become the shared viewer, another one runs?\n"));
+	  return 1;
+	}
+	if (!shared_viewer_run(g_rpc_connection)) {
+	  rpc_connection_unref(g_rpc_connection);
+	  return 0;
+	}
+	D(bug("  Plugin viewer session pid: %d\n", getpid()));
+  }
+
   // Xt and GTK initialization
   XtToolkitInitialize();
   x_app_context = XtCreateApplicationContext();
   x_display = XtOpenDisplay(x_app_context, NULL, "npw-viewer", "npw-viewer", NULL, 0, &argc, argv);
+  xt_appcontext_init();
   g_thread_init(NULL);
   gtk_init(&argc, &argv);
 
   // Initialize RPC communication channel
-  if ((g_rpc_connection = rpc_init_server(connection_path)) == NULL) {
+  if (g_rpc_connection == NULL && (g_rpc_connection = rpc_init_server(connection_path)) == NULL) {
 	npw_printf("ERROR: failed to initialize plugin-side RPC server connection\n");
 	return 1;
   }
@@ -4925,6 +5994,7 @@ static int do_main(int argc, char **argv, const char *connection_path)
 	{ RPC_METHOD_NPP_NEW,						handle_NPP_New },
 	{ RPC_METHOD_NPP_DESTROY,					handle_NPP_Destroy },
 	{ RPC_METHOD_NPP_GET_VALUE,					handle_NPP_GetValue },
+	{ RPC_METHOD_NPP_SET_VALUE,					handle_NPP_SetValue },
 	{ RPC_METHOD_NPP_SET_WINDOW,				handle_NPP_SetWindow },
 	{ RPC_METHOD_NPP_URL_NOTIFY,				handle_NPP_URLNotify },
 	{ RPC_METHOD_NPP_NEW_STREAM,				handle_NPP_NewStream },
@@ -4936,6 +6006,7 @@ static int do_main(int argc, char **argv, const char *connection_path)
 	{ RPC_METHOD_NPP_HANDLE_EVENT,				handle_NPP_HandleEvent },
 	{ RPC_METHOD_NPP_CLEAR_SITE_DATA,			handle_NPP_ClearSiteData },
 	{ RPC_METHOD_NPP_GET_SITES_WITH_DATA,		handle_NPP_GetSitesWithData },
+	{ RPC_METHOD_NPW_HIBERNATE,					handle_NPW_Hibernate },
   };
   if (rpc_connection_add_method_descriptors(g_rpc_connection, vtable, sizeof(vtable) / sizeof(vtable[0])) < 0) {
 	npw_printf("ERROR: failed to setup NPP method callbacks\n");
@@ -4948,8 +6019,15 @@ static int do_main(int argc, char **argv, const char *connection_path)
 
   id_init();
 
-  // Initialize RPC events listener
-  int ret = rpc_listen_socket(g_rpc_connection);
+  if (!npw_async_calls_init(G_PRIORITY_DEFAULT_IDLE)) {
+	npw_printf("ERROR: failed to setup NPN_PluginThreadAsyncCall queue\n");
+	return 1;
+  }
+
+  // Initialize RPC events listener, shared viewer sessions are connected already
+  int ret = rpc_socket(g_rpc_connection);
+  if (ret < 0)
+	ret = rpc_listen_socket(g_rpc_connection);
   if (ret < 0) {
 	npw_perror("ERROR: Failed to listen on socket.", ret);
 	return 1;
@@ -4974,6 +6052,8 @@ static int do_main(int argc, char **argv, const char *connection_path)
   rpc_fd.events = G_IO_IN;
   g_main_context_add_poll(context, &rpc_fd, G_PRIORITY_HIGH);
 
+  uint64_t start_time = npw_get_time_us();
+  uint64_t n_syncs = 0;
   while (g_is_running) {
 	/* PREPARE */
 	int max_priority;
@@ -5001,6 +6081,7 @@ static int do_main(int argc, char **argv, const char *connection_path)
 	  rpc_sync(g_rpc_connection);
 	  g_main_context_dispatch(context);
 	  rpc_end_sync(g_rpc_connection);
+	  n_syncs++;
 	} else if (rpc_fd.revents & rpc_fd.events) {
 	  // We don't have anything, but there is an incoming RPC
 	  // request. Just respond to it. No need to sync.
@@ -5010,6 +6091,20 @@ static int do_main(int argc, char **argv, const char *connection_path)
   g_main_context_remove_poll(context, &rpc_fd);
   g_free(fds);
   D(bug("--- EXIT ---\n"));
+  uint64_t n_timer_wakeups, n_timer_calls;
+  npw_timeout_get_stats(&n_timer_wakeups, &n_timer_calls);
+  double elapsed = MAX(npw_get_time_us() - start_time, 1) / 1e6;
+  uint64_t n_async_batches, n_async_calls;
+  npw_async_calls_get_stats(&n_async_batches, &n_async_calls);
+  npw_dprintf("%" G_GUINT64_FORMAT " syncs with the browser (%.1f/s), "
+			  "%" G_GUINT64_FORMAT " timer wakeups for %" G_GUINT64_FORMAT " calls, "
+			  "%" G_GUINT64_FORMAT " async call batches for %" G_GUINT64_FORMAT " calls\n",
+			  n_syncs, n_syncs / elapsed, n_timer_wakeups, n_timer_calls,
+			  n_async_batches, n_async_calls);
+  npw_async_calls_exit();
+  npw_histogram_dump(&xt_dispatch_histogram);
+  if (g_shared_session)
+	shared_viewer_report("session");
 
 #if USE_NPIDENTIFIER_CACHE
   npidentifier_cache_destroy();
@@ -5079,6 +6174,7 @@ static int do_help(const char *prog)
   printf("   -i --info               print plugin information\n");
   printf("   -p --plugin             set plugin path\n");
   printf("   -c --connection         set connection path\n");
+  printf("   -s --shared             serve all connections to the path\n");
   return 0;
 }
 
@@ -5117,6 +6213,10 @@ int main(int argc, char **argv)
 		argv[i] = NULL;
 	  }
 	}
+	else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--shared") == 0) {
+	  argv[i] = NULL;
+	  g_shared_viewer = true;
+	}
 	else if (strcmp(arg, "-c") == 0 || strcmp(arg, "--connection") == 0) {
 	  argv[i] = NULL;
 	  if (++i < argc) {
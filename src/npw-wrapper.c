@@ -28,10 +28,16 @@
 #include <limits.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <semaphore.h>
 #include <sys/wait.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#if defined(__linux__)
+#include <sys/prctl.h>
+#endif
 
 #include <glib.h>
 
@@ -41,6 +47,7 @@
 #include <X11/Intrinsic.h>
 #include <X11/Shell.h>
 #include <X11/StringDefs.h>
+#include <X11/extensions/XShm.h>
 
 #include "utils.h"
 #include "npw-common.h"
@@ -55,15 +62,19 @@
 #define ALLOW_DIRECT_EXECUTION 1
 
 
-// Globally exported plugin ident, used by the "npconfig" tool
-const NPW_PluginInfo NPW_Plugin = {
+// Globally exported plugin ident, used by the "npconfig" tool. This
+// is not const: npconfig patches it in the file, and the compiler would
+// otherwise fold the checks against the defaults below at build time
+NPW_PluginInfo NPW_Plugin = {
   NPW_PLUGIN_IDENT,
   NPW_DEFAULT_PLUGIN_PATH,
   0,
   HOST_OS,
   HOST_ARCH,
   NPW_PLUGIN_INFO_VERSION,
-  ""
+  "",
+  0,
+  0
 };
 
 // Path to plugin to use
@@ -90,11 +101,40 @@ typedef struct {
 
 static Plugin g_plugin = { 0, -1, 0, NULL, NULL, NULL };
 
+// Shared memory surface a windowless plugin is painted into
+typedef struct _Surface {
+  NPW_Surface desc;
+  Display *display;
+  XShmSegmentInfo shminfo[2];
+  XImage *image[2];
+  unsigned long put_serial[2];
+  int last_buffer;
+  int x, y;
+  GC gc;
+} Surface;
+
 // Instance state information about the plugin
 typedef struct _PluginInstance {
   NPW_DECL_PLUGIN_INSTANCE;
   rpc_connection_t *connection;
   NPP native_instance;
+  bool is_transparent;
+  Surface *surface;
+  // What plugin_replay() needs to create the instance again
+  char *mime_type;
+  uint16_t mode;
+  int16_t argc;
+  char **argn;
+  char **argv;
+  NPWindow window;						// last NPP_SetWindow()
+  NPSetWindowCallbackStruct ws_info;	// window.ws_info, the browser's may go away
+  bool has_window;
+  char *src_url;						// first stream the browser sent
+  GList *streams;						// live browser streams
+  bool is_hidden;						// empty clip rect or no window
+  bool hibernated;						// see RPC_METHOD_NPW_HIBERNATE
+  bool hibernate_pending;
+  uint32_t hibernate_timer;				// browser timer to hibernate
 } PluginInstance;
 
 #define PLUGIN_INSTANCE(instance) \
@@ -106,8 +146,17 @@ typedef struct _PluginInstance {
 // Plugin side data for an NPStream instance
 typedef struct _StreamInstance {
   NPW_DECL_STREAM_INSTANCE;
+  bool as_file_only;					// the plugin only wants NPP_StreamAsFile()
+  uint8_t *cache_data;					// seekable stream data shared with the viewer
+  uint32_t cache_size;
+  int cache_shm_id;
+  GArray *cache_ranges;					// what cache_data holds already
+  int generation;						// viewer the stream was opened in
 } StreamInstance;
 
+// Largest seekable stream we keep a copy of for NPN_RequestRead()
+#define STREAM_CACHE_MAX (256 * 1024 * 1024)
+
 // Prototypes
 static void plugin_init(int is_NP_Initialize);
 static void plugin_exit(void);
@@ -115,15 +164,39 @@ static void plugin_exit(void);
 static void plugin_kill_cb(rpc_connection_t *connection, void *user_data);
 static NPError plugin_start(void);
 static NPError plugin_start_if_needed(void);
+static void plugin_schedule_recovery(void);
+static void plugin_recover_instances(uint64_t start_time);
 static int plugin_killed = 0;
 
+// Bumped on each viewer restart, streams from older viewers are dead
+static int g_viewer_generation = 0;
+
+// Live instances, in creation order
+static GList *g_plugin_instances = NULL;
+
+// Browser timer for a restart that came too early, see
+// plugin_start_if_needed()
+static NPP g_recovery_instance = NULL;
+static uint32_t g_recovery_timer = 0;
+
 /*
  *  Notes concerning NSPluginWrapper recovery model.
  *
  *  NSPluginWrapper will restart the Viewer if it detected to be
- *  dead. It will not attempt to "replay" the plugin. This means that
- *  if a plugin crashed, its window will remain grayed: only new
- *  instances will start a new viewer.
+ *  dead, as soon as the browser runs plugin_schedule_recovery() or
+ *  creates a new instance. Restarts are at least MIN_RESTART_INTERVAL
+ *  apart, a Viewer dying sooner is restarted from a browser timer
+ *  once the interval has passed. The Viewer is the warm standby one if
+ *  NPW_VIEWER_STANDBY=yes, i.e. a spare Viewer that has loaded the
+ *  plugin already and waits for a connection.
+ *
+ *  Live instances are then "replayed" (see plugin_replay()): each one
+ *  records its NPP_New() arguments, its last NPP_SetWindow() and the
+ *  URLs of the streams the browser sent it. The instance is created
+ *  again in the new Viewer from this state, and the streams are
+ *  requested again with NPN_GetURL(). Posted data, notification data
+ *  and plugin-side state are lost. The old streams fail on their next
+ *  NPP_Write() so that the browser drops them.
  *
  *  Each PlugInstance holds a reference to the RPC connection it was
  *  created with. g_rpc_connection can be seen as the "master"
@@ -197,6 +270,146 @@ static void pointer_ungrab(NPP instance, Time time)
   }
 }
 
+/*
+ *  Windowless plugins can be painted into a double-buffered MIT-SHM
+ *  surface owned by the viewer, instead of drawing straight into the
+ *  browser's drawable. We composite the damaged area ourselves, which
+ *  avoids flushing the browser's X connection before every expose.
+ *
+ *  This is disabled by default and enabled with NPW_WINDOWLESS_SHM=yes.
+ */
+
+// Check whether windowless plugins can use shared memory surfaces
+static bool surface_is_enabled(Display *display)
+{
+  static int is_enabled = -1;
+  if (is_enabled < 0) {
+	const char *str = getenv("NPW_WINDOWLESS_SHM");
+	is_enabled = str && (strcmp(str, "yes") == 0 || strcmp(str, "1") == 0);
+  }
+  if (!is_enabled)
+	return false;
+  return display && XShmQueryExtension(display);
+}
+
+static void surface_destroy(PluginInstance *plugin)
+{
+  Surface *surface = plugin->surface;
+  if (surface == NULL)
+	return;
+
+  for (int i = 0; i < 2; i++) {
+	if (surface->image[i]) {
+	  XShmDetach(surface->display, &surface->shminfo[i]);
+	  surface->image[i]->data = NULL;
+	  XDestroyImage(surface->image[i]);
+	}
+	if (surface->shminfo[i].shmaddr && surface->shminfo[i].shmaddr != (char *)-1)
+	  shmdt(surface->shminfo[i].shmaddr);
+  }
+  if (surface->gc)
+	XFreeGC(surface->display, surface->gc);
+  // make sure the X server is done with the segments
+  XSync(surface->display, False);
+  NPW_MemFree(surface);
+  plugin->surface = NULL;
+}
+
+// Attach to the surface the viewer created for the plugin
+static int surface_update(PluginInstance *plugin, NPWindow *window, const NPW_Surface *desc)
+{
+  Surface *surface = plugin->surface;
+  if (surface &&
+	  surface->desc.shm_id[0] == desc->shm_id[0] &&
+	  surface->desc.shm_id[1] == desc->shm_id[1]) {
+	surface->x = window->x;
+	surface->y = window->y;
+	return 0;
+  }
+
+  surface_destroy(plugin);
+  if (desc->shm_id[0] < 0 || desc->shm_id[1] < 0)
+	return 0;
+
+  NPSetWindowCallbackStruct *ws_info = window->ws_info;
+  if (ws_info == NULL || ws_info->display == NULL || ws_info->depth != desc->depth)
+	return -1;
+
+  if ((surface = NPW_MemNew0(Surface, 1)) == NULL)
+	return -1;
+  plugin->surface = surface;
+  surface->desc = *desc;
+  surface->display = ws_info->display;
+  surface->last_buffer = 1;
+  surface->x = window->x;
+  surface->y = window->y;
+
+  for (int i = 0; i < 2; i++) {
+	XShmSegmentInfo *shminfo = &surface->shminfo[i];
+	XImage *image = XShmCreateImage(surface->display, ws_info->visual, desc->depth,
+									ZPixmap, NULL, shminfo, desc->width, desc->height);
+	if (image == NULL)
+	  goto error;
+	if (image->bytes_per_line != desc->bytes_per_line) {
+	  XDestroyImage(image);
+	  goto error;
+	}
+	shminfo->shmid = desc->shm_id[i];
+	shminfo->shmaddr = shmat(shminfo->shmid, NULL, SHM_RDONLY);
+	if (shminfo->shmaddr == (char *)-1) {
+	  XDestroyImage(image);
+	  goto error;
+	}
+	// the segment is destroyed once both processes are gone
+	shmctl(shminfo->shmid, IPC_RMID, NULL);
+	image->data = shminfo->shmaddr;
+	shminfo->readOnly = True;
+	if (!XShmAttach(surface->display, shminfo)) {
+	  image->data = NULL;
+	  XDestroyImage(image);
+	  goto error;
+	}
+	surface->image[i] = image;
+  }
+  D(bug("attached %dx%d shared memory surface\n", desc->width, desc->height));
+  return 0;
+
+ error:
+  npw_printf("WARNING: could not attach shared memory surface\n");
+  surface_destroy(plugin);
+  return -1;
+}
+
+// Make sure the X server no longer reads the buffer the viewer paints into next
+static void surface_prepare(PluginInstance *plugin)
+{
+  Surface *surface = plugin->surface;
+  int buffer = surface->last_buffer ^ 1;
+  if (surface->put_serial[buffer] > LastKnownRequestProcessed(surface->display))
+	XSync(surface->display, False);
+}
+
+// Composite the damaged area of the surface into the browser drawable
+static void surface_commit(PluginInstance *plugin, Drawable drawable, int buffer, const NPRect *damage)
+{
+  Surface *surface = plugin->surface;
+  if (buffer < 0 || buffer > 1)
+	return;
+  surface->last_buffer = buffer;
+
+  if (damage->right <= damage->left || damage->bottom <= damage->top)
+	return;
+
+  if (surface->gc == NULL)
+	surface->gc = XCreateGC(surface->display, drawable, 0, NULL);
+  surface->put_serial[buffer] = NextRequest(surface->display);
+  XShmPutImage(surface->display, drawable, surface->gc, surface->image[buffer],
+			   damage->left, damage->top,
+			   surface->x + damage->left, surface->y + damage->top,
+			   damage->right - damage->left, damage->bottom - damage->top,
+			   False);
+}
+
 // PluginInstance vfuncs
 static void *plugin_instance_allocate(void);
 static void plugin_instance_deallocate(PluginInstance *plugin);
@@ -224,10 +437,25 @@ static void plugin_instance_finalize(PluginInstance *plugin)
 {
   id_remove(plugin->instance_id);
   rpc_connection_unref(plugin->connection);
+
+  g_free(plugin->mime_type);
+  for (int i = 0; i < plugin->argc; i++) {
+	g_free(plugin->argn[i]);
+	g_free(plugin->argv[i]);
+  }
+  g_free(plugin->argn);
+  g_free(plugin->argv);
+  g_free(plugin->src_url);
+  g_list_free(plugin->streams);
 }
 
+static void surface_destroy(PluginInstance *plugin);
+
 static void plugin_instance_invalidate(PluginInstance *plugin)
 {
+  surface_destroy(plugin);
+  g_plugin_instances = g_list_remove(g_plugin_instances, plugin);
+
   /* Browser's NPP instance is no longer valid beyond this point. So,
 	 let's just break the link to nspluginwrapper's PluginInstance now.  */
   if (plugin->instance) {
@@ -294,23 +522,137 @@ static bool plugin_load_native(void)
   return true;
 }
 
-// Check for direct execution of the plugin
-static inline bool plugin_has_direct_exec_env(void)
+// Check whether a single viewer serves all browser processes of this
+// user, which is enabled with NPW_SHARED_VIEWER=yes
+static bool plugin_use_shared_viewer(void)
 {
-  if (getenv("NPW_DIRECT_EXEC"))
-	return true;
-  if (getenv("NPW_DIRECT_EXECUTION"))
-	return true;
-  return false;
+  static int use_shared_viewer = -1;
+  if (use_shared_viewer < 0) {
+	const char *str = getenv("NPW_SHARED_VIEWER");
+	use_shared_viewer = str && (strcmp(str, "yes") == 0 || strcmp(str, "1") == 0);
+  }
+  return use_shared_viewer;
+}
+
+// Check whether to keep a spare viewer around to recover from crashes,
+// which is enabled with NPW_VIEWER_STANDBY=yes
+static bool plugin_use_standby_viewer(void)
+{
+  static int use_standby_viewer = -1;
+  if (use_standby_viewer < 0) {
+	const char *str = getenv("NPW_VIEWER_STANDBY");
+	use_standby_viewer = str && (strcmp(str, "yes") == 0 || strcmp(str, "1") == 0);
+  }
+  return use_standby_viewer && !plugin_use_shared_viewer();
+}
+
+// Number of seconds an instance stays hidden before the viewer makes
+// it hibernate, from NPW_HIBERNATE_DELAY. Zero, the default, disables
+// hibernation, since some browsers never give a meaningful clip rect
+static int plugin_hibernate_delay(void)
+{
+  static int hibernate_delay = -1;
+  if (hibernate_delay < 0) {
+	const char *str = getenv("NPW_HIBERNATE_DELAY");
+	hibernate_delay = str ? atoi(str) : 0;
+	if (hibernate_delay < 0)
+	  hibernate_delay = 0;
+  }
+  return hibernate_delay;
+}
+
+/*
+ *  Direct execution policy
+ *
+ *  A plugin built for the host OS and architecture can run in the
+ *  browser process, with plugin_funcs called directly and no viewer.
+ *  This is only done for plugins the user trusts, listed in the
+ *  allowlist file (NPW_DIRECT_EXEC_CONFIG, or else
+ *  $XDG_CONFIG_HOME/nspluginwrapper/direct-exec). Each line holds a
+ *  plugin path or file name, possibly with '*' and '?' wildcards; a
+ *  line starting with '!' denies matching plugins, and '#' starts a
+ *  comment. The first matching line wins.
+ *
+ *  NPW_DIRECT_EXEC=yes (or the older NPW_DIRECT_EXECUTION) runs any
+ *  native plugin directly, NPW_DIRECT_EXEC=no none of them.
+ */
+
+enum {
+  DIRECT_EXEC_UNSET = -1,
+  DIRECT_EXEC_DENY,
+  DIRECT_EXEC_ALLOW,
+};
+
+static int plugin_direct_exec_env(void)
+{
+  const char *str = getenv("NPW_DIRECT_EXEC");
+  if (str == NULL)
+	str = getenv("NPW_DIRECT_EXECUTION");
+  if (str == NULL)
+	return DIRECT_EXEC_UNSET;
+  if (strcmp(str, "no") == 0 || strcmp(str, "0") == 0)
+	return DIRECT_EXEC_DENY;
+  return DIRECT_EXEC_ALLOW;
+}
+
+static char *plugin_direct_exec_config_path(void)
+{
+  const char *path = getenv("NPW_DIRECT_EXEC_CONFIG");
+  if (path)
+	return g_strdup(path);
+  return g_build_filename(g_get_user_config_dir(), "nspluginwrapper", "direct-exec", NULL);
+}
+
+// Look up the plugin in the allowlist file
+static int plugin_direct_exec_config(void)
+{
+  char *path = plugin_direct_exec_config_path();
+  FILE *fp = fopen(path, "r");
+  g_free(path);
+  if (fp == NULL)
+	return DIRECT_EXEC_UNSET;
+
+  const char *plugin_file_name = strrchr(plugin_path, '/');
+  plugin_file_name = plugin_file_name ? plugin_file_name + 1 : plugin_path;
+
+  int policy = DIRECT_EXEC_UNSET;
+  char line[PATH_MAX];
+  while (policy == DIRECT_EXEC_UNSET && fgets(line, sizeof(line), fp)) {
+	char *pattern = g_strstrip(line);
+	if (pattern[0] == '\0' || pattern[0] == '#')
+	  continue;
+	bool allow = true;
+	if (pattern[0] == '!') {
+	  allow = false;
+	  pattern = g_strchug(pattern + 1);
+	}
+	// Patterns without a slash match the file name only
+	const char *name = strchr(pattern, '/') ? plugin_path : plugin_file_name;
+	if (g_pattern_match_simple(pattern, name))
+	  policy = allow ? DIRECT_EXEC_ALLOW : DIRECT_EXEC_DENY;
+  }
+  fclose(fp);
+  return policy;
 }
 
 static bool plugin_can_direct_exec(void)
 {
-  if (!plugin_has_direct_exec_env())
+  // NPW_Plugin describes the plugin this wrapper was installed for
+  if (strcmp(NPW_Plugin.target_arch, HOST_ARCH) != 0 || strcmp(NPW_Plugin.target_os, HOST_OS) != 0) {
+	D(bug("Run plugin in viewer: built for %s/%s\n", NPW_Plugin.target_os, NPW_Plugin.target_arch));
+	return false;
+  }
+
+  int policy = plugin_direct_exec_env();
+  if (policy == DIRECT_EXEC_UNSET)
+	policy = plugin_direct_exec_config();
+  if (policy != DIRECT_EXEC_ALLOW) {
+	D(bug("Run plugin in viewer: not trusted\n"));
 	return false;
+  }
+
   if (!plugin_load_native())
 	return false;
-  // XXX: really check for same OS/ARCH
   D(bug("Run plugin natively\n"));
   return true;
 }
@@ -329,6 +671,54 @@ static inline bool plugin_direct_exec(void)
 
 #define PLUGIN_DIRECT_EXEC plugin_direct_exec()
 
+// Latency of NPP calls as seen by the browser, collected with
+// NPW_CALL_LATENCY=yes and dumped on exit with NPW_DEBUG set
+enum {
+#define PLUGIN_FUNC(func, member) PLUGIN_CALL_##func,
+#include "plugin-funcs.h"
+#undef PLUGIN_FUNC
+  PLUGIN_CALL_COUNT
+};
+
+static NPW_Histogram plugin_call_stats[PLUGIN_CALL_COUNT] = {
+#define PLUGIN_FUNC(func, member) { #func, "us" },
+#include "plugin-funcs.h"
+#undef PLUGIN_FUNC
+};
+
+static bool plugin_call_stats_enabled(void)
+{
+  static int is_enabled = -1;
+  if (G_UNLIKELY(is_enabled < 0)) {
+	const char *str = getenv("NPW_CALL_LATENCY");
+	is_enabled = str && (strcmp(str, "yes") == 0 || strcmp(str, "1") == 0);
+  }
+  return is_enabled;
+}
+
+static inline uint64_t plugin_call_begin(void)
+{
+  return plugin_call_stats_enabled() ? npw_get_time_us() : 0;
+}
+
+static inline void plugin_call_end(int func, uint64_t start)
+{
+  if (start)
+	npw_histogram_add(&plugin_call_stats[func], npw_get_time_us() - start);
+}
+
+static void plugin_call_stats_dump(void)
+{
+  uint64_t n_calls = 0;
+  for (int i = 0; i < PLUGIN_CALL_COUNT; i++)
+	n_calls += plugin_call_stats[i].count;
+  if (n_calls == 0)
+	return;
+  npw_dprintf("NPP call latency, %s:\n", PLUGIN_DIRECT_EXEC ? "in-process" : "through the viewer");
+  for (int i = 0; i < PLUGIN_CALL_COUNT; i++)
+	npw_histogram_dump(&plugin_call_stats[i]);
+}
+
 
 /* ====================================================================== */
 /* === RPC communication                                              === */
@@ -449,9 +839,10 @@ static int handle_NPN_Status(rpc_connection_t *connection)
 
   g_NPN_Status(PLUGIN_INSTANCE_NPP(plugin), message);
 
+  // the viewer sends status messages with rpc_method_notify()
   if (message)
 	free(message);
-  return rpc_method_send_reply (connection, RPC_TYPE_INVALID);
+  return RPC_ERROR_NO_ERROR;
 }
 
 // NPN_GetValue
@@ -587,6 +978,11 @@ static int handle_NPN_SetValue(rpc_connection_t *connection)
 	D(bug("Skipping NPN_SetValue on NULL instance to avoid possible crash.\n"));
 	ret = NPERR_INVALID_INSTANCE_ERROR;
   } else {
+	// the viewer paints transparent plugins into our drawable again
+	if (variable == NPPVpluginTransparentBool) {
+	  if ((plugin->is_transparent = value))
+		surface_destroy(plugin);
+	}
 	ret = g_NPN_SetValue(PLUGIN_INSTANCE_NPP(plugin), variable, (void *)(uintptr_t)value);
   }
 
@@ -860,6 +1256,67 @@ static NPError g_NPN_RequestRead(NPStream *stream, NPByteRange *rangeList)
   return ret;
 }
 
+static void byte_range_list_free(NPByteRange *rangeList)
+{
+  while (rangeList) {
+	NPByteRange *p = rangeList;
+	rangeList = rangeList->next;
+	free(p);
+  }
+}
+
+// Appends [start, end) to the list, extending its LAST range if they
+// are contiguous. Returns the new last range
+static NPByteRange *byte_range_list_append(NPByteRange **head, NPByteRange *last,
+										   int32_t start, uint32_t length)
+{
+  if (last && length > 0 && last->offset + last->length == start) {
+	last->length += length;
+	return last;
+  }
+  NPByteRange *range = malloc(sizeof(*range));
+  if (range == NULL)
+	return last;
+  range->offset = start;
+  range->length = length;
+  range->next = NULL;
+  if (last)
+	last->next = range;
+  else
+	*head = range;
+  return range;
+}
+
+// Splits the ranges the plugin wants into those the stream cache holds
+// already and those the browser has yet to deliver
+static void stream_cache_split(StreamInstance *stream_pdata, NPByteRange *rangeList,
+							   NPByteRange **present, NPByteRange **missing)
+{
+  NPByteRange *present_last = NULL, *missing_last = NULL;
+  *present = *missing = NULL;
+  for (NPByteRange *r = rangeList; r != NULL; r = r->next) {
+	int64_t start = r->offset;
+	if (start < 0)
+	  start += stream_pdata->cache_size;
+	int64_t end = start + r->length;
+	if (start < 0 || end > stream_pdata->cache_size || r->length == 0) {
+	  // Let the browser deal with whatever this is
+	  missing_last = byte_range_list_append(missing, missing_last, r->offset, r->length);
+	  continue;
+	}
+	while (start < end) {
+	  bool is_present;
+	  uint32_t run_end = range_set_lookup(stream_pdata->cache_ranges, start, &is_present);
+	  run_end = MIN(run_end, end);
+	  if (is_present)
+		present_last = byte_range_list_append(present, present_last, start, run_end - start);
+	  else
+		missing_last = byte_range_list_append(missing, missing_last, start, run_end - start);
+	  start = run_end;
+	}
+  }
+}
+
 static int handle_NPN_RequestRead(rpc_connection_t *connection)
 {
   D(bug("handle_NPN_RequestRead\n"));
@@ -876,15 +1333,33 @@ static int handle_NPN_RequestRead(rpc_connection_t *connection)
 	return error;
   }
 
-  NPError ret = g_NPN_RequestRead(stream, rangeList);
-
-  while (rangeList) {
-	NPByteRange *p = rangeList;
-	rangeList = rangeList->next;
-	free(p);
+  // The viewer reads cached ranges from the shared memory right away,
+  // only the rest is requested from the browser, in a single call
+  NPError ret = NPERR_NO_ERROR;
+  NPByteRange *present = NULL;
+  StreamInstance *stream_pdata = stream ? stream->pdata : NULL;
+  if (stream_pdata && stream_pdata->cache_data) {
+	NPByteRange *missing;
+	stream_cache_split(stream_pdata, rangeList, &present, &missing);
+	if (missing)
+	  ret = g_NPN_RequestRead(stream, missing);
+	byte_range_list_free(missing);
+	if (ret != NPERR_NO_ERROR) {
+	  byte_range_list_free(present);
+	  present = NULL;
+	}
   }
+  else
+	ret = g_NPN_RequestRead(stream, rangeList);
 
-  return rpc_method_send_reply(connection, RPC_TYPE_INT32, ret, RPC_TYPE_INVALID);
+  byte_range_list_free(rangeList);
+
+  error = rpc_method_send_reply(connection,
+								RPC_TYPE_INT32, ret,
+								RPC_TYPE_NP_BYTE_RANGE, present,
+								RPC_TYPE_INVALID);
+  byte_range_list_free(present);
+  return error;
 }
 
 // NPN_NewStream
@@ -911,6 +1386,7 @@ static NPError g_NPN_NewStream(NPP instance, NPMIMEType type, const char *target
 	stream_pdata->stream = *stream;
 	stream_pdata->stream_id = id_create(stream_pdata);
 	stream_pdata->is_plugin_stream = 1;
+	stream_pdata->cache_shm_id = -1;
 	(*stream)->pdata = stream_pdata;
   }
   else {
@@ -2080,6 +2556,26 @@ invoke_NPP_New(PluginInstance *plugin, NPMIMEType mime_type,
   npw_return_val_if_fail(rpc_method_invoke_possible(plugin->connection),
 						 NPERR_GENERIC_ERROR);
 
+  // Snapshot the browser values that don't change for the lifetime of
+  // the instance, so that the viewer doesn't need to call back for
+  // them. Private mode changes are pushed through NPP_SetValue()
+  uint32_t values = 0;
+  uint32_t supports_windowless = FALSE;
+  uint32_t supports_xembed = FALSE;
+  uint32_t private_mode = FALSE;
+  char *document_origin = NULL;
+  // NPNVSupportsXEmbedBool is a 4-byte PRBool in some browsers, so
+  // booleans are read into zeroed 32-bit words
+  if (g_NPN_GetValue(plugin->instance, NPNVSupportsWindowless, &supports_windowless) == NPERR_NO_ERROR)
+	values |= NPW_NPP_NEW_SUPPORTS_WINDOWLESS;
+  if (g_NPN_GetValue(plugin->instance, NPNVSupportsXEmbedBool, &supports_xembed) == NPERR_NO_ERROR)
+	values |= NPW_NPP_NEW_SUPPORTS_XEMBED;
+  if (g_NPN_GetValue(plugin->instance, NPNVprivateModeBool, &private_mode) == NPERR_NO_ERROR)
+	values |= NPW_NPP_NEW_PRIVATE_MODE;
+  if (g_NPN_GetValue(plugin->instance, NPNVdocumentOrigin, &document_origin) == NPERR_NO_ERROR
+	  && document_origin != NULL)
+	values |= NPW_NPP_NEW_DOCUMENT_ORIGIN;
+
   int error = rpc_method_invoke(plugin->connection,
 								RPC_METHOD_NPP_NEW,
 								RPC_TYPE_UINT32, plugin->instance_id,
@@ -2088,8 +2584,16 @@ invoke_NPP_New(PluginInstance *plugin, NPMIMEType mime_type,
 								RPC_TYPE_ARRAY, RPC_TYPE_STRING, (uint32_t)argc, argn,
 								RPC_TYPE_ARRAY, RPC_TYPE_STRING, (uint32_t)argc, argv,
 								RPC_TYPE_NP_SAVED_DATA, saved,
+								RPC_TYPE_UINT32, values,
+								RPC_TYPE_BOOLEAN, supports_windowless != FALSE,
+								RPC_TYPE_BOOLEAN, supports_xembed != FALSE,
+								RPC_TYPE_BOOLEAN, private_mode != FALSE,
+								RPC_TYPE_STRING, (values & NPW_NPP_NEW_DOCUMENT_ORIGIN) ? document_origin : NULL,
 								RPC_TYPE_INVALID);
 
+  if (document_origin)
+	NPN_MemFree(document_origin);
+
   if (error != RPC_ERROR_NO_ERROR) {
 	npw_perror("NPP_New() invoke", error);
 	return NPERR_GENERIC_ERROR;
@@ -2134,9 +2638,23 @@ g_NPP_New(NPMIMEType mime_type, NPP instance,
 	  return NPERR_OUT_OF_MEMORY_ERROR;
 	plugin->native_instance->ndata = instance->ndata;
   }
+  else {
+	plugin->mime_type = g_strdup(mime_type);
+	plugin->mode = mode;
+	plugin->argc = MAX(argc, 0);
+	plugin->argn = g_new0(char *, plugin->argc);
+	plugin->argv = g_new0(char *, plugin->argc);
+	for (int i = 0; i < plugin->argc; i++) {
+	  plugin->argn[i] = g_strdup(argn[i]);
+	  plugin->argv[i] = g_strdup(argv[i]);
+	}
+	g_plugin_instances = g_list_append(g_plugin_instances, plugin);
+  }
 
   D(bugiI("NPP_New instance=%p\n", instance));
+  uint64_t call_start = plugin_call_begin();
   ret = invoke_NPP_New(plugin, mime_type, mode, argc, argn, argv, saved);
+  plugin_call_end(PLUGIN_CALL_NPP_New, call_start);
   D(bugiD("NPP_New return: %d [%s]\n", ret, string_of_NPError(ret)));
 
   if (saved) {
@@ -2201,8 +2719,17 @@ g_NPP_Destroy(NPP instance, NPSavedData **save)
   if (plugin == NULL)
 	return NPERR_INVALID_INSTANCE_ERROR;
 
+  if (plugin->hibernate_pending) {
+	mozilla_funcs.unscheduletimer(instance, plugin->hibernate_timer);
+	plugin->hibernate_pending = false;
+  }
+  if (instance == g_recovery_instance)
+	mozilla_funcs.unscheduletimer(instance, g_recovery_timer);
+
   D(bugiI("NPP_Destroy instance=%p\n", instance));
+  uint64_t call_start = plugin_call_begin();
   NPError ret = invoke_NPP_Destroy(plugin, save);
+  plugin_call_end(PLUGIN_CALL_NPP_Destroy, call_start);
   D(bugiD("NPP_Destroy return: %d [%s]\n", ret, string_of_NPError(ret)));
 
   if (PLUGIN_DIRECT_EXEC) {
@@ -2214,6 +2741,12 @@ g_NPP_Destroy(NPP instance, NPSavedData **save)
 
   npw_plugin_instance_invalidate(plugin);
   npw_plugin_instance_unref(plugin);
+
+  // The pending restart moves to another instance
+  if (instance == g_recovery_instance) {
+	g_recovery_instance = NULL;
+	plugin_schedule_recovery();
+  }
   return ret;
 }
 
@@ -2227,10 +2760,15 @@ invoke_NPP_SetWindow(PluginInstance *plugin, NPWindow *window)
   npw_return_val_if_fail(rpc_method_invoke_possible(plugin->connection),
 						 NPERR_GENERIC_ERROR);
 
+  bool use_surface = false;
+  if (window && window->type == NPWindowTypeDrawable && window->ws_info && !plugin->is_transparent)
+	use_surface = surface_is_enabled(((NPSetWindowCallbackStruct *)window->ws_info)->display);
+
   int error = rpc_method_invoke(plugin->connection,
 								RPC_METHOD_NPP_SET_WINDOW,
 								RPC_TYPE_NPW_PLUGIN_INSTANCE, plugin,
 								RPC_TYPE_NP_WINDOW, window,
+								RPC_TYPE_BOOLEAN, use_surface,
 								RPC_TYPE_INVALID);
 
   if (error != RPC_ERROR_NO_ERROR) {
@@ -2239,8 +2777,10 @@ invoke_NPP_SetWindow(PluginInstance *plugin, NPWindow *window)
   }
 
   int32_t ret;
+  NPW_Surface surface;
   error = rpc_method_wait_for_reply(plugin->connection,
 									RPC_TYPE_INT32, &ret,
+									RPC_TYPE_NPW_SURFACE, &surface,
 									RPC_TYPE_INVALID);
 
   if (error != RPC_ERROR_NO_ERROR) {
@@ -2248,9 +2788,87 @@ invoke_NPP_SetWindow(PluginInstance *plugin, NPWindow *window)
 	return NPERR_GENERIC_ERROR;
   }
 
+  if (use_surface)
+	surface_update(plugin, window, &surface);
+  else if (window)
+	surface_destroy(plugin);
+
   return ret;
 }
 
+// Tells the viewer that an instance has been hidden for a while
+static NPError
+invoke_NPW_Hibernate(PluginInstance *plugin)
+{
+  npw_return_val_if_fail(rpc_method_invoke_possible(plugin->connection),
+						 NPERR_GENERIC_ERROR);
+
+  int error = rpc_method_invoke(plugin->connection,
+								RPC_METHOD_NPW_HIBERNATE,
+								RPC_TYPE_NPW_PLUGIN_INSTANCE, plugin,
+								RPC_TYPE_INVALID);
+
+  if (error != RPC_ERROR_NO_ERROR) {
+	npw_perror("NPW_Hibernate() invoke", error);
+	return NPERR_GENERIC_ERROR;
+  }
+
+  uint32_t rss_kb, timer_wakeups;
+  error = rpc_method_wait_for_reply(plugin->connection,
+									RPC_TYPE_UINT32, &rss_kb,
+									RPC_TYPE_UINT32, &timer_wakeups,
+									RPC_TYPE_INVALID);
+
+  if (error != RPC_ERROR_NO_ERROR) {
+	npw_perror("NPW_Hibernate() wait for reply", error);
+	return NPERR_GENERIC_ERROR;
+  }
+
+  npw_dprintf("instance %p hibernated: viewer rss %u KB, %u timer wakeups\n",
+			  PLUGIN_INSTANCE_NPP(plugin), rss_kb, timer_wakeups);
+  return NPERR_NO_ERROR;
+}
+
+static void
+plugin_hibernate_cb(NPP instance, uint32_t timer_id)
+{
+  PluginInstance *plugin = PLUGIN_INSTANCE(instance);
+  if (plugin == NULL || !plugin->hibernate_pending || plugin->hibernate_timer != timer_id)
+	return;
+
+  plugin->hibernate_pending = false;
+  if (plugin->is_hidden && !plugin->hibernated)
+	plugin->hibernated = invoke_NPW_Hibernate(plugin) == NPERR_NO_ERROR;
+}
+
+// Track whether the instance shows anything, so that it hibernates
+// once hidden for NPW_HIBERNATE_DELAY seconds. The viewer wakes it up
+// itself on the NPP_SetWindow() that makes it visible again
+static void
+plugin_update_visibility(PluginInstance *plugin, NPWindow *window)
+{
+  NPP instance = PLUGIN_INSTANCE_NPP(plugin);
+
+  plugin->is_hidden = !npw_window_is_visible(window);
+  if (!plugin->is_hidden) {
+	if (plugin->hibernate_pending) {
+	  mozilla_funcs.unscheduletimer(instance, plugin->hibernate_timer);
+	  plugin->hibernate_pending = false;
+	}
+	plugin->hibernated = false;
+	return;
+  }
+
+  int delay = plugin_hibernate_delay();
+  if (delay == 0 || PLUGIN_DIRECT_EXEC || plugin->hibernated || plugin->hibernate_pending)
+	return;
+  if (mozilla_funcs.scheduletimer == NULL || mozilla_funcs.unscheduletimer == NULL)
+	return;
+  plugin->hibernate_timer = mozilla_funcs.scheduletimer(instance, delay * 1000, false,
+														plugin_hibernate_cb);
+  plugin->hibernate_pending = true;
+}
+
 static NPError
 g_NPP_SetWindow(NPP instance, NPWindow *window)
 {
@@ -2262,8 +2880,20 @@ g_NPP_SetWindow(NPP instance, NPWindow *window)
 	return NPERR_INVALID_INSTANCE_ERROR;
 
   D(bugiI("NPP_SetWindow instance=%p\n", instance));
+  uint64_t call_start = plugin_call_begin();
   NPError ret = invoke_NPP_SetWindow(plugin, window);
+  plugin_call_end(PLUGIN_CALL_NPP_SetWindow, call_start);
   D(bugiD("NPP_SetWindow return: %d [%s]\n", ret, string_of_NPError(ret)));
+
+  if (window) {
+	plugin->window = *window;
+	if (window->ws_info) {
+	  plugin->ws_info = *(NPSetWindowCallbackStruct *)window->ws_info;
+	  plugin->window.ws_info = &plugin->ws_info;
+	}
+	plugin->has_window = true;
+  }
+  plugin_update_visibility(plugin, window);
   return ret;
 }
 
@@ -2401,7 +3031,9 @@ g_NPP_GetValue(NPP instance, NPPVariable variable, void *value)
   }
 
   D(bugiI("NPP_GetValue instance=%p, variable=%d [%s]\n", instance, variable, string_of_NPPVariable(variable)));
+  uint64_t call_start = plugin_call_begin();
   NPError ret = invoke_NPP_GetValue(plugin, variable, value);
+  plugin_call_end(PLUGIN_CALL_NPP_GetValue, call_start);
   D(bugiD("NPP_GetValue return: %d [%s]\n", ret, string_of_NPError(ret)));
   return ret;
 }
@@ -2410,9 +3042,46 @@ g_NPP_GetValue(NPP instance, NPPVariable variable, void *value)
 static NPError
 invoke_NPP_SetValue(PluginInstance *plugin, NPNVariable variable, void *value)
 {
-  NPW_UNIMPLEMENTED();
+  if (PLUGIN_DIRECT_EXEC) {
+	if (plugin_funcs.setvalue == NULL)
+	  return NPERR_GENERIC_ERROR;
+	return plugin_funcs.setvalue(plugin->native_instance, variable, value);
+  }
+
+  switch (variable) {
+  case NPNVprivateModeBool:
+	break;
+  default:
+	NPW_UNIMPLEMENTED();
+	return NPERR_GENERIC_ERROR;
+  }
+
+  npw_return_val_if_fail(rpc_method_invoke_possible(plugin->connection),
+						 NPERR_GENERIC_ERROR);
+
+  int error = rpc_method_invoke(plugin->connection,
+								RPC_METHOD_NPP_SET_VALUE,
+								RPC_TYPE_NPW_PLUGIN_INSTANCE, plugin,
+								RPC_TYPE_UINT32, (uint32_t)variable,
+								RPC_TYPE_BOOLEAN, *(NPBool *)value != FALSE,
+								RPC_TYPE_INVALID);
+
+  if (error != RPC_ERROR_NO_ERROR) {
+	npw_perror("NPP_SetValue() invoke", error);
+	return NPERR_GENERIC_ERROR;
+  }
+
+  int32_t ret;
+  error = rpc_method_wait_for_reply(plugin->connection,
+									RPC_TYPE_INT32, &ret,
+									RPC_TYPE_INVALID);
+
+  if (error != RPC_ERROR_NO_ERROR) {
+	npw_perror("NPP_SetValue() wait for reply", error);
+	return NPERR_GENERIC_ERROR;
+  }
 
-  return NPERR_GENERIC_ERROR;
+  return ret;
 }
 
 static NPError
@@ -2426,9 +3095,11 @@ g_NPP_SetValue(NPP instance, NPNVariable variable, void *value)
 	return NPERR_INVALID_INSTANCE_ERROR;
 
   D(bugiI("NPP_SetValue instance=%p, variable=%d [%s]\n", instance, variable, string_of_NPPVariable(variable)));
+  uint64_t call_start = plugin_call_begin();
   NPError ret = invoke_NPP_SetValue(plugin, variable, value);
+  plugin_call_end(PLUGIN_CALL_NPP_SetValue, call_start);
   D(bugiD("NPP_SetValue return: %d [%s]\n", ret, string_of_NPError(ret)));
-  return NPERR_GENERIC_ERROR;
+  return ret;
 }
 
 // Notifies the instance of the completion of a URL request
@@ -2472,10 +3143,70 @@ g_NPP_URLNotify(NPP instance, const char *url, NPReason reason, void *notifyData
 	return;
 
   D(bugiI("NPP_URLNotify instance=%p, url='%s', reason=%s, notifyData=%p\n", instance, url, string_of_NPReason(reason), notifyData));
+  uint64_t call_start = plugin_call_begin();
   invoke_NPP_URLNotify(plugin, url, reason, notifyData);
+  plugin_call_end(PLUGIN_CALL_NPP_URLNotify, call_start);
   D(bugiD("NPP_URLNotify done\n"));
 }
 
+// Seekable streams are mirrored into a shared memory segment as the
+// data arrives, so that NPN_RequestRead() doesn't need the browser to
+// send again what the viewer got already. Pages are only allocated
+// for the parts that are actually delivered
+static void stream_cache_destroy(StreamInstance *stream_pdata)
+{
+  if (stream_pdata->cache_data) {
+	shmdt(stream_pdata->cache_data);
+	stream_pdata->cache_data = NULL;
+  }
+  if (stream_pdata->cache_shm_id >= 0) {
+	shmctl(stream_pdata->cache_shm_id, IPC_RMID, NULL);
+	stream_pdata->cache_shm_id = -1;
+  }
+  if (stream_pdata->cache_ranges) {
+	D(bug("stream cache held %" G_GUINT64_FORMAT " of %u bytes\n",
+		  range_set_size(stream_pdata->cache_ranges), stream_pdata->cache_size));
+	range_set_destroy(stream_pdata->cache_ranges);
+	stream_pdata->cache_ranges = NULL;
+  }
+}
+
+static void stream_cache_create(StreamInstance *stream_pdata, NPStream *stream)
+{
+  if (stream->end == 0 || stream->end > STREAM_CACHE_MAX)
+	return;
+
+  stream_pdata->cache_shm_id = shmget(IPC_PRIVATE, stream->end, IPC_CREAT | 0600);
+  if (stream_pdata->cache_shm_id < 0) {
+	D(bug("could not allocate %u bytes stream cache\n", stream->end));
+	return;
+  }
+  void *data = shmat(stream_pdata->cache_shm_id, NULL, 0);
+  if (data == (void *)-1) {
+	stream_cache_destroy(stream_pdata);
+	return;
+  }
+  stream_pdata->cache_data = data;
+  stream_pdata->cache_size = stream->end;
+  stream_pdata->cache_ranges = range_set_new();
+}
+
+// Copies data from NPP_Write() into the stream cache. Returns false if
+// the viewer has to get the bytes through the RPC
+static bool stream_cache_store(NPStream *stream, int32_t offset, int32_t len, const void *buf)
+{
+  if (PLUGIN_DIRECT_EXEC)
+	return false;
+  StreamInstance *stream_pdata = stream->pdata;
+  if (stream_pdata == NULL || stream_pdata->cache_data == NULL)
+	return false;
+  if (buf == NULL || offset < 0 || len <= 0 || (uint32_t)offset + (uint32_t)len > stream_pdata->cache_size)
+	return false;
+  memcpy(stream_pdata->cache_data + offset, buf, len);
+  range_set_add(stream_pdata->cache_ranges, offset, offset + len);
+  return true;
+}
+
 // Notifies a plug-in instance of a new data stream
 static NPError
 invoke_NPP_NewStream(PluginInstance *plugin, NPMIMEType type, NPStream *stream, NPBool seekable, uint16_t *stype)
@@ -2486,6 +3217,10 @@ invoke_NPP_NewStream(PluginInstance *plugin, NPMIMEType type, NPStream *stream,
   npw_return_val_if_fail(rpc_method_invoke_possible(plugin->connection),
 						 NPERR_GENERIC_ERROR);
 
+  StreamInstance *stream_pdata = stream->pdata;
+  if (seekable)
+	stream_cache_create(stream_pdata, stream);
+
   int error = rpc_method_invoke(plugin->connection,
 								RPC_METHOD_NPP_NEW_STREAM,
 								RPC_TYPE_NPW_PLUGIN_INSTANCE, plugin,
@@ -2497,26 +3232,37 @@ invoke_NPP_NewStream(PluginInstance *plugin, NPMIMEType type, NPStream *stream,
 								RPC_TYPE_NP_NOTIFY_DATA, stream->notifyData,
 								RPC_TYPE_STRING, NPN_HAS_FEATURE(RESPONSE_HEADERS) ? stream->headers : NULL,
 								RPC_TYPE_BOOLEAN, seekable,
+								RPC_TYPE_INT32, stream_pdata->cache_data ? stream_pdata->cache_shm_id : -1,
 								RPC_TYPE_INVALID);
 
   if (error != RPC_ERROR_NO_ERROR) {
 	npw_perror("NPP_NewStream() invoke", error);
+	stream_cache_destroy(stream_pdata);
 	return NPERR_GENERIC_ERROR;
   }
 
   int32_t ret;
   uint32_t r_stype;
+  uint32_t cache_attached;
   error = rpc_method_wait_for_reply(plugin->connection,
 									RPC_TYPE_INT32, &ret,
 									RPC_TYPE_UINT32, &r_stype,
 									RPC_TYPE_NP_NOTIFY_DATA, &stream->notifyData,
+									RPC_TYPE_BOOLEAN, &cache_attached,
 									RPC_TYPE_INVALID);
 
   if (error != RPC_ERROR_NO_ERROR) {
 	npw_perror("NPP_NewStream() wait for reply", error);
+	stream_cache_destroy(stream_pdata);
 	return NPERR_GENERIC_ERROR;
   }
 
+  // The viewer marked the segment for removal as soon as it attached it
+  if (cache_attached)
+	stream_pdata->cache_shm_id = -1;
+  if (!cache_attached || ret != NPERR_NO_ERROR || r_stype == NP_ASFILEONLY)
+	stream_cache_destroy(stream_pdata);
+
   *stype = r_stype;
   return ret;
 }
@@ -2539,15 +3285,51 @@ g_NPP_NewStream(NPP instance, NPMIMEType type, NPStream *stream, NPBool seekable
 	stream_pdata->stream = stream;
 	stream_pdata->stream_id = id_create(stream_pdata);
 	stream_pdata->is_plugin_stream = 0;
+	stream_pdata->cache_shm_id = -1;
+	stream_pdata->generation = g_viewer_generation;
 	stream->pdata = stream_pdata;
   }
 
   D(bugiI("NPP_NewStream instance=%p\n", instance));
+  uint64_t call_start = plugin_call_begin();
   NPError ret = invoke_NPP_NewStream(plugin, type, stream, seekable, stype);
+  plugin_call_end(PLUGIN_CALL_NPP_NewStream, call_start);
   D(bugiD("NPP_NewStream return: %d [%s], stype=%s\n", ret, string_of_NPError(ret), string_of_NPStreamType(*stype)));
+
+  if (!PLUGIN_DIRECT_EXEC && ret == NPERR_NO_ERROR) {
+	StreamInstance *stream_pdata = stream->pdata;
+	if (*stype == NP_ASFILEONLY)
+	  stream_pdata->as_file_only = true;
+	if (plugin->src_url == NULL && stream->url)
+	  plugin->src_url = g_strdup(stream->url);
+	plugin->streams = g_list_append(plugin->streams, stream_pdata);
+  }
+
   return ret;
 }
 
+// Checks whether the plug-in asked for NP_ASFILEONLY. The browser
+// saves the data to the file it passes to NPP_StreamAsFile(), the
+// viewer doesn't need to see it through NPP_Write()
+static inline bool
+stream_is_file_only(NPStream *stream)
+{
+  if (PLUGIN_DIRECT_EXEC)
+	return false;
+  StreamInstance *stream_pdata = stream->pdata;
+  return stream_pdata && stream_pdata->as_file_only;
+}
+
+// Check whether STREAM was opened in a viewer that died since
+static inline bool
+stream_is_stale(NPStream *stream)
+{
+  if (PLUGIN_DIRECT_EXEC)
+	return false;
+  StreamInstance *stream_pdata = stream->pdata;
+  return stream_pdata && stream_pdata->generation != g_viewer_generation;
+}
+
 // Tells the plug-in that a stream is about to be closed or destroyed
 static NPError
 invoke_NPP_DestroyStream(PluginInstance *plugin, NPStream *stream, NPReason reason)
@@ -2593,13 +3375,22 @@ g_NPP_DestroyStream(NPP instance, NPStream *stream, NPReason reason)
   if (plugin == NULL)
 	return NPERR_INVALID_INSTANCE_ERROR;
 
-  D(bugiI("NPP_DestroyStream instance=%p\n", instance));
-  NPError ret = invoke_NPP_DestroyStream(plugin, stream, reason);
-  D(bugiD("NPP_DestroyStream return: %d [%s]\n", ret, string_of_NPError(ret)));
+  NPError ret = NPERR_NO_ERROR;
+  if (stream_is_stale(stream))
+	D(bug("NPP_DestroyStream skipped for stream from a dead viewer\n"));
+  else {
+	D(bugiI("NPP_DestroyStream instance=%p\n", instance));
+	uint64_t call_start = plugin_call_begin();
+	ret = invoke_NPP_DestroyStream(plugin, stream, reason);
+	plugin_call_end(PLUGIN_CALL_NPP_DestroyStream, call_start);
+	D(bugiD("NPP_DestroyStream return: %d [%s]\n", ret, string_of_NPError(ret)));
+  }
 
   if (!PLUGIN_DIRECT_EXEC) {
 	StreamInstance *stream_pdata = stream->pdata;
 	if (stream_pdata) {
+	  plugin->streams = g_list_remove(plugin->streams, stream_pdata);
+	  stream_cache_destroy(stream_pdata);
 	  id_remove(stream_pdata->stream_id);
 	  free(stream->pdata);
 	  stream->pdata = NULL;
@@ -2620,13 +3411,21 @@ invoke_NPP_StreamAsFile(PluginInstance *plugin, NPStream *stream, const char *fn
 
   npw_return_if_fail(rpc_method_invoke_possible(plugin->connection));
 
+  // Pass the file itself so that the viewer can read it even if it
+  // doesn't see the same filesystem. The path is only a fallback
+  int fd = fname ? open(fname, O_RDONLY) : -1;
+
   int error = rpc_method_invoke(plugin->connection,
 								RPC_METHOD_NPP_STREAM_AS_FILE,
 								RPC_TYPE_NPW_PLUGIN_INSTANCE, plugin,
 								RPC_TYPE_NP_STREAM, stream,
+								RPC_TYPE_FD, fd,
 								RPC_TYPE_STRING, fname,
 								RPC_TYPE_INVALID);
 
+  if (fd >= 0)
+	close(fd);
+
   if (error != RPC_ERROR_NO_ERROR) {
 	npw_perror("NPP_StreamAsFile() invoke", error);
 	return;
@@ -2648,8 +3447,13 @@ g_NPP_StreamAsFile(NPP instance, NPStream *stream, const char *fname)
   if (plugin == NULL)
 	return;
 
+  if (stream_is_stale(stream))
+	return;
+
   D(bugiI("NPP_StreamAsFile instance=%p\n", instance));
+  uint64_t call_start = plugin_call_begin();
   invoke_NPP_StreamAsFile(plugin, stream, fname);
+  plugin_call_end(PLUGIN_CALL_NPP_StreamAsFile, call_start);
   D(bugiD("NPP_StreamAsFile done\n"));
 }
 
@@ -2697,8 +3501,23 @@ g_NPP_WriteReady(NPP instance, NPStream *stream)
   if (plugin == NULL)
 	return 0;
 
+  if (stream_is_file_only(stream)) {
+	D(bug("NPP_WriteReady skipped for NP_ASFILEONLY stream\n"));
+	return 0x0fffffff;
+  }
+
+  // Let NPP_Write() fail so that the browser drops the stream
+  if (stream_is_stale(stream))
+	return NPERR_STREAM_BUFSIZ;
+
+  // The browser holds the data back and asks again later
+  if (plugin->hibernated)
+	return 0;
+
   D(bugiI("NPP_WriteReady instance=%p\n", instance));
+  uint64_t call_start = plugin_call_begin();
   int32_t ret = invoke_NPP_WriteReady(plugin, stream);
+  plugin_call_end(PLUGIN_CALL_NPP_WriteReady, call_start);
   D(bugiD("NPP_WriteReady return: %d\n", ret));
   return ret;
 }
@@ -2767,8 +3586,24 @@ g_NPP_Write(NPP instance, NPStream *stream, int32_t offset, int32_t len, void *b
   if (len <= 0)
 	buf = NULL;
 
+  if (stream_is_file_only(stream)) {
+	D(bug("NPP_Write skipped for NP_ASFILEONLY stream\n"));
+	return len > 0 ? len : 0;
+  }
+
+  if (stream_is_stale(stream)) {
+	D(bug("NPP_Write failed for stream from a dead viewer\n"));
+	return -1;
+  }
+
+  // The viewer reads cached data from the shared memory
+  if (stream_cache_store(stream, offset, len, buf))
+	buf = NULL;
+
   D(bugiI("NPP_Write instance=%p\n", instance));
+  uint64_t call_start = plugin_call_begin();
   int32_t ret = invoke_NPP_Write(plugin, stream, offset, len, buf);
+  plugin_call_end(PLUGIN_CALL_NPP_Write, call_start);
   D(bugiD("NPP_Write return: %d\n", ret));
   return ret;
 }
@@ -2844,7 +3679,9 @@ static void g_NPP_Print(NPP instance, NPPrint *PrintInfo)
 	return;
 
   D(bugiI("NPP_Print instance=%p\n", instance));
+  uint64_t call_start = plugin_call_begin();
   invoke_NPP_Print(plugin, PrintInfo);
+  plugin_call_end(PLUGIN_CALL_NPP_Print, call_start);
   D(bugiD("NPP_Print done\n"));
 }
 
@@ -2856,6 +3693,11 @@ static int16_t invoke_NPP_HandleEvent(PluginInstance *plugin, void *event)
 
   npw_return_val_if_fail(rpc_method_invoke_possible(plugin->connection), false);
 
+  NPEvent *npevent = event;
+  bool use_surface = npevent->type == GraphicsExpose && plugin->surface;
+  if (use_surface)
+	surface_prepare(plugin);
+
   int error = rpc_method_invoke(plugin->connection,
 								RPC_METHOD_NPP_HANDLE_EVENT,
 								RPC_TYPE_NPW_PLUGIN_INSTANCE, plugin,
@@ -2867,9 +3709,12 @@ static int16_t invoke_NPP_HandleEvent(PluginInstance *plugin, void *event)
 	return false;
   }
 
-  int32_t ret;
+  int32_t ret, buffer;
+  NPRect damage;
   error = rpc_method_wait_for_reply(plugin->connection,
 									RPC_TYPE_INT32, &ret,
+									RPC_TYPE_INT32, &buffer,
+									RPC_TYPE_NP_RECT, &damage,
 									RPC_TYPE_INVALID);
 
   if (error != RPC_ERROR_NO_ERROR) {
@@ -2877,6 +3722,9 @@ static int16_t invoke_NPP_HandleEvent(PluginInstance *plugin, void *event)
 	return false;
   }
 
+  if (use_surface && plugin->surface)
+	surface_commit(plugin, npevent->xgraphicsexpose.drawable, buffer, &damage);
+
   return ret;
 }
 
@@ -2890,7 +3738,7 @@ static int16_t g_NPP_HandleEvent(NPP instance, void *event)
 	return NPERR_INVALID_INSTANCE_ERROR;
 
   NPEvent *npevent = event;
-  if (npevent->type == GraphicsExpose) {
+  if (npevent->type == GraphicsExpose && plugin->surface == NULL) {
 	/* XXX: flush the X output buffer so that the call to
 	   gdk_pixmap_foreign_new() in the viewer can work */
 	toolkit_flush(instance);
@@ -2906,7 +3754,9 @@ static int16_t g_NPP_HandleEvent(NPP instance, void *event)
   }
 
   D(bugiI("NPP_HandleEvent instance=%p\n", instance));
+  uint64_t call_start = plugin_call_begin();
   int16_t ret = invoke_NPP_HandleEvent(plugin, event);
+  plugin_call_end(PLUGIN_CALL_NPP_HandleEvent, call_start);
   D(bugiD("NPP_HandleEvent return: %d\n", ret));
   return ret;
 }
@@ -2952,7 +3802,9 @@ g_NPP_ClearSiteData(const char* site, uint64_t flags, uint64_t maxAge)
   D(bugiI("NPP_ClearSiteData site=%s, flags=%" G_GUINT64_FORMAT
 		  ", maxAge=%" G_GUINT64_FORMAT "\n",
 		  site ? site : "<null>", flags, maxAge));
+  uint64_t call_start = plugin_call_begin();
   NPError ret = invoke_NPP_ClearSiteData(site, flags, maxAge);
+  plugin_call_end(PLUGIN_CALL_NPP_ClearSiteData, call_start);
   D(bugiD("NPP_ClearSiteData return: %d [%s]\n", ret, string_of_NPError(ret)));
   return ret;
 }
@@ -3014,7 +3866,9 @@ static char **
 g_NPP_GetSitesWithData(void)
 {
   D(bugiI("NPP_GetSitesWithData\n"));
+  uint64_t call_start = plugin_call_begin();
   char **ret = invoke_NPP_GetSitesWithData();
+  plugin_call_end(PLUGIN_CALL_NPP_GetSitesWithData, call_start);
   D(bugiD("NPP_GetSitesWithData return: %d sites\n",
 		  ret ? g_strv_length(ret) : 0));
   return ret;
@@ -3572,12 +4426,14 @@ invoke_NP_Initialize(uint32_t npapi_version,
 #undef BROWSER_FUNC
   };
 
+  // Send the user agent along, plugins often want it from NPP_New()
   int error = rpc_method_invoke(g_rpc_connection,
 								RPC_METHOD_NP_INITIALIZE,
 								RPC_TYPE_UINT32, npapi_version,
 								RPC_TYPE_ARRAY, RPC_TYPE_UINT32,
 								G_N_ELEMENTS(browser_capabilities),
 								browser_capabilities,
+								RPC_TYPE_STRING, g_NPN_UserAgent(NULL),
 								RPC_TYPE_INVALID);
 
   if (error != RPC_ERROR_NO_ERROR) {
@@ -3782,9 +4638,93 @@ NP_Shutdown(void)
 
   id_kill();
 
+  // Anything still allocated at this point is most likely leaked
+  NPW_MemDumpProfile("NP_Shutdown", true);
+  rpc_dump_stats("NP_Shutdown");
+
   return ret;
 }
 
+// Spare viewer waiting for a connection, see plugin_use_standby_viewer()
+static int g_standby_pid = -1;
+static char *g_standby_path = NULL;
+
+enum {
+  VIEWER_PRIVATE,
+  VIEWER_SHARED,						// serves all browser processes
+  VIEWER_STANDBY,						// waits until plugin_take_standby_viewer()
+};
+
+// Start a viewer listening on CONNECTION_PATH, returns its pid
+static int plugin_spawn_viewer(const char *connection_path, int kind)
+{
+  int pid = fork();
+  if (pid == 0) {
+	char *argv[8];
+	int argc = 0;
+
+	argv[argc++] = NPW_VIEWER;
+	argv[argc++] = "--plugin";
+	argv[argc++] = (char *)plugin_path;
+	argv[argc++] = "--connection";
+	argv[argc++] = (char *)connection_path;
+	if (kind == VIEWER_SHARED)
+	  argv[argc++] = "--shared";
+	argv[argc] = NULL;
+
+	npw_close_all_open_files();
+
+	// The shared viewer outlives this browser process
+	if (kind == VIEWER_SHARED) {
+	  setsid();
+	  if (fork() != 0)
+		_exit(0);
+	}
+#if defined(__linux__)
+	// Nobody would ever connect to a standby viewer of a dead browser
+	if (kind == VIEWER_STANDBY)
+	  prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+
+	execv(plugin_viewer_path, argv);
+	npw_printf("ERROR: failed to execute NSPlugin viewer\n");
+	_Exit(255);
+  }
+  return pid;
+}
+
+// Use the standby viewer, if it is still alive, as the current one
+static bool plugin_take_standby_viewer(char **connection_path)
+{
+  if (g_standby_pid < 0)
+	return false;
+
+  int pid = g_standby_pid;
+  char *path = g_standby_path;
+  g_standby_pid = -1;
+  g_standby_path = NULL;
+  if (waitpid(pid, NULL, WNOHANG) != 0) {
+	g_free(path);
+	return false;
+  }
+
+  g_free(*connection_path);
+  *connection_path = path;
+  g_plugin.viewer_pid = pid;
+  return true;
+}
+
+static void plugin_kill_standby_viewer(void)
+{
+  if (g_standby_pid > 0) {
+	kill(g_standby_pid, SIGTERM);
+	waitpid(g_standby_pid, NULL, 0);
+  }
+  g_standby_pid = -1;
+  g_free(g_standby_path);
+  g_standby_path = NULL;
+}
+
 // Initialize wrapper plugin and execute viewer
 static void plugin_init(int is_NP_Initialize)
 {
@@ -3871,37 +4811,52 @@ static void plugin_init(int is_NP_Initialize)
   if (!is_NP_Initialize)
 	return;
 
-  char *connection_path =
-	g_strdup_printf("%s/%s/%d-%d/%ld",
-					NPW_CONNECTION_PATH, plugin_file_name,
-					getpid(), init_count, random());
-
-  // Start plug-in viewer
-  if ((g_plugin.viewer_pid = fork()) == 0) {
-	char *argv[8];
-	int argc = 0;
-
-	argv[argc++] = NPW_VIEWER;
-	argv[argc++] = "--plugin";
-	argv[argc++] = (char *)plugin_path;
-	argv[argc++] = "--connection";
-	argv[argc++] = connection_path;
-	argv[argc] = NULL;
-
-	npw_close_all_open_files();
+  // Join the shared viewer, or start it if it doesn't run yet
+  char *connection_path;
+  g_rpc_connection = NULL;
+  g_plugin.viewer_pid = -1;
+  if (plugin_use_shared_viewer()) {
+	connection_path = g_strdup_printf("%s/%s/shared-%d",
+									  NPW_CONNECTION_PATH, plugin_file_name,
+									  getuid());
+	if ((g_rpc_connection = rpc_try_init_client(connection_path)) == NULL) {
+	  int pid = plugin_spawn_viewer(connection_path, VIEWER_SHARED);
+	  if (pid > 0) {
+		waitpid(pid, NULL, 0);
+		g_rpc_connection = rpc_init_client(connection_path);
+	  }
+	}
+	g_free(connection_path);
 
-	execv(plugin_viewer_path, argv);
-	npw_printf("ERROR: failed to execute NSPlugin viewer\n");
-	_Exit(255);
+	// Anybody can listen on that path, so rather use a private viewer
+	// than one of another user
+	if (g_rpc_connection && !rpc_peer_is_same_user(g_rpc_connection)) {
+	  npw_printf("WARNING: shared viewer runs as another user, using a private one\n");
+	  rpc_connection_unref(g_rpc_connection);
+	  g_rpc_connection = NULL;
+	}
+	if (g_rpc_connection == NULL)
+	  D(bug("  could not use the shared viewer\n"));
+  }
+
+  // Start plug-in viewer, or take over the standby one
+  if (g_rpc_connection == NULL) {
+	connection_path = g_strdup_printf("%s/%s/%d-%d/%ld",
+									  NPW_CONNECTION_PATH, plugin_file_name,
+									  getpid(), init_count, random());
+	if (plugin_take_standby_viewer(&connection_path))
+	  D(bug("  using standby viewer %d\n", g_plugin.viewer_pid));
+	else
+	  g_plugin.viewer_pid = plugin_spawn_viewer(connection_path, VIEWER_PRIVATE);
+
+	// Initialize browser-side RPC communication channel
+	g_rpc_connection = rpc_init_client(connection_path);
+	g_free(connection_path);
   }
-
-  // Initialize browser-side RPC communication channel
-  if ((g_rpc_connection = rpc_init_client(connection_path)) == NULL) {
+  if (g_rpc_connection == NULL) {
 	npw_printf("ERROR: failed to initialize plugin-side RPC client connection\n");
-	g_free(connection_path);
 	return;
   }
-  g_free(connection_path);
   if (rpc_add_np_marshalers(g_rpc_connection) < 0) {
 	npw_printf("ERROR: failed to initialize browser-side marshalers\n");
 	return;
@@ -4003,6 +4958,15 @@ static void plugin_init(int is_NP_Initialize)
 
   g_plugin.initialized = 1 + is_NP_Initialize;
   D(bug("--- INIT ---\n"));
+
+  // Get the next viewer ready while this one is in use
+  if (plugin_use_standby_viewer() && g_standby_pid < 0) {
+	g_standby_path = g_strdup_printf("%s/%s/%d-%d-standby/%ld",
+									 NPW_CONNECTION_PATH, plugin_file_name,
+									 getpid(), init_count, random());
+	g_standby_pid = plugin_spawn_viewer(g_standby_path, VIEWER_STANDBY);
+	D(bug("  started standby viewer %d\n", g_standby_pid));
+  }
 }
 
 // Kill NSPlugin Viewer process
@@ -4034,9 +4998,11 @@ static void plugin_exit(void)
   }
 
   if (g_plugin.viewer_pid != -1) {
-	// let it shutdown gracefully, then kill it gently to no mercy
-	const int WAITPID_DELAY_TO_SIGTERM = 3;
-	const int WAITPID_DELAY_TO_SIGKILL = 3;
+	// let it shutdown gracefully, then kill it gently to no mercy. A
+	// viewer that just died is usually reaped within a few ms, so don't
+	// sleep a whole second on the first miss (delays in 10 ms units)
+	const int WAITPID_DELAY_TO_SIGTERM = 300;
+	const int WAITPID_DELAY_TO_SIGKILL = 300;
 	int counter = 0;
 	while (waitpid(g_plugin.viewer_pid, NULL, WNOHANG) == 0) {
 	  if (++counter > WAITPID_DELAY_TO_SIGTERM) {
@@ -4047,11 +5013,11 @@ static void plugin_exit(void)
 			kill(g_plugin.viewer_pid, SIGKILL);
 			break;
 		  }
-		  sleep(1);
+		  usleep(10000);
 		}
 		break;
 	  }
-	  sleep(1);
+	  usleep(10000);
 	}
 	g_plugin.viewer_pid = -1;
   }
@@ -4061,7 +5027,9 @@ static void plugin_exit(void)
 
 static void __attribute__((destructor)) plugin_exit_sentinel(void)
 {
+  plugin_call_stats_dump();
   plugin_exit();
+  plugin_kill_standby_viewer();
 
   if (plugin_handle) {
 	dlclose(plugin_handle);
@@ -4111,6 +5079,7 @@ static void plugin_kill_cb(rpc_connection_t *connection, void *user_data)
   rpc_connection_set_error_callback(connection, NULL, NULL);
 
   plugin_kill();
+  plugin_schedule_recovery();
 }
 
 static NPError plugin_start(void)
@@ -4125,6 +5094,7 @@ static NPError plugin_start(void)
   plugin_killed = 0;
 
   // And start it again
+  ++g_viewer_generation;
   plugin_init(1);
   if (g_plugin.initialized <= 0)
 	return NPERR_MODULE_LOAD_FAILED_ERROR;
@@ -4140,23 +5110,130 @@ static NPError plugin_start(void)
   return ret;
 }
 
+static void plugin_recover_timer_cb(NPP instance, uint32_t timer_id)
+{
+  if (instance != g_recovery_instance || timer_id != g_recovery_timer)
+	return;
+  g_recovery_instance = NULL;
+  plugin_start_if_needed();
+}
+
+// Restart the viewer in DELAY ms, unless a restart is pending already
+static void plugin_schedule_recovery_timer(uint32_t delay)
+{
+  if (g_recovery_instance != NULL || g_plugin_instances == NULL)
+	return;
+  if (mozilla_funcs.scheduletimer == NULL || mozilla_funcs.unscheduletimer == NULL)
+	return;
+
+  PluginInstance *plugin = g_plugin_instances->data;
+  g_recovery_instance = PLUGIN_INSTANCE_NPP(plugin);
+  g_recovery_timer = mozilla_funcs.scheduletimer(g_recovery_instance, delay, false,
+												 plugin_recover_timer_cb);
+}
+
 static NPError plugin_start_if_needed(void)
 {
   if (PLUGIN_DIRECT_EXEC)
 	return NPERR_NO_ERROR;
 
   if (rpc_status(g_rpc_connection) != RPC_STATUS_ACTIVE) {
-	static time_t last_restart = 0;
-	time_t now = time(NULL);
-	if (now - last_restart < MIN_RESTART_INTERVAL)
+	static uint64_t last_restart = 0;
+	uint64_t now = npw_get_time_us();
+	if (last_restart && now - last_restart < MIN_RESTART_INTERVAL * 1000000ULL) {
+	  // Don't give up on the instances, come back when it's time
+	  uint32_t delay = (last_restart + MIN_RESTART_INTERVAL * 1000000ULL - now + 999) / 1000;
+	  plugin_schedule_recovery_timer(delay);
 	  return NPERR_GENERIC_ERROR;
+	}
 	last_restart = now;
 
 	D(bug("Restart plugins viewer\n"));
+	uint64_t start_time = npw_get_time_us();
 	NPError ret = plugin_start();
 	D(bug(" return: %d [%s]\n", ret, string_of_NPError(ret)));
+	if (ret == NPERR_NO_ERROR)
+	  plugin_recover_instances(start_time);
 	return ret;
   }
 
   return NPERR_NO_ERROR;
 }
+
+// Create PLUGIN again in the new viewer
+static bool plugin_replay(PluginInstance *plugin)
+{
+  NPP instance = PLUGIN_INSTANCE_NPP(plugin);
+
+  rpc_connection_unref(plugin->connection);
+  plugin->connection = rpc_connection_ref(g_rpc_connection);
+  surface_destroy(plugin);
+
+  NPError ret = invoke_NPP_New(plugin, plugin->mime_type, plugin->mode,
+							   plugin->argc, plugin->argn, plugin->argv, NULL);
+  if (ret != NPERR_NO_ERROR) {
+	D(bug("replay of NPP_New failed: %d [%s]\n", ret, string_of_NPError(ret)));
+	return false;
+  }
+  plugin->hibernated = false;
+  if (plugin->has_window) {
+	invoke_NPP_SetWindow(plugin, &plugin->window);
+	plugin_update_visibility(plugin, &plugin->window);
+  }
+
+  // The browser sends new streams, the old ones fail on NPP_Write()
+  GList *urls = NULL;
+  if (plugin->src_url)
+	urls = g_list_append(urls, plugin->src_url);
+  for (GList *l = plugin->streams; l != NULL; l = l->next) {
+	StreamInstance *stream_pdata = l->data;
+	const char *url = stream_pdata->stream->url;
+	if (url && g_list_find_custom(urls, url, (GCompareFunc)strcmp) == NULL)
+	  urls = g_list_append(urls, (char *)url);
+  }
+  for (GList *l = urls; l != NULL; l = l->next)
+	g_NPN_GetURL(instance, l->data, NULL);
+  g_list_free(urls);
+  return true;
+}
+
+static void plugin_recover_instances(uint64_t start_time)
+{
+  // NPP_Destroy() may be called for any instance meanwhile
+  GList *plugins = g_list_copy(g_plugin_instances);
+  for (GList *l = plugins; l != NULL; l = l->next)
+	npw_plugin_instance_ref(l->data);
+
+  int n_instances = 0, n_recovered = 0;
+  for (GList *l = plugins; l != NULL; l = l->next) {
+	PluginInstance *plugin = l->data;
+	if (npw_plugin_instance_is_valid(plugin) && plugin->instance
+		&& plugin->connection != g_rpc_connection) {
+	  ++n_instances;
+	  if (plugin_replay(plugin))
+		++n_recovered;
+	}
+	npw_plugin_instance_unref(plugin);
+  }
+  g_list_free(plugins);
+
+  if (n_instances > 0)
+	npw_dprintf("Recovered %d of %d plugin instances in %.1f ms\n",
+				n_recovered, n_instances, (npw_get_time_us() - start_time) / 1000.0);
+}
+
+static void plugin_recover_cb(void *user_data)
+{
+  plugin_start_if_needed();
+}
+
+// Restart the viewer from the browser main loop, instead of waiting
+// for the next NPP_New()
+static void plugin_schedule_recovery(void)
+{
+  if (g_plugin_instances == NULL || mozilla_funcs.pluginthreadasynccall == NULL)
+	return;
+
+  PluginInstance *plugin = g_plugin_instances->data;
+  mozilla_funcs.pluginthreadasynccall(PLUGIN_INSTANCE_NPP(plugin), plugin_recover_cb, NULL);
+}
@@ -0,0 +1,67 @@
+/*
+ *  rpc-trace.h - RPC trace file format (NPW_RPC_TRACE)
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef RPC_TRACE_H
+#define RPC_TRACE_H
+
+// A trace file is a header followed by records, all in host byte
+// order. It is meant to be read back on the machine that recorded it.
+
+#define RPC_TRACE_MAGIC		"NPWTRACE"
+#define RPC_TRACE_VERSION	1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  int32_t pid;
+  uint32_t reserved;
+  char component[16];
+} rpc_trace_header_t;
+
+// Record types
+enum {
+  RPC_TRACE_PADDING			= 0,	// ring buffer only, never written out
+  RPC_TRACE_INVOKE_SEND		= 1,	// rpc_method_invoke()
+  RPC_TRACE_INVOKE_RECV		= 2,	// rpc_method_get_args()
+  RPC_TRACE_REPLY_SEND		= 3,	// rpc_method_send_reply()
+  RPC_TRACE_REPLY_RECV		= 4,	// rpc_method_wait_for_reply()
+  RPC_TRACE_METHOD_NAME		= 5,	// payload is the method name
+  RPC_TRACE_DROPPED			= 6,	// payload_size records were lost
+};
+
+// The payload is the <method-args> block (MESSAGE_ARGS .. MESSAGE_END)
+// as found on the wire, or nothing if the message had no arguments.
+// Only its first payload_captured bytes follow the record header.
+typedef struct {
+  uint32_t size;					// header, payload and padding to 8 bytes
+  uint16_t type;
+  uint16_t depth;					// nesting level, 1 for top-level calls
+  int32_t method;
+  int32_t connection;				// socket of the connection
+  uint32_t payload_size;
+  uint32_t payload_captured;
+  uint64_t start_ns;				// CLOCK_MONOTONIC
+  uint64_t end_ns;
+} rpc_trace_record_t;
+
+#define RPC_TRACE_ALIGN(size)	(((size) + 7) & ~7)
+
+#endif /* RPC_TRACE_H */
@@ -27,11 +27,13 @@
  *  - split for windows rpc support
  */
 
+#define _GNU_SOURCE 1 /* SO_PEERCRED */
 #include "sysdeps.h"
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <unistd.h>
@@ -47,6 +49,7 @@
 #include <time.h>
 
 #include "rpc.h"
+#include "rpc-trace.h"
 #include "utils.h"
 
 #define DEBUG 0
@@ -431,6 +434,458 @@ static int rpc_map_insert(rpc_map_t *map, int key, void *value)
 }
 
 
+/* ====================================================================== */
+/* === RPC Statistics                                                 === */
+/* ====================================================================== */
+
+// Methods with larger IDs are accounted in the last slot
+#define RPC_STATS_MAX_METHODS 128
+
+// Maximum depth of nested invocations whose method is tracked
+#define RPC_STATS_MAX_DEPTH 32
+
+typedef struct {
+  uint64_t calls_out;					// invoked from this side
+  uint64_t calls_in;					// handled on this side
+  uint64_t bytes_sent;					// arguments and replies, not headers
+  uint64_t bytes_recv;
+  NPW_Histogram wait_time;				// blocked in rpc_method_wait_for_reply()
+} rpc_method_stats_t;
+
+static rpc_method_stats_t *g_rpc_stats;
+static const char *g_rpc_stats_file;
+static rpc_method_name_func_t g_rpc_method_name_func;
+static volatile sig_atomic_t g_rpc_stats_dump_requested;
+
+static void rpc_stats_sigusr2(int sig)
+{
+  // Only record the request, the report is printed on the next
+  // dispatch or invocation, from a safe context
+  g_rpc_stats_dump_requested = 1;
+}
+
+// NPW_RPC_STATS=yes prints statistics to the log, any other value
+// (but "no") names a file they get appended to
+static bool _rpc_stats_enabled(void)
+{
+  const char *stats_str = getenv("NPW_RPC_STATS");
+  if (stats_str == NULL || *stats_str == '\0')
+	return false;
+  if (strcmp(stats_str, "no") == 0 || strcmp(stats_str, "0") == 0)
+	return false;
+  if (strcmp(stats_str, "yes") != 0 && strcmp(stats_str, "1") != 0)
+	g_rpc_stats_file = stats_str;
+
+  if ((g_rpc_stats = (rpc_method_stats_t *)calloc(RPC_STATS_MAX_METHODS, sizeof(*g_rpc_stats))) == NULL)
+	return false;
+
+  // Don't override a SIGUSR2 handler the application installed
+  struct sigaction sa;
+  if (sigaction(SIGUSR2, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = rpc_stats_sigusr2;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR2, &sa, NULL);
+  }
+  return true;
+}
+
+static inline bool rpc_stats_enabled(void)
+{
+  static int enabled = -1;
+  if (enabled < 0)
+	enabled = _rpc_stats_enabled();
+  return enabled;
+}
+
+static inline rpc_method_stats_t *rpc_stats_lookup(int method)
+{
+  if (method < 0 || method >= RPC_STATS_MAX_METHODS)
+	method = RPC_STATS_MAX_METHODS - 1;
+  return &g_rpc_stats[method];
+}
+
+// Set the function mapping method IDs to names in the report
+void rpc_set_method_name_func(rpc_method_name_func_t func)
+{
+  g_rpc_method_name_func = func;
+}
+
+static G_GNUC_PRINTF(2, 3) void rpc_stats_printf(FILE *fp, const char *format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  if (fp)
+	vfprintf(fp, format, args);
+  else
+	npw_vprintf(format, args);
+  va_end(args);
+}
+
+static bool g_rpc_stats_dumped = false;
+
+// Print per-method statistics, if NPW_RPC_STATS is set
+void rpc_dump_stats(const char *reason)
+{
+  if (!rpc_stats_enabled())
+	return;
+  g_rpc_stats_dumped = true;
+
+  FILE *fp = NULL;
+  if (g_rpc_stats_file && (fp = fopen(g_rpc_stats_file, "a")) == NULL)
+	npw_printf("ERROR: could not open RPC statistics file %s\n", g_rpc_stats_file);
+
+  rpc_stats_printf(fp, "# RPC statistics for %s (pid %d), %s\n",
+				   NPW_COMPONENT_NAME, getpid(), reason);
+  rpc_stats_printf(fp, "# %-38s %9s %9s %12s %12s %9s %9s %9s\n",
+				   "method", "calls-out", "calls-in", "bytes-sent", "bytes-recv",
+				   "waits", "avg-us", "max-us");
+
+  GString *buckets = g_string_new(NULL);
+  for (int i = 0; i < RPC_STATS_MAX_METHODS; i++) {
+	const rpc_method_stats_t *stats = &g_rpc_stats[i];
+	if (stats->calls_out == 0 && stats->calls_in == 0)
+	  continue;
+
+	char name_buf[32];
+	const char *name = NULL;
+	if (i == RPC_STATS_MAX_METHODS - 1)
+	  name = "<other>";
+	else if (g_rpc_method_name_func)
+	  name = g_rpc_method_name_func(i);
+	if (name == NULL) {
+	  snprintf(name_buf, sizeof(name_buf), "method-%d", i);
+	  name = name_buf;
+	}
+
+	const NPW_Histogram *wait_time = &stats->wait_time;
+	rpc_stats_printf(fp, "%-40s %9" PRIu64 " %9" PRIu64 " %12" PRIu64 " %12" PRIu64
+					 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n",
+					 name, stats->calls_out, stats->calls_in,
+					 stats->bytes_sent, stats->bytes_recv, wait_time->count,
+					 wait_time->count ? wait_time->total / wait_time->count : 0,
+					 wait_time->max);
+
+	// Non-empty log2 buckets of the wait time, as [lo, hi) us:count
+	if (wait_time->count == 0)
+	  continue;
+	g_string_assign(buckets, "  wait-us");
+	for (int j = 0; j < NPW_HISTOGRAM_BUCKETS; j++) {
+	  if (wait_time->buckets[j] == 0)
+		continue;
+	  uint64_t lo = j > 0 ? UINT64_C(1) << (j - 1) : 0;
+	  g_string_append_printf(buckets, " [%" PRIu64 ",%" PRIu64 "):%u",
+							 lo, UINT64_C(1) << j, wait_time->buckets[j]);
+	}
+	rpc_stats_printf(fp, "%s\n", buckets->str);
+  }
+  g_string_free(buckets, TRUE);
+
+  if (fp)
+	fclose(fp);
+}
+
+static void rpc_stats_check_dump(void)
+{
+  if (g_rpc_stats_dump_requested) {
+	g_rpc_stats_dump_requested = 0;
+	rpc_dump_stats("SIGUSR2");
+  }
+}
+
+static void __attribute__((destructor)) rpc_stats_sentinel(void)
+{
+  // Processes that never reached NP_Shutdown
+  if (!g_rpc_stats_dumped && g_rpc_stats)
+	rpc_dump_stats("exit");
+}
+
+
+/* ====================================================================== */
+/* === RPC Tracing                                                    === */
+/* ====================================================================== */
+
+// Minimal size of the trace ring buffer, must be a power of two
+#define RPC_TRACE_RING_SIZE (4 * 1024 * 1024)
+
+// Maximum number of payload bytes captured with NPW_RPC_TRACE_PAYLOAD=yes
+#define RPC_TRACE_PAYLOAD_MAX (1024 * 1024)
+
+// Interval between two flushes of the ring buffer (in milliseconds)
+#define RPC_TRACE_FLUSH_INTERVAL 10
+
+// Set in the size of a ring buffer record once it is complete
+#define RPC_TRACE_COMMITTED 0x80000000
+
+typedef struct {
+  uint8_t *ring;
+  uint32_t ring_size;
+  volatile uint32_t head;				// reserved by producers
+  volatile uint32_t tail;				// consumed by the flusher thread
+  volatile uint32_t n_dropped;
+  uint32_t n_dropped_written;
+  uint32_t payload_max;
+  int fd;
+  pid_t pid;
+  pthread_t thread;
+  volatile int stop;
+  uint8_t method_names[RPC_STATS_MAX_METHODS];
+  uint32_t out_length;
+  uint8_t out[65536];
+} rpc_trace_t;
+
+static rpc_trace_t *g_rpc_trace;
+
+static inline uint64_t rpc_trace_time_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void rpc_trace_write_out(rpc_trace_t *trace, const void *data, uint32_t size)
+{
+  const uint8_t *ptr = (const uint8_t *)data;
+  while (size > 0) {
+	ssize_t n = write(trace->fd, ptr, size);
+	if (n < 0) {
+	  if (errno == EINTR)
+		continue;
+	  break;
+	}
+	ptr += n;
+	size -= n;
+  }
+}
+
+static void rpc_trace_write(rpc_trace_t *trace, const void *data, uint32_t size)
+{
+  if (trace->out_length + size > sizeof(trace->out)) {
+	rpc_trace_write_out(trace, trace->out, trace->out_length);
+	trace->out_length = 0;
+	if (size > sizeof(trace->out)) {
+	  rpc_trace_write_out(trace, data, size);
+	  return;
+	}
+  }
+  memcpy(trace->out + trace->out_length, data, size);
+  trace->out_length += size;
+}
+
+// Move committed records from the ring buffer to the trace file. This
+// is only called from the flusher thread, or once it is stopped.
+static void rpc_trace_drain(rpc_trace_t *trace)
+{
+  const uint32_t mask = trace->ring_size - 1;
+  uint32_t tail = trace->tail;
+  while (tail != trace->head) {
+	rpc_trace_record_t *record = (rpc_trace_record_t *)(trace->ring + (tail & mask));
+	uint32_t size = *(volatile uint32_t *)&record->size;
+	if ((size & RPC_TRACE_COMMITTED) == 0)
+	  break;
+	__sync_synchronize();
+	size &= ~RPC_TRACE_COMMITTED;
+	if (record->type != RPC_TRACE_PADDING) {
+	  record->size = size;
+	  rpc_trace_write(trace, record, size);
+	}
+	// the next producer at this offset must not find it committed
+	record->size = 0;
+	__sync_synchronize();
+	tail += size;
+	trace->tail = tail;
+  }
+
+  uint32_t n_dropped = trace->n_dropped;
+  if (n_dropped != trace->n_dropped_written) {
+	rpc_trace_record_t record;
+	memset(&record, 0, sizeof(record));
+	record.size = sizeof(record);
+	record.type = RPC_TRACE_DROPPED;
+	record.payload_size = n_dropped - trace->n_dropped_written;
+	record.start_ns = record.end_ns = rpc_trace_time_ns();
+	rpc_trace_write(trace, &record, sizeof(record));
+	trace->n_dropped_written = n_dropped;
+  }
+
+  rpc_trace_write_out(trace, trace->out, trace->out_length);
+  trace->out_length = 0;
+}
+
+static void *rpc_trace_thread(void *arg)
+{
+  rpc_trace_t *trace = (rpc_trace_t *)arg;
+  while (!trace->stop) {
+	rpc_trace_drain(trace);
+	rpc_delay(RPC_TRACE_FLUSH_INTERVAL * 1000);
+  }
+  return NULL;
+}
+
+// NPW_RPC_TRACE=PREFIX records the messages of this process to
+// PREFIX.<pid>. NPW_RPC_TRACE_PAYLOAD=yes or a number of bytes also
+// records the arguments of each message, up to that size.
+static bool _rpc_trace_enabled(void)
+{
+  const char *prefix = getenv("NPW_RPC_TRACE");
+  if (prefix == NULL || *prefix == '\0')
+	return false;
+
+  uint32_t payload_max = 0;
+  const char *payload_str = getenv("NPW_RPC_TRACE_PAYLOAD");
+  if (payload_str) {
+	if (strcmp(payload_str, "yes") == 0)
+	  payload_max = RPC_TRACE_PAYLOAD_MAX;
+	else if (strcmp(payload_str, "no") != 0)
+	  payload_max = MIN(strtoul(payload_str, NULL, 10), 64 * 1024 * 1024);
+  }
+
+  // A record with its payload never takes more than a quarter of the ring
+  uint32_t ring_size = RPC_TRACE_RING_SIZE;
+  while (ring_size / 4 < sizeof(rpc_trace_record_t) + RPC_TRACE_ALIGN(payload_max))
+	ring_size *= 2;
+
+  rpc_trace_t *trace;
+  if ((trace = (rpc_trace_t *)calloc(1, sizeof(*trace))) == NULL)
+	return false;
+  if ((trace->ring = (uint8_t *)calloc(1, ring_size)) == NULL) {
+	free(trace);
+	return false;
+  }
+  trace->ring_size = ring_size;
+  trace->payload_max = payload_max;
+  trace->pid = getpid();
+
+  char *path = g_strdup_printf("%s.%d", prefix, trace->pid);
+  if ((trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+	npw_printf("ERROR: could not create RPC trace file %s\n", path);
+	g_free(path);
+	free(trace->ring);
+	free(trace);
+	return false;
+  }
+  g_free(path);
+  fcntl(trace->fd, F_SETFD, FD_CLOEXEC);
+
+  rpc_trace_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RPC_TRACE_MAGIC, sizeof(header.magic));
+  header.version = RPC_TRACE_VERSION;
+  header.header_size = sizeof(header);
+  header.pid = trace->pid;
+  strncpy(header.component, NPW_COMPONENT_NAME, sizeof(header.component) - 1);
+  rpc_trace_write_out(trace, &header, sizeof(header));
+
+  if (pthread_create(&trace->thread, NULL, rpc_trace_thread, trace) != 0) {
+	npw_printf("ERROR: could not start RPC trace thread\n");
+	close(trace->fd);
+	free(trace->ring);
+	free(trace);
+	return false;
+  }
+
+  g_rpc_trace = trace;
+  return true;
+}
+
+static inline bool rpc_trace_enabled(void)
+{
+  static int enabled = -1;
+  if (enabled < 0)
+	enabled = _rpc_trace_enabled();
+  return enabled;
+}
+
+static inline bool rpc_trace_payload_enabled(void)
+{
+  return rpc_trace_enabled() && g_rpc_trace->payload_max > 0;
+}
+
+// Reserve SIZE bytes in the ring buffer, or return NULL if it is full.
+// Records never wrap around, the end of the ring is padded instead.
+static uint8_t *rpc_trace_reserve(rpc_trace_t *trace, uint32_t size)
+{
+  const uint32_t mask = trace->ring_size - 1;
+  uint32_t head, offset, padding;
+  do {
+	head = trace->head;
+	offset = head & mask;
+	padding = offset + size > trace->ring_size ? trace->ring_size - offset : 0;
+	if (head + padding + size - trace->tail > trace->ring_size) {
+	  __sync_fetch_and_add(&trace->n_dropped, 1);
+	  return NULL;
+	}
+  } while (!__sync_bool_compare_and_swap(&trace->head, head, head + padding + size));
+
+  if (padding) {
+	rpc_trace_record_t *record = (rpc_trace_record_t *)(trace->ring + offset);
+	record->type = RPC_TRACE_PADDING;
+	__sync_synchronize();
+	record->size = padding | RPC_TRACE_COMMITTED;
+  }
+  return trace->ring + ((head + padding) & mask);
+}
+
+static void rpc_trace_add(int type, int depth, int method, int connection,
+						  const uint8_t *payload, uint32_t payload_size, uint32_t payload_captured,
+						  uint64_t start_ns, uint64_t end_ns)
+{
+  rpc_trace_t *trace = g_rpc_trace;
+  uint32_t size = RPC_TRACE_ALIGN(sizeof(rpc_trace_record_t) + payload_captured);
+  rpc_trace_record_t *record = (rpc_trace_record_t *)rpc_trace_reserve(trace, size);
+  if (record == NULL)
+	return;
+
+  record->type = type;
+  record->depth = depth;
+  record->method = method;
+  record->connection = connection;
+  record->payload_size = payload_size;
+  record->payload_captured = payload_captured;
+  record->start_ns = start_ns;
+  record->end_ns = end_ns;
+  if (payload_captured > 0)
+	memcpy(record + 1, payload, payload_captured);
+  __sync_synchronize();
+  record->size = size | RPC_TRACE_COMMITTED;
+}
+
+// Record a message. Method names are recorded on first use so that
+// trace files can be read without the method tables.
+static void rpc_trace_message(int type, int depth, int method, int connection,
+							  GByteArray *payload, uint32_t payload_size, uint64_t start_ns)
+{
+  rpc_trace_t *trace = g_rpc_trace;
+  uint64_t end_ns = rpc_trace_time_ns();
+
+  if (method >= 0 && method < RPC_STATS_MAX_METHODS && !trace->method_names[method]) {
+	trace->method_names[method] = 1;
+	const char *name = g_rpc_method_name_func ? g_rpc_method_name_func(method) : NULL;
+	if (name)
+	  rpc_trace_add(RPC_TRACE_METHOD_NAME, 0, method, connection,
+					(const uint8_t *)name, strlen(name), strlen(name), start_ns, start_ns);
+  }
+
+  uint32_t payload_captured = payload ? MIN(payload->len, payload_size) : 0;
+  rpc_trace_add(type, depth, method, connection,
+				payload ? payload->data : NULL, payload_size, payload_captured,
+				start_ns, end_ns);
+}
+
+static void __attribute__((destructor)) rpc_trace_sentinel(void)
+{
+  rpc_trace_t *trace = g_rpc_trace;
+  if (trace == NULL || trace->pid != getpid())
+	return;
+  trace->stop = 1;
+  pthread_join(trace->thread, NULL);
+  rpc_trace_drain(trace);
+  close(trace->fd);
+  g_rpc_trace = NULL;
+}
+
+
 /* ====================================================================== */
 /* === RPC Connection Handling                                        === */
 /* ====================================================================== */
@@ -462,6 +917,9 @@ struct rpc_connection {
   int handle_depth;
   bool is_sync;
   int pending_sync_depth;
+  int dispatch_method;
+  int invoke_methods[RPC_STATS_MAX_DEPTH];
+  GByteArray *trace_payload;
 };
 
 // Increment connection reference count
@@ -670,6 +1128,7 @@ static rpc_connection_t *rpc_connection_new(int type, const char *ident)
   connection->handle_depth = 0;
   connection->is_sync = false;
   connection->pending_sync_depth = 0;
+  connection->dispatch_method = -1;
 
   if ((connection->types = rpc_map_new_full((free))) == NULL) {
 	rpc_exit(connection);
@@ -756,6 +1215,10 @@ static void rpc_connection_destroy(rpc_connection_t *connection)
 	rpc_map_destroy(connection->methods);
 	connection->methods = NULL;
   }
+  if (connection->trace_payload) {
+	g_byte_array_free(connection->trace_payload, TRUE);
+	connection->trace_payload = NULL;
+  }
 
   free(connection);
 }
@@ -786,25 +1249,21 @@ rpc_connection_t *rpc_init_server(const char *ident)
   return connection;
 }
 
-// Initialize client-side RPC system
-rpc_connection_t *rpc_init_client(const char *ident)
-{
-  D(bug("rpc_init_client ident='%s'\n", ident));
+// Connect to the server, retrying every N_CONNECT_WAIT_DELAY ms
+static const int N_CONNECT_WAIT_DELAY = 10;
 
+static rpc_connection_t *_rpc_init_client(const char *ident, int n_connect_attempts)
+{
   rpc_connection_t *connection;
 
   if ((connection = rpc_connection_new(RPC_CONNECTION_CLIENT, ident)) == NULL)
 	return NULL;
 
-  // Wait at most RPC_INIT_TIMEOUT seconds for server to initialize
-  const int N_CONNECT_WAIT_DELAY = 10;
-  int n_connect_attempts = (rpc_init_timeout() * 1000) / N_CONNECT_WAIT_DELAY;
-  if (n_connect_attempts == 0)
-	n_connect_attempts = 1;
   while (n_connect_attempts > 0) {
 	if (connect(connection->socket, (struct sockaddr *)&connection->socket_addr, connection->socket_addr_len) == 0)
 	  break;
-	if (n_connect_attempts > 1 && errno != ECONNREFUSED && errno != ENOENT) {
+	// A shared server may have other clients pending
+	if (n_connect_attempts > 1 && errno != ECONNREFUSED && errno != ENOENT && errno != EAGAIN) {
 	  perror("client_connect");
 	  rpc_exit(connection);
 	  return NULL;
@@ -821,6 +1280,26 @@ rpc_connection_t *rpc_init_client(const char *ident)
   return connection;
 }
 
+// Initialize client-side RPC system
+rpc_connection_t *rpc_init_client(const char *ident)
+{
+  D(bug("rpc_init_client ident='%s'\n", ident));
+
+  // Wait at most RPC_INIT_TIMEOUT seconds for server to initialize
+  int n_connect_attempts = (rpc_init_timeout() * 1000) / N_CONNECT_WAIT_DELAY;
+  if (n_connect_attempts == 0)
+	n_connect_attempts = 1;
+  return _rpc_init_client(ident, n_connect_attempts);
+}
+
+// Initialize client-side RPC system, if the server is up already
+rpc_connection_t *rpc_try_init_client(const char *ident)
+{
+  D(bug("rpc_try_init_client ident='%s'\n", ident));
+
+  return _rpc_init_client(ident, 1);
+}
+
 // Close RPC connection
 int rpc_exit(rpc_connection_t *connection)
 {
@@ -898,6 +1377,76 @@ int rpc_listen_socket(rpc_connection_t *connection)
   return connection->socket;
 }
 
+// Wait for a client to connect, TIMEOUT is in microseconds
+int rpc_wait_accept(rpc_connection_t *connection, int timeout)
+{
+  if (connection == NULL)
+	return RPC_ERROR_CONNECTION_NULL;
+  if (connection->type != RPC_CONNECTION_SERVER)
+	return RPC_ERROR_CONNECTION_TYPE_MISMATCH;
+  if (connection->server_socket < 0)
+	return RPC_ERROR_GENERIC;
+
+  int ret = rpc_poll(RPC_POLL_READ, connection->server_socket, timeout);
+  return ret >= 0 ? ret : RPC_ERROR_ERRNO_SET;
+}
+
+// Close the socket of the accepted client, the server keeps listening.
+// This and rpc_close_listen_socket() split a server that forks a
+// process per client
+int rpc_close_socket(rpc_connection_t *connection)
+{
+  D(bug("rpc_close_socket\n"));
+
+  if (connection == NULL)
+	return RPC_ERROR_CONNECTION_NULL;
+
+  if (connection->socket != -1) {
+	close(connection->socket);
+	connection->socket = -1;
+  }
+  return RPC_ERROR_NO_ERROR;
+}
+
+// Stop listening for clients, only keep the accepted one
+int rpc_close_listen_socket(rpc_connection_t *connection)
+{
+  D(bug("rpc_close_listen_socket\n"));
+
+  if (connection == NULL)
+	return RPC_ERROR_CONNECTION_NULL;
+  if (connection->type != RPC_CONNECTION_SERVER)
+	return RPC_ERROR_CONNECTION_TYPE_MISMATCH;
+
+  if (connection->server_socket != -1) {
+	close(connection->server_socket);
+	connection->server_socket = -1;
+  }
+  // The socket file belongs to whoever still listens
+  if (connection->socket_path) {
+	free(connection->socket_path);
+	connection->socket_path = NULL;
+  }
+  return RPC_ERROR_NO_ERROR;
+}
+
+// Check the peer runs as the same user as we do
+bool rpc_peer_is_same_user(rpc_connection_t *connection)
+{
+  if (connection == NULL || connection->socket < 0)
+	return false;
+
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if (getsockopt(connection->socket, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0)
+	return false;
+  return cred.uid == getuid();
+#else
+  return true;
+#endif
+}
+
 // Listen for incoming messages on RPC connection
 #ifdef USE_THREADS
 int rpc_listen(rpc_connection_t *connection)
@@ -934,6 +1483,10 @@ struct rpc_message_t {
   const rpc_map_t *types;
   int socket;
   int offset;
+  size_t n_bytes;
+  bool trace_active;					// counting <method-args> bytes
+  uint32_t trace_bytes;
+  GByteArray *trace_payload;
   unsigned char buffer[BUFSIZ];
 };
 
@@ -991,6 +1544,50 @@ static inline void rpc_message_init(rpc_message_t *message, rpc_connection_t *co
   message->types  = connection->types;
   message->socket = connection->socket;
   message->offset = 0;
+  message->n_bytes = 0;
+  message->trace_active = false;
+  message->trace_bytes = 0;
+  message->trace_payload = NULL;
+}
+
+// Start counting, and capturing if NPW_RPC_TRACE_PAYLOAD is set, the
+// bytes of the <method-args> block. Messages of a connection never
+// overlap there, so they all share the same capture buffer.
+static void rpc_message_trace_begin(rpc_message_t *message, rpc_connection_t *connection)
+{
+  message->trace_active = true;
+  message->trace_bytes = 0;
+  if (rpc_trace_payload_enabled()) {
+	if (connection->trace_payload == NULL)
+	  connection->trace_payload = g_byte_array_new();
+	g_byte_array_set_size(connection->trace_payload, 0);
+	message->trace_payload = connection->trace_payload;
+  }
+}
+
+static inline void rpc_message_trace_end(rpc_message_t *message)
+{
+  message->trace_active = false;
+}
+
+// Record the message in the trace, METHOD being the method invoked
+// or handled, nested calls adding one level of depth
+static void rpc_message_trace_commit(rpc_message_t *message, rpc_connection_t *connection,
+									 int type, int method, uint64_t start_ns)
+{
+  rpc_trace_message(type, connection->invoke_depth + connection->dispatch_depth,
+					method, connection->socket,
+					message->trace_payload, message->trace_bytes, start_ns);
+}
+
+static inline void rpc_message_trace_bytes(rpc_message_t *message, const unsigned char *bytes, int count)
+{
+  if (G_LIKELY(!message->trace_active))
+	return;
+  message->trace_bytes += count;
+  GByteArray *payload = message->trace_payload;
+  if (payload && payload->len < g_rpc_trace->payload_max)
+	g_byte_array_append(payload, bytes, MIN(count, g_rpc_trace->payload_max - payload->len));
 }
 
 // Send BYTES
@@ -1001,6 +1598,7 @@ static inline int _rpc_message_send_bytes(rpc_message_t *message, unsigned char
 	if (n >= 0) { // XXX is this correct behaviour for n == 0?
 	  count -= n;
 	  bytes += n;
+	  message->n_bytes += n;
 	}
 	else {
 	  if (errno == ECONNRESET)
@@ -1033,6 +1631,7 @@ static inline int rpc_message_flush(rpc_message_t *message)
 // Send BYTES
 int rpc_message_send_bytes(rpc_message_t *message, unsigned char *bytes, int count)
 {
+  rpc_message_trace_bytes(message, bytes, count);
   if (message->offset + count >= sizeof(message->buffer)) {
 	int error = rpc_message_flush(message);
 	if (error != RPC_ERROR_NO_ERROR)
@@ -1116,6 +1715,65 @@ int rpc_message_send_string(rpc_message_t *message, const char *str)
   return RPC_ERROR_NO_ERROR;
 }
 
+// Send FD
+// The descriptor travels as SCM_RIGHTS ancillary data attached to a
+// single marker byte, which is non-zero if a descriptor follows. The
+// caller keeps ownership of FD
+int rpc_message_send_fd(rpc_message_t *message, int fd)
+{
+  D(bug("  send FD %d\n", fd));
+
+  // The marker byte must not be merged with previously buffered data
+  int error = rpc_message_flush(message);
+  if (error != RPC_ERROR_NO_ERROR)
+	return error;
+
+  unsigned char marker = fd >= 0;
+  struct iovec iov;
+  iov.iov_base = &marker;
+  iov.iov_len = 1;
+  union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd >= 0) {
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+
+  for (;;) {
+	int n = sendmsg(message->socket, &msg, 0);
+	if (n == 1)
+	  break;
+	if (n < 0) {
+	  if (errno == ECONNRESET)
+		return RPC_ERROR_CONNECTION_CLOSED;
+	  else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		int ret = rpc_poll(RPC_POLL_WRITE, message->socket, rpc_message_timeout() * 1000000);
+		if (ret > 0)
+		  continue;
+		if (ret == 0)
+		  return RPC_ERROR_MESSAGE_TIMEOUT;
+	  }
+	  if (errno == EINTR)
+		continue;
+	  return RPC_ERROR_ERRNO_SET;
+	}
+  }
+  message->n_bytes++;
+  rpc_message_trace_bytes(message, &marker, 1);
+  return RPC_ERROR_NO_ERROR;
+}
+
 // Send message arguments
 static int rpc_message_send_args(rpc_message_t *message, va_list args)
 {
@@ -1150,6 +1808,9 @@ static int rpc_message_send_args(rpc_message_t *message, va_list args)
 	case RPC_TYPE_STRING:
 	  error = rpc_message_send_string(message, va_arg(args, char *));
 	  break;
+	case RPC_TYPE_FD:
+	  error = rpc_message_send_fd(message, va_arg(args, int));
+	  break;
 	case RPC_TYPE_ARRAY: {
 	  int i;
 	  int array_type = va_arg(args, int32_t);
@@ -1251,11 +1912,14 @@ static int rpc_message_send_args(rpc_message_t *message, va_list args)
 // Receive raw BYTES
 static inline int _rpc_message_recv_bytes(rpc_message_t *message, unsigned char *bytes, int count)
 {
+  unsigned char *data = bytes;
+  int length = count;
   do {
 	int n = recv(message->socket, bytes, count, 0);
 	if (n > 0) {
 	  count -= n;
 	  bytes += n;
+	  message->n_bytes += n;
 	}
 	else if (n == 0)
 	  return RPC_ERROR_CONNECTION_CLOSED;
@@ -1274,6 +1938,7 @@ static inline int _rpc_message_recv_bytes(rpc_message_t *message, unsigned char
 	  return RPC_ERROR_ERRNO_SET;
 	}
   } while (count > 0);
+  rpc_message_trace_bytes(message, data, length);
   return RPC_ERROR_NO_ERROR;
 }
 
@@ -1384,6 +2049,68 @@ int rpc_message_recv_string(rpc_message_t *message, char **ret)
   return RPC_ERROR_NO_ERROR;
 }
 
+// Receive FD
+// The caller owns the returned descriptor, or gets -1 if none was sent
+// or if it could not be passed along (e.g. out of descriptors)
+int rpc_message_recv_fd(rpc_message_t *message, int *ret)
+{
+  unsigned char marker;
+  struct iovec iov;
+  iov.iov_base = &marker;
+  iov.iov_len = 1;
+  union {
+	struct cmsghdr align;
+	char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+  flags |= MSG_CMSG_CLOEXEC;
+#endif
+  for (;;) {
+	int n = recvmsg(message->socket, &msg, flags);
+	if (n == 1)
+	  break;
+	if (n == 0)
+	  return RPC_ERROR_CONNECTION_CLOSED;
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	  int ret = rpc_poll(RPC_POLL_READ, message->socket, rpc_message_timeout() * 1000000);
+	  if (ret > 0)
+		continue;
+	  if (ret == 0)
+		return RPC_ERROR_MESSAGE_TIMEOUT;
+	}
+	if (errno == EINTR)
+	  continue;
+	return RPC_ERROR_ERRNO_SET;
+  }
+  message->n_bytes++;
+  rpc_message_trace_bytes(message, &marker, 1);
+
+  int fd = -1;
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+		&& cmsg->cmsg_len >= CMSG_LEN(sizeof(int)) && fd < 0)
+	  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  }
+#ifndef MSG_CMSG_CLOEXEC
+  if (fd >= 0)
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+  if (marker && fd < 0)
+	D(bug("  FD expected but none received\n"));
+  *ret = fd;
+  D(bug("  recv FD %d\n", *ret));
+  return RPC_ERROR_NO_ERROR;
+}
+
 // Receive message arguments
 static int rpc_message_recv_args(rpc_message_t *message, va_list args)
 {
@@ -1425,6 +2152,9 @@ static int rpc_message_recv_args(rpc_message_t *message, va_list args)
 	case RPC_TYPE_STRING:
 	  error = rpc_message_recv_string(message, (char **)p_value);
 	  break;
+	case RPC_TYPE_FD:
+	  error = rpc_message_recv_fd(message, (int *)p_value);
+	  break;
 	case RPC_TYPE_ARRAY: {
 	  int i;
 	  int32_t array_type;
@@ -1585,12 +2315,21 @@ static int _rpc_dispatch_1(rpc_connection_t *connection, rpc_message_t *message)
 	return RPC_ERROR_MESSAGE_TYPE_INVALID;
   D(bug("  -- message received [%d]\n", method));
 
+  if (rpc_stats_enabled())
+	rpc_stats_lookup(method)->calls_in++;
+
   // call: <method>
   rpc_method_callback_t callback = rpc_lookup_callback(connection, method);
+  int saved_dispatch_method = connection->dispatch_method;
+  int saved_handle_depth = connection->handle_depth;
+  connection->dispatch_method = method;
   if (callback)
 	error = callback(connection);
   else
 	error = RPC_ERROR_MESSAGE_HANDLER_INVALID;
+  connection->dispatch_method = saved_dispatch_method;
+  // handlers of rpc_method_notify() calls don't send any reply
+  connection->handle_depth = saved_handle_depth;
   if (error != RPC_ERROR_NO_ERROR) {
 	int error_code = error;
 
@@ -1630,6 +2369,7 @@ static int _rpc_dispatch_until(rpc_connection_t *connection, rpc_message_t *mess
   assert(expected_msg_tag != 0);
   for (;;) {
 	int32_t msg_tag;
+	size_t n_bytes = message->n_bytes;
 	int error = rpc_message_recv_int32(message, &msg_tag);
 	if (error != RPC_ERROR_NO_ERROR)
 	  return error;
@@ -1644,6 +2384,8 @@ static int _rpc_dispatch_until(rpc_connection_t *connection, rpc_message_t *mess
 	case RPC_MESSAGE_START:
 	  if ((error = _rpc_dispatch(connection, message)) < 0)
 		return error;
+	  // nested calls are accounted to their own method
+	  message->n_bytes = n_bytes;
 	  break;
 	default:
 	  return RPC_ERROR_MESSAGE_TYPE_INVALID;
@@ -1682,6 +2424,9 @@ int rpc_dispatch(rpc_connection_t *connection)
   rpc_message_t message;
   rpc_message_init(&message, connection);
 
+  if (G_UNLIKELY(g_rpc_stats_dump_requested))
+	rpc_stats_check_dump();
+
   // recv: <invoke> (header: MESSAGE_START)
   int error = rpc_message_recv_int32(&message, &msg_tag);
   if (error != RPC_ERROR_NO_ERROR)
@@ -1885,6 +2630,7 @@ static int _rpc_method_invoke_valist(rpc_connection_t *connection, int method, v
 {
   rpc_message_t message;
   rpc_message_init(&message, connection);
+  uint64_t start_ns = rpc_trace_enabled() ? rpc_trace_time_ns() : 0;
 
   // send: <invoke> = MESSAGE_START <method-id> MESSAGE_END
   int error = rpc_message_send_int32(&message, RPC_MESSAGE_START);
@@ -1899,6 +2645,9 @@ static int _rpc_method_invoke_valist(rpc_connection_t *connection, int method, v
   error = rpc_message_flush(&message);
   if (error != RPC_ERROR_NO_ERROR)
 	return rpc_error(connection, error);
+  message.n_bytes = 0;
+  if (rpc_trace_enabled())
+	rpc_message_trace_begin(&message, connection);
 
   // send optional arguments
   va_list args_copy;
@@ -1916,6 +2665,14 @@ static int _rpc_method_invoke_valist(rpc_connection_t *connection, int method, v
 	  return rpc_error(connection, error);
   }
 
+  if (rpc_stats_enabled()) {
+	rpc_method_stats_t *stats = rpc_stats_lookup(method);
+	stats->calls_out++;
+	stats->bytes_sent += message.n_bytes;
+  }
+  if (rpc_trace_enabled())
+	rpc_message_trace_commit(&message, connection, RPC_TRACE_INVOKE_SEND, method, start_ns);
+
   return RPC_ERROR_NO_ERROR;
 }
 
@@ -1929,6 +2686,33 @@ int rpc_method_invoke(rpc_connection_t *connection, int method, ...)
 	return RPC_ERROR_CONNECTION_CLOSED;
 
   ++connection->invoke_depth;
+  if (connection->invoke_depth <= RPC_STATS_MAX_DEPTH)
+	connection->invoke_methods[connection->invoke_depth - 1] = method;
+
+  if (G_UNLIKELY(g_rpc_stats_dump_requested))
+	rpc_stats_check_dump();
+
+  va_list args;
+  va_start(args, method);
+  int ret = _rpc_method_invoke_valist(connection, method, args);
+  va_end(args);
+
+  return ret;
+}
+
+// Invoke remote procedure without waiting for a reply (client side)
+// The handler on the other side must not rpc_method_send_reply()
+int rpc_method_notify(rpc_connection_t *connection, int method, ...)
+{
+  D(bug("rpc_method_notify method=%d\n", method));
+
+  if (connection == NULL)
+	return RPC_ERROR_CONNECTION_NULL;
+  if (_rpc_status(connection) == RPC_STATUS_CLOSED)
+	return RPC_ERROR_CONNECTION_CLOSED;
+
+  if (G_UNLIKELY(g_rpc_stats_dump_requested))
+	rpc_stats_check_dump();
 
   va_list args;
   va_start(args, method);
@@ -1943,6 +2727,11 @@ static int _rpc_method_get_args_valist(rpc_connection_t *connection, va_list arg
 {
   rpc_message_t message;
   rpc_message_init(&message, connection);
+  uint64_t start_ns = 0;
+  if (rpc_trace_enabled()) {
+	start_ns = rpc_trace_time_ns();
+	rpc_message_trace_begin(&message, connection);
+  }
 
   // we can't have pending calls here because the method invocation
   // message and its arguments are atomic (i.e. they are sent right
@@ -1953,6 +2742,11 @@ static int _rpc_method_get_args_valist(rpc_connection_t *connection, va_list arg
   if (error != RPC_ERROR_NO_ERROR)
 	return rpc_error(connection, error);
 
+  if (rpc_stats_enabled())
+	rpc_stats_lookup(connection->dispatch_method)->bytes_recv += message.n_bytes;
+  if (rpc_trace_enabled())
+	rpc_message_trace_commit(&message, connection, RPC_TRACE_INVOKE_RECV, connection->dispatch_method, start_ns);
+
   return RPC_ERROR_NO_ERROR;
 }
 
@@ -1982,12 +2776,16 @@ static int _rpc_method_wait_for_reply_valist(rpc_connection_t *connection, va_li
   int32_t msg_tag;
   rpc_message_t message;
   rpc_message_init(&message, connection);
+  uint64_t start_time = rpc_stats_enabled() ? npw_get_time_us() : 0;
+  uint64_t start_ns = rpc_trace_enabled() ? rpc_trace_time_ns() : 0;
 
   // call: rpc_dispatch() (pending remote calls)
   // recv: MESSAGE_REPLY
   error = _rpc_dispatch_until(connection, &message, RPC_MESSAGE_REPLY);
   if (error != RPC_ERROR_NO_ERROR)
 	return rpc_error(connection, error);
+  if (rpc_trace_enabled())
+	rpc_message_trace_begin(&message, connection);
 
   // receive optional arguments
   va_list args_copy;
@@ -2001,6 +2799,7 @@ static int _rpc_method_wait_for_reply_valist(rpc_connection_t *connection, va_li
 	if (error != RPC_ERROR_NO_ERROR)
 	  return rpc_error(connection, error);
   }
+  rpc_message_trace_end(&message);
 
   // recv: MESSAGE_END
   error = rpc_message_recv_int32(&message, &msg_tag);
@@ -2009,6 +2808,17 @@ static int _rpc_method_wait_for_reply_valist(rpc_connection_t *connection, va_li
   if (msg_tag != RPC_MESSAGE_END)
 	return rpc_error(connection, RPC_ERROR_MESSAGE_TYPE_INVALID);
 
+  int depth = connection->invoke_depth;
+  if (rpc_stats_enabled() && depth > 0 && depth <= RPC_STATS_MAX_DEPTH) {
+	rpc_method_stats_t *stats = rpc_stats_lookup(connection->invoke_methods[depth - 1]);
+	stats->bytes_recv += message.n_bytes;
+	npw_histogram_add(&stats->wait_time, npw_get_time_us() - start_time);
+  }
+  if (rpc_trace_enabled()) {
+	int method = depth > 0 && depth <= RPC_STATS_MAX_DEPTH ? connection->invoke_methods[depth - 1] : -1;
+	rpc_message_trace_commit(&message, connection, RPC_TRACE_REPLY_RECV, method, start_ns);
+  }
+
   return RPC_ERROR_NO_ERROR;
 }
 
@@ -2036,14 +2846,18 @@ static int _rpc_method_send_reply_valist(rpc_connection_t *connection, va_list a
 {
   rpc_message_t message;
   rpc_message_init(&message, connection);
+  uint64_t start_ns = rpc_trace_enabled() ? rpc_trace_time_ns() : 0;
 
   // send: <reply> = MESSAGE_REPLY [ <method-args> ] MESSAGE_END
   int error = rpc_message_send_int32(&message, RPC_MESSAGE_REPLY);
   if (error != RPC_ERROR_NO_ERROR)
 	return rpc_error(connection, error);
+  if (rpc_trace_enabled())
+	rpc_message_trace_begin(&message, connection);
   error = rpc_message_send_args(&message, args);
   if (error != RPC_ERROR_NO_ERROR)
 	return rpc_error(connection, error);
+  rpc_message_trace_end(&message);
   error = rpc_message_send_int32(&message, RPC_MESSAGE_END);
   if (error != RPC_ERROR_NO_ERROR)
 	return rpc_error(connection, error);
@@ -2051,6 +2865,11 @@ static int _rpc_method_send_reply_valist(rpc_connection_t *connection, va_list a
   if (error != RPC_ERROR_NO_ERROR)
 	return rpc_error(connection, error);
 
+  if (rpc_stats_enabled())
+	rpc_stats_lookup(connection->dispatch_method)->bytes_sent += message.n_bytes;
+  if (rpc_trace_enabled())
+	rpc_message_trace_commit(&message, connection, RPC_TRACE_REPLY_SEND, connection->dispatch_method, start_ns);
+
   return RPC_ERROR_NO_ERROR;
 }
 
@@ -2073,6 +2892,218 @@ int rpc_method_send_reply(rpc_connection_t *connection, ...)
   return ret;
 }
 
+// Receive a raw <method-args> block of SIZE bytes, as recorded in a trace
+static int rpc_message_recv_raw_args(rpc_message_t *message, void *args, size_t size)
+{
+  if (size == 0)
+	return RPC_ERROR_NO_ERROR;
+  if (size < 2 * sizeof(int32_t))
+	return RPC_ERROR_MESSAGE_ARGUMENT_INVALID;
+
+  int error = _rpc_message_recv_bytes(message, (unsigned char *)args, size);
+  if (error != RPC_ERROR_NO_ERROR)
+	return error;
+
+  // check the block is framed as expected, i.e. the other side sent
+  // the same amount of data than when the trace was recorded
+  int32_t tag;
+  memcpy(&tag, args, sizeof(tag));
+  if ((int32_t)ntohl(tag) != RPC_MESSAGE_ARGS)
+	return RPC_ERROR_MESSAGE_ARGUMENT_MISMATCH;
+  memcpy(&tag, (char *)args + size - sizeof(tag), sizeof(tag));
+  if ((int32_t)ntohl(tag) != RPC_MESSAGE_END)
+	return RPC_ERROR_MESSAGE_ARGUMENT_MISMATCH;
+  return RPC_ERROR_NO_ERROR;
+}
+
+/* The following functions exchange <method-args> blocks as recorded
+   by NPW_RPC_TRACE, without decoding them. They are meant for tools
+   replaying a trace, and mirror rpc_method_invoke() and friends.  */
+
+// Invoke remote procedure with raw arguments (client side)
+int rpc_method_invoke_raw(rpc_connection_t *connection, int method, const void *args, size_t args_size)
+{
+  D(bug("rpc_method_invoke_raw method=%d\n", method));
+
+  if (connection == NULL)
+	return RPC_ERROR_CONNECTION_NULL;
+  if (_rpc_status(connection) == RPC_STATUS_CLOSED)
+	return RPC_ERROR_CONNECTION_CLOSED;
+
+  ++connection->invoke_depth;
+  if (connection->invoke_depth <= RPC_STATS_MAX_DEPTH)
+	connection->invoke_methods[connection->invoke_depth - 1] = method;
+
+  rpc_message_t message;
+  rpc_message_init(&message, connection);
+  uint64_t start_ns = rpc_trace_enabled() ? rpc_trace_time_ns() : 0;
+
+  // send: <invoke> = MESSAGE_START <method-id> MESSAGE_END
+  int error = rpc_message_send_int32(&message, RPC_MESSAGE_START);
+  if (error != RPC_ERROR_NO_ERROR)
+	return rpc_error(connection, error);
+  error = rpc_message_send_int32(&message, method);
+  if (error != RPC_ERROR_NO_ERROR)
+	return rpc_error(connection, error);
+  error = rpc_message_send_int32(&message, RPC_MESSAGE_END);
+  if (error != RPC_ERROR_NO_ERROR)
+	return rpc_error(connection, error);
+  error = rpc_message_flush(&message);
+  if (error != RPC_ERROR_NO_ERROR)
+	return rpc_error(connection, error);
+  message.n_bytes = 0;
+
+  // send: [ <method-args> ]
+  if (rpc_trace_enabled())
+	rpc_message_trace_begin(&message, connection);
+  if (args_size > 0) {
+	error = rpc_message_send_bytes(&message, (unsigned char *)args, args_size);
+	if (error != RPC_ERROR_NO_ERROR)
+	  return rpc_error(connection, error);
+	error = rpc_message_flush(&message);
+	if (error != RPC_ERROR_NO_ERROR)
+	  return rpc_error(connection, error);
+  }
+
+  if (rpc_stats_enabled()) {
+	rpc_method_stats_t *stats = rpc_stats_lookup(method);
+	stats->calls_out++;
+	stats->bytes_sent += message.n_bytes;
+  }
+  if (rpc_trace_enabled())
+	rpc_message_trace_commit(&message, connection, RPC_TRACE_INVOKE_SEND, method, start_ns);
+
+  return RPC_ERROR_NO_ERROR;
+}
+
+// Wait for a reply with ARGS_SIZE bytes of raw arguments (client side)
+int rpc_method_wait_for_reply_raw(rpc_connection_t *connection, void *args, size_t args_size)
+{
+  D(bug("rpc_method_wait_for_reply_raw\n"));
+
+  if (connection == NULL)
+	return RPC_ERROR_CONNECTION_NULL;
+  if (_rpc_status(connection) == RPC_STATUS_CLOSED)
+	return RPC_ERROR_CONNECTION_CLOSED;
+
+  int32_t msg_tag;
+  rpc_message_t message;
+  rpc_message_init(&message, connection);
+  uint64_t start_time = rpc_stats_enabled() ? npw_get_time_us() : 0;
+  uint64_t start_ns = rpc_trace_enabled() ? rpc_trace_time_ns() : 0;
+
+  // call: rpc_dispatch() (pending remote calls)
+  // recv: MESSAGE_REPLY [ <method-args> ] MESSAGE_END
+  int error = _rpc_dispatch_until(connection, &message, RPC_MESSAGE_REPLY);
+  if (error == RPC_ERROR_NO_ERROR) {
+	if (rpc_trace_enabled())
+	  rpc_message_trace_begin(&message, connection);
+	error = rpc_message_recv_raw_args(&message, args, args_size);
+	rpc_message_trace_end(&message);
+  }
+  if (error == RPC_ERROR_NO_ERROR) {
+	error = rpc_message_recv_int32(&message, &msg_tag);
+	if (error == RPC_ERROR_NO_ERROR && msg_tag != RPC_MESSAGE_END)
+	  error = RPC_ERROR_MESSAGE_TYPE_INVALID;
+  }
+  if (error != RPC_ERROR_NO_ERROR) {
+	--connection->invoke_depth;
+	return rpc_error(connection, error);
+  }
+
+  int depth = connection->invoke_depth;
+  int method = depth > 0 && depth <= RPC_STATS_MAX_DEPTH ? connection->invoke_methods[depth - 1] : -1;
+  if (rpc_stats_enabled() && method >= 0) {
+	rpc_method_stats_t *stats = rpc_stats_lookup(method);
+	stats->bytes_recv += message.n_bytes;
+	npw_histogram_add(&stats->wait_time, npw_get_time_us() - start_time);
+  }
+  if (rpc_trace_enabled())
+	rpc_message_trace_commit(&message, connection, RPC_TRACE_REPLY_RECV, method, start_ns);
+
+  --connection->invoke_depth;
+  return RPC_ERROR_NO_ERROR;
+}
+
+// Retrieve ARGS_SIZE bytes of raw procedure arguments (server side)
+int rpc_method_get_args_raw(rpc_connection_t *connection, void *args, size_t args_size)
+{
+  D(bug("rpc_method_get_args_raw\n"));
+
+  if (connection == NULL)
+	return RPC_ERROR_CONNECTION_NULL;
+  if (_rpc_status(connection) == RPC_STATUS_CLOSED)
+	return RPC_ERROR_CONNECTION_CLOSED;
+
+  ++connection->handle_depth;
+
+  rpc_message_t message;
+  rpc_message_init(&message, connection);
+  uint64_t start_ns = 0;
+  if (rpc_trace_enabled()) {
+	start_ns = rpc_trace_time_ns();
+	rpc_message_trace_begin(&message, connection);
+  }
+
+  // recv: [ <method-args> ]
+  int error = rpc_message_recv_raw_args(&message, args, args_size);
+  if (error != RPC_ERROR_NO_ERROR)
+	return rpc_error(connection, error);
+
+  if (rpc_stats_enabled())
+	rpc_stats_lookup(connection->dispatch_method)->bytes_recv += message.n_bytes;
+  if (rpc_trace_enabled())
+	rpc_message_trace_commit(&message, connection, RPC_TRACE_INVOKE_RECV, connection->dispatch_method, start_ns);
+
+  return RPC_ERROR_NO_ERROR;
+}
+
+// Send a reply with raw arguments (server side)
+int rpc_method_send_reply_raw(rpc_connection_t *connection, const void *args, size_t args_size)
+{
+  D(bug("rpc_method_send_reply_raw\n"));
+
+  if (connection == NULL)
+	return RPC_ERROR_CONNECTION_NULL;
+  if (_rpc_status(connection) == RPC_STATUS_CLOSED)
+	return RPC_ERROR_CONNECTION_CLOSED;
+
+  rpc_message_t message;
+  rpc_message_init(&message, connection);
+  uint64_t start_ns = rpc_trace_enabled() ? rpc_trace_time_ns() : 0;
+
+  // send: <reply> = MESSAGE_REPLY [ <method-args> ] MESSAGE_END
+  int error = rpc_message_send_int32(&message, RPC_MESSAGE_REPLY);
+  if (error == RPC_ERROR_NO_ERROR && args_size > 0) {
+	if (rpc_trace_enabled())
+	  rpc_message_trace_begin(&message, connection);
+	error = rpc_message_send_bytes(&message, (unsigned char *)args, args_size);
+	rpc_message_trace_end(&message);
+  }
+  if (error == RPC_ERROR_NO_ERROR)
+	error = rpc_message_send_int32(&message, RPC_MESSAGE_END);
+  if (error == RPC_ERROR_NO_ERROR)
+	error = rpc_message_flush(&message);
+  --connection->handle_depth;
+  if (error != RPC_ERROR_NO_ERROR)
+	return rpc_error(connection, error);
+
+  if (rpc_stats_enabled())
+	rpc_stats_lookup(connection->dispatch_method)->bytes_sent += message.n_bytes;
+  if (rpc_trace_enabled())
+	rpc_message_trace_commit(&message, connection, RPC_TRACE_REPLY_SEND, connection->dispatch_method, start_ns);
+
+  return RPC_ERROR_NO_ERROR;
+}
+
+// Returns the method being handled, or -1 outside of method callbacks
+int rpc_method_get_current(rpc_connection_t *connection)
+{
+  if (connection == NULL)
+	return -1;
+  return connection->dispatch_method;
+}
+
 
 /* ====================================================================== */
 /* === Remote Procedure Call (method invocation)                      === */
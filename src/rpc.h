@@ -54,8 +54,13 @@ extern void rpc_connection_unref(rpc_connection_t *connection) attribute_hidden;
 
 extern rpc_connection_t *rpc_init_server(const char *ident) attribute_hidden;
 extern rpc_connection_t *rpc_init_client(const char *ident) attribute_hidden;
+extern rpc_connection_t *rpc_try_init_client(const char *ident) attribute_hidden;
 extern int rpc_exit(rpc_connection_t *connection) attribute_hidden;
 extern int rpc_listen_socket(rpc_connection_t *connection) attribute_hidden;
+extern int rpc_wait_accept(rpc_connection_t *connection, int timeout) attribute_hidden;
+extern int rpc_close_socket(rpc_connection_t *connection) attribute_hidden;
+extern int rpc_close_listen_socket(rpc_connection_t *connection) attribute_hidden;
+extern bool rpc_peer_is_same_user(rpc_connection_t *connection) attribute_hidden;
 extern int rpc_listen(rpc_connection_t *connection) attribute_hidden;
 extern int rpc_dispatch(rpc_connection_t *connection) attribute_hidden;
 extern int rpc_wait_dispatch(rpc_connection_t *connection, int timeout) attribute_hidden;
@@ -83,6 +88,7 @@ enum {
   RPC_TYPE_DOUBLE						= -2005,
   RPC_TYPE_STRING						= -2006,
   RPC_TYPE_ARRAY						= -2007,
+  RPC_TYPE_FD							= -2008,	// passed as SCM_RIGHTS
 };
 typedef struct rpc_message_t rpc_message_t;
 extern int rpc_message_send_char(rpc_message_t *message, char c) attribute_hidden;
@@ -92,6 +98,7 @@ extern int rpc_message_send_uint64(rpc_message_t *message, uint64_t value) attri
 extern int rpc_message_send_double(rpc_message_t *message, double value) attribute_hidden;
 extern int rpc_message_send_string(rpc_message_t *message, const char *str) attribute_hidden;
 extern int rpc_message_send_bytes(rpc_message_t *message, unsigned char *bytes, int count) attribute_hidden;
+extern int rpc_message_send_fd(rpc_message_t *message, int fd) attribute_hidden;
 extern int rpc_message_recv_char(rpc_message_t *message, char *ret) attribute_hidden;
 extern int rpc_message_recv_int32(rpc_message_t *message, int32_t *ret) attribute_hidden;
 extern int rpc_message_recv_uint32(rpc_message_t *message, uint32_t *ret) attribute_hidden;
@@ -99,6 +106,7 @@ extern int rpc_message_recv_uint64(rpc_message_t *message, uint64_t *ret) attrib
 extern int rpc_message_recv_double(rpc_message_t *message, double *ret) attribute_hidden;
 extern int rpc_message_recv_string(rpc_message_t *message, char **ret) attribute_hidden;
 extern int rpc_message_recv_bytes(rpc_message_t *message, unsigned char *bytes, int count) attribute_hidden;
+extern int rpc_message_recv_fd(rpc_message_t *message, int *ret) attribute_hidden;
 
 typedef int (*rpc_message_callback_t)(rpc_message_t *message, void *p_value);
 typedef struct {
@@ -122,14 +130,27 @@ extern int rpc_connection_add_method_descriptors(rpc_connection_t *connection, c
 // Remote Procedure Call (method invocation)
 extern bool rpc_method_invoke_possible(rpc_connection_t *connection) attribute_hidden;
 extern int rpc_method_invoke(rpc_connection_t *connection, int method, ...) attribute_hidden;
+extern int rpc_method_notify(rpc_connection_t *connection, int method, ...) attribute_hidden;
 extern int rpc_method_wait_for_reply(rpc_connection_t *connection, ...) attribute_hidden;
 extern int rpc_method_get_args(rpc_connection_t *connection, ...) attribute_hidden;
 extern int rpc_method_send_reply(rpc_connection_t *connection, ...) attribute_hidden;
+extern int rpc_method_get_current(rpc_connection_t *connection) attribute_hidden;
+
+// Raw <method-args> blocks, as recorded by NPW_RPC_TRACE
+extern int rpc_method_invoke_raw(rpc_connection_t *connection, int method, const void *args, size_t args_size) attribute_hidden;
+extern int rpc_method_wait_for_reply_raw(rpc_connection_t *connection, void *args, size_t args_size) attribute_hidden;
+extern int rpc_method_get_args_raw(rpc_connection_t *connection, void *args, size_t args_size) attribute_hidden;
+extern int rpc_method_send_reply_raw(rpc_connection_t *connection, const void *args, size_t args_size) attribute_hidden;
 
 // Sources
 extern GSource *rpc_event_source_new(rpc_connection_t *connection) attribute_hidden;
 extern GSource *rpc_sync_source_new(rpc_connection_t *connection) attribute_hidden;
 
+// Statistics (NPW_RPC_STATS)
+typedef const char *(*rpc_method_name_func_t)(int method);
+extern void rpc_set_method_name_func(rpc_method_name_func_t func) attribute_hidden;
+extern void rpc_dump_stats(const char *reason) attribute_hidden;
+
 #ifdef __cplusplus
 }
 #endif
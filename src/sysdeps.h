@@ -46,7 +46,7 @@
 #define NPW_WRAPPER_BASE "npwrapper"
 #define NPW_WRAPPER NPW_WRAPPER_BASE ".so"
 #define NPW_DEFAULT_PLUGIN_PATH NPW_HOST_LIBDIR "/" NPW_WRAPPER
-#define NPW_PLUGIN_INFO_VERSION 2
+#define NPW_PLUGIN_INFO_VERSION 3
 #define NPW_PLUGIN_IDENT "NPW:X:" NPW_FULL_VERSION
 #define NPW_PLUGIN_IDENT_SIZE 32
 typedef struct __attribute__((packed)) {
@@ -57,6 +57,8 @@ typedef struct __attribute__((packed)) {
   char target_os[65];
   char struct_version; /* extended format "NPW:X:VERSION" */
   char viewer_path[PATH_MAX];
+  uint64_t size; /* version 3 */
+  uint64_t inode;
 } NPW_PluginInfo;
 
 #if defined(BUILD_WRAPPER)
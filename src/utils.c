@@ -28,7 +28,12 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
 #include <sys/resource.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "utils.h"
 #include "rpc.h"
@@ -106,6 +111,449 @@ int id_lookup_value(void *ptr)
 }
 
 
+/* ====================================================================== */
+/* === Byte ranges                                                    === */
+/* ====================================================================== */
+
+// A range set is an array of disjoint, non-adjacent [start, end)
+// intervals sorted by offset
+
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+} range_t;
+
+#define RANGE(set, i) g_array_index(set, range_t, i)
+
+GArray *range_set_new(void)
+{
+  return g_array_new(FALSE, FALSE, sizeof(range_t));
+}
+
+void range_set_destroy(GArray *set)
+{
+  if (set)
+	g_array_free(set, TRUE);
+}
+
+// Index of the first range that ends at or after OFFSET
+static guint range_set_search(GArray *set, uint32_t offset)
+{
+  guint lo = 0, hi = set->len;
+  while (lo < hi) {
+	guint mid = (lo + hi) / 2;
+	if (RANGE(set, mid).end < offset)
+	  lo = mid + 1;
+	else
+	  hi = mid;
+  }
+  return lo;
+}
+
+void range_set_add(GArray *set, uint32_t start, uint32_t end)
+{
+  if (start >= end)
+	return;
+
+  // Merge with every range that overlaps or touches [start, end)
+  guint i = range_set_search(set, start);
+  guint j = i;
+  while (j < set->len && RANGE(set, j).start <= end) {
+	start = MIN(start, RANGE(set, j).start);
+	end = MAX(end, RANGE(set, j).end);
+	j++;
+  }
+  range_t range = { start, end };
+  if (j > i) {
+	RANGE(set, i) = range;
+	if (j > i + 1)
+	  g_array_remove_range(set, i + 1, j - i - 1);
+  }
+  else
+	g_array_insert_val(set, i, range);
+}
+
+uint32_t range_set_lookup(GArray *set, uint32_t offset, bool *present)
+{
+  guint i = range_set_search(set, offset);
+  // A range ending exactly at OFFSET doesn't contain it
+  if (i < set->len && RANGE(set, i).end == offset)
+	i++;
+  if (i < set->len && RANGE(set, i).start <= offset) {
+	*present = true;
+	return RANGE(set, i).end;
+  }
+  *present = false;
+  return i < set->len ? RANGE(set, i).start : UINT32_MAX;
+}
+
+uint64_t range_set_size(GArray *set)
+{
+  uint64_t size = 0;
+  for (guint i = 0; i < set->len; i++)
+	size += RANGE(set, i).end - RANGE(set, i).start;
+  return size;
+}
+
+
+/* ====================================================================== */
+/* === Coalescing timers                                              === */
+/* ====================================================================== */
+
+// All timers share one GSource and fire on multiples of their slack,
+// so that timers due at about the same time are run in the same main
+// loop iteration. A timer is run at most SLACK ms late; its following
+// deadlines are still computed from the exact interval, so it doesn't
+// drift. The list is sorted by fire time and timer ids are never 0
+
+typedef struct {
+  uint32_t id;
+  uint32_t interval;
+  uint32_t slack;
+  uint64_t deadline;					// when the timer is due, in us
+  uint64_t fire_time;					// deadline rounded up to the slack
+  GSourceFunc func;
+  void *data;
+  GDestroyNotify notify;
+  bool dispatching;						// in the current batch
+  bool removed;							// free once the batch is over
+} timeout_t;
+
+static GSource *timeout_source = NULL;
+static GList *timeout_list = NULL;
+static GHashTable *timeout_ids = NULL;
+static uint32_t timeout_next_id = 1;
+static uint64_t timeout_n_wakeups = 0;
+static uint64_t timeout_n_calls = 0;
+
+static uint64_t timeout_get_time(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static gint timeout_compare(gconstpointer a, gconstpointer b)
+{
+  const timeout_t *ta = a, *tb = b;
+  if (ta->fire_time != tb->fire_time)
+	return ta->fire_time < tb->fire_time ? -1 : 1;
+  return 0;
+}
+
+static void timeout_queue(timeout_t *timeout)
+{
+  uint64_t slack = (uint64_t)timeout->slack * 1000;
+  timeout->fire_time = timeout->deadline;
+  if (slack > 0)
+	timeout->fire_time = ((timeout->deadline + slack - 1) / slack) * slack;
+  timeout_list = g_list_insert_sorted(timeout_list, timeout, timeout_compare);
+}
+
+static void timeout_free(timeout_t *timeout)
+{
+  g_hash_table_remove(timeout_ids, GUINT_TO_POINTER(timeout->id));
+  if (timeout->notify)
+	timeout->notify(timeout->data);
+  g_free(timeout);
+}
+
+static gboolean timeout_prepare(GSource *source, gint *timeout)
+{
+  if (timeout_list == NULL) {
+	*timeout = -1;
+	return FALSE;
+  }
+  uint64_t now = timeout_get_time();
+  uint64_t fire_time = ((timeout_t *)timeout_list->data)->fire_time;
+  if (fire_time <= now)
+	return TRUE;
+  *timeout = (fire_time - now + 999) / 1000;
+  return FALSE;
+}
+
+static gboolean timeout_check(GSource *source)
+{
+  return (timeout_list != NULL
+		  && ((timeout_t *)timeout_list->data)->fire_time <= timeout_get_time());
+}
+
+static gboolean timeout_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+  uint64_t now = timeout_get_time();
+
+  // Callbacks may add or remove timers, run the ones due now only
+  GList *batch = NULL;
+  while (timeout_list && ((timeout_t *)timeout_list->data)->fire_time <= now) {
+	timeout_t *timeout = timeout_list->data;
+	timeout_list = g_list_delete_link(timeout_list, timeout_list);
+	timeout->dispatching = true;
+	batch = g_list_prepend(batch, timeout);
+  }
+  batch = g_list_reverse(batch);
+  if (batch)
+	++timeout_n_wakeups;
+
+  for (GList *l = batch; l != NULL; l = l->next) {
+	timeout_t *timeout = l->data;
+	bool keep = false;
+	if (!timeout->removed) {
+	  ++timeout_n_calls;
+	  keep = timeout->func(timeout->data);
+	}
+	timeout->dispatching = false;
+	if (keep && !timeout->removed) {
+	  timeout->deadline += (uint64_t)timeout->interval * 1000;
+	  if (timeout->deadline <= now)
+		timeout->deadline = now + (uint64_t)MAX(timeout->interval, 1) * 1000;
+	  timeout_queue(timeout);
+	}
+	else
+	  timeout_free(timeout);
+  }
+  g_list_free(batch);
+  return TRUE;
+}
+
+static GSourceFuncs timeout_funcs = {
+  timeout_prepare,
+  timeout_check,
+  timeout_dispatch,
+  NULL,
+  (GSourceFunc)NULL,
+  (GSourceDummyMarshal)NULL
+};
+
+uint32_t npw_timeout_add(uint32_t interval, uint32_t slack,
+						 GSourceFunc func, void *data, GDestroyNotify notify)
+{
+  if (timeout_source == NULL) {
+	if ((timeout_source = g_source_new(&timeout_funcs, sizeof(GSource))) == NULL)
+	  return 0;
+	g_source_attach(timeout_source, NULL);
+	timeout_ids = g_hash_table_new(NULL, NULL);
+  }
+
+  timeout_t *timeout = g_new0(timeout_t, 1);
+  do {
+	timeout->id = timeout_next_id++;
+  } while (timeout->id == 0 || g_hash_table_lookup(timeout_ids, GUINT_TO_POINTER(timeout->id)));
+  timeout->interval = interval;
+  timeout->slack = slack;
+  timeout->deadline = timeout_get_time() + (uint64_t)interval * 1000;
+  timeout->func = func;
+  timeout->data = data;
+  timeout->notify = notify;
+  g_hash_table_insert(timeout_ids, GUINT_TO_POINTER(timeout->id), timeout);
+  timeout_queue(timeout);
+  return timeout->id;
+}
+
+bool npw_timeout_remove(uint32_t id)
+{
+  if (timeout_ids == NULL)
+	return false;
+  timeout_t *timeout = g_hash_table_lookup(timeout_ids, GUINT_TO_POINTER(id));
+  if (timeout == NULL || timeout->removed)
+	return false;
+  if (timeout->dispatching) {
+	timeout->removed = true;
+	return true;
+  }
+  timeout_list = g_list_remove(timeout_list, timeout);
+  timeout_free(timeout);
+  return true;
+}
+
+void npw_timeout_get_stats(uint64_t *n_wakeups, uint64_t *n_calls)
+{
+  if (n_wakeups)
+	*n_wakeups = timeout_n_wakeups;
+  if (n_calls)
+	*n_calls = timeout_n_calls;
+}
+
+
+/* ====================================================================== */
+/* === Async calls                                                    === */
+/* ====================================================================== */
+
+// Any thread pushes calls onto a lock-free stack. The first push onto
+// an empty stack wakes up the main loop through an eventfd (a pipe on
+// other systems). The GSource then takes the whole stack at once and
+// runs it in posting order, so a burst of calls costs one main loop
+// iteration. Taking the whole stack means nodes are never popped one
+// by one, which keeps the stack free of ABA problems
+
+static NPW_AsyncCall *volatile async_calls = NULL;
+static GSource *async_source = NULL;
+static GPollFD async_poll_fd = { .fd = -1 };
+static int async_write_fd = -1;
+static uint64_t async_n_batches = 0;
+static uint64_t async_n_calls = 0;
+
+static void async_calls_wakeup(void)
+{
+#ifdef __linux__
+  uint64_t value = 1;
+#else
+  char value = 1;
+#endif
+  ssize_t ret;
+  do {
+	ret = write(async_write_fd, &value, sizeof(value));
+  } while (ret < 0 && errno == EINTR);
+}
+
+static void async_calls_clear_wakeup(void)
+{
+#ifdef __linux__
+  uint64_t value;
+  while (read(async_poll_fd.fd, &value, sizeof(value)) < 0 && errno == EINTR)
+	;
+#else
+  char buf[64];
+  while (read(async_poll_fd.fd, buf, sizeof(buf)) > 0)
+	;
+#endif
+}
+
+static NPW_AsyncCall *async_calls_take(void)
+{
+  NPW_AsyncCall *head;
+  do {
+	head = async_calls;
+  } while (!__sync_bool_compare_and_swap(&async_calls, head, NULL));
+
+  // The stack has the latest call first
+  NPW_AsyncCall *calls = NULL;
+  while (head) {
+	NPW_AsyncCall *next = head->next;
+	head->next = calls;
+	calls = head;
+	head = next;
+  }
+  return calls;
+}
+
+static gboolean async_calls_prepare(GSource *source, gint *timeout)
+{
+  *timeout = -1;
+  return FALSE;
+}
+
+static gboolean async_calls_check(GSource *source)
+{
+  return (async_poll_fd.revents & G_IO_IN) != 0;
+}
+
+static gboolean async_calls_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+  // Clear the wakeup first, a call pushed from now on signals again
+  async_calls_clear_wakeup();
+  NPW_AsyncCall *calls = async_calls_take();
+  if (calls)
+	++async_n_batches;
+  while (calls) {
+	NPW_AsyncCall *call = calls;
+	calls = call->next;
+	++async_n_calls;
+	call->run(call);
+	if (call->destroy)
+	  call->destroy(call);
+  }
+  return TRUE;
+}
+
+static GSourceFuncs async_calls_funcs = {
+  async_calls_prepare,
+  async_calls_check,
+  async_calls_dispatch,
+  NULL,
+  (GSourceFunc)NULL,
+  (GSourceDummyMarshal)NULL
+};
+
+bool npw_async_calls_init(int priority)
+{
+  if (async_source)
+	return true;
+
+#ifdef __linux__
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd < 0)
+	return false;
+  async_poll_fd.fd = fd;
+  async_write_fd = fd;
+#else
+  int fds[2];
+  if (pipe(fds) < 0)
+	return false;
+  for (int i = 0; i < 2; i++) {
+	fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  async_poll_fd.fd = fds[0];
+  async_write_fd = fds[1];
+#endif
+
+  if ((async_source = g_source_new(&async_calls_funcs, sizeof(GSource))) == NULL) {
+	npw_async_calls_exit();
+	return false;
+  }
+  async_poll_fd.events = G_IO_IN;
+  async_poll_fd.revents = 0;
+  g_source_add_poll(async_source, &async_poll_fd);
+  g_source_set_priority(async_source, priority);
+  g_source_attach(async_source, NULL);
+  return true;
+}
+
+void npw_async_calls_exit(void)
+{
+  if (async_source) {
+	g_source_destroy(async_source);
+	g_source_unref(async_source);
+	async_source = NULL;
+  }
+
+  // Calls that didn't get a chance to run are only destroyed
+  NPW_AsyncCall *calls = async_calls_take();
+  while (calls) {
+	NPW_AsyncCall *call = calls;
+	calls = call->next;
+	if (call->destroy)
+	  call->destroy(call);
+  }
+
+  if (async_write_fd >= 0 && async_write_fd != async_poll_fd.fd)
+	close(async_write_fd);
+  if (async_poll_fd.fd >= 0)
+	close(async_poll_fd.fd);
+  async_write_fd = async_poll_fd.fd = -1;
+}
+
+void npw_async_call(NPW_AsyncCall *call)
+{
+  NPW_AsyncCall *head;
+  do {
+	head = async_calls;
+	call->next = head;
+  } while (!__sync_bool_compare_and_swap(&async_calls, head, call));
+
+  if (head == NULL)
+	async_calls_wakeup();
+}
+
+void npw_async_calls_get_stats(uint64_t *n_batches, uint64_t *n_calls)
+{
+  if (n_batches)
+	*n_batches = async_n_batches;
+  if (n_calls)
+	*n_calls = async_n_calls;
+}
+
+
 /* ====================================================================== */
 /* === String expansions                                              === */
 /* ====================================================================== */
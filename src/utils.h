@@ -36,6 +36,37 @@ extern bool id_remove(int id) attribute_hidden;
 extern void *id_lookup(int id) attribute_hidden;
 extern int id_lookup_value(void *ptr) attribute_hidden;
 
+// Byte ranges
+extern GArray *range_set_new(void) attribute_hidden;
+extern void range_set_destroy(GArray *set) attribute_hidden;
+extern void range_set_add(GArray *set, uint32_t start, uint32_t end) attribute_hidden;
+// Returns the end of the run of bytes from OFFSET that are all either
+// present or not (UINT32_MAX past the last range)
+extern uint32_t range_set_lookup(GArray *set, uint32_t offset, bool *present) attribute_hidden;
+extern uint64_t range_set_size(GArray *set) attribute_hidden;
+
+// Coalescing timers, like g_timeout_add_full() but run up to SLACK ms
+// late along with the other timers due by then. FUNC returns TRUE to
+// keep the timer
+extern uint32_t npw_timeout_add(uint32_t interval, uint32_t slack, GSourceFunc func, void *data, GDestroyNotify notify) attribute_hidden;
+extern bool npw_timeout_remove(uint32_t id) attribute_hidden;
+extern void npw_timeout_get_stats(uint64_t *n_wakeups, uint64_t *n_calls) attribute_hidden;
+
+// Calls posted from any thread and run by the main loop in batches.
+// Embed NPW_AsyncCall at the start of the call data; DESTROY, if set,
+// is called after RUN, or instead of it at npw_async_calls_exit()
+typedef struct _NPW_AsyncCall NPW_AsyncCall;
+struct _NPW_AsyncCall {
+  NPW_AsyncCall *next;
+  void (*run)(NPW_AsyncCall *call);
+  void (*destroy)(NPW_AsyncCall *call);
+};
+
+extern bool npw_async_calls_init(int priority) attribute_hidden;
+extern void npw_async_calls_exit(void) attribute_hidden;
+extern void npw_async_call(NPW_AsyncCall *call) attribute_hidden;
+extern void npw_async_calls_get_stats(uint64_t *n_batches, uint64_t *n_calls) attribute_hidden;
+
 // String expansions
 extern const char *string_of_NPError(int error) attribute_hidden;
 extern const char *string_of_NPReason(int reason) attribute_hidden;
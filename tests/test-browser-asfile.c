@@ -0,0 +1,158 @@
+/*
+ *  test-browser-asfile.c - Files the viewer gets from NPP_StreamAsFile()
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The stub takes a stream as a file, and opens that file again in
+   NPP_StreamAsFile() and in each later NPP_SetWindow(), as Flash
+   does. When the viewer can open the browser's path, the plugin must
+   get that very path, extension included. Otherwise it gets a name
+   for the file the wrapper opened, which has to stay valid after the
+   stream is destroyed and the browser removed the file. A path
+   relative to a directory the test moves into after the viewer was
+   started stands for a path the viewer can't see.  */
+
+#define _GNU_SOURCE 1 /* mkdtemp */
+#include "sysdeps.h"
+#include "test-browser-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEBUG 1
+#include "debug.h"
+
+#define FILE_NAME	"movie.npwstub"
+#define FILE_URL	"http://localhost/" FILE_NAME
+#define FILE_SIZE	(256 * 1024)
+#define WAIT_TIMEOUT	10000
+
+static uint8_t g_data[FILE_SIZE];
+
+static uint32_t
+checksum (const uint8_t *buf, uint32_t len)
+{
+  uint32_t sum = 0;
+  while (len-- > 0)
+    sum = sum * 31 + *buf++;
+  return sum;
+}
+
+static void
+ensure_status (const char *expected)
+{
+  gchar *status = test_browser_wait_status (expected, WAIT_TIMEOUT);
+
+  if (status == NULL)
+    g_printerr ("ERROR: no status '%s'\n", expected);
+  TEST_BROWSER_ENSURE (status != NULL);
+  g_free (status);
+}
+
+static void
+ensure_reopen (void)
+{
+  gchar *expected;
+
+  expected = g_strdup_printf ("reopen size=%u sum=%08x ",
+			      FILE_SIZE, checksum (g_data, FILE_SIZE));
+  ensure_status (expected);
+  g_free (expected);
+}
+
+/* Streams the file as FNAME. Returns the name the plugin got */
+static gchar *
+stream_as_file (NPP instance, const char *fname)
+{
+  NPStream *stream;
+  uint16_t stype;
+  uint64_t start;
+  gchar *status, *name;
+
+  stream = test_browser_new_stream (instance, FILE_URL, g_data, FILE_SIZE,
+				    FALSE, &stype);
+  TEST_BROWSER_ENSURE (stream != NULL);
+  TEST_BROWSER_ENSURE (stype == NP_ASFILE);
+  TEST_BROWSER_ENSURE (test_browser_write_stream (instance, stream, 0, FILE_SIZE) == FILE_SIZE);
+  start = npw_get_time_us ();
+  test_browser_stream_as_file (instance, stream, fname);
+  g_print ("%s: NPP_StreamAsFile() took %.2f ms\n",
+	   fname, (npw_get_time_us () - start) / 1000.0);
+
+  status = test_browser_wait_status ("asfile ", WAIT_TIMEOUT);
+  TEST_BROWSER_ENSURE (status != NULL);
+  name = g_strdup (status + strlen ("asfile name="));
+  *strchr (name, ' ') = '\0';
+  g_free (status);
+  ensure_reopen ();
+
+  test_browser_destroy_stream (instance, stream, NPRES_DONE);
+  ensure_status ("destroystream ");
+  return name;
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const char *argn[] = { "npw-report", "npw-stype", NULL };
+  static const char *args[] = { "yes", "asfile", NULL };
+  gchar *tmp_dir, *path, *name;
+  NPP instance;
+  FILE *fp;
+  int i;
+
+  for (i = 0; i < FILE_SIZE; i++)
+    g_data[i] = g_random_int ();
+
+  test_browser_init (argc, argv);
+  tmp_dir = g_build_filename (g_get_tmp_dir (), "test-browser-asfile-XXXXXX", NULL);
+  TEST_BROWSER_ENSURE (mkdtemp (tmp_dir) != NULL);
+  path = g_build_filename (tmp_dir, FILE_NAME, NULL);
+  TEST_BROWSER_ENSURE ((fp = fopen (path, "wb")) != NULL);
+  TEST_BROWSER_ENSURE (fwrite (g_data, 1, FILE_SIZE, fp) == FILE_SIZE);
+  TEST_BROWSER_ENSURE (fclose (fp) == 0);
+
+  instance = test_browser_new_instance (argn, args);
+  TEST_BROWSER_ENSURE (instance != NULL);
+  ensure_status ("new ");
+
+  /* The viewer sees the file, the plugin gets its path */
+  name = stream_as_file (instance, path);
+  TEST_BROWSER_ENSURE (strcmp (name, FILE_NAME) == 0);
+  g_free (name);
+  test_browser_set_window (instance, 320, 240, 24);
+  ensure_reopen ();
+
+  /* The viewer doesn't see the file, it lives on after the browser
+     removed it */
+  TEST_BROWSER_ENSURE (chdir (tmp_dir) == 0);
+  name = stream_as_file (instance, FILE_NAME);
+  TEST_BROWSER_ENSURE (strcmp (name, FILE_NAME) != 0);
+  g_free (name);
+  TEST_BROWSER_ENSURE (unlink (path) == 0);
+  test_browser_set_window (instance, 320, 240, 24);
+  ensure_reopen ();
+
+  test_browser_destroy_instance (instance);
+  test_browser_exit ();
+  rmdir (tmp_dir);
+  g_free (path);
+  g_free (tmp_dir);
+  return 0;
+}
@@ -0,0 +1,690 @@
+/*
+ *  test-browser-common.c - Minimal browser hosting the wrapper
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE 1 /* mkdtemp */
+#include "sysdeps.h"
+#include "test-browser-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+
+typedef struct _TestBrowser TestBrowser;
+struct _TestBrowser
+{
+  gchar            *build_dir;
+  gchar            *tmp_dir;
+  gchar            *wrapper_path;
+  void             *handle;
+  NP_ShutdownFunc   NP_Shutdown;
+  NPNetscapeFuncs   browser_funcs;
+  NPPluginFuncs     plugin_funcs;
+  gboolean          private_mode;
+  gchar            *document_origin;
+  TestBrowserStats  stats;
+  GQueue            status;
+  GQueue            urls;
+  GHashTable       *timers;
+  uint32_t          next_timer_id;
+};
+
+static TestBrowser g_browser;
+
+/* Browser side of an NPStream */
+typedef struct _TestStream TestStream;
+struct _TestStream
+{
+  NPP            instance;
+  NPStream       stream;
+  const uint8_t *data;
+  uint32_t       size;
+};
+
+typedef struct _TestTimer TestTimer;
+struct _TestTimer
+{
+  NPP      instance;
+  uint32_t id;
+  void   (*func) (NPP instance, uint32_t timer_id);
+  guint    source_id;
+};
+
+typedef struct _TestAsyncCall TestAsyncCall;
+struct _TestAsyncCall
+{
+  void (*func) (void *user_data);
+  void  *user_data;
+};
+
+
+/* ====================================================================== */
+/* === Browser functions                                              === */
+/* ====================================================================== */
+
+static NPError
+browser_get_url (NPP instance, const char *url, const char *target)
+{
+  g_queue_push_tail (&g_browser.urls, g_strdup (url));
+  return NPERR_NO_ERROR;
+}
+
+static NPError
+browser_get_url_notify (NPP instance, const char *url, const char *target,
+			void *notify_data)
+{
+  return browser_get_url (instance, url, target);
+}
+
+typedef struct _TestRead TestRead;
+struct _TestRead
+{
+  NPP          instance;
+  TestStream  *stream;
+  NPByteRange *ranges;
+};
+
+static gboolean
+request_read_cb (gpointer user_data)
+{
+  TestRead *read = user_data;
+
+  while (read->ranges)
+    {
+      NPByteRange *range = read->ranges;
+      read->ranges = range->next;
+      test_browser_write_stream (read->instance, &read->stream->stream,
+				 range->offset, range->length);
+      g_free (range);
+    }
+  g_free (read);
+  return FALSE;
+}
+
+/* Sends the ranges from the main loop, like a browser getting them
+   from the network */
+static NPError
+browser_request_read (NPStream *stream, NPByteRange *range_list)
+{
+  TestStream *test_stream = stream->ndata;
+  TestRead *read;
+  NPByteRange *range, **tail;
+
+  g_browser.stats.request_read++;
+  if (test_stream == NULL || test_stream->data == NULL)
+    return NPERR_GENERIC_ERROR;
+  for (range = range_list; range != NULL; range = range->next)
+    {
+      if (range->offset < 0
+	  || (uint64_t)range->offset + range->length > test_stream->size)
+	return NPERR_GENERIC_ERROR;
+    }
+
+  read = g_new0 (TestRead, 1);
+  read->instance = test_stream->instance;
+  read->stream = test_stream;
+  tail = &read->ranges;
+  for (; range_list != NULL; range_list = range_list->next)
+    {
+      *tail = g_new0 (NPByteRange, 1);
+      (*tail)->offset = range_list->offset;
+      (*tail)->length = range_list->length;
+      tail = &(*tail)->next;
+      g_browser.stats.request_read_bytes += range_list->length;
+    }
+  g_idle_add (request_read_cb, read);
+  return NPERR_NO_ERROR;
+}
+
+static void
+browser_status (NPP instance, const char *message)
+{
+  g_queue_push_tail (&g_browser.status, g_strdup (message));
+}
+
+static const char *
+browser_user_agent (NPP instance)
+{
+  return "Mozilla/5.0 (X11; Linux) test-browser/" NPW_VERSION;
+}
+
+static void *
+browser_mem_alloc (uint32_t size)
+{
+  return malloc (size);
+}
+
+static void
+browser_mem_free (void *ptr)
+{
+  free (ptr);
+}
+
+static uint32_t
+browser_mem_flush (uint32_t size)
+{
+  return 0;
+}
+
+static NPError
+browser_get_value (NPP instance, NPNVariable variable, void *value)
+{
+  if (instance)
+    g_browser.stats.get_value++;
+
+  switch (variable)
+    {
+    case NPNVToolkit:
+      *(NPNToolkitType *)value = NPNVGtk2;
+      return NPERR_NO_ERROR;
+    case NPNVSupportsXEmbedBool:
+      *(NPBool *)value = TRUE;
+      return NPERR_NO_ERROR;
+    case NPNVSupportsWindowless:
+      *(NPBool *)value = FALSE;
+      return NPERR_NO_ERROR;
+    case NPNVprivateModeBool:
+      *(NPBool *)value = g_browser.private_mode;
+      return NPERR_NO_ERROR;
+    case NPNVdocumentOrigin:
+      if (g_browser.document_origin == NULL)
+	return NPERR_GENERIC_ERROR;
+      *(char **)value = strdup (g_browser.document_origin);
+      return NPERR_NO_ERROR;
+    default:
+      break;
+    }
+  return NPERR_GENERIC_ERROR;
+}
+
+static NPError
+browser_set_value (NPP instance, NPPVariable variable, void *value)
+{
+  return NPERR_NO_ERROR;
+}
+
+static void
+browser_invalidate_rect (NPP instance, NPRect *rect)
+{
+}
+
+static void
+browser_invalidate_region (NPP instance, NPRegion region)
+{
+}
+
+static void
+browser_force_redraw (NPP instance)
+{
+}
+
+static gboolean
+async_call_cb (gpointer user_data)
+{
+  TestAsyncCall *call = user_data;
+
+  call->func (call->user_data);
+  g_free (call);
+  return FALSE;
+}
+
+static void
+browser_plugin_thread_async_call (NPP instance, void (*func) (void *),
+				  void *user_data)
+{
+  TestAsyncCall *call = g_new (TestAsyncCall, 1);
+
+  call->func = func;
+  call->user_data = user_data;
+  g_idle_add (async_call_cb, call);
+}
+
+static gboolean
+timer_cb (gpointer user_data)
+{
+  TestTimer *timer = user_data;
+  uint32_t timer_id = timer->id;
+  gboolean repeat = timer->source_id != 0;
+
+  /* One-shot timers are gone before their callback runs */
+  if (!repeat)
+    g_hash_table_remove (g_browser.timers, GUINT_TO_POINTER (timer_id));
+  timer->func (timer->instance, timer_id);
+  if (!repeat)
+    g_free (timer);
+  return repeat
+    && g_hash_table_lookup (g_browser.timers, GUINT_TO_POINTER (timer_id));
+}
+
+static uint32_t
+browser_schedule_timer (NPP instance, uint32_t interval, NPBool repeat,
+			void (*func) (NPP instance, uint32_t timer_id))
+{
+  TestTimer *timer = g_new0 (TestTimer, 1);
+  guint source_id;
+
+  timer->instance = instance;
+  timer->id = ++g_browser.next_timer_id;
+  timer->func = func;
+  source_id = g_timeout_add (interval, timer_cb, timer);
+  if (repeat)
+    timer->source_id = source_id;
+  g_hash_table_insert (g_browser.timers, GUINT_TO_POINTER (timer->id), timer);
+  return timer->id;
+}
+
+static void
+browser_unschedule_timer (NPP instance, uint32_t timer_id)
+{
+  TestTimer *timer;
+
+  timer = g_hash_table_lookup (g_browser.timers, GUINT_TO_POINTER (timer_id));
+  if (timer == NULL)
+    return;
+  g_hash_table_remove (g_browser.timers, GUINT_TO_POINTER (timer_id));
+  if (timer->source_id)
+    g_source_remove (timer->source_id);
+  else
+    g_source_remove_by_user_data (timer);
+  g_free (timer);
+}
+
+
+/* ====================================================================== */
+/* === Wrapper setup                                                  === */
+/* ====================================================================== */
+
+/* Writes a copy of npwrapper.so for test-plugin-stub.so, as
+   do_install_plugin() in npconfig does */
+static gchar *
+install_wrapper (void)
+{
+  gchar *wrapper_data, *path;
+  gsize wrapper_size, i;
+  NPW_PluginInfo *pi = NULL;
+  gchar *plugin_path, *viewer_path;
+  struct stat st;
+  FILE *fp;
+  GError *error = NULL;
+
+  path = g_build_filename (g_browser.build_dir, NPW_WRAPPER, NULL);
+  if (!g_file_get_contents (path, &wrapper_data, &wrapper_size, &error))
+    {
+      g_printerr ("ERROR: %s\n", error->message);
+      exit (1);
+    }
+  g_free (path);
+
+  for (i = NPW_PLUGIN_IDENT_SIZE; i + PATH_MAX < wrapper_size; i++)
+    {
+      if (memcmp (wrapper_data + i, NPW_DEFAULT_PLUGIN_PATH,
+		  sizeof (NPW_DEFAULT_PLUGIN_PATH)) == 0
+	  && memcmp (wrapper_data + i - NPW_PLUGIN_IDENT_SIZE, NPW_PLUGIN_IDENT,
+		     strlen (NPW_PLUGIN_IDENT)) == 0)
+	{
+	  pi = (NPW_PluginInfo *)(wrapper_data + i - NPW_PLUGIN_IDENT_SIZE);
+	  break;
+	}
+    }
+  TEST_BROWSER_ENSURE (pi != NULL);
+
+  plugin_path = g_build_filename (g_browser.build_dir, "test-plugin-stub.so", NULL);
+  viewer_path = g_build_filename (g_browser.build_dir, "npviewer.bin", NULL);
+  TEST_BROWSER_ENSURE (stat (plugin_path, &st) == 0);
+  TEST_BROWSER_ENSURE (strlen (plugin_path) < PATH_MAX);
+  TEST_BROWSER_ENSURE (strlen (viewer_path) < PATH_MAX);
+  strcpy (pi->path, plugin_path);
+  strcpy (pi->viewer_path, viewer_path);
+  strcpy (pi->target_arch, HOST_ARCH);
+  strcpy (pi->target_os, HOST_OS);
+  pi->mtime = st.st_mtime;
+  pi->size = st.st_size;
+  pi->inode = st.st_ino;
+  g_free (plugin_path);
+  g_free (viewer_path);
+
+  path = g_build_filename (g_browser.tmp_dir,
+			   NPW_WRAPPER_BASE ".test-plugin-stub.so", NULL);
+  if ((fp = fopen (path, "wb")) == NULL
+      || fwrite (wrapper_data, 1, wrapper_size, fp) != wrapper_size
+      || fclose (fp) != 0)
+    {
+      g_printerr ("ERROR: could not write %s\n", path);
+      exit (1);
+    }
+  g_free (wrapper_data);
+  return path;
+}
+
+void
+test_browser_init (int argc, char *argv[])
+{
+  NP_InitializeFunc NP_Initialize;
+  NPNetscapeFuncs *funcs = &g_browser.browser_funcs;
+  gchar *dir;
+  NPError ret;
+
+  if (getenv ("DISPLAY") == NULL)
+    {
+      g_print ("%s: skipped, the viewer needs an X display\n", argv[0]);
+      exit (TEST_BROWSER_SKIP);
+    }
+
+  /* The plugin has to run in npviewer.bin, and report everything */
+  setenv ("NPW_DIRECT_EXEC", "no", 1);
+  setenv ("NPW_STATUS_INTERVAL", "0", 1);
+
+  dir = g_path_get_dirname (argv[0]);
+  g_browser.build_dir = realpath (dir, NULL);
+  g_free (dir);
+  TEST_BROWSER_ENSURE (g_browser.build_dir != NULL);
+  g_browser.tmp_dir = g_build_filename (g_get_tmp_dir (), "test-browser-XXXXXX", NULL);
+  TEST_BROWSER_ENSURE (mkdtemp (g_browser.tmp_dir) != NULL);
+  g_browser.wrapper_path = install_wrapper ();
+  g_browser.timers = g_hash_table_new (NULL, NULL);
+
+  if ((g_browser.handle = dlopen (g_browser.wrapper_path, RTLD_NOW | RTLD_LOCAL)) == NULL)
+    {
+      g_printerr ("ERROR: %s\n", dlerror ());
+      exit (1);
+    }
+  NP_Initialize = (NP_InitializeFunc)dlsym (g_browser.handle, "NP_Initialize");
+  g_browser.NP_Shutdown = (NP_ShutdownFunc)dlsym (g_browser.handle, "NP_Shutdown");
+  TEST_BROWSER_ENSURE (NP_Initialize != NULL && g_browser.NP_Shutdown != NULL);
+
+  funcs->size = sizeof (*funcs);
+  funcs->version = (NP_VERSION_MAJOR << 8) + NP_VERSION_MINOR;
+  funcs->geturl = browser_get_url;
+  funcs->geturlnotify = browser_get_url_notify;
+  funcs->requestread = browser_request_read;
+  funcs->status = browser_status;
+  funcs->uagent = browser_user_agent;
+  funcs->memalloc = browser_mem_alloc;
+  funcs->memfree = browser_mem_free;
+  funcs->memflush = browser_mem_flush;
+  funcs->getvalue = browser_get_value;
+  funcs->setvalue = browser_set_value;
+  funcs->invalidaterect = browser_invalidate_rect;
+  funcs->invalidateregion = browser_invalidate_region;
+  funcs->forceredraw = browser_force_redraw;
+  funcs->pluginthreadasynccall = browser_plugin_thread_async_call;
+  funcs->scheduletimer = browser_schedule_timer;
+  funcs->unscheduletimer = browser_unschedule_timer;
+
+  g_browser.plugin_funcs.size = sizeof (g_browser.plugin_funcs);
+  ret = NP_Initialize (funcs, &g_browser.plugin_funcs);
+  if (ret != NPERR_NO_ERROR)
+    {
+      g_printerr ("ERROR: NP_Initialize() returned %d\n", ret);
+      exit (1);
+    }
+}
+
+void
+test_browser_exit (void)
+{
+  gchar *status;
+
+  g_browser.NP_Shutdown ();
+  dlclose (g_browser.handle);
+  unlink (g_browser.wrapper_path);
+  rmdir (g_browser.tmp_dir);
+  g_free (g_browser.wrapper_path);
+  g_free (g_browser.tmp_dir);
+  free (g_browser.build_dir);
+  g_free (g_browser.document_origin);
+  while ((status = g_queue_pop_head (&g_browser.status)) != NULL)
+    g_free (status);
+  while ((status = g_queue_pop_head (&g_browser.urls)) != NULL)
+    g_free (status);
+}
+
+NPPluginFuncs *
+test_browser_plugin_funcs (void)
+{
+  return &g_browser.plugin_funcs;
+}
+
+void
+test_browser_set_private_mode (gboolean private_mode)
+{
+  g_browser.private_mode = private_mode;
+}
+
+void
+test_browser_set_document_origin (const gchar *origin)
+{
+  g_free (g_browser.document_origin);
+  g_browser.document_origin = g_strdup (origin);
+}
+
+TestBrowserStats *
+test_browser_stats (void)
+{
+  return &g_browser.stats;
+}
+
+
+/* ====================================================================== */
+/* === Plugin calls                                                   === */
+/* ====================================================================== */
+
+NPP
+test_browser_new_instance (const char *argn[], const char *argv[])
+{
+  NPP instance = g_new0 (NPP_t, 1);
+  int16_t argc = 0;
+  NPError ret;
+
+  while (argn[argc])
+    argc++;
+  ret = g_browser.plugin_funcs.newp (TEST_BROWSER_MIME_TYPE, instance, NP_EMBED,
+				     argc, (char **)argn, (char **)argv, NULL);
+  if (ret != NPERR_NO_ERROR)
+    {
+      g_printerr ("ERROR: NPP_New() returned %d\n", ret);
+      g_free (instance);
+      return NULL;
+    }
+  return instance;
+}
+
+void
+test_browser_destroy_instance (NPP instance)
+{
+  NPSavedData *save = NULL;
+
+  g_browser.plugin_funcs.destroy (instance, &save);
+  if (save)
+    {
+      free (save->buf);
+      free (save);
+    }
+  g_free (instance);
+}
+
+NPError
+test_browser_set_window (NPP instance, uint32_t width, uint32_t height,
+			 int32_t depth)
+{
+  NPWindow *window = g_new0 (NPWindow, 1);
+  NPSetWindowCallbackStruct *ws_info = g_new0 (NPSetWindowCallbackStruct, 1);
+  NPError ret;
+
+  ws_info->type = NP_SETWINDOW;
+  ws_info->depth = depth;
+  ws_info->colormap = depth * 1000;
+  window->type = NPWindowTypeWindow;
+  window->width = width;
+  window->height = height;
+  window->clipRect.right = width;
+  window->clipRect.bottom = height;
+  window->ws_info = ws_info;
+  ret = g_browser.plugin_funcs.setwindow (instance, window);
+
+  /* Anything that still points into these is caught by the next use */
+  memset (ws_info, 0xaa, sizeof (*ws_info));
+  g_free (ws_info);
+  memset (window, 0xaa, sizeof (*window));
+  g_free (window);
+  return ret;
+}
+
+NPStream *
+test_browser_new_stream (NPP instance, const char *url,
+			 const void *data, uint32_t size,
+			 NPBool seekable, uint16_t *stype)
+{
+  TestStream *test_stream = g_new0 (TestStream, 1);
+  NPError ret;
+
+  test_stream->instance = instance;
+  test_stream->data = data;
+  test_stream->size = size;
+  test_stream->stream.ndata = test_stream;
+  test_stream->stream.url = g_strdup (url);
+  test_stream->stream.end = size;
+  *stype = NP_NORMAL;
+  ret = g_browser.plugin_funcs.newstream (instance, TEST_BROWSER_MIME_TYPE,
+					  &test_stream->stream, seekable, stype);
+  if (ret != NPERR_NO_ERROR)
+    {
+      g_free ((char *)test_stream->stream.url);
+      g_free (test_stream);
+      return NULL;
+    }
+  return &test_stream->stream;
+}
+
+int32_t
+test_browser_write_stream (NPP instance, NPStream *stream,
+			   uint32_t offset, uint32_t size)
+{
+  TestStream *test_stream = stream->ndata;
+  uint32_t written = 0;
+
+  TEST_BROWSER_ENSURE (test_stream->data != NULL);
+  TEST_BROWSER_ENSURE ((uint64_t)offset + size <= test_stream->size);
+  while (written < size)
+    {
+      int32_t ready, len, ret;
+
+      ready = g_browser.plugin_funcs.writeready (instance, stream);
+      if (ready <= 0)
+	{
+	  test_browser_run (10);
+	  continue;
+	}
+      len = MIN ((uint32_t)ready, size - written);
+      ret = g_browser.plugin_funcs.write (instance, stream, offset + written,
+					  len, (void *)(test_stream->data + offset + written));
+      if (ret < 0)
+	return -1;
+      written += ret;
+    }
+  return written;
+}
+
+void
+test_browser_stream_as_file (NPP instance, NPStream *stream, const char *fname)
+{
+  g_browser.plugin_funcs.asfile (instance, stream, fname);
+}
+
+NPError
+test_browser_destroy_stream (NPP instance, NPStream *stream, NPReason reason)
+{
+  TestStream *test_stream = stream->ndata;
+  NPError ret;
+
+  ret = g_browser.plugin_funcs.destroystream (instance, stream, reason);
+  g_free ((char *)stream->url);
+  g_free (test_stream);
+  return ret;
+}
+
+
+/* ====================================================================== */
+/* === Main loop                                                      === */
+/* ====================================================================== */
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+  *(gboolean *)user_data = TRUE;
+  return FALSE;
+}
+
+void
+test_browser_run (guint timeout)
+{
+  gboolean timed_out = FALSE;
+
+  g_timeout_add (timeout, timeout_cb, &timed_out);
+  while (!timed_out)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+static gchar *
+pop_matching (GQueue *queue, const char *prefix)
+{
+  GList *l;
+
+  for (l = queue->head; l != NULL; l = l->next)
+    {
+      gchar *str = l->data;
+      if (prefix == NULL || g_str_has_prefix (str, prefix))
+	{
+	  g_queue_delete_link (queue, l);
+	  return str;
+	}
+    }
+  return NULL;
+}
+
+static gchar *
+wait_for (GQueue *queue, const char *prefix, guint timeout)
+{
+  gboolean timed_out = FALSE;
+  guint source_id;
+  gchar *str;
+
+  if ((str = pop_matching (queue, prefix)) != NULL)
+    return str;
+  source_id = g_timeout_add (timeout, timeout_cb, &timed_out);
+  while (!timed_out && (str = pop_matching (queue, prefix)) == NULL)
+    g_main_context_iteration (NULL, TRUE);
+  if (!timed_out)
+    g_source_remove (source_id);
+  return str;
+}
+
+gchar *
+test_browser_wait_status (const char *prefix, guint timeout)
+{
+  return wait_for (&g_browser.status, prefix, timeout);
+}
+
+gchar *
+test_browser_wait_url (guint timeout)
+{
+  return wait_for (&g_browser.urls, NULL, timeout);
+}
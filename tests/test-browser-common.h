@@ -0,0 +1,127 @@
+/*
+ *  test-browser-common.h - Minimal browser hosting the wrapper
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef TEST_BROWSER_COMMON_H
+#define TEST_BROWSER_COMMON_H
+
+#define XP_UNIX 1
+#define MOZ_X11 1
+
+#include <stdint.h>
+#include <glib.h>
+#include <npapi.h>
+#include <npfunctions.h>
+
+/* The test-browser-* programs load npwrapper.so the way a browser
+   does, configured like npconfig would for test-plugin-stub.so, and
+   so run the real npviewer.bin. They look for these files next to
+   their own executable and need an X display for the viewer. Without
+   one they exit with status TEST_BROWSER_SKIP.  */
+
+#define TEST_BROWSER_SKIP 77
+
+#define TEST_BROWSER_MIME_TYPE "application/x-npw-stub"
+
+#define TEST_BROWSER_ENSURE(expr) do {				\
+  if (!(expr)) {						\
+    g_printerr ("ERROR:(%s:%d):%s: assertion failed: (%s)\n",	\
+		__FILE__, __LINE__, __func__, #expr);		\
+    abort ();							\
+  }								\
+} while (0)
+
+typedef struct _TestBrowserStats TestBrowserStats;
+struct _TestBrowserStats
+{
+  guint get_value;		/* NPN_GetValue() calls with an instance */
+  guint request_read;		/* NPN_RequestRead() calls */
+  guint64 request_read_bytes;
+};
+
+/* Loads the wrapper and calls its NP_Initialize() */
+void
+test_browser_init (int argc, char *argv[]);
+
+/* Calls NP_Shutdown() and removes the wrapper copy */
+void
+test_browser_exit (void);
+
+NPPluginFuncs *
+test_browser_plugin_funcs (void);
+
+/* Browser values the stub can query */
+void
+test_browser_set_private_mode (gboolean private_mode);
+
+void
+test_browser_set_document_origin (const gchar *origin);
+
+TestBrowserStats *
+test_browser_stats (void);
+
+/* Creates an instance of the stub plugin with NULL terminated
+   argument names and values */
+NPP
+test_browser_new_instance (const char *argn[], const char *argv[]);
+
+void
+test_browser_destroy_instance (NPP instance);
+
+/* Calls NPP_SetWindow() with no X window. The NPWindow and its
+   ws_info are freed as soon as the call returns, as browsers may */
+NPError
+test_browser_set_window (NPP instance, uint32_t width, uint32_t height,
+			 int32_t depth);
+
+/* Streams DATA, which has to outlive the stream for NPN_RequestRead() */
+NPStream *
+test_browser_new_stream (NPP instance, const char *url,
+			 const void *data, uint32_t size,
+			 NPBool seekable, uint16_t *stype);
+
+/* Writes SIZE bytes at OFFSET the way the browser does. Returns the
+   number of bytes the plugin took, or -1 if it failed the stream */
+int32_t
+test_browser_write_stream (NPP instance, NPStream *stream,
+			   uint32_t offset, uint32_t size);
+
+void
+test_browser_stream_as_file (NPP instance, NPStream *stream,
+			     const char *fname);
+
+NPError
+test_browser_destroy_stream (NPP instance, NPStream *stream,
+			     NPReason reason);
+
+/* Runs the main loop until the stub reports a message starting with
+   PREFIX, which is returned and has to be freed with g_free(). Returns
+   NULL after TIMEOUT ms */
+gchar *
+test_browser_wait_status (const char *prefix, guint timeout);
+
+/* Likewise for the next NPN_GetURL() */
+gchar *
+test_browser_wait_url (guint timeout);
+
+/* Runs the main loop for TIMEOUT ms */
+void
+test_browser_run (guint timeout);
+
+#endif /* TEST_BROWSER_COMMON_H */
@@ -0,0 +1,86 @@
+/*
+ *  test-browser-getvalue.c - Browser values the viewer answers itself
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The stub, which has no NPP_SetValue(), asks for the windowless,
+   XEmbed, private mode and document origin values in NPP_New() and
+   in each NPP_SetWindow(). The wrapper sends these values along with
+   NPP_New(), so the viewer must answer all of them without calling
+   the browser, and still see a private mode change the browser makes
+   with NPP_SetValue().  */
+
+#include "sysdeps.h"
+#include "test-browser-common.h"
+#include <stdio.h>
+#include <string.h>
+
+#define WAIT_TIMEOUT	10000
+#define ORIGIN		"http://localhost"
+
+static guint
+ensure_query (const char *event, int private_mode)
+{
+  gchar *status, *expected;
+
+  status = test_browser_wait_status (event, WAIT_TIMEOUT);
+  TEST_BROWSER_ENSURE (status != NULL);
+  expected = g_strdup_printf ("%s windowless=0 xembed=1 private=%d origin=%s ",
+			      event, private_mode, ORIGIN);
+  TEST_BROWSER_ENSURE (g_str_has_prefix (status, expected));
+  g_free (expected);
+  g_free (status);
+  return test_browser_stats ()->get_value;
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const char *argn[] = { "npw-report", "npw-query", NULL };
+  static const char *args[] = { "yes", "yes", NULL };
+  NPP instance;
+  NPBool private_mode;
+  guint n_new, n_set_window, n_set_value;
+
+  test_browser_init (argc, argv);
+  test_browser_set_document_origin (ORIGIN);
+  instance = test_browser_new_instance (argn, args);
+  TEST_BROWSER_ENSURE (instance != NULL);
+  n_new = ensure_query ("query", 0);
+
+  TEST_BROWSER_ENSURE (test_browser_set_window (instance, 320, 240, 24) == NPERR_NO_ERROR);
+  n_set_window = ensure_query ("requery", 0) - n_new;
+
+  /* The browser switches to private browsing */
+  private_mode = TRUE;
+  test_browser_set_private_mode (private_mode);
+  TEST_BROWSER_ENSURE (test_browser_plugin_funcs ()->setvalue != NULL);
+  test_browser_plugin_funcs ()->setvalue (instance, NPNVprivateModeBool, &private_mode);
+  TEST_BROWSER_ENSURE (test_browser_set_window (instance, 320, 240, 24) == NPERR_NO_ERROR);
+  n_set_value = ensure_query ("requery", 1) - n_new - n_set_window;
+
+  g_print ("NPN_GetValue() calls reaching the browser for 4 plugin queries:"
+	   " NPP_New %u (the wrapper's own), NPP_SetWindow %u,"
+	   " after NPP_SetValue %u\n", n_new, n_set_window, n_set_value);
+  TEST_BROWSER_ENSURE (n_set_window == 0);
+  TEST_BROWSER_ENSURE (n_set_value == 0);
+
+  test_browser_destroy_instance (instance);
+  test_browser_exit ();
+  return 0;
+}
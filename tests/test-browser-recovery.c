@@ -0,0 +1,200 @@
+/*
+ *  test-browser-recovery.c - Kill the viewer and check instances come back
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* An instance of the stub plugin gets a window and a stream, then the
+   viewer is killed with SIGKILL in the middle of the stream. The
+   wrapper has to start a new viewer by itself and replay NPP_New(),
+   the last NPP_SetWindow() and the source URL into it, while the old
+   stream fails. The viewer is killed a second time right away, within
+   the minimum restart interval, which must delay recovery rather than
+   drop it. This runs once with a cold restart and once with
+   NPW_VIEWER_STANDBY=yes, and prints how long recovery took.  */
+
+#include "sysdeps.h"
+#include "test-browser-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define DEBUG 1
+#include "debug.h"
+
+#define STREAM_URL	"http://localhost/recovery.npwstub"
+#define STREAM_SIZE	(256 * 1024)
+#define WAIT_TIMEOUT	10000
+
+static uint8_t g_data[STREAM_SIZE];
+
+static uint32_t
+checksum (const uint8_t *buf, uint32_t len)
+{
+  uint32_t sum = 0;
+  while (len-- > 0)
+    sum = sum * 31 + *buf++;
+  return sum;
+}
+
+static GPid
+wait_viewer_pid (void)
+{
+  gchar *status;
+  GPid pid = -1;
+
+  status = test_browser_wait_status ("new ", WAIT_TIMEOUT);
+  TEST_BROWSER_ENSURE (status != NULL);
+  TEST_BROWSER_ENSURE (sscanf (status, "new pid=%d", &pid) == 1);
+  g_free (status);
+  return pid;
+}
+
+static void
+ensure_window (void)
+{
+  gchar *status = test_browser_wait_status ("window ", WAIT_TIMEOUT);
+
+  TEST_BROWSER_ENSURE (status != NULL);
+  TEST_BROWSER_ENSURE (g_str_has_prefix (status, "window 320x240 depth=24 colormap=24000 "));
+  g_free (status);
+}
+
+static void
+ensure_url (void)
+{
+  gchar *url = test_browser_wait_url (WAIT_TIMEOUT);
+
+  TEST_BROWSER_ENSURE (url != NULL);
+  TEST_BROWSER_ENSURE (strcmp (url, STREAM_URL) == 0);
+  g_free (url);
+}
+
+/* Sends the whole stream, as the browser does for the URL replayed */
+static void
+ensure_stream (NPP instance)
+{
+  NPStream *stream;
+  uint16_t stype;
+  gchar *status, *expected;
+
+  stream = test_browser_new_stream (instance, STREAM_URL, g_data, STREAM_SIZE,
+				    FALSE, &stype);
+  TEST_BROWSER_ENSURE (stream != NULL);
+  TEST_BROWSER_ENSURE (test_browser_write_stream (instance, stream, 0, STREAM_SIZE) == STREAM_SIZE);
+  test_browser_destroy_stream (instance, stream, NPRES_DONE);
+
+  status = test_browser_wait_status ("destroystream ", WAIT_TIMEOUT);
+  TEST_BROWSER_ENSURE (status != NULL);
+  expected = g_strdup_printf ("destroystream bytes=%u sum=%08x reason=%d ",
+			      STREAM_SIZE, checksum (g_data, STREAM_SIZE), NPRES_DONE);
+  TEST_BROWSER_ENSURE (g_str_has_prefix (status, expected));
+  g_free (expected);
+  g_free (status);
+}
+
+static void
+run (const char *mode, int argc, char *argv[])
+{
+  static const char *argn[] = { "src", "npw-report", NULL };
+  static const char *args[] = { STREAM_URL, "yes", NULL };
+  NPP instance;
+  NPStream *stream;
+  uint16_t stype;
+  GPid pid, new_pid;
+  uint64_t start;
+  gchar *status;
+
+  test_browser_init (argc, argv);
+  instance = test_browser_new_instance (argn, args);
+  TEST_BROWSER_ENSURE (instance != NULL);
+  pid = wait_viewer_pid ();
+  TEST_BROWSER_ENSURE (test_browser_set_window (instance, 320, 240, 24) == NPERR_NO_ERROR);
+  ensure_window ();
+
+  /* Kill the viewer in the middle of the stream */
+  stream = test_browser_new_stream (instance, STREAM_URL, g_data, STREAM_SIZE,
+				    FALSE, &stype);
+  TEST_BROWSER_ENSURE (stream != NULL);
+  TEST_BROWSER_ENSURE (test_browser_write_stream (instance, stream, 0, STREAM_SIZE / 2) == STREAM_SIZE / 2);
+  start = npw_get_time_us ();
+  kill (pid, SIGKILL);
+
+  new_pid = wait_viewer_pid ();
+  TEST_BROWSER_ENSURE (new_pid != pid);
+  ensure_window ();
+  g_print ("%s: instance back %.1f ms after SIGKILL\n",
+	   mode, (npw_get_time_us () - start) / 1000.0);
+  ensure_url ();
+
+  /* The stream from the dead viewer fails, the new one goes through */
+  TEST_BROWSER_ENSURE (test_browser_write_stream (instance, stream, STREAM_SIZE / 2,
+						  STREAM_SIZE / 2) < 0);
+  test_browser_destroy_stream (instance, stream, NPRES_NETWORK_ERR);
+  ensure_stream (instance);
+
+  /* Crash again within MIN_RESTART_INTERVAL */
+  pid = new_pid;
+  start = npw_get_time_us ();
+  kill (pid, SIGKILL);
+  new_pid = wait_viewer_pid ();
+  TEST_BROWSER_ENSURE (new_pid != pid);
+  ensure_window ();
+  g_print ("%s: instance back %.1f ms after second SIGKILL\n",
+	   mode, (npw_get_time_us () - start) / 1000.0);
+  ensure_url ();
+  ensure_stream (instance);
+
+  /* Nothing else may come up */
+  test_browser_run (100);
+  status = test_browser_wait_status ("new ", 0);
+  TEST_BROWSER_ENSURE (status == NULL);
+
+  test_browser_destroy_instance (instance);
+  test_browser_exit ();
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const char *modes[] = { "cold", "standby" };
+  int i, status;
+  pid_t pid;
+
+  for (i = 0; i < STREAM_SIZE; i++)
+    g_data[i] = g_random_int ();
+
+  /* The wrapper reads NPW_VIEWER_STANDBY once, so each mode gets its
+     own process */
+  for (i = 0; i < G_N_ELEMENTS (modes); i++)
+    {
+      if ((pid = fork ()) == 0)
+	{
+	  setenv ("NPW_VIEWER_STANDBY", i == 1 ? "yes" : "no", 1);
+	  run (modes[i], argc, argv);
+	  exit (0);
+	}
+      TEST_BROWSER_ENSURE (pid > 0);
+      TEST_BROWSER_ENSURE (waitpid (pid, &status, 0) == pid);
+      if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+	return WIFEXITED (status) ? WEXITSTATUS (status) : 1;
+    }
+  return 0;
+}
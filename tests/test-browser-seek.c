@@ -0,0 +1,187 @@
+/*
+ *  test-browser-seek.c - Check NPN_RequestRead() on the stream cache
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The stub takes a seekable stream as NP_SEEK, the browser delivers
+   the first part of it, then the stub asks for a range with
+   NPN_RequestRead(). The viewer has to serve what it got already from
+   the stream cache and only ask the browser for the rest. The cache
+   segment must be marked for removal by the time NPP_NewStream()
+   returns, so that it can't outlive both processes, and be gone once
+   the stream is destroyed.  */
+
+#include "sysdeps.h"
+#include "test-browser-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEBUG 1
+#include "debug.h"
+
+#define STREAM_URL	"http://localhost/seek.npwstub"
+/* An odd size, to tell our segment in /proc/sysvipc/shm */
+#define STREAM_SIZE	(3 * 1024 * 1024 + 4321)
+#define DELIVERED_SIZE	(2 * 1024 * 1024)
+#define WAIT_TIMEOUT	10000
+
+#define SHM_DEST_MODE	01000
+
+static uint8_t g_data[STREAM_SIZE];
+
+static uint32_t
+checksum (const uint8_t *buf, uint32_t len)
+{
+  uint32_t sum = 0;
+  while (len-- > 0)
+    sum = sum * 31 + *buf++;
+  return sum;
+}
+
+/* Counts the SysV segments of the stream cache, and in *REMOVED those
+   already marked for removal */
+static int
+count_cache_segments (int *removed)
+{
+  FILE *fp;
+  char line[512];
+  int count = 0;
+
+  *removed = 0;
+  if ((fp = fopen ("/proc/sysvipc/shm", "r")) == NULL)
+    return -1;
+  while (fgets (line, sizeof (line), fp))
+    {
+      unsigned long size;
+      unsigned int perms, uid;
+      int key, shmid, cpid, lpid, nattch;
+
+      if (sscanf (line, "%d %d %o %lu %d %d %d %u",
+		  &key, &shmid, &perms, &size, &cpid, &lpid, &nattch, &uid) != 8)
+	continue;
+      if (size != STREAM_SIZE || uid != getuid ())
+	continue;
+      count++;
+      if (perms & SHM_DEST_MODE)
+	(*removed)++;
+    }
+  fclose (fp);
+  return count;
+}
+
+static void
+run (uint32_t offset, uint32_t length)
+{
+  static const char *argn[] = { "npw-report", "npw-stype", "npw-seek", NULL };
+  const char *args[] = { "yes", "seek", NULL, NULL };
+  TestBrowserStats *stats = test_browser_stats ();
+  guint request_read = stats->request_read;
+  guint64 request_read_bytes = stats->request_read_bytes;
+  uint64_t expected_bytes, start;
+  uint32_t received = 0;
+  NPStream *stream;
+  NPP instance;
+  uint16_t stype;
+  gchar *status, *expected;
+  int segments, removed;
+
+  args[2] = expected = g_strdup_printf ("%u:%u", offset, length);
+  instance = test_browser_new_instance (argn, args);
+  TEST_BROWSER_ENSURE (instance != NULL);
+  g_free (expected);
+
+  stream = test_browser_new_stream (instance, STREAM_URL, g_data, STREAM_SIZE,
+				    TRUE, &stype);
+  TEST_BROWSER_ENSURE (stream != NULL);
+  TEST_BROWSER_ENSURE (stype == NP_SEEK);
+  status = test_browser_wait_status ("newstream ", WAIT_TIMEOUT);
+  TEST_BROWSER_ENSURE (status != NULL);
+  g_free (status);
+  if ((segments = count_cache_segments (&removed)) >= 0)
+    {
+      TEST_BROWSER_ENSURE (segments == 1);
+      TEST_BROWSER_ENSURE (removed == 1);
+    }
+
+  TEST_BROWSER_ENSURE (test_browser_write_stream (instance, stream, 0, DELIVERED_SIZE) == DELIVERED_SIZE);
+
+  /* The stub reads the range when it gets a window */
+  start = npw_get_time_us ();
+  TEST_BROWSER_ENSURE (test_browser_set_window (instance, 320, 240, 24) == NPERR_NO_ERROR);
+  status = test_browser_wait_status ("requestread ", WAIT_TIMEOUT);
+  TEST_BROWSER_ENSURE (status != NULL);
+  TEST_BROWSER_ENSURE (g_str_has_prefix (status, "requestread ret=0 "));
+  g_free (status);
+
+  /* Cached and missing parts may come in any order, each chunk once */
+  while (received < length)
+    {
+      uint32_t chunk_offset, chunk_length, chunk_sum;
+
+      status = test_browser_wait_status ("read ", WAIT_TIMEOUT);
+      TEST_BROWSER_ENSURE (status != NULL);
+      TEST_BROWSER_ENSURE (sscanf (status, "read offset=%u len=%u sum=%x",
+				   &chunk_offset, &chunk_length, &chunk_sum) == 3);
+      TEST_BROWSER_ENSURE (chunk_offset >= offset);
+      TEST_BROWSER_ENSURE (chunk_offset + chunk_length <= offset + length);
+      TEST_BROWSER_ENSURE (chunk_sum == checksum (g_data + chunk_offset, chunk_length));
+      received += chunk_length;
+      g_free (status);
+    }
+  TEST_BROWSER_ENSURE (received == length);
+
+  expected_bytes = offset + length > DELIVERED_SIZE
+    ? offset + length - MAX (offset, DELIVERED_SIZE) : 0;
+  TEST_BROWSER_ENSURE (stats->request_read - request_read == (expected_bytes > 0));
+  TEST_BROWSER_ENSURE (stats->request_read_bytes - request_read_bytes == expected_bytes);
+  g_print ("read %u bytes at %u in %.1f ms, %" G_GUINT64_FORMAT " from the browser\n",
+	   length, offset, (npw_get_time_us () - start) / 1000.0, expected_bytes);
+
+  /* Nothing more than asked for */
+  test_browser_run (100);
+  status = test_browser_wait_status ("read ", 0);
+  TEST_BROWSER_ENSURE (status == NULL);
+
+  test_browser_destroy_stream (instance, stream, NPRES_DONE);
+  status = test_browser_wait_status ("destroystream ", WAIT_TIMEOUT);
+  TEST_BROWSER_ENSURE (status != NULL);
+  g_free (status);
+  if ((segments = count_cache_segments (&removed)) >= 0)
+    TEST_BROWSER_ENSURE (segments == 0);
+
+  test_browser_destroy_instance (instance);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int i;
+
+  for (i = 0; i < STREAM_SIZE; i++)
+    g_data[i] = g_random_int ();
+
+  test_browser_init (argc, argv);
+  /* All of it in the cache already */
+  run (DELIVERED_SIZE / 2 - 1000, 300000);
+  /* Straddling what the browser delivered so far */
+  run (DELIVERED_SIZE - 100000, 250000);
+  test_browser_exit ();
+  return 0;
+}
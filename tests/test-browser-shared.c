@@ -0,0 +1,274 @@
+/*
+ *  test-browser-shared.c - Check and measure the shared viewer
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Several browser processes each create an instance of the stub, once
+   with a viewer of their own and once with NPW_SHARED_VIEWER=yes. With
+   the shared viewer, all of them must be served by sessions of a
+   single daemon. The Pss of the viewer processes is printed for both,
+   which is what each browser process costs.
+
+   When run as root, an unprivileged process then squats the shared
+   viewer path, and the browser has to fall back to a viewer of its
+   own rather than fail.  */
+
+#include "sysdeps.h"
+#include "test-browser-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define DEBUG 1
+#include "debug.h"
+
+#define N_BROWSERS	3
+#define WAIT_TIMEOUT	10000
+#define NOBODY_UID	65534
+
+typedef struct _Browser Browser;
+struct _Browser
+{
+  pid_t pid;
+  int   to_browser;
+  int   from_browser;
+  GPid  viewer_pid;
+};
+
+/* Creates an instance, tells the viewer pid and waits to be told to
+   quit */
+static void
+run_browser (int argc, char *argv[], int in, int out)
+{
+  static const char *argn[] = { "npw-report", NULL };
+  static const char *args[] = { "yes", NULL };
+  NPP instance;
+  gchar *status;
+  GPid pid = -1;
+  char c;
+
+  test_browser_init (argc, argv);
+  instance = test_browser_new_instance (argn, args);
+  TEST_BROWSER_ENSURE (instance != NULL);
+  status = test_browser_wait_status ("new ", WAIT_TIMEOUT);
+  TEST_BROWSER_ENSURE (status != NULL);
+  TEST_BROWSER_ENSURE (sscanf (status, "new pid=%d", &pid) == 1);
+  g_free (status);
+  TEST_BROWSER_ENSURE (write (out, &pid, sizeof (pid)) == sizeof (pid));
+  TEST_BROWSER_ENSURE (read (in, &c, 1) == 1);
+  test_browser_destroy_instance (instance);
+  test_browser_exit ();
+}
+
+static void
+start_browser (Browser *browser, int argc, char *argv[])
+{
+  int to_browser[2], from_browser[2];
+
+  TEST_BROWSER_ENSURE (pipe (to_browser) == 0 && pipe (from_browser) == 0);
+  if ((browser->pid = fork ()) == 0)
+    {
+      close (to_browser[1]);
+      close (from_browser[0]);
+      run_browser (argc, argv, to_browser[0], from_browser[1]);
+      exit (0);
+    }
+  TEST_BROWSER_ENSURE (browser->pid > 0);
+  close (to_browser[0]);
+  close (from_browser[1]);
+  browser->to_browser = to_browser[1];
+  browser->from_browser = from_browser[0];
+  TEST_BROWSER_ENSURE (read (browser->from_browser, &browser->viewer_pid,
+			     sizeof (browser->viewer_pid)) == sizeof (browser->viewer_pid));
+}
+
+static void
+stop_browser (Browser *browser)
+{
+  int status;
+
+  TEST_BROWSER_ENSURE (write (browser->to_browser, "q", 1) == 1);
+  TEST_BROWSER_ENSURE (waitpid (browser->pid, &status, 0) == browser->pid);
+  TEST_BROWSER_ENSURE (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+  close (browser->to_browser);
+  close (browser->from_browser);
+}
+
+static pid_t
+get_parent_pid (pid_t pid)
+{
+  gchar *path, *line;
+  pid_t ppid = -1;
+  FILE *fp;
+  char buf[512];
+
+  path = g_strdup_printf ("/proc/%d/stat", pid);
+  fp = fopen (path, "r");
+  g_free (path);
+  TEST_BROWSER_ENSURE (fp != NULL);
+  TEST_BROWSER_ENSURE (fgets (buf, sizeof (buf), fp) != NULL);
+  fclose (fp);
+  /* The command name may have spaces */
+  line = strrchr (buf, ')');
+  TEST_BROWSER_ENSURE (line != NULL);
+  TEST_BROWSER_ENSURE (sscanf (line, ") %*c %d", &ppid) == 1);
+  return ppid;
+}
+
+/* Returns the Pss of PID in KB, or 0 if the kernel does not tell */
+static unsigned long
+get_pss (pid_t pid)
+{
+  unsigned long pss = 0;
+  gchar *path;
+  FILE *fp;
+  char line[256];
+
+  path = g_strdup_printf ("/proc/%d/smaps_rollup", pid);
+  fp = fopen (path, "r");
+  g_free (path);
+  if (fp == NULL)
+    return 0;
+  while (fgets (line, sizeof (line), fp))
+    {
+      if (sscanf (line, "Pss: %lu kB", &pss) == 1)
+	break;
+    }
+  fclose (fp);
+  return pss;
+}
+
+static void
+run (const char *mode, int argc, char *argv[])
+{
+  Browser browsers[N_BROWSERS];
+  unsigned long pss = 0, daemon_pss = 0;
+  pid_t daemon_pid = -1;
+  int i;
+
+  setenv ("NPW_SHARED_VIEWER", strcmp (mode, "shared") == 0 ? "yes" : "no", 1);
+  for (i = 0; i < N_BROWSERS; i++)
+    start_browser (&browsers[i], argc, argv);
+
+  for (i = 0; i < N_BROWSERS; i++)
+    {
+      pid_t ppid = get_parent_pid (browsers[i].viewer_pid);
+
+      if (strcmp (mode, "shared") != 0)
+	TEST_BROWSER_ENSURE (ppid == browsers[i].pid);
+      else
+	{
+	  /* Sessions of the one daemon, which no browser started itself */
+	  TEST_BROWSER_ENSURE (ppid != browsers[i].pid);
+	  TEST_BROWSER_ENSURE (daemon_pid < 0 || ppid == daemon_pid);
+	  daemon_pid = ppid;
+	}
+      pss += get_pss (browsers[i].viewer_pid);
+    }
+  if (daemon_pid > 0)
+    daemon_pss = get_pss (daemon_pid);
+  g_print ("%s: %d viewers, pss %lu KB each, %lu KB with the daemon\n",
+	   mode, N_BROWSERS, pss / N_BROWSERS, pss + daemon_pss);
+
+  for (i = 0; i < N_BROWSERS; i++)
+    stop_browser (&browsers[i]);
+
+  /* The daemon would otherwise linger for a minute */
+  if (daemon_pid > 0)
+    {
+      kill (daemon_pid, SIGTERM);
+      while (kill (daemon_pid, 0) == 0)
+	g_usleep (10000);
+    }
+}
+
+/* Listens on the shared viewer path as another user */
+static pid_t
+start_squatter (void)
+{
+  struct sockaddr_un addr;
+  gchar *ident;
+  int fd, ready[2], len;
+  pid_t pid;
+  char c;
+
+  TEST_BROWSER_ENSURE (pipe (ready) == 0);
+  ident = g_strdup_printf ("%s/test-plugin-stub.so/shared-%d",
+			   NPW_CONNECTION_PATH, getuid ());
+  if ((pid = fork ()) == 0)
+    {
+      TEST_BROWSER_ENSURE (setgid (NOBODY_UID) == 0 && setuid (NOBODY_UID) == 0);
+      fd = socket (AF_UNIX, SOCK_STREAM, 0);
+      TEST_BROWSER_ENSURE (fd >= 0);
+      memset (&addr, 0, sizeof (addr));
+      addr.sun_family = AF_UNIX;
+      len = strlen (ident);
+      /* An abstract socket, like rpc.c makes */
+      memcpy (&addr.sun_path[1], ident, len);
+      TEST_BROWSER_ENSURE (bind (fd, (struct sockaddr *)&addr,
+				 offsetof (struct sockaddr_un, sun_path) + 1 + len) == 0);
+      TEST_BROWSER_ENSURE (listen (fd, 16) == 0);
+      TEST_BROWSER_ENSURE (write (ready[1], "r", 1) == 1);
+      for (;;)
+	pause ();
+    }
+  TEST_BROWSER_ENSURE (pid > 0);
+  g_free (ident);
+  close (ready[1]);
+  TEST_BROWSER_ENSURE (read (ready[0], &c, 1) == 1);
+  close (ready[0]);
+  return pid;
+}
+
+static void
+run_squatted (int argc, char *argv[])
+{
+  Browser browser;
+  pid_t squatter;
+
+  squatter = start_squatter ();
+  setenv ("NPW_SHARED_VIEWER", "yes", 1);
+  start_browser (&browser, argc, argv);
+  TEST_BROWSER_ENSURE (get_parent_pid (browser.viewer_pid) == browser.pid);
+  stop_browser (&browser);
+  kill (squatter, SIGKILL);
+  waitpid (squatter, NULL, 0);
+  g_print ("squatted: fell back to a private viewer\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+  if (getenv ("DISPLAY") == NULL)
+    {
+      g_print ("%s: skipped, the viewer needs an X display\n", argv[0]);
+      return TEST_BROWSER_SKIP;
+    }
+
+  run ("private", argc, argv);
+  run ("shared", argc, argv);
+  if (getuid () == 0)
+    run_squatted (argc, argv);
+  return 0;
+}
@@ -0,0 +1,350 @@
+/*
+ *  test-glibcurl.c - Benchmark concurrent glibcurl downloads
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Download many streams at once through glibcurl, the way npplayer
+   does, and report the aggregate throughput.
+
+   By default, the streams are served over loopback HTTP by a minimal
+   server living in the same main loop. With --file, the streams are
+   read from a temporary file through file:// URLs instead.  */
+
+#include "sysdeps.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include "glibcurl.h"
+
+typedef struct
+{
+  gint        fd;
+  GIOChannel *channel;
+  GString    *request;
+  gchar      *header;
+  gsize       header_length;
+  gsize       offset;
+} ServerConnection;
+
+typedef struct
+{
+  CURL  *handle;
+  gsize  received;
+} Stream;
+
+static gint       g_n_streams   = 64;
+static gsize      g_stream_size = 256 * 1024;
+static gboolean   g_use_file    = FALSE;
+static gchar     *g_payload;
+static gint       g_n_pending;
+static gint       g_n_callbacks;
+static gint       g_n_errors;
+static GMainLoop *g_loop;
+
+static gboolean
+set_nonblocking (gint fd)
+{
+  gint flags = fcntl (fd, F_GETFL, 0);
+  return flags >= 0 && fcntl (fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static void
+server_connection_destroy (ServerConnection *conn)
+{
+  g_io_channel_unref (conn->channel);
+  close (conn->fd);
+  g_string_free (conn->request, TRUE);
+  g_free (conn->header);
+  g_free (conn);
+}
+
+static gboolean
+on_server_write (GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+  ServerConnection *conn = data;
+  const gsize total = conn->header_length + g_stream_size;
+
+  if (condition & (G_IO_ERR | G_IO_HUP))
+    {
+      server_connection_destroy (conn);
+      return FALSE;
+    }
+
+  while (conn->offset < total)
+    {
+      const gchar *buf;
+      gsize        len;
+      if (conn->offset < conn->header_length)
+	{
+	  buf = conn->header + conn->offset;
+	  len = conn->header_length - conn->offset;
+	}
+      else
+	{
+	  buf = g_payload + (conn->offset - conn->header_length);
+	  len = total - conn->offset;
+	}
+
+      ssize_t n = write (conn->fd, buf, len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  if (errno == EAGAIN)
+	    return TRUE;
+	  break;
+	}
+      conn->offset += n;
+    }
+
+  server_connection_destroy (conn);
+  return FALSE;
+}
+
+static gboolean
+on_server_read (GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+  ServerConnection *conn = data;
+  gchar buf[1024];
+  ssize_t n;
+
+  while ((n = read (conn->fd, buf, sizeof (buf))) < 0 && errno == EINTR)
+    ;
+  if (n < 0 && errno == EAGAIN)
+    return TRUE;
+  if (n <= 0)
+    {
+      server_connection_destroy (conn);
+      return FALSE;
+    }
+
+  g_string_append_len (conn->request, buf, n);
+  if (g_strstr_len (conn->request->str, conn->request->len, "\r\n\r\n") == NULL)
+    return TRUE;
+
+  conn->header = g_strdup_printf ("HTTP/1.0 200 OK\r\n"
+				  "Content-Type: application/octet-stream\r\n"
+				  "Content-Length: %lu\r\n"
+				  "\r\n",
+				  (unsigned long)g_stream_size);
+  conn->header_length = strlen (conn->header);
+  g_io_add_watch (conn->channel, G_IO_OUT | G_IO_ERR | G_IO_HUP,
+		  on_server_write, conn);
+  return FALSE;
+}
+
+static gboolean
+on_server_accept (GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+  gint listen_fd = GPOINTER_TO_INT (data);
+  gint fd;
+
+  while ((fd = accept (listen_fd, NULL, NULL)) >= 0)
+    {
+      ServerConnection *conn = g_new0 (ServerConnection, 1);
+      set_nonblocking (fd);
+      conn->fd = fd;
+      conn->channel = g_io_channel_unix_new (fd);
+      conn->request = g_string_new (NULL);
+      g_io_add_watch (conn->channel, G_IO_IN | G_IO_ERR | G_IO_HUP,
+		      on_server_read, conn);
+    }
+  return TRUE;
+}
+
+/* Start the loopback HTTP server, return its port */
+static gint
+start_server (void)
+{
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof (addr);
+  gint fd;
+
+  if ((fd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0
+      || listen (fd, SOMAXCONN) < 0
+      || getsockname (fd, (struct sockaddr *)&addr, &addr_len) < 0
+      || !set_nonblocking (fd))
+    {
+      close (fd);
+      return -1;
+    }
+
+  GIOChannel *channel = g_io_channel_unix_new (fd);
+  g_io_add_watch (channel, G_IO_IN, on_server_accept, GINT_TO_POINTER (fd));
+  g_io_channel_unref (channel);
+  return ntohs (addr.sin_port);
+}
+
+static size_t
+on_stream_read_cb (void *ptr, size_t size, size_t nmemb, void *data)
+{
+  Stream *stream = data;
+  stream->received += size * nmemb;
+  return size * nmemb;
+}
+
+static void
+on_stream_done_cb (gpointer user_data)
+{
+  CURLMsg *msg;
+  int in_queue;
+
+  ++g_n_callbacks;
+  while ((msg = curl_multi_info_read (glibcurl_handle (), &in_queue)) != NULL)
+    {
+      if (msg->msg != CURLMSG_DONE)
+	continue;
+
+      char *stream_;
+      if (curl_easy_getinfo (msg->easy_handle, CURLINFO_PRIVATE, &stream_) != CURLE_OK)
+	continue;
+
+      Stream *stream = (Stream *)stream_;
+      if (msg->data.result != CURLE_OK || stream->received != g_stream_size)
+	{
+	  g_printerr ("stream %p failed: %s, got %lu bytes\n",
+		      stream, curl_easy_strerror (msg->data.result),
+		      (unsigned long)stream->received);
+	  ++g_n_errors;
+	}
+
+      if (--g_n_pending == 0)
+	g_main_loop_quit (g_loop);
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  gchar *tmp_file = NULL;
+  gchar *url;
+
+  for (int i = 1; i < argc; i++)
+    {
+      const gchar *arg = argv[i];
+      if (strcmp (arg, "--streams") == 0)
+	{
+	  if (++i < argc)
+	    {
+	      unsigned long v = strtoul (argv[i], NULL, 10);
+	      if (v > 0)
+		g_n_streams = v;
+	    }
+	}
+      else if (strcmp (arg, "--size") == 0)
+	{
+	  if (++i < argc)
+	    {
+	      unsigned long v = strtoul (argv[i], NULL, 10);
+	      if (v > 0)
+		g_stream_size = v;
+	    }
+	}
+      else if (strcmp (arg, "--file") == 0)
+	g_use_file = TRUE;
+      else if (strcmp (arg, "--help") == 0)
+	{
+	  g_print ("Usage: %s [--streams COUNT] [--size BYTES] [--file]\n", argv[0]);
+	  return 0;
+	}
+    }
+
+  g_payload = g_malloc (g_stream_size);
+  for (gsize i = 0; i < g_stream_size; i++)
+    g_payload[i] = i & 0xff;
+
+  g_loop = g_main_loop_new (NULL, FALSE);
+  if (g_use_file)
+    {
+      gint fd = g_file_open_tmp ("test-glibcurl-XXXXXX", &tmp_file, NULL);
+      if (fd < 0)
+	g_error ("could not create temporary file");
+      close (fd);
+      if (!g_file_set_contents (tmp_file, g_payload, g_stream_size, NULL))
+	g_error ("could not write temporary file");
+      url = g_strdup_printf ("file://%s", tmp_file);
+    }
+  else
+    {
+      gint port = start_server ();
+      if (port < 0)
+	g_error ("could not start loopback server");
+      url = g_strdup_printf ("http://127.0.0.1:%d/", port);
+    }
+
+  glibcurl_init ();
+  glibcurl_set_callback (on_stream_done_cb, NULL);
+
+  Stream *streams = g_new0 (Stream, g_n_streams);
+  GTimer *timer = g_timer_new ();
+  for (gint i = 0; i < g_n_streams; i++)
+    {
+      CURL *handle = curl_easy_init ();
+      curl_easy_setopt (handle, CURLOPT_URL, url);
+      curl_easy_setopt (handle, CURLOPT_NOSIGNAL, 1);
+      curl_easy_setopt (handle, CURLOPT_PROXY, "");
+      curl_easy_setopt (handle, CURLOPT_WRITEFUNCTION, on_stream_read_cb);
+      curl_easy_setopt (handle, CURLOPT_WRITEDATA, &streams[i]);
+      curl_easy_setopt (handle, CURLOPT_PRIVATE, &streams[i]);
+      streams[i].handle = handle;
+      glibcurl_add (handle);
+    }
+  g_n_pending = g_n_streams;
+  g_main_loop_run (g_loop);
+  g_timer_stop (timer);
+
+  gdouble elapsed = g_timer_elapsed (timer, NULL);
+  gdouble total = (gdouble)g_stream_size * g_n_streams;
+  g_print ("# source  streams        size      MB/s  callbacks\n");
+  g_print ("%-8s %8d %11lu %9.1f %10d\n",
+	   g_use_file ? "file" : "http", g_n_streams,
+	   (unsigned long)g_stream_size, total / elapsed / 1e6, g_n_callbacks);
+
+  for (gint i = 0; i < g_n_streams; i++)
+    {
+      glibcurl_remove (streams[i].handle);
+      curl_easy_cleanup (streams[i].handle);
+    }
+  glibcurl_cleanup ();
+
+  if (tmp_file)
+    {
+      unlink (tmp_file);
+      g_free (tmp_file);
+    }
+  g_timer_destroy (timer);
+  g_free (streams);
+  g_free (url);
+  g_free (g_payload);
+  g_main_loop_unref (g_loop);
+  return g_n_errors > 0;
+}
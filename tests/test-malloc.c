@@ -0,0 +1,167 @@
+/*
+ *  test-malloc.c - Benchmark NPW_MemAlloc() backends
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Replay an allocation pattern resembling the RPC layer's: bursts of
+   small, short-lived blocks (NPUTF8 strings, NPVariant strings,
+   NPIdentifierInfo, identifier arrays) released in a different order
+   than they were allocated. Each backend runs in its own process since
+   the NPW_MALLOC_LIB selection is made once.  */
+
+#include "sysdeps.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <glib.h>
+
+#undef ENABLE_MALLOC_CHECK
+#include "npw-malloc.h"
+
+#define BATCH_SIZE 64
+
+static gint g_n_iterations = 200000;
+static gint g_n_threads    = 1;
+
+static inline guint32
+next_random (guint32 *state)
+{
+  /* Numerical Recipes LCG, good enough to pick sizes */
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+static guint32
+next_size (guint32 *state)
+{
+  guint32 r = next_random (state);
+  switch (r % 8)
+    {
+    case 0: case 1: case 2:
+      return 4 + (r >> 3) % 60;		/* NPUTF8 strings */
+    case 3: case 4:
+      return 16;			/* NPVariant */
+    case 5:
+      return 24;			/* NPIdentifierInfo */
+    case 6:
+      return 8 * (1 + (r >> 3) % 16);	/* NPIdentifier arrays */
+    default:
+      return 64 + (r >> 3) % 960;	/* larger strings */
+    }
+}
+
+static gpointer
+run_iterations (gpointer data)
+{
+  guint32 state = GPOINTER_TO_UINT (data);
+  void *blocks[BATCH_SIZE];
+
+  for (gint i = 0; i < g_n_iterations; i++)
+    {
+      for (gint j = 0; j < BATCH_SIZE; j++)
+	{
+	  guint32 size = next_size (&state);
+	  blocks[j] = NPW_MemAlloc (size);
+	  memset (blocks[j], j, size);
+	}
+      /* Free odd blocks first, then even ones in reverse order */
+      for (gint j = 1; j < BATCH_SIZE; j += 2)
+	NPW_MemFree (blocks[j]);
+      for (gint j = BATCH_SIZE - 2; j >= 0; j -= 2)
+	NPW_MemFree (blocks[j]);
+    }
+  return NULL;
+}
+
+static void
+run_benchmark (const gchar *malloc_lib)
+{
+  pthread_t threads[16];
+  struct rusage ru;
+  GTimer *timer;
+
+  setenv ("NPW_MALLOC_LIB", malloc_lib, 1);
+  timer = g_timer_new ();
+  for (gint i = 0; i < g_n_threads; i++)
+    pthread_create (&threads[i], NULL, run_iterations, GUINT_TO_POINTER (i + 1));
+  for (gint i = 0; i < g_n_threads; i++)
+    pthread_join (threads[i], NULL);
+  g_timer_stop (timer);
+
+  gdouble n_ops = (gdouble)g_n_iterations * BATCH_SIZE * g_n_threads;
+  gdouble elapsed = g_timer_elapsed (timer, NULL);
+  getrusage (RUSAGE_SELF, &ru);
+  g_print ("%-8s %7d %14.1f %12ld\n",
+	   malloc_lib, g_n_threads, elapsed * 1e9 / n_ops, ru.ru_maxrss);
+  g_timer_destroy (timer);
+}
+
+int
+main (int argc, char *argv[])
+{
+  static const gchar *malloc_libs[] = { "libc", "glib", "pool" };
+
+  for (int i = 1; i < argc; i++)
+    {
+      const gchar *arg = argv[i];
+      if (strcmp (arg, "--count") == 0)
+	{
+	  if (++i < argc)
+	    {
+	      unsigned long v = strtoul (argv[i], NULL, 10);
+	      if (v > 0)
+		g_n_iterations = v;
+	    }
+	}
+      else if (strcmp (arg, "--threads") == 0)
+	{
+	  if (++i < argc)
+	    {
+	      unsigned long v = strtoul (argv[i], NULL, 10);
+	      if (v > 0)
+		g_n_threads = MIN (v, 16);
+	    }
+	}
+      else if (strcmp (arg, "--help") == 0)
+	{
+	  g_print ("Usage: %s [--count ITERATIONS] [--threads COUNT]\n", argv[0]);
+	  return 0;
+	}
+    }
+
+  g_print ("# backend threads ns/alloc+free  maxrss (KB)\n");
+  for (gint i = 0; i < G_N_ELEMENTS (malloc_libs); i++)
+    {
+      pid_t pid = fork ();
+      if (pid == 0)
+	{
+	  run_benchmark (malloc_libs[i]);
+	  _exit (0);
+	}
+      if (pid < 0)
+	return 1;
+
+      int status;
+      if (waitpid (pid, &status, 0) != pid || !WIFEXITED (status) || WEXITSTATUS (status) != 0)
+	return 1;
+    }
+  return 0;
+}
@@ -0,0 +1,399 @@
+/*
+ *  test-plugin-stub.c - Minimal NPAPI plugin to exercise the viewer
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* A windowed plugin that accepts every call and draws nothing. Like
+   most plugins, it has no NPP_SetValue(). Its replies only depend on
+   the calls it gets, so that the RPC traffic of a wrapped instance
+   can be recorded and replayed against the viewer (see
+   test-rpc-replay.c).
+
+   The test-browser-* programs pass these <embed> arguments to make
+   the stub do more:
+
+   npw-report=yes      tell what happens through NPN_Status()
+   npw-query=yes       ask for browser values in NPP_New() and
+                       NPP_SetWindow()
+   npw-stype=TYPE      take streams as normal, asfile, asfileonly
+                       or seek
+   npw-seek=OFS:LEN    request that range of a seekable stream on
+                       the next NPP_SetWindow()
+
+   Each message starts with the event name and ends with a sequence
+   number, since the viewer drops repeated ones. Reporting instances
+   also ask for XEmbed, like the Gtk plugins, so that the viewer does
+   not need an Xt event loop for them.  */
+
+#define _XOPEN_SOURCE 600
+#define XP_UNIX 1
+#define MOZ_X11 1
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <npapi.h>
+#include <npfunctions.h>
+
+#define PLUGIN_NAME        "NSPluginWrapper Stub Plugin"
+#define PLUGIN_DESCRIPTION "Plugin doing nothing, for RPC testing"
+#define PLUGIN_MIME_TYPES  "application/x-npw-stub:npwstub:NSPluginWrapper stub"
+
+static NPNetscapeFuncs *g_browser;
+
+typedef struct _StubInstance StubInstance;
+struct _StubInstance
+{
+  int         report;
+  int         query;
+  uint16_t    stype;
+  int32_t     seek_offset;
+  int32_t     seek_length;
+  NPStream   *seek_stream;
+  int         seek_pending;
+  char       *file_name;
+  uint64_t    bytes;
+  uint32_t    sum;
+  unsigned    seq;
+};
+
+static uint32_t
+stub_checksum (uint32_t sum, const unsigned char *buf, int32_t len)
+{
+  while (len-- > 0)
+    sum = sum * 31 + *buf++;
+  return sum;
+}
+
+static void
+stub_report (NPP instance, const char *format, ...)
+  __attribute__((format (printf, 2, 3)));
+
+static void
+stub_report (NPP instance, const char *format, ...)
+{
+  StubInstance *stub = instance->pdata;
+  char message[1024];
+  va_list args;
+  int n;
+
+  if (stub == NULL || !stub->report)
+    return;
+  va_start (args, format);
+  n = vsnprintf (message, sizeof (message), format, args);
+  va_end (args);
+  if (n < 0 || n >= sizeof (message))
+    return;
+  snprintf (message + n, sizeof (message) - n, " seq=%u", ++stub->seq);
+  g_browser->status (instance, message);
+}
+
+static void
+stub_query (NPP instance, const char *event)
+{
+  NPBool windowless = 0, xembed = 0, private_mode = 0;
+  char *origin = NULL;
+
+  g_browser->getvalue (instance, NPNVSupportsWindowless, &windowless);
+  g_browser->getvalue (instance, NPNVSupportsXEmbedBool, &xembed);
+  g_browser->getvalue (instance, NPNVprivateModeBool, &private_mode);
+  if (g_browser->getvalue (instance, NPNVdocumentOrigin, &origin) != NPERR_NO_ERROR)
+    origin = NULL;
+  stub_report (instance, "%s windowless=%d xembed=%d private=%d origin=%s",
+	       event, windowless, xembed, private_mode,
+	       origin ? origin : "(none)");
+  if (origin)
+    g_browser->memfree (origin);
+}
+
+/* Plugins such as Flash open the file again after NPP_StreamAsFile()
+   returned, even after the stream is destroyed */
+static void
+stub_reopen_file (NPP instance)
+{
+  StubInstance *stub = instance->pdata;
+  unsigned char buf[4096];
+  uint32_t sum = 0;
+  uint64_t size = 0;
+  ssize_t n;
+  int fd;
+
+  if ((fd = open (stub->file_name, O_RDONLY)) < 0)
+    {
+      stub_report (instance, "reopen failed");
+      return;
+    }
+  while ((n = read (fd, buf, sizeof (buf))) > 0)
+    {
+      sum = stub_checksum (sum, buf, n);
+      size += n;
+    }
+  close (fd);
+  stub_report (instance, "reopen size=%llu sum=%08x",
+	       (unsigned long long)size, sum);
+}
+
+static NPError
+stub_new (NPMIMEType mime_type, NPP instance, uint16_t mode,
+	  int16_t argc, char *argn[], char *argv[], NPSavedData *saved)
+{
+  StubInstance *stub;
+  int i;
+
+  if ((stub = calloc (1, sizeof (*stub))) == NULL)
+    return NPERR_OUT_OF_MEMORY_ERROR;
+  stub->stype = NP_NORMAL;
+  instance->pdata = stub;
+
+  for (i = 0; i < argc; i++)
+    {
+      const char *value = argv[i] ? argv[i] : "";
+      if (strcmp (argn[i], "npw-report") == 0)
+	stub->report = strcmp (value, "yes") == 0;
+      else if (strcmp (argn[i], "npw-query") == 0)
+	stub->query = strcmp (value, "yes") == 0;
+      else if (strcmp (argn[i], "npw-stype") == 0)
+	{
+	  if (strcmp (value, "asfile") == 0)
+	    stub->stype = NP_ASFILE;
+	  else if (strcmp (value, "asfileonly") == 0)
+	    stub->stype = NP_ASFILEONLY;
+	  else if (strcmp (value, "seek") == 0)
+	    stub->stype = NP_SEEK;
+	}
+      else if (strcmp (argn[i], "npw-seek") == 0)
+	sscanf (value, "%d:%d", &stub->seek_offset, &stub->seek_length);
+    }
+
+  stub_report (instance, "new pid=%d", getpid ());
+  if (stub->query)
+    stub_query (instance, "query");
+  return NPERR_NO_ERROR;
+}
+
+static NPError
+stub_destroy (NPP instance, NPSavedData **save)
+{
+  StubInstance *stub = instance->pdata;
+
+  if (save)
+    *save = NULL;
+  if (stub)
+    {
+      free (stub->file_name);
+      free (stub);
+      instance->pdata = NULL;
+    }
+  return NPERR_NO_ERROR;
+}
+
+static NPError
+stub_set_window (NPP instance, NPWindow *window)
+{
+  StubInstance *stub = instance->pdata;
+  NPSetWindowCallbackStruct *ws_info;
+
+  if (window)
+    {
+      ws_info = window->ws_info;
+      stub_report (instance, "window %ux%u depth=%d colormap=%lu",
+		   window->width, window->height,
+		   ws_info ? ws_info->depth : -1,
+		   ws_info ? (unsigned long)ws_info->colormap : 0);
+    }
+  if (stub && stub->query)
+    stub_query (instance, "requery");
+  if (stub && stub->file_name)
+    stub_reopen_file (instance);
+  if (stub && stub->seek_stream && stub->seek_length > 0)
+    {
+      NPByteRange range;
+      NPError ret;
+
+      range.offset = stub->seek_offset;
+      range.length = stub->seek_length;
+      range.next = NULL;
+      stub->seek_pending = 1;
+      ret = g_browser->requestread (stub->seek_stream, &range);
+      stub_report (instance, "requestread ret=%d", ret);
+    }
+  return NPERR_NO_ERROR;
+}
+
+static NPError
+stub_new_stream (NPP instance, NPMIMEType type, NPStream *stream,
+		 NPBool seekable, uint16_t *stype)
+{
+  StubInstance *stub = instance->pdata;
+
+  *stype = NP_NORMAL;
+  if (stub)
+    {
+      *stype = stub->stype;
+      stub->bytes = 0;
+      stub->sum = 0;
+      if (stub->stype == NP_SEEK)
+	stub->seek_stream = stream;
+      stub_report (instance, "newstream url=%s end=%u seekable=%d",
+		   stream->url, stream->end, seekable);
+    }
+  return NPERR_NO_ERROR;
+}
+
+static NPError
+stub_destroy_stream (NPP instance, NPStream *stream, NPReason reason)
+{
+  StubInstance *stub = instance->pdata;
+
+  if (stub)
+    {
+      if (stub->seek_stream == stream)
+	stub->seek_stream = NULL;
+      stub_report (instance, "destroystream bytes=%llu sum=%08x reason=%d",
+		   (unsigned long long)stub->bytes, stub->sum, reason);
+    }
+  return NPERR_NO_ERROR;
+}
+
+static void
+stub_stream_as_file (NPP instance, NPStream *stream, const char *fname)
+{
+  StubInstance *stub = instance->pdata;
+  const char *base;
+
+  if (stub == NULL || fname == NULL)
+    return;
+  free (stub->file_name);
+  stub->file_name = strdup (fname);
+  base = strrchr (fname, '/');
+  stub_report (instance, "asfile name=%s", base ? base + 1 : fname);
+  if (stub->file_name)
+    stub_reopen_file (instance);
+}
+
+static int32_t
+stub_write_ready (NPP instance, NPStream *stream)
+{
+  return 65536;
+}
+
+static int32_t
+stub_write (NPP instance, NPStream *stream, int32_t offset, int32_t len, void *buf)
+{
+  StubInstance *stub = instance->pdata;
+
+  if (stub && buf && len > 0)
+    {
+      if (stub->seek_pending)
+	stub_report (instance, "read offset=%d len=%d sum=%08x",
+		     offset, len, stub_checksum (0, buf, len));
+      else
+	{
+	  stub->bytes += len;
+	  stub->sum = stub_checksum (stub->sum, buf, len);
+	}
+    }
+  return len;
+}
+
+static void
+stub_print (NPP instance, NPPrint *print_info)
+{
+}
+
+static int16_t
+stub_handle_event (NPP instance, void *event)
+{
+  return 0;
+}
+
+static void
+stub_url_notify (NPP instance, const char *url, NPReason reason, void *notify_data)
+{
+}
+
+static NPError
+stub_get_value (NPP instance, NPPVariable variable, void *value)
+{
+  switch (variable)
+    {
+    case NPPVpluginNameString:
+      *(const char **)value = PLUGIN_NAME;
+      return NPERR_NO_ERROR;
+    case NPPVpluginDescriptionString:
+      *(const char **)value = PLUGIN_DESCRIPTION;
+      return NPERR_NO_ERROR;
+    case NPPVpluginNeedsXEmbed:
+      *(NPBool *)value = instance && instance->pdata
+	&& ((StubInstance *)instance->pdata)->report;
+      return NPERR_NO_ERROR;
+    default:
+      return NPERR_INVALID_PARAM;
+    }
+}
+
+NP_EXPORT(const char *)
+NP_GetMIMEDescription (void)
+{
+  return PLUGIN_MIME_TYPES;
+}
+
+NP_EXPORT(NPError)
+NP_GetValue (void *future, NPPVariable variable, void *value)
+{
+  return stub_get_value (NULL, variable, value);
+}
+
+NP_EXPORT(NPError)
+NP_Initialize (NPNetscapeFuncs *moz_funcs, NPPluginFuncs *plugin_funcs)
+{
+  if (moz_funcs == NULL || plugin_funcs == NULL)
+    return NPERR_INVALID_FUNCTABLE_ERROR;
+  g_browser = moz_funcs;
+  if ((moz_funcs->version >> 8) > NP_VERSION_MAJOR)
+    return NPERR_INCOMPATIBLE_VERSION_ERROR;
+  if (plugin_funcs->size < sizeof (NPPluginFuncs))
+    return NPERR_INVALID_FUNCTABLE_ERROR;
+
+  memset (plugin_funcs, 0, sizeof (NPPluginFuncs));
+  plugin_funcs->size          = sizeof (NPPluginFuncs);
+  plugin_funcs->version       = (NP_VERSION_MAJOR << 8) + NP_VERSION_MINOR;
+  plugin_funcs->newp          = stub_new;
+  plugin_funcs->destroy       = stub_destroy;
+  plugin_funcs->setwindow     = stub_set_window;
+  plugin_funcs->newstream     = stub_new_stream;
+  plugin_funcs->destroystream = stub_destroy_stream;
+  plugin_funcs->asfile        = stub_stream_as_file;
+  plugin_funcs->writeready    = stub_write_ready;
+  plugin_funcs->write         = stub_write;
+  plugin_funcs->print         = stub_print;
+  plugin_funcs->event         = stub_handle_event;
+  plugin_funcs->urlnotify     = stub_url_notify;
+  plugin_funcs->getvalue      = stub_get_value;
+  return NPERR_NO_ERROR;
+}
+
+NP_EXPORT(NPError)
+NP_Shutdown (void)
+{
+  return NPERR_NO_ERROR;
+}
@@ -0,0 +1,996 @@
+/*
+ *  test-rpc-bench.c - Benchmark RPC latency and throughput
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The client plays the wrapper (BUILD_WRAPPER), the server plays the
+   viewer (BUILD_VIEWER), so that NPVariant and NPIdentifier values go
+   through the real npw-rpc.c marshalers.
+
+   Results are printed one per line as "test param metric value" so
+   that runs from different releases can be compared with a script:
+   - empty:      round-trip latency percentiles of an empty call
+   - array:      client to server RPC_TYPE_ARRAY throughput, 16 B to 16 MB
+   - variant:    NPVariant batches echoed back by the server
+   - identifier: NPIdentifier batches echoed back by the server
+   - nested:     cost of a call nesting DEPTH callbacks in between
+   - timers:     syncs with the client per second while COUNT plugin
+                 timers run every 16 ms, as GLib timeouts or coalesced
+                 with 8 ms (visible) and 64 ms (hidden) of slack
+   - async:      NPN_PluginThreadAsyncCall() stress, THREADS threads post
+                 a million calls as GLib idle sources or through the
+                 batched queue, checking that each runs once and in order
+   - status:     per call cost of NPN_Status() like messages, as round
+                 trips or sent with rpc_method_notify()  */
+
+#include "sysdeps.h"
+#include "test-rpc-common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "npw-common.h"
+#include "npw-rpc.h"
+#include "utils.h"
+
+#define DEBUG 1
+#include "debug.h"
+
+enum
+  {
+    RPC_TEST_METHOD_EMPTY = 1,
+    RPC_TEST_METHOD_ARRAY,
+    RPC_TEST_METHOD_VARIANTS,
+    RPC_TEST_METHOD_IDENTIFIERS,
+    RPC_TEST_METHOD_NESTED,
+    RPC_TEST_METHOD_TIMERS,
+    RPC_TEST_METHOD_ASYNC,
+    RPC_TEST_METHOD_STATUS,
+    RPC_TEST_METHOD_STATUS_SYNC
+  };
+
+#define MAX_ARRAY_SIZE	(16 * 1024 * 1024)
+#define MAX_BATCH_SIZE	1024
+#define TIMER_INTERVAL	16
+#define TIMER_DURATION	500
+#define MAX_ASYNC_THREADS 64
+
+/* NPRuntime glue talks to the peer through this one */
+rpc_connection_t *g_rpc_connection attribute_hidden = NULL;
+
+static gint  g_n_calls     = 10000;
+static gsize g_array_bytes = 64 * 1024 * 1024;
+static gint  g_batch_size  = 64;
+static gint  g_async_calls = 1000000;
+static gint  g_async_threads = 4;
+
+/* The marshalers and the NPRuntime glue call the browser-side
+   NPN_*() functions, back them with minimal implementations */
+static void *
+g_NPN_MemAlloc (uint32_t size)
+{
+  return malloc (size);
+}
+
+static void
+g_NPN_MemFree (void *ptr)
+{
+  free (ptr);
+}
+
+static NPObject *
+g_NPN_CreateObject (NPP npp, NPClass *aClass)
+{
+  return NULL;
+}
+
+static NPObject *
+g_NPN_RetainObject (NPObject *obj)
+{
+  if (obj)
+    ++obj->referenceCount;
+  return obj;
+}
+
+static void
+g_NPN_ReleaseObject (NPObject *obj)
+{
+  if (obj)
+    --obj->referenceCount;
+}
+
+static void
+g_NPN_ReleaseVariantValue (NPVariant *variant)
+{
+  if (NPVARIANT_IS_STRING (*variant))
+    g_NPN_MemFree ((void *)NPVARIANT_TO_STRING (*variant).UTF8Characters);
+  VOID_TO_NPVARIANT (*variant);
+}
+
+static void
+init_npn_funcs (void)
+{
+  NPNetscapeFuncs mozilla_funcs;
+  NPPluginFuncs   plugin_funcs;
+
+  memset (&mozilla_funcs, 0, sizeof (mozilla_funcs));
+  mozilla_funcs.size                = sizeof (mozilla_funcs);
+  mozilla_funcs.memalloc            = g_NPN_MemAlloc;
+  mozilla_funcs.memfree             = g_NPN_MemFree;
+  mozilla_funcs.createobject        = g_NPN_CreateObject;
+  mozilla_funcs.retainobject        = g_NPN_RetainObject;
+  mozilla_funcs.releaseobject       = g_NPN_ReleaseObject;
+  mozilla_funcs.releasevariantvalue = g_NPN_ReleaseVariantValue;
+
+  memset (&plugin_funcs, 0, sizeof (plugin_funcs));
+  plugin_funcs.size = sizeof (plugin_funcs);
+
+  NPW_InitializeFuncs (&mozilla_funcs, &plugin_funcs);
+}
+
+static inline guint64
+get_time_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+invoke_nested (gint32 depth)
+{
+  rpc_connection_t *connection;
+  int               error;
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  error = rpc_method_invoke (connection,
+			     RPC_TEST_METHOD_NESTED,
+			     RPC_TYPE_INT32, depth,
+			     RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+
+  error = rpc_method_wait_for_reply (connection, RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+}
+
+/* Both sides run this one: call back the peer until DEPTH is exhausted */
+static int
+handle_nested (rpc_connection_t *connection)
+{
+  gint32 depth;
+  int    error;
+
+  error = rpc_method_get_args (connection,
+			       RPC_TYPE_INT32, &depth,
+			       RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+
+  if (depth > 0)
+    invoke_nested (depth - 1);
+
+  return rpc_method_send_reply (connection, RPC_TYPE_INVALID);
+}
+
+#ifdef BUILD_SERVER
+static int
+handle_empty (rpc_connection_t *connection)
+{
+  int error;
+
+  error = rpc_method_get_args (connection, RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+
+  return rpc_method_send_reply (connection, RPC_TYPE_INVALID);
+}
+
+static int
+handle_array (rpc_connection_t *connection)
+{
+  gchar  *bytes;
+  gint32  len;
+  int     error;
+
+  error = rpc_method_get_args (connection,
+			       RPC_TYPE_ARRAY, RPC_TYPE_CHAR, &len, &bytes,
+			       RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+  free (bytes);
+
+  return rpc_method_send_reply (connection,
+				RPC_TYPE_UINT32, len,
+				RPC_TYPE_INVALID);
+}
+
+static gboolean
+timer_tick (gpointer user_data)
+{
+  ++*(guint32 *)user_data;
+  return TRUE;
+}
+
+/* Runs the main loop like the viewer does, syncing with the client
+   each time it dispatched something. SLACK < 0 means GLib timeouts */
+static int
+handle_timers (rpc_connection_t *connection)
+{
+  gint32   n_timers, slack;
+  guint32  duration, n_syncs = 0, n_calls = 0;
+  guint   *ids;
+  int      error;
+
+  error = rpc_method_get_args (connection,
+			       RPC_TYPE_INT32, &n_timers,
+			       RPC_TYPE_INT32, &slack,
+			       RPC_TYPE_UINT32, &duration,
+			       RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+
+  /* Plugins start their timers at random times */
+  ids = g_new (guint, n_timers);
+  for (gint i = 0; i < n_timers; i++)
+    {
+      g_usleep (TIMER_INTERVAL * 1000 / n_timers);
+      if (slack < 0)
+	ids[i] = g_timeout_add (TIMER_INTERVAL, timer_tick, &n_calls);
+      else
+	ids[i] = npw_timeout_add (TIMER_INTERVAL, slack, timer_tick, &n_calls, NULL);
+    }
+
+  n_calls = 0;
+  guint64 end = get_time_ns () + (guint64)duration * 1000000;
+  while (get_time_ns () < end)
+    {
+      if (g_main_context_iteration (NULL, TRUE))
+	{
+	  invoke_nested (0);
+	  n_syncs++;
+	}
+    }
+
+  for (gint i = 0; i < n_timers; i++)
+    {
+      if (slack < 0)
+	g_source_remove (ids[i]);
+      else
+	npw_timeout_remove (ids[i]);
+    }
+  g_free (ids);
+
+  return rpc_method_send_reply (connection,
+				RPC_TYPE_UINT32, n_syncs,
+				RPC_TYPE_UINT32, n_calls,
+				RPC_TYPE_INVALID);
+}
+
+typedef struct _AsyncTestCall AsyncTestCall;
+struct _AsyncTestCall
+{
+  NPW_AsyncCall base;
+  gint32        thread;
+  guint32       seq;
+};
+
+typedef struct _AsyncTestThread AsyncTestThread;
+struct _AsyncTestThread
+{
+  pthread_t thread;
+  gint32    index;
+  guint32   n_calls;
+  gboolean  use_queue;
+};
+
+static guint32  g_async_next[MAX_ASYNC_THREADS];
+static guint32  g_async_done;
+static gboolean g_async_in_order;
+
+static void
+async_test_run (NPW_AsyncCall *call)
+{
+  AsyncTestCall *test_call = (AsyncTestCall *)call;
+  if (test_call->seq != g_async_next[test_call->thread])
+    g_async_in_order = FALSE;
+  g_async_next[test_call->thread] = test_call->seq + 1;
+  g_async_done++;
+}
+
+static void
+async_test_free (NPW_AsyncCall *call)
+{
+  g_free (call);
+}
+
+static gboolean
+async_test_idle (gpointer user_data)
+{
+  async_test_run (user_data);
+  return FALSE;
+}
+
+/* What a decoder thread does */
+static void *
+async_test_thread (void *arg)
+{
+  AsyncTestThread *thread = arg;
+  for (guint32 i = 0; i < thread->n_calls; i++)
+    {
+      AsyncTestCall *call = g_new (AsyncTestCall, 1);
+      call->base.run = async_test_run;
+      call->base.destroy = async_test_free;
+      call->thread = thread->index;
+      call->seq = i;
+      if (thread->use_queue)
+	npw_async_call (&call->base);
+      else
+	g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, async_test_idle, call, g_free);
+    }
+  return NULL;
+}
+
+/* Runs the main loop like the viewer does until all calls ran */
+static int
+handle_async (rpc_connection_t *connection)
+{
+  gint32           n_threads, n_calls;
+  guint32          use_queue, n_syncs = 0;
+  AsyncTestThread *threads;
+  int              error;
+
+  error = rpc_method_get_args (connection,
+			       RPC_TYPE_INT32, &n_threads,
+			       RPC_TYPE_INT32, &n_calls,
+			       RPC_TYPE_BOOLEAN, &use_queue,
+			       RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+  RPC_TEST_ENSURE (n_threads > 0 && n_threads <= MAX_ASYNC_THREADS);
+
+  if (use_queue)
+    RPC_TEST_ENSURE (npw_async_calls_init (G_PRIORITY_DEFAULT_IDLE));
+
+  memset (g_async_next, 0, sizeof (g_async_next));
+  g_async_done = 0;
+  g_async_in_order = TRUE;
+
+  guint64 start = get_time_ns ();
+  threads = g_new0 (AsyncTestThread, n_threads);
+  for (gint i = 0; i < n_threads; i++)
+    {
+      threads[i].index = i;
+      threads[i].n_calls = n_calls / n_threads;
+      threads[i].use_queue = use_queue;
+      RPC_TEST_ENSURE (pthread_create (&threads[i].thread, NULL,
+				       async_test_thread, &threads[i]) == 0);
+    }
+
+  guint32 total = (n_calls / n_threads) * n_threads;
+  while (g_async_done < total)
+    {
+      if (g_main_context_iteration (NULL, TRUE))
+	{
+	  invoke_nested (0);
+	  n_syncs++;
+	}
+    }
+  guint32 elapsed_us = (get_time_ns () - start) / 1000;
+
+  for (gint i = 0; i < n_threads; i++)
+    pthread_join (threads[i].thread, NULL);
+  g_free (threads);
+
+  /* Nothing ran twice or went missing */
+  for (gint i = 0; i < n_threads; i++)
+    RPC_TEST_ENSURE (g_async_next[i] == n_calls / n_threads);
+  RPC_TEST_ENSURE (g_async_done == total);
+
+  if (use_queue)
+    npw_async_calls_exit ();
+
+  return rpc_method_send_reply (connection,
+				RPC_TYPE_UINT32, elapsed_us,
+				RPC_TYPE_UINT32, n_syncs,
+				RPC_TYPE_BOOLEAN, g_async_in_order,
+				RPC_TYPE_INVALID);
+}
+
+/* Messages got by both status handlers, the reply of the synchronous
+   one tells the client how many so far */
+static guint32 g_n_status = 0;
+
+static int
+handle_status (rpc_connection_t *connection)
+{
+  gchar *message;
+  int    error;
+
+  error = rpc_method_get_args (connection,
+			       RPC_TYPE_STRING, &message,
+			       RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+  free (message);
+  ++g_n_status;
+
+  /* sent with rpc_method_notify(), no reply */
+  return RPC_ERROR_NO_ERROR;
+}
+
+static int
+handle_status_sync (rpc_connection_t *connection)
+{
+  gchar *message;
+  int    error;
+
+  error = rpc_method_get_args (connection,
+			       RPC_TYPE_STRING, &message,
+			       RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+  free (message);
+  ++g_n_status;
+
+  return rpc_method_send_reply (connection,
+				RPC_TYPE_UINT32, g_n_status,
+				RPC_TYPE_INVALID);
+}
+
+static int
+handle_variants (rpc_connection_t *connection)
+{
+  NPVariant *variants;
+  gint32     n_variants;
+  int        error;
+
+  error = rpc_method_get_args (connection,
+			       RPC_TYPE_ARRAY, RPC_TYPE_NP_VARIANT,
+			       &n_variants, &variants,
+			       RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+
+  error = rpc_method_send_reply (connection,
+				 RPC_TYPE_ARRAY, RPC_TYPE_NP_VARIANT,
+				 n_variants, variants,
+				 RPC_TYPE_INVALID);
+
+  for (gint i = 0; i < n_variants; i++)
+    NPN_ReleaseVariantValue (&variants[i]);
+  free (variants);
+  return error;
+}
+
+static int
+handle_identifiers (rpc_connection_t *connection)
+{
+  NPIdentifier *idents;
+  gint32        n_idents;
+  int           error;
+
+  error = rpc_method_get_args (connection,
+			       RPC_TYPE_ARRAY, RPC_TYPE_NP_IDENTIFIER,
+			       &n_idents, &idents,
+			       RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+
+  error = rpc_method_send_reply (connection,
+				 RPC_TYPE_ARRAY, RPC_TYPE_NP_IDENTIFIER,
+				 n_idents, idents,
+				 RPC_TYPE_INVALID);
+  free (idents);
+  return error;
+}
+#endif
+
+#ifdef BUILD_CLIENT
+static void
+report (const gchar *test, const gchar *param, const gchar *metric, gdouble value)
+{
+  g_print ("%-10s %-9s %-10s %.3f\n", test, param, metric, value);
+}
+
+static gint
+compare_times (gconstpointer a, gconstpointer b)
+{
+  guint64 ta = *(const guint64 *)a;
+  guint64 tb = *(const guint64 *)b;
+  return ta < tb ? -1 : ta > tb;
+}
+
+static gdouble
+percentile_us (const guint64 *times, gint n, gdouble p)
+{
+  gint i = (gint)(p * (n - 1) + 0.5);
+  return times[CLAMP (i, 0, n - 1)] / 1000.0;
+}
+
+static void
+run_empty (void)
+{
+  rpc_connection_t *connection;
+  guint64          *times;
+  guint64           total = 0;
+  int               error;
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  times = g_new (guint64, g_n_calls);
+  for (gint i = 0; i < g_n_calls; i++)
+    {
+      guint64 start = get_time_ns ();
+      error = rpc_method_invoke (connection,
+				 RPC_TEST_METHOD_EMPTY,
+				 RPC_TYPE_INVALID);
+      RPC_TEST_ENSURE_NO_ERROR (error);
+      error = rpc_method_wait_for_reply (connection, RPC_TYPE_INVALID);
+      RPC_TEST_ENSURE_NO_ERROR (error);
+      times[i] = get_time_ns () - start;
+      total += times[i];
+    }
+
+  qsort (times, g_n_calls, sizeof (times[0]), compare_times);
+  report ("empty", "-", "p50_us",  percentile_us (times, g_n_calls, 0.50));
+  report ("empty", "-", "p90_us",  percentile_us (times, g_n_calls, 0.90));
+  report ("empty", "-", "p99_us",  percentile_us (times, g_n_calls, 0.99));
+  report ("empty", "-", "p999_us", percentile_us (times, g_n_calls, 0.999));
+  report ("empty", "-", "max_us",  times[g_n_calls - 1] / 1000.0);
+  report ("empty", "-", "mean_us", total / 1000.0 / g_n_calls);
+  g_free (times);
+}
+
+static void
+run_array (void)
+{
+  rpc_connection_t *connection;
+  gchar            *bytes;
+  int               error;
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  bytes = g_malloc (MAX_ARRAY_SIZE);
+  for (gint i = 0; i < MAX_ARRAY_SIZE; i++)
+    bytes[i] = i & 0xff;
+
+  for (gint32 size = 16; size <= MAX_ARRAY_SIZE; size *= 4)
+    {
+      /* Transfer about the same amount of data for each size */
+      gint n_calls = CLAMP (g_array_bytes / size, 4, g_n_calls);
+      guint64 start = get_time_ns ();
+      for (gint i = 0; i < n_calls; i++)
+	{
+	  guint32 len;
+	  error = rpc_method_invoke (connection,
+				     RPC_TEST_METHOD_ARRAY,
+				     RPC_TYPE_ARRAY, RPC_TYPE_CHAR, size, bytes,
+				     RPC_TYPE_INVALID);
+	  RPC_TEST_ENSURE_NO_ERROR (error);
+	  error = rpc_method_wait_for_reply (connection,
+					     RPC_TYPE_UINT32, &len,
+					     RPC_TYPE_INVALID);
+	  RPC_TEST_ENSURE_NO_ERROR (error);
+	  RPC_TEST_ENSURE (len == size);
+	}
+      gdouble elapsed = (get_time_ns () - start) / 1e9;
+
+      gchar param[16];
+      snprintf (param, sizeof (param), "%d", size);
+      report ("array", param, "MB/s", (gdouble)size * n_calls / elapsed / 1e6);
+      report ("array", param, "us/call", elapsed * 1e6 / n_calls);
+    }
+  g_free (bytes);
+}
+
+static void
+run_variants (void)
+{
+  static const gchar *strings[] = {
+    "x", "width", "readyState", "getElementById",
+    "application/x-shockwave-flash; charset=UTF-8"
+  };
+  rpc_connection_t *connection;
+  NPVariant        *variants;
+  int               error;
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  /* Scripting argument lists mostly carry numbers and short strings */
+  variants = g_new (NPVariant, g_batch_size);
+  for (gint i = 0; i < g_batch_size; i++)
+    {
+      switch (i % 5)
+	{
+	case 0: INT32_TO_NPVARIANT (i, variants[i]);		break;
+	case 1: DOUBLE_TO_NPVARIANT (i * 0.5, variants[i]);	break;
+	case 2: BOOLEAN_TO_NPVARIANT (i & 1, variants[i]);	break;
+	case 3: STRINGZ_TO_NPVARIANT (strings[(i / 5) % G_N_ELEMENTS (strings)],
+				      variants[i]);		break;
+	case 4: NULL_TO_NPVARIANT (variants[i]);		break;
+	}
+    }
+
+  gint n_calls = MAX (g_n_calls / 10, 1);
+  guint64 start = get_time_ns ();
+  for (gint i = 0; i < n_calls; i++)
+    {
+      NPVariant *results;
+      gint32     n_results;
+
+      error = rpc_method_invoke (connection,
+				 RPC_TEST_METHOD_VARIANTS,
+				 RPC_TYPE_ARRAY, RPC_TYPE_NP_VARIANT,
+				 g_batch_size, variants,
+				 RPC_TYPE_INVALID);
+      RPC_TEST_ENSURE_NO_ERROR (error);
+      error = rpc_method_wait_for_reply (connection,
+					 RPC_TYPE_ARRAY, RPC_TYPE_NP_VARIANT,
+					 &n_results, &results,
+					 RPC_TYPE_INVALID);
+      RPC_TEST_ENSURE_NO_ERROR (error);
+      RPC_TEST_ENSURE (n_results == g_batch_size);
+      for (gint j = 0; j < n_results; j++)
+	{
+	  RPC_TEST_ENSURE (results[j].type == variants[j].type);
+	  NPN_ReleaseVariantValue (&results[j]);
+	}
+      free (results);
+    }
+  gdouble elapsed = (get_time_ns () - start) / 1e9;
+
+  /* Each variant is marshaled twice (there and back) */
+  gchar param[16];
+  snprintf (param, sizeof (param), "%d", g_batch_size);
+  report ("variant", param, "items/s", 2.0 * g_batch_size * n_calls / elapsed);
+  report ("variant", param, "us/call", elapsed * 1e6 / n_calls);
+  g_free (variants);
+}
+
+static void
+run_identifiers (void)
+{
+  rpc_connection_t *connection;
+  NPIdentifier     *idents;
+  gchar            *storage;
+  int               error;
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  /* Browser-side NPIdentifiers are opaque pointers, any unique
+     address will do */
+  storage = g_new (gchar, g_batch_size);
+  idents = g_new (NPIdentifier, g_batch_size);
+  for (gint i = 0; i < g_batch_size; i++)
+    idents[i] = &storage[i];
+
+  gint n_calls = MAX (g_n_calls / 10, 1);
+  guint64 start = get_time_ns ();
+  for (gint i = 0; i < n_calls; i++)
+    {
+      NPIdentifier *results;
+      gint32        n_results;
+
+      error = rpc_method_invoke (connection,
+				 RPC_TEST_METHOD_IDENTIFIERS,
+				 RPC_TYPE_ARRAY, RPC_TYPE_NP_IDENTIFIER,
+				 g_batch_size, idents,
+				 RPC_TYPE_INVALID);
+      RPC_TEST_ENSURE_NO_ERROR (error);
+      error = rpc_method_wait_for_reply (connection,
+					 RPC_TYPE_ARRAY, RPC_TYPE_NP_IDENTIFIER,
+					 &n_results, &results,
+					 RPC_TYPE_INVALID);
+      RPC_TEST_ENSURE_NO_ERROR (error);
+      RPC_TEST_ENSURE (n_results == g_batch_size);
+      RPC_TEST_ENSURE (memcmp (results, idents, n_results * sizeof (*idents)) == 0);
+      free (results);
+    }
+  gdouble elapsed = (get_time_ns () - start) / 1e9;
+
+  gchar param[16];
+  snprintf (param, sizeof (param), "%d", g_batch_size);
+  report ("identifier", param, "items/s", 2.0 * g_batch_size * n_calls / elapsed);
+  report ("identifier", param, "us/call", elapsed * 1e6 / n_calls);
+  g_free (idents);
+  g_free (storage);
+}
+
+static void
+run_nested (void)
+{
+  static const gint depths[] = { 0, 1, 2, 4, 8, 16, 32 };
+  gdouble base_us = 0.0;
+
+  for (gint i = 0; i < G_N_ELEMENTS (depths); i++)
+    {
+      gint depth = depths[i];
+      gint n_calls = MAX (g_n_calls / (10 * (depth + 1)), 1);
+      guint64 start = get_time_ns ();
+      for (gint j = 0; j < n_calls; j++)
+	invoke_nested (depth);
+      gdouble call_us = (get_time_ns () - start) / 1e3 / n_calls;
+
+      gchar param[16];
+      snprintf (param, sizeof (param), "%d", depth);
+      report ("nested", param, "us/call", call_us);
+      if (depth == 0)
+	base_us = call_us;
+      else
+	report ("nested", param, "us/level", (call_us - base_us) / depth);
+    }
+}
+
+static void
+run_timers (void)
+{
+  static const struct {
+    const gchar *name;
+    gint32       slack;
+  } modes[] = {
+    { "glib",    -1 },
+    { "slack8",   8 },
+    { "slack64", 64 }
+  };
+  static const gint32 counts[] = { 1, 16, 64 };
+  rpc_connection_t *connection;
+  int               error;
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  for (guint i = 0; i < G_N_ELEMENTS (counts); i++)
+    {
+      gchar param[16];
+      snprintf (param, sizeof (param), "%d", counts[i]);
+      for (guint j = 0; j < G_N_ELEMENTS (modes); j++)
+	{
+	  guint32 n_syncs, n_calls;
+	  error = rpc_method_invoke (connection,
+				     RPC_TEST_METHOD_TIMERS,
+				     RPC_TYPE_INT32, counts[i],
+				     RPC_TYPE_INT32, modes[j].slack,
+				     RPC_TYPE_UINT32, TIMER_DURATION,
+				     RPC_TYPE_INVALID);
+	  RPC_TEST_ENSURE_NO_ERROR (error);
+	  error = rpc_method_wait_for_reply (connection,
+					     RPC_TYPE_UINT32, &n_syncs,
+					     RPC_TYPE_UINT32, &n_calls,
+					     RPC_TYPE_INVALID);
+	  RPC_TEST_ENSURE_NO_ERROR (error);
+	  RPC_TEST_ENSURE (n_calls > 0);
+
+	  gchar metric[32];
+	  snprintf (metric, sizeof (metric), "%s_sync/s", modes[j].name);
+	  report ("timers", param, metric, n_syncs * 1000.0 / TIMER_DURATION);
+	  snprintf (metric, sizeof (metric), "%s_call/s", modes[j].name);
+	  report ("timers", param, metric, n_calls * 1000.0 / TIMER_DURATION);
+	}
+    }
+}
+
+static void
+run_async (void)
+{
+  rpc_connection_t *connection;
+  int               error;
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  gchar param[32];
+  snprintf (param, sizeof (param), "%dx%d",
+	    g_async_threads, g_async_calls / g_async_threads);
+  for (gint use_queue = 0; use_queue <= 1; use_queue++)
+    {
+      const gchar *mode = use_queue ? "queue" : "glib";
+      guint32 elapsed_us, n_syncs, in_order;
+      error = rpc_method_invoke (connection,
+				 RPC_TEST_METHOD_ASYNC,
+				 RPC_TYPE_INT32, g_async_threads,
+				 RPC_TYPE_INT32, g_async_calls,
+				 RPC_TYPE_BOOLEAN, use_queue,
+				 RPC_TYPE_INVALID);
+      RPC_TEST_ENSURE_NO_ERROR (error);
+      error = rpc_method_wait_for_reply (connection,
+					 RPC_TYPE_UINT32, &elapsed_us,
+					 RPC_TYPE_UINT32, &n_syncs,
+					 RPC_TYPE_BOOLEAN, &in_order,
+					 RPC_TYPE_INVALID);
+      RPC_TEST_ENSURE_NO_ERROR (error);
+      RPC_TEST_ENSURE (in_order);
+
+      gchar metric[32];
+      snprintf (metric, sizeof (metric), "%s_ms", mode);
+      report ("async", param, metric, elapsed_us / 1000.0);
+      snprintf (metric, sizeof (metric), "%s_syncs", mode);
+      report ("async", param, metric, n_syncs);
+    }
+}
+
+static guint32
+invoke_status_sync (rpc_connection_t *connection, const gchar *message)
+{
+  guint32 n_status;
+  int     error;
+
+  error = rpc_method_invoke (connection,
+			     RPC_TEST_METHOD_STATUS_SYNC,
+			     RPC_TYPE_STRING, message,
+			     RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+  error = rpc_method_wait_for_reply (connection,
+				     RPC_TYPE_UINT32, &n_status,
+				     RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+  return n_status;
+}
+
+static void
+run_status (void)
+{
+  rpc_connection_t *connection;
+  gchar             message[64];
+  guint32           n_status = 0;
+  guint64           start;
+  int               error;
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  start = get_time_ns ();
+  for (gint i = 0; i < g_n_calls; i++)
+    {
+      snprintf (message, sizeof (message), "Loading frame %d", i);
+      n_status = invoke_status_sync (connection, message);
+    }
+  report ("status", "-", "invoke_us", (get_time_ns () - start) / 1000.0 / g_n_calls);
+
+  /* The final round-trip waits for all messages to be handled */
+  start = get_time_ns ();
+  for (gint i = 0; i < g_n_calls; i++)
+    {
+      snprintf (message, sizeof (message), "Loading frame %d", i);
+      error = rpc_method_notify (connection,
+				 RPC_TEST_METHOD_STATUS,
+				 RPC_TYPE_STRING, message,
+				 RPC_TYPE_INVALID);
+      RPC_TEST_ENSURE_NO_ERROR (error);
+    }
+  RPC_TEST_ENSURE (invoke_status_sync (connection, "Done") == n_status + g_n_calls + 1);
+  report ("status", "-", "notify_us", (get_time_ns () - start) / 1000.0 / g_n_calls);
+}
+
+static void
+run_benchmark (void)
+{
+  g_print ("# test     param     metric     value\n");
+  run_empty ();
+  run_array ();
+  run_variants ();
+  run_identifiers ();
+  run_nested ();
+  run_timers ();
+  run_async ();
+  run_status ();
+}
+#endif
+
+int
+rpc_test_init (int argc, char *argv[])
+{
+  rpc_connection_t *connection;
+
+  for (int i = 1; i < argc; i++)
+    {
+      const gchar *arg = argv[i];
+      if (strcmp (arg, "--calls") == 0)
+	{
+	  if (++i < argc)
+	    {
+	      unsigned long v = strtoul (argv[i], NULL, 10);
+	      if (v > 0)
+		g_n_calls = v;
+	    }
+	}
+      else if (strcmp (arg, "--array-bytes") == 0)
+	{
+	  if (++i < argc)
+	    {
+	      unsigned long v = strtoul (argv[i], NULL, 10);
+	      if (v > 0)
+		g_array_bytes = v;
+	    }
+	}
+      else if (strcmp (arg, "--batch") == 0)
+	{
+	  if (++i < argc)
+	    {
+	      unsigned long v = strtoul (argv[i], NULL, 10);
+	      if (v > 0)
+		g_batch_size = MIN (v, MAX_BATCH_SIZE);
+	    }
+	}
+      else if (strcmp (arg, "--async-calls") == 0)
+	{
+	  if (++i < argc)
+	    {
+	      unsigned long v = strtoul (argv[i], NULL, 10);
+	      if (v > 0)
+		g_async_calls = v;
+	    }
+	}
+      else if (strcmp (arg, "--async-threads") == 0)
+	{
+	  if (++i < argc)
+	    {
+	      unsigned long v = strtoul (argv[i], NULL, 10);
+	      if (v > 0)
+		g_async_threads = MIN (v, MAX_ASYNC_THREADS);
+	    }
+	}
+      else if (strcmp (arg, "--help") == 0)
+	{
+	  g_print ("Usage: %s [--calls COUNT] [--array-bytes BYTES] [--batch COUNT]"
+		   " [--async-calls COUNT] [--async-threads COUNT]\n", argv[0]);
+	  rpc_test_exit (0);
+	}
+    }
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  g_rpc_connection = connection;
+  init_npn_funcs ();
+  if (rpc_add_np_marshalers (connection) < 0)
+    g_error ("could not add NPAPI marshalers");
+  /* Our method IDs are not NPAPI ones, don't let NPW_RPC_STATS say so */
+  rpc_set_method_name_func (NULL);
+
+  static const rpc_method_descriptor_t vtable[] = {
+#ifdef BUILD_SERVER
+    { RPC_TEST_METHOD_EMPTY,       handle_empty       },
+    { RPC_TEST_METHOD_ARRAY,       handle_array       },
+    { RPC_TEST_METHOD_VARIANTS,    handle_variants    },
+    { RPC_TEST_METHOD_IDENTIFIERS, handle_identifiers },
+    { RPC_TEST_METHOD_TIMERS,      handle_timers      },
+    { RPC_TEST_METHOD_ASYNC,       handle_async       },
+    { RPC_TEST_METHOD_STATUS,      handle_status      },
+    { RPC_TEST_METHOD_STATUS_SYNC, handle_status_sync },
+#endif
+    { RPC_TEST_METHOD_NESTED,      handle_nested      }
+  };
+
+  if (rpc_connection_add_method_descriptors (connection, &vtable[0],
+					     G_N_ELEMENTS (vtable)) < 0)
+    g_error ("could not add method descriptors");
+
+#ifdef BUILD_CLIENT
+  if (!id_init ())
+    g_error ("could not initialize NPIdentifier map");
+#endif
+  return 0;
+}
+
+int
+rpc_test_execute (gpointer user_data)
+{
+#ifdef BUILD_CLIENT
+  run_benchmark ();
+#endif
+  return RPC_TEST_EXECUTE_SUCCESS;
+}
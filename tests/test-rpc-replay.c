@@ -0,0 +1,527 @@
+/*
+ *  test-rpc-replay.c - Replay an RPC trace recorded with NPW_RPC_TRACE
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* Play the client side of a trace recorded with NPW_RPC_TRACE=PREFIX
+   and NPW_RPC_TRACE_PAYLOAD=yes against a new instance of the server
+   side, and compare the latency of each call with the recorded one.
+   A wrapper trace is typically replayed against the viewer running
+   the stub plugin it was recorded with:
+
+     test-rpc-replay --connection /org/wrapper/NSPlugins/replay \
+       trace.1234 -- npviewer.bin --plugin test-plugin-stub.so \
+       --connection /org/wrapper/NSPlugins/replay
+
+   Calls are issued in the recorded order, nested ones from within
+   the calls they were made from, and calls from the server are
+   answered with the recorded replies. Arguments are not decoded: the
+   server has to send the same amount of data as when the trace was
+   recorded. Calls whose arguments were not fully captured are skipped
+   with the calls they nested.  */
+
+#include "sysdeps.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib.h>
+#include "rpc.h"
+#include "rpc-trace.h"
+
+#define N_METHODS 128
+
+typedef struct
+{
+  const rpc_trace_record_t *record;
+  gint                      match;	/* index of the reply, or -1 */
+  gboolean                  done;
+} Message;
+
+typedef struct
+{
+  guint   count;
+  guint64 recorded_ns;
+  guint64 recorded_max_ns;
+  guint64 replayed_ns;
+  guint64 replayed_max_ns;
+} MethodStats;
+
+static Message          *g_messages;
+static gint              g_n_messages;
+static gchar            *g_method_names[N_METHODS];
+static MethodStats       g_stats[N_METHODS];
+static rpc_connection_t *g_connection;
+static gboolean          g_realtime;
+static gint              g_level;	/* nesting level of the current call */
+static gint              g_scope_start;
+static gint              g_scope_end;
+static guint             g_n_calls;
+static guint             g_n_skipped;
+static guint             g_n_mismatches;
+
+static guint64
+get_time_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const gchar *
+method_name (gint method)
+{
+  static gchar name[32];
+  if (method >= 0 && method < N_METHODS && g_method_names[method])
+    return g_method_names[method];
+  snprintf (name, sizeof (name), "method-%d", method);
+  return name;
+}
+
+static inline const guint8 *
+message_payload (const Message *msg)
+{
+  return (const guint8 *)(msg->record + 1);
+}
+
+static inline gboolean
+message_is_complete (const Message *msg)
+{
+  return msg->record->payload_captured == msg->record->payload_size;
+}
+
+/* Load the messages of the first connection found in the trace */
+static gboolean
+load_trace (const gchar *filename, gchar **contents)
+{
+  gsize length;
+  GError *error = NULL;
+
+  if (!g_file_get_contents (filename, contents, &length, &error))
+    {
+      g_printerr ("could not read %s: %s\n", filename, error->message);
+      g_error_free (error);
+      return FALSE;
+    }
+
+  const rpc_trace_header_t *header = (const rpc_trace_header_t *)*contents;
+  if (length < sizeof (*header)
+      || memcmp (header->magic, RPC_TRACE_MAGIC, sizeof (header->magic)) != 0
+      || header->version != RPC_TRACE_VERSION)
+    {
+      g_printerr ("%s is not an RPC trace\n", filename);
+      return FALSE;
+    }
+  g_print ("# trace of %.*s (pid %d)\n",
+	   (gint)sizeof (header->component), header->component, header->pid);
+
+  GArray *messages = g_array_new (FALSE, TRUE, sizeof (Message));
+  gint connection = -1;
+  guint n_dropped = 0, n_ignored = 0;
+  gsize offset = header->header_size;
+  while (offset + sizeof (rpc_trace_record_t) <= length)
+    {
+      const rpc_trace_record_t *record = (const rpc_trace_record_t *)(*contents + offset);
+      if (record->size < sizeof (*record) || offset + record->size > length)
+	break;
+      offset += record->size;
+
+      switch (record->type)
+	{
+	case RPC_TRACE_METHOD_NAME:
+	  if (record->method >= 0 && record->method < N_METHODS)
+	    {
+	      g_free (g_method_names[record->method]);
+	      g_method_names[record->method] = g_strndup ((const gchar *)(record + 1),
+							  record->payload_captured);
+	    }
+	  break;
+	case RPC_TRACE_DROPPED:
+	  n_dropped += record->payload_size;
+	  break;
+	case RPC_TRACE_INVOKE_SEND:
+	case RPC_TRACE_INVOKE_RECV:
+	case RPC_TRACE_REPLY_SEND:
+	case RPC_TRACE_REPLY_RECV:
+	  if (connection < 0)
+	    connection = record->connection;
+	  if (record->connection != connection)
+	    {
+	      ++n_ignored;
+	      break;
+	    }
+	  Message msg = { record, -1, FALSE };
+	  g_array_append_val (messages, msg);
+	  break;
+	}
+    }
+
+  if (n_dropped)
+    g_print ("# WARNING: %u messages were lost while recording\n", n_dropped);
+  if (n_ignored)
+    g_print ("# %u messages from other connections ignored\n", n_ignored);
+
+  g_n_messages = messages->len;
+  g_messages = (Message *)g_array_free (messages, FALSE);
+
+  /* Pair calls with their replies, at the same nesting level */
+  GArray *stack = g_array_new (FALSE, FALSE, sizeof (gint));
+  for (gint i = 0; i < g_n_messages; i++)
+    {
+      const rpc_trace_record_t *record = g_messages[i].record;
+      if (record->type == RPC_TRACE_INVOKE_SEND || record->type == RPC_TRACE_INVOKE_RECV)
+	{
+	  g_array_append_val (stack, i);
+	  continue;
+	}
+      gint call_type = (record->type == RPC_TRACE_REPLY_RECV
+			? RPC_TRACE_INVOKE_SEND : RPC_TRACE_INVOKE_RECV);
+      while (stack->len > 0)
+	{
+	  gint j = g_array_index (stack, gint, stack->len - 1);
+	  g_array_set_size (stack, stack->len - 1);
+	  if (g_messages[j].record->depth == record->depth
+	      && g_messages[j].record->type == call_type)
+	    {
+	      g_messages[j].match = i;
+	      break;
+	    }
+	}
+    }
+  g_array_free (stack, TRUE);
+  return TRUE;
+}
+
+/* Mark a call and the messages it nested as replayed, or skipped */
+static void
+mark_done (gint first, gint last, gboolean replayed)
+{
+  for (gint i = first; i <= last; i++)
+    {
+      const Message *msg = &g_messages[i];
+      if (replayed && !msg->done && i > first
+	  && msg->record->type == RPC_TRACE_INVOKE_RECV)
+	++g_n_mismatches;	/* the server did not make that call */
+      g_messages[i].done = TRUE;
+    }
+}
+
+static int
+replay_call (gint index)
+{
+  const Message *msg = &g_messages[index];
+  const rpc_trace_record_t *record = msg->record;
+  gint last = msg->match >= 0 ? msg->match : index;
+
+  if (!message_is_complete (msg))
+    {
+      ++g_n_skipped;
+      mark_done (index, last, FALSE);
+      return RPC_ERROR_NO_ERROR;
+    }
+
+  guint64 start_ns = get_time_ns ();
+  int error = rpc_method_invoke_raw (g_connection, record->method,
+				     message_payload (msg), record->payload_size);
+  if (error < 0)
+    return error;
+  ++g_n_calls;
+  g_messages[index].done = TRUE;
+  if (msg->match < 0)
+    return RPC_ERROR_NO_ERROR;
+
+  /* Server calls made while we wait are looked up between the call
+     and its reply */
+  gint saved_level = g_level;
+  gint saved_scope_start = g_scope_start;
+  gint saved_scope_end = g_scope_end;
+  g_level = record->depth;
+  g_scope_start = index + 1;
+  g_scope_end = msg->match;
+
+  const rpc_trace_record_t *reply = g_messages[msg->match].record;
+  guint8 *args = g_malloc (reply->payload_size + 1);
+  error = rpc_method_wait_for_reply_raw (g_connection, args, reply->payload_size);
+  g_free (args);
+
+  g_level = saved_level;
+  g_scope_start = saved_scope_start;
+  g_scope_end = saved_scope_end;
+  if (error < 0)
+    return error;
+  mark_done (index, msg->match, TRUE);
+
+  guint64 replayed_ns = get_time_ns () - start_ns;
+  guint64 recorded_ns = reply->end_ns - record->start_ns;
+  MethodStats *stats = &g_stats[CLAMP (record->method, 0, N_METHODS - 1)];
+  stats->count++;
+  stats->recorded_ns += recorded_ns;
+  stats->recorded_max_ns = MAX (stats->recorded_max_ns, recorded_ns);
+  stats->replayed_ns += replayed_ns;
+  stats->replayed_max_ns = MAX (stats->replayed_max_ns, replayed_ns);
+  return RPC_ERROR_NO_ERROR;
+}
+
+/* Answer a call from the server with the recorded reply, after having
+   replayed the calls made from it */
+static int
+handle_call (rpc_connection_t *connection)
+{
+  gint method = rpc_method_get_current (connection);
+  gint level = g_level + 1;
+  gint index = -1;
+  gboolean in_order = TRUE;
+
+  for (gint i = g_scope_start; i < g_scope_end; i++)
+    {
+      const Message *msg = &g_messages[i];
+      if (msg->done || msg->record->type != RPC_TRACE_INVOKE_RECV
+	  || msg->record->depth != level)
+	continue;
+      if (msg->record->method == method)
+	{
+	  index = i;
+	  break;
+	}
+      in_order = FALSE;
+    }
+  if (index < 0)
+    {
+      g_printerr ("unexpected call to %s\n", method_name (method));
+      return RPC_ERROR_MESSAGE_HANDLER_INVALID;
+    }
+  if (!in_order)
+    ++g_n_mismatches;
+
+  const Message *msg = &g_messages[index];
+  guint8 *args = g_malloc (msg->record->payload_size + 1);
+  int error = rpc_method_get_args_raw (connection, args, msg->record->payload_size);
+  g_free (args);
+  if (error < 0)
+    return error;
+  g_messages[index].done = TRUE;
+
+  gint last = msg->match >= 0 ? msg->match : index;
+  gint saved_level = g_level;
+  g_level = level;
+  for (gint i = index + 1; i < last && error == RPC_ERROR_NO_ERROR; i++)
+    {
+      const Message *child = &g_messages[i];
+      if (!child->done && child->record->type == RPC_TRACE_INVOKE_SEND
+	  && child->record->depth == level + 1)
+	error = replay_call (i);
+    }
+  g_level = saved_level;
+  if (error < 0)
+    return error;
+
+  if (msg->match >= 0)
+    {
+      const Message *reply = &g_messages[msg->match];
+      if (!message_is_complete (reply))
+	{
+	  g_printerr ("reply to %s was not fully recorded\n", method_name (method));
+	  return RPC_ERROR_MESSAGE_ARGUMENT_INVALID;
+	}
+      error = rpc_method_send_reply_raw (connection, message_payload (reply),
+					 reply->record->payload_size);
+    }
+  mark_done (index, last, TRUE);
+  return error;
+}
+
+static int
+dispatch_pending (gint timeout)
+{
+  int ret;
+  while ((ret = rpc_wait_dispatch (g_connection, timeout)) > 0)
+    {
+      if ((ret = rpc_dispatch (g_connection)) < 0)
+	return ret;
+      timeout = 0;
+    }
+  if (ret < 0)
+    return ret;
+  return rpc_dispatch_pending_sync (g_connection);
+}
+
+static int
+replay (void)
+{
+  const guint64 first_ns = g_n_messages > 0 ? g_messages[0].record->start_ns : 0;
+  const guint64 start_ns = get_time_ns ();
+
+  g_level = 0;
+  g_scope_start = 0;
+  g_scope_end = g_n_messages;
+  for (gint i = 0; i < g_n_messages; i++)
+    {
+      const Message *msg = &g_messages[i];
+      if (msg->done || msg->record->depth != 1)
+	continue;
+
+      if (g_realtime)
+	{
+	  guint64 offset_ns = msg->record->start_ns - first_ns;
+	  guint64 elapsed_ns = get_time_ns () - start_ns;
+	  if (offset_ns > elapsed_ns)
+	    g_usleep ((offset_ns - elapsed_ns) / 1000);
+	}
+
+      int error = dispatch_pending (0);
+      if (error < 0)
+	return error;
+
+      switch (msg->record->type)
+	{
+	case RPC_TRACE_INVOKE_SEND:
+	  if ((error = replay_call (i)) < 0)
+	    return error;
+	  break;
+	case RPC_TRACE_INVOKE_RECV:
+	  /* the server called us on its own, wait for it */
+	  if ((error = dispatch_pending (5 * 1000000)) < 0)
+	    return error;
+	  if (!g_messages[i].done)
+	    {
+	      ++g_n_mismatches;
+	      mark_done (i, msg->match >= 0 ? msg->match : i, FALSE);
+	    }
+	  break;
+	}
+    }
+
+  /* the server may have quit upon the last call */
+  int error = dispatch_pending (0);
+  return error == RPC_ERROR_CONNECTION_CLOSED ? RPC_ERROR_NO_ERROR : error;
+}
+
+static void
+print_report (guint64 elapsed_ns)
+{
+  guint64 recorded_ns = 0;
+  if (g_n_messages > 0)
+    recorded_ns = g_messages[g_n_messages - 1].record->end_ns - g_messages[0].record->start_ns;
+
+  g_print ("# %u calls replayed in %.3f ms, recorded in %.3f ms\n",
+	   g_n_calls, elapsed_ns / 1e6, recorded_ns / 1e6);
+  g_print ("# %u calls skipped (arguments not captured), %u mismatches\n",
+	   g_n_skipped, g_n_mismatches);
+  g_print ("# %-38s %8s %12s %12s %12s %12s\n",
+	   "method", "calls", "rec-avg-us", "rec-max-us", "avg-us", "max-us");
+  for (gint i = 0; i < N_METHODS; i++)
+    {
+      const MethodStats *stats = &g_stats[i];
+      if (stats->count == 0)
+	continue;
+      g_print ("%-40s %8u %12.1f %12.1f %12.1f %12.1f\n",
+	       method_name (i), stats->count,
+	       stats->recorded_ns / 1e3 / stats->count, stats->recorded_max_ns / 1e3,
+	       stats->replayed_ns / 1e3 / stats->count, stats->replayed_max_ns / 1e3);
+    }
+}
+
+static void
+stop_server (GPid pid)
+{
+  for (gint i = 0; i < 50; i++)
+    {
+      if (waitpid (pid, NULL, WNOHANG) == pid)
+	return;
+      g_usleep (100000);
+    }
+  kill (pid, SIGTERM);
+  waitpid (pid, NULL, 0);
+}
+
+int
+main (int argc, char *argv[])
+{
+  const gchar *connection_path = NPW_CONNECTION_PATH "/Test.RPC";
+  const gchar *trace_file = NULL;
+  gchar **server_args = NULL;
+
+  for (int i = 1; i < argc; i++)
+    {
+      const gchar *arg = argv[i];
+      if (strcmp (arg, "--connection") == 0)
+	{
+	  if (++i < argc)
+	    connection_path = argv[i];
+	}
+      else if (strcmp (arg, "--realtime") == 0)
+	g_realtime = TRUE;
+      else if (strcmp (arg, "--") == 0)
+	{
+	  server_args = &argv[i + 1];
+	  break;
+	}
+      else if (strcmp (arg, "--help") == 0)
+	{
+	  g_print ("Usage: %s [--connection PATH] [--realtime] TRACE -- SERVER [ARGS...]\n", argv[0]);
+	  return 0;
+	}
+      else
+	trace_file = arg;
+    }
+  if (trace_file == NULL || server_args == NULL || server_args[0] == NULL)
+    g_error ("no trace file or server program provided on command line");
+
+  gchar *contents = NULL;
+  if (!load_trace (trace_file, &contents))
+    return 1;
+
+  GPid server_pid;
+  GError *error = NULL;
+  if (!g_spawn_async (NULL, server_args, NULL,
+		      G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH,
+		      NULL, NULL, &server_pid, &error))
+    g_error ("could not start server program '%s': %s", server_args[0], error->message);
+
+  if ((g_connection = rpc_init_client (connection_path)) == NULL)
+    {
+      kill (server_pid, SIGTERM);
+      g_error ("failed to initialize RPC client connection");
+    }
+
+  /* Answer all the methods the server called in the trace */
+  for (gint i = 0; i < g_n_messages; i++)
+    {
+      const rpc_trace_record_t *record = g_messages[i].record;
+      if (record->type != RPC_TRACE_INVOKE_RECV)
+	continue;
+      rpc_method_descriptor_t desc = { record->method, handle_call };
+      if (rpc_connection_add_method_descriptor (g_connection, &desc) < 0)
+	g_error ("could not add method descriptor for %s", method_name (record->method));
+    }
+
+  guint64 start_ns = get_time_ns ();
+  int rc = replay ();
+  guint64 elapsed_ns = get_time_ns () - start_ns;
+  if (rc < 0)
+    g_printerr ("replay failed: %s\n", rpc_strerror (rc));
+  print_report (elapsed_ns);
+
+  rpc_exit (g_connection);
+  stop_server (server_pid);
+  g_free (contents);
+  return rc < 0 || g_n_mismatches > 0;
+}
@@ -22,6 +22,8 @@
 #include "test-rpc-common.h"
 #include "utils.h"
 #include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define DEBUG 1
 #include "debug.h"
@@ -47,7 +49,8 @@ enum
     RPC_TEST_METHOD_VOID__STRING_ARRAY,
     RPC_TEST_METHOD_VOID__NULL_ARRAY,
     RPC_TEST_METHOD_VOID__0LEN_ARRAY,
-    RPC_TEST_METHOD_VOID__MIXED_ARRAY
+    RPC_TEST_METHOD_VOID__MIXED_ARRAY,
+    RPC_TEST_METHOD_VOID__FDx2
  };
 
 const gchar *
@@ -123,6 +126,12 @@ rpc_test_signature (gboolean is_invoke, ...)
 	    va_arg (args, gchar *);
 	  was_array = FALSE;
 	  break;
+	case RPC_TYPE_FD:
+	  g_string_append (str, "fd");
+	  if (is_invoke && !was_array)
+	    va_arg (args, int);
+	  was_array = FALSE;
+	  break;
 	case RPC_TYPE_ARRAY:
 	  /* XXX: don't allow array of arrays */
 	  if (!was_array)
@@ -174,6 +183,7 @@ static gdouble g_double_array[] =
   { -2.0, -1.0, 0.0, 1.0, 2.0 };
 static const gchar *g_string_array[] =
   { "string", "", NULL, "another one" };
+static const gchar g_fd_data[] = "data read through a passed fd";
 
 #ifdef BUILD_SERVER
 typedef union _RPCTestArg RPCTestArg;
@@ -187,6 +197,7 @@ union _RPCTestArg
   guint64 j;
   gdouble d;
   gchar  *s;
+  gint    f;
   struct {
     gint  l;
     void *p;
@@ -200,6 +211,7 @@ union _RPCTestArg
 #define RPC_TEST_ARG_UINT64	j
 #define RPC_TEST_ARG_DOUBLE	d
 #define RPC_TEST_ARG_STRING	s
+#define RPC_TEST_ARG_FD		f
 
 static RPCTestArg g_args[RPC_TEST_MAX_ARGS];
 
@@ -598,6 +610,28 @@ handle_VOID__MIXED_ARRAY (rpc_connection_t *connection)
 
   return rpc_method_send_reply (connection, RPC_TYPE_INVALID);
 }
+
+static int
+handle_VOID__FDx2 (rpc_connection_t *connection)
+{
+  gchar buf[sizeof (g_fd_data)];
+  gssize n;
+
+  rpc_test_get_args (connection,
+		     RPC_GET_ARG (0, FD),
+		     RPC_GET_ARG (1, FD),
+		     RPC_TYPE_INVALID);
+
+  RPC_TEST_ENSURE (g_args[0].f >= 0);
+  RPC_TEST_ENSURE ((fcntl (g_args[0].f, F_GETFD) & FD_CLOEXEC) != 0);
+  n = read (g_args[0].f, buf, sizeof (buf));
+  RPC_TEST_ENSURE (n == sizeof (g_fd_data));
+  RPC_TEST_ENSURE (memcmp (buf, g_fd_data, n) == 0);
+  close (g_args[0].f);
+  RPC_TEST_ENSURE (g_args[1].f == -1);
+
+  return rpc_method_send_reply (connection, RPC_TYPE_INVALID);
+}
 #endif
 
 int
@@ -625,7 +659,8 @@ rpc_test_init (int argc, char *argv[])
 	  { RPC_TEST_METHOD_VOID__STRING_ARRAY,	handle_VOID__STRING_ARRAY },
 	  { RPC_TEST_METHOD_VOID__NULL_ARRAY,	handle_VOID__NULL_ARRAY	},
 	  { RPC_TEST_METHOD_VOID__0LEN_ARRAY,	handle_VOID__0LEN_ARRAY	},
-	  { RPC_TEST_METHOD_VOID__MIXED_ARRAY,	handle_VOID__MIXED_ARRAY }
+	  { RPC_TEST_METHOD_VOID__MIXED_ARRAY,	handle_VOID__MIXED_ARRAY },
+	  { RPC_TEST_METHOD_VOID__FDx2,		handle_VOID__FDx2	}
 	};
 
   connection = rpc_test_get_connection ();
@@ -778,6 +813,19 @@ rpc_test_execute (gpointer user_data)
 		   RPC_TYPE_ARRAY, RPC_TYPE_CHAR, 0, g_char_array,
 		   RPC_TYPE_ARRAY, RPC_TYPE_CHAR, 1, NULL,
 		   RPC_TYPE_INVALID);
+
+  /* File descriptors */
+  {
+    int fds[2];
+    RPC_TEST_ENSURE (pipe (fds) == 0);
+    RPC_TEST_ENSURE (write (fds[1], g_fd_data, sizeof (g_fd_data)) == sizeof (g_fd_data));
+    close (fds[1]);
+    rpc_test_invoke (RPC_TEST_METHOD_VOID__FDx2,
+		     RPC_TYPE_FD, fds[0],
+		     RPC_TYPE_FD, -1,
+		     RPC_TYPE_INVALID);
+    close (fds[0]);
+  }
 #endif
   return RPC_TEST_EXECUTE_SUCCESS;
 }
@@ -0,0 +1,363 @@
+/*
+ *  test-rpc-windowless.c - Benchmark windowless plugin painting
+ *
+ *  nspluginwrapper (C) 2005-2009 Gwenole Beauchesne
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* The server plays a synthetic windowless plugin running in the
+   viewer, the client plays the wrapper compositing its frames into a
+   browser "drawable" (a plain memory buffer here, so that no X server
+   is needed).
+
+   Two transports are measured:
+   - shm:  double-buffered SysV shared memory surface, the reply only
+           carries the buffer index and the damaged rectangle
+   - copy: damaged pixels are sent back in the reply itself  */
+
+#include "sysdeps.h"
+#include "test-rpc-common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#define DEBUG 1
+#include "debug.h"
+
+enum
+  {
+    RPC_TEST_METHOD_SETUP = 1,
+    RPC_TEST_METHOD_PAINT_SHM,
+    RPC_TEST_METHOD_PAINT_COPY
+  };
+
+static gint     g_width    = 640;
+static gint     g_height   = 480;
+static gint     g_n_frames = 500;
+static gint32   g_shm_id[2] = { -1, -1 };
+static guint32 *g_buffers[2];
+static gint     g_back_buffer;
+
+/* Paint a moving gradient into the damaged rectangle, PIXELS points
+   to its top-left corner */
+static void
+paint_frame (guint32 *pixels, gint stride, gint x, gint y, gint w, gint h,
+	     gint frame)
+{
+  for (gint j = 0; j < h; j++)
+    {
+      guint32 *p = pixels + j * stride;
+      for (gint i = 0; i < w; i++)
+	p[i] = ((x + i + frame) & 0xff) << 16 | ((y + j + frame) & 0xff) << 8 | (frame & 0xff);
+    }
+}
+
+static void
+destroy_buffers (void)
+{
+  for (gint i = 0; i < 2; i++)
+    {
+      if (g_buffers[i])
+	{
+	  shmdt (g_buffers[i]);
+	  g_buffers[i] = NULL;
+	}
+      if (g_shm_id[i] >= 0)
+	{
+	  shmctl (g_shm_id[i], IPC_RMID, NULL);
+	  g_shm_id[i] = -1;
+	}
+    }
+}
+
+static void
+create_buffers (void)
+{
+  gsize size = g_width * g_height * sizeof (guint32);
+
+  for (gint i = 0; i < 2; i++)
+    {
+      g_shm_id[i] = shmget (IPC_PRIVATE, size, IPC_CREAT | 0600);
+      RPC_TEST_ENSURE (g_shm_id[i] >= 0);
+      g_buffers[i] = shmat (g_shm_id[i], NULL, 0);
+      RPC_TEST_ENSURE (g_buffers[i] != (void *)-1);
+    }
+}
+
+static int
+handle_setup (rpc_connection_t *connection)
+{
+  int error;
+
+  error = rpc_method_get_args (connection,
+			       RPC_TYPE_INT32, &g_width,
+			       RPC_TYPE_INT32, &g_height,
+			       RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+
+  destroy_buffers ();
+  create_buffers ();
+  g_back_buffer = 0;
+
+  return rpc_method_send_reply (connection,
+				RPC_TYPE_INT32, g_shm_id[0],
+				RPC_TYPE_INT32, g_shm_id[1],
+				RPC_TYPE_INVALID);
+}
+
+static int
+handle_paint_shm (rpc_connection_t *connection)
+{
+  gint32 frame, x, y, w, h;
+  int    error;
+
+  error = rpc_method_get_args (connection,
+			       RPC_TYPE_INT32, &frame,
+			       RPC_TYPE_INT32, &x,
+			       RPC_TYPE_INT32, &y,
+			       RPC_TYPE_INT32, &w,
+			       RPC_TYPE_INT32, &h,
+			       RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+
+  gint buffer = g_back_buffer;
+  paint_frame (g_buffers[buffer] + y * g_width + x, g_width, x, y, w, h, frame);
+  g_back_buffer ^= 1;
+
+  return rpc_method_send_reply (connection,
+				RPC_TYPE_INT32, buffer,
+				RPC_TYPE_INT32, x,
+				RPC_TYPE_INT32, y,
+				RPC_TYPE_INT32, w,
+				RPC_TYPE_INT32, h,
+				RPC_TYPE_INVALID);
+}
+
+static int
+handle_paint_copy (rpc_connection_t *connection)
+{
+  gint32   frame, x, y, w, h;
+  guint32 *pixels;
+  int      error;
+
+  error = rpc_method_get_args (connection,
+			       RPC_TYPE_INT32, &frame,
+			       RPC_TYPE_INT32, &x,
+			       RPC_TYPE_INT32, &y,
+			       RPC_TYPE_INT32, &w,
+			       RPC_TYPE_INT32, &h,
+			       RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+
+  pixels = g_new (guint32, w * h);
+  paint_frame (pixels, w, x, y, w, h, frame);
+
+  error = rpc_method_send_reply (connection,
+				 RPC_TYPE_ARRAY, RPC_TYPE_CHAR,
+				 (int)(w * h * sizeof (guint32)), pixels,
+				 RPC_TYPE_INVALID);
+  g_free (pixels);
+  return error;
+}
+
+#ifdef BUILD_CLIENT
+/* Copy W x H pixels from SRC to the (X, Y) position in DST */
+static void
+composite (guint32 *dst, const guint32 *src, gint src_stride,
+	   gint x, gint y, gint w, gint h)
+{
+  for (gint j = 0; j < h; j++)
+    memcpy (dst + (y + j) * g_width + x,
+	    src + j * src_stride,
+	    w * sizeof (guint32));
+}
+
+static void
+setup_surface (void)
+{
+  rpc_connection_t *connection;
+  int               error;
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  error = rpc_method_invoke (connection,
+			     RPC_TEST_METHOD_SETUP,
+			     RPC_TYPE_INT32, g_width,
+			     RPC_TYPE_INT32, g_height,
+			     RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+
+  error = rpc_method_wait_for_reply (connection,
+				     RPC_TYPE_INT32, &g_shm_id[0],
+				     RPC_TYPE_INT32, &g_shm_id[1],
+				     RPC_TYPE_INVALID);
+  RPC_TEST_ENSURE_NO_ERROR (error);
+
+  for (gint i = 0; i < 2; i++)
+    {
+      g_buffers[i] = shmat (g_shm_id[i], NULL, SHM_RDONLY);
+      RPC_TEST_ENSURE (g_buffers[i] != (void *)-1);
+    }
+}
+
+static gdouble
+run_frames (gint method, guint32 *drawable, gint w, gint h)
+{
+  rpc_connection_t *connection;
+  GTimer           *timer;
+  int               error;
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  timer = g_timer_new ();
+  for (gint frame = 0; frame < g_n_frames; frame++)
+    {
+      /* Move the damaged area around like an animation would */
+      gint32 x = (frame * 7) % (g_width - w + 1);
+      gint32 y = (frame * 5) % (g_height - h + 1);
+
+      error = rpc_method_invoke (connection,
+				 method,
+				 RPC_TYPE_INT32, frame,
+				 RPC_TYPE_INT32, x,
+				 RPC_TYPE_INT32, y,
+				 RPC_TYPE_INT32, w,
+				 RPC_TYPE_INT32, h,
+				 RPC_TYPE_INVALID);
+      RPC_TEST_ENSURE_NO_ERROR (error);
+
+      if (method == RPC_TEST_METHOD_PAINT_SHM)
+	{
+	  gint32 buffer, dx, dy, dw, dh;
+	  error = rpc_method_wait_for_reply (connection,
+					     RPC_TYPE_INT32, &buffer,
+					     RPC_TYPE_INT32, &dx,
+					     RPC_TYPE_INT32, &dy,
+					     RPC_TYPE_INT32, &dw,
+					     RPC_TYPE_INT32, &dh,
+					     RPC_TYPE_INVALID);
+	  RPC_TEST_ENSURE_NO_ERROR (error);
+	  RPC_TEST_ENSURE (buffer == 0 || buffer == 1);
+	  composite (drawable, g_buffers[buffer] + dy * g_width + dx, g_width,
+		     dx, dy, dw, dh);
+	}
+      else
+	{
+	  guint32 *pixels;
+	  gint32   len;
+	  error = rpc_method_wait_for_reply (connection,
+					     RPC_TYPE_ARRAY, RPC_TYPE_CHAR,
+					     &len, &pixels,
+					     RPC_TYPE_INVALID);
+	  RPC_TEST_ENSURE_NO_ERROR (error);
+	  RPC_TEST_ENSURE (len == w * h * sizeof (guint32));
+	  composite (drawable, pixels, w, x, y, w, h);
+	  free (pixels);
+	}
+    }
+  g_timer_stop (timer);
+
+  gdouble elapsed = g_timer_elapsed (timer, NULL);
+  g_timer_destroy (timer);
+  return g_n_frames / elapsed;
+}
+
+static void
+run_benchmark (void)
+{
+  static const gint sizes[][2] = {
+    {  64,  64 },
+    { 320, 240 },
+    { 640, 480 }
+  };
+  guint32 *drawable;
+
+  setup_surface ();
+  drawable = g_new0 (guint32, g_width * g_height);
+
+  g_print ("# damage        shm fps     copy fps\n");
+  for (gint i = 0; i < G_N_ELEMENTS (sizes); i++)
+    {
+      gint w = MIN (sizes[i][0], g_width);
+      gint h = MIN (sizes[i][1], g_height);
+      gdouble shm_fps  = run_frames (RPC_TEST_METHOD_PAINT_SHM,  drawable, w, h);
+      gdouble copy_fps = run_frames (RPC_TEST_METHOD_PAINT_COPY, drawable, w, h);
+      g_print ("%4dx%-4d %12.1f %12.1f\n", w, h, shm_fps, copy_fps);
+    }
+
+  g_free (drawable);
+  for (gint i = 0; i < 2; i++)
+    {
+      shmdt (g_buffers[i]);
+      g_buffers[i] = NULL;
+    }
+}
+#endif
+
+int
+rpc_test_init (int argc, char *argv[])
+{
+  rpc_connection_t *connection;
+
+  for (int i = 1; i < argc; i++)
+    {
+      const gchar *arg = argv[i];
+      if (strcmp (arg, "--frames") == 0)
+	{
+	  if (++i < argc)
+	    {
+	      unsigned long v = strtoul (argv[i], NULL, 10);
+	      if (v > 0)
+		g_n_frames = v;
+	    }
+	}
+      else if (strcmp (arg, "--help") == 0)
+	{
+	  g_print ("Usage: %s [--frames COUNT]\n", argv[0]);
+	  rpc_test_exit (0);
+	}
+    }
+
+  connection = rpc_test_get_connection ();
+  RPC_TEST_ENSURE (connection != NULL);
+
+  static const rpc_method_descriptor_t vtable[] = {
+    { RPC_TEST_METHOD_SETUP,      handle_setup      },
+    { RPC_TEST_METHOD_PAINT_SHM,  handle_paint_shm  },
+    { RPC_TEST_METHOD_PAINT_COPY, handle_paint_copy }
+  };
+
+  if (rpc_connection_add_method_descriptors (connection, &vtable[0],
+					     G_N_ELEMENTS (vtable)) < 0)
+    g_error ("could not add method descriptors");
+
+#ifdef BUILD_SERVER
+  atexit (destroy_buffers);
+#endif
+  return 0;
+}
+
+int
+rpc_test_execute (gpointer user_data)
+{
+#ifdef BUILD_CLIENT
+  run_benchmark ();
+#endif
+  return RPC_TEST_EXECUTE_SUCCESS;
+}